@@ -0,0 +1,134 @@
+// Integer kernels: a prime sieve, bitwise CRC-32, a matrix multiply and a
+// heapsort. Built twice, with and without compressed instructions.
+#include "rt.h"
+
+#define SIEVE_SIZE (1 << 20)
+#define CRC_SIZE (64 * 1024)
+#define MATRIX_SIZE 64
+#define SORT_SIZE (64 * 1024)
+
+#define EXPECTED 0x810a4fb843f9a8b8ULL
+
+static uint8_t composite[SIEVE_SIZE];
+static uint8_t crc_data[CRC_SIZE];
+static uint32_t a[MATRIX_SIZE][MATRIX_SIZE];
+static uint32_t b[MATRIX_SIZE][MATRIX_SIZE];
+static uint32_t c[MATRIX_SIZE][MATRIX_SIZE];
+static uint32_t sort_data[SORT_SIZE];
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint64_t sieve(void) {
+  uint64_t primes = 0;
+  for (uint64_t n = 2; n < SIEVE_SIZE; n++) {
+    if (composite[n]) {
+      continue;
+    }
+    primes++;
+    for (uint64_t m = n * n; m < SIEVE_SIZE; m += n) {
+      composite[m] = 1;
+    }
+  }
+  return primes;
+}
+
+static uint32_t crc32(void) {
+  uint32_t crc = ~0U;
+  for (uint64_t n = 0; n < CRC_SIZE; n++) {
+    crc ^= crc_data[n];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t matrix_multiply(void) {
+  for (int i = 0; i < MATRIX_SIZE; i++) {
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      uint32_t sum = 0;
+      for (int k = 0; k < MATRIX_SIZE; k++) {
+        sum += a[i][k] * b[k][j];
+      }
+      c[i][j] = sum;
+    }
+  }
+  uint32_t trace = 0;
+  for (int i = 0; i < MATRIX_SIZE; i++) {
+    trace += c[i][i];
+  }
+  return trace;
+}
+
+static void sift_down(uint32_t *v, uint64_t root, uint64_t size) {
+  while (2 * root + 1 < size) {
+    uint64_t child = 2 * root + 1;
+    if (child + 1 < size && v[child] < v[child + 1]) {
+      child++;
+    }
+    if (v[root] >= v[child]) {
+      return;
+    }
+    uint32_t t = v[root];
+    v[root] = v[child];
+    v[child] = t;
+    root = child;
+  }
+}
+
+// returns 0 unless the result is out of order
+static uint64_t heapsort(void) {
+  for (uint64_t n = SORT_SIZE / 2; n-- > 0;) {
+    sift_down(sort_data, n, SORT_SIZE);
+  }
+  for (uint64_t end = SORT_SIZE - 1; end > 0; end--) {
+    uint32_t t = sort_data[0];
+    sort_data[0] = sort_data[end];
+    sort_data[end] = t;
+    sift_down(sort_data, 0, end);
+  }
+  uint64_t unsorted = 0;
+  for (uint64_t n = 1; n < SORT_SIZE; n++) {
+    unsorted += sort_data[n - 1] > sort_data[n];
+  }
+  return unsorted;
+}
+
+int main(void) {
+  uint64_t sum = sieve();
+
+  for (uint64_t n = 0; n < CRC_SIZE; n++) {
+    crc_data[n] = xorshift();
+  }
+  for (int round = 0; round < 4; round++) {
+    crc_data[round] ^= round;
+    sum = sum * 31 + crc32();
+  }
+
+  for (int i = 0; i < MATRIX_SIZE; i++) {
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      a[i][j] = xorshift();
+      b[i][j] = xorshift();
+    }
+  }
+  for (int round = 0; round < 8; round++) {
+    a[round][round]++;
+    sum = sum * 31 + matrix_multiply();
+  }
+
+  for (uint64_t round = 0; round < 4; round++) {
+    for (uint64_t n = 0; n < SORT_SIZE; n++) {
+      sort_data[n] = xorshift();
+    }
+    sum = sum * 31 + heapsort() + sort_data[SORT_SIZE / 2];
+  }
+
+  return check(sum, EXPECTED);
+}
@@ -0,0 +1,97 @@
+// A switch-dispatched stack machine running a Collatz step count, the
+// unpredictable indirect branches of a bytecode interpreter.
+#include "rt.h"
+
+#define LIMIT 30000
+
+#define EXPECTED 0x2bb405
+
+enum {
+  OP_PUSH,
+  OP_LOAD,
+  OP_STORE,
+  OP_ADD,
+  OP_MUL,
+  OP_SHR,
+  OP_AND,
+  OP_LT,
+  OP_EQ,
+  OP_JMP,
+  OP_JZ,
+  OP_HALT
+};
+
+// sum of the Collatz step counts of 1..LIMIT-1, with the variables n (0),
+// x (1), steps (2) and total (3)
+static const int64_t program[] = {
+    OP_PUSH, 1, OP_STORE, 0, OP_PUSH, 0, OP_STORE, 3,
+    // 8: while n < LIMIT
+    OP_LOAD, 0, OP_PUSH, LIMIT, OP_LT, OP_JZ, 79,
+    OP_LOAD, 0, OP_STORE, 1, OP_PUSH, 0, OP_STORE, 2,
+    // 23: while x != 1
+    OP_LOAD, 1, OP_PUSH, 1, OP_EQ, OP_JZ, 32, OP_JMP, 63,
+    // 32: x = x & 1 ? 3 * x + 1 : x >> 1, steps++
+    OP_LOAD, 1, OP_PUSH, 1, OP_AND, OP_JZ, 49,
+    OP_LOAD, 1, OP_PUSH, 3, OP_MUL, OP_PUSH, 1, OP_ADD, OP_JMP, 52,
+    // 49
+    OP_LOAD, 1, OP_SHR,
+    // 52
+    OP_STORE, 1, OP_LOAD, 2, OP_PUSH, 1, OP_ADD, OP_STORE, 2, OP_JMP, 23,
+    // 63: total += steps, n++
+    OP_LOAD, 3, OP_LOAD, 2, OP_ADD, OP_STORE, 3,
+    OP_LOAD, 0, OP_PUSH, 1, OP_ADD, OP_STORE, 0, OP_JMP, 8,
+    // 79
+    OP_LOAD, 3, OP_HALT};
+
+static int64_t run(const int64_t *code) {
+  int64_t stack[16];
+  int64_t vars[4] = {0};
+  int64_t sp = 0;
+  int64_t pc = 0;
+  while (1) {
+    switch (code[pc++]) {
+    case OP_PUSH:
+      stack[sp++] = code[pc++];
+      break;
+    case OP_LOAD:
+      stack[sp++] = vars[code[pc++]];
+      break;
+    case OP_STORE:
+      vars[code[pc++]] = stack[--sp];
+      break;
+    case OP_ADD:
+      sp--;
+      stack[sp - 1] += stack[sp];
+      break;
+    case OP_MUL:
+      sp--;
+      stack[sp - 1] *= stack[sp];
+      break;
+    case OP_SHR:
+      stack[sp - 1] >>= 1;
+      break;
+    case OP_AND:
+      sp--;
+      stack[sp - 1] &= stack[sp];
+      break;
+    case OP_LT:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] < stack[sp];
+      break;
+    case OP_EQ:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] == stack[sp];
+      break;
+    case OP_JMP:
+      pc = code[pc];
+      break;
+    case OP_JZ:
+      pc = stack[--sp] == 0 ? code[pc] : pc + 1;
+      break;
+    case OP_HALT:
+      return stack[sp - 1];
+    }
+  }
+}
+
+int main(void) { return check(run(program), EXPECTED); }
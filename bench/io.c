@@ -0,0 +1,24 @@
+// Many small reads from /dev/zero and writes to stdout, so the time goes to
+// ecall dispatch and the host syscalls behind it.
+#include "rt.h"
+
+#define ROUNDS 200000
+#define CHUNK 512
+
+int main(void) {
+  static uint8_t buf[CHUNK];
+  long fd = sys_openat(AT_FDCWD, "/dev/zero", O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  uint64_t total = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    long n = sys_read(fd, buf, CHUNK - round % 64);
+    if (n <= 0 || buf[round % n] != 0) {
+      return 1;
+    }
+    buf[0] = round;
+    total += sys_write(1, buf, n);
+  }
+  return check(total, (uint64_t)ROUNDS * CHUNK - ROUNDS / 64 * (63 * 64 / 2));
+}
@@ -0,0 +1,42 @@
+// memcpy and memset over a spread of sizes and alignments, from a few bytes
+// to buffers well past the guest TLB's reach.
+#include "rt.h"
+
+#define BUFFER_SIZE (1 << 20)
+
+#define EXPECTED 0x81bf10482ea5e979ULL
+
+static uint8_t src[BUFFER_SIZE];
+static uint8_t dst[BUFFER_SIZE];
+
+int main(void) {
+  for (uint64_t n = 0; n < BUFFER_SIZE; n++) {
+    src[n] = n * 7 + (n >> 8);
+  }
+
+  uint64_t sum = 0;
+  uint64_t offset = 0;
+  for (uint64_t round = 0; round < 20000; round++) {
+    // sizes from 1 byte to 64K, most of them small the way real programs'
+    // are
+    uint64_t size = 1 + (round * 2654435761U) % (round % 16 == 0 ? 65536 : 256);
+    uint64_t from = (offset * 13) % (BUFFER_SIZE - size);
+    uint64_t to = (offset * 29 + round % 8) % (BUFFER_SIZE - size);
+    offset += size;
+
+    if (round % 4 == 0) {
+      memset(dst + to, round, size);
+    } else {
+      memcpy(dst + to, src + from, size);
+    }
+    sum = sum * 31 + dst[to] + dst[to + size - 1];
+  }
+
+  for (int round = 0; round < 16; round++) {
+    memset(dst, round, BUFFER_SIZE);
+    memcpy(src, dst, BUFFER_SIZE);
+    sum = sum * 31 + src[round * 4096];
+  }
+
+  return check(sum, EXPECTED);
+}
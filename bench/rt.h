@@ -0,0 +1,95 @@
+// The little runtime the benchmark guests need without a libc: the entry
+// point, the syscalls they make and the mem* functions GCC may call on its
+// own. Every benchmark is a single file that includes this once.
+#include <stddef.h>
+#include <stdint.h>
+
+#define AT_FDCWD -100
+#define O_RDONLY 0
+
+int main(void);
+
+// main()'s return value is the exit code, 0 when the result checks out
+__asm__(".globl _start\n"
+        "_start:\n"
+        ".option push\n"
+        ".option norelax\n"
+        "  la gp, __global_pointer$\n"
+        ".option pop\n"
+        "  call main\n"
+        "  li a7, 93\n"
+        "  ecall\n");
+
+static inline long syscall3(long n, long a, long b, long c) {
+  register long a0 __asm__("a0") = a;
+  register long a1 __asm__("a1") = b;
+  register long a2 __asm__("a2") = c;
+  register long a7 __asm__("a7") = n;
+  __asm__ volatile("ecall"
+                   : "+r"(a0)
+                   : "r"(a1), "r"(a2), "r"(a7)
+                   : "memory");
+  return a0;
+}
+
+static inline long sys_openat(int dirfd, const char *path, int flags) {
+  return syscall3(56, dirfd, (long)path, flags);
+}
+
+static inline long sys_read(int fd, void *buf, size_t len) {
+  return syscall3(63, fd, (long)buf, len);
+}
+
+static inline long sys_write(int fd, const void *buf, size_t len) {
+  return syscall3(64, fd, (long)buf, len);
+}
+
+// 0 if sum is what's expected, otherwise 1 after printing sum to stderr, so
+// a wrong expected value can be told apart from a wrong result
+static int check(uint64_t sum, uint64_t expected) {
+  if (sum == expected) {
+    return 0;
+  }
+  char line[] = "wrong checksum 0x0000000000000000\n";
+  for (int n = 0; n < 16; n++) {
+    line[sizeof(line) - 3 - n] = "0123456789abcdef"[(sum >> (4 * n)) & 15];
+  }
+  sys_write(2, line, sizeof(line) - 1);
+  return 1;
+}
+
+// a uint64_t that may alias anything, for the word loops below
+typedef uint64_t __attribute__((may_alias)) word;
+
+// word at a time once dst is aligned, the way a libc's would
+void *memcpy(void *dst, const void *src, size_t n) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  for (; n > 0 && ((uintptr_t)d & 7); n--) {
+    *d++ = *s++;
+  }
+  if (((uintptr_t)s & 7) == 0) {
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+      *(word *)d = *(const word *)s;
+    }
+  }
+  for (; n > 0; n--) {
+    *d++ = *s++;
+  }
+  return dst;
+}
+
+void *memset(void *dst, int c, size_t n) {
+  uint8_t *d = dst;
+  uint64_t pattern = (uint8_t)c * 0x0101010101010101ULL;
+  for (; n > 0 && ((uintptr_t)d & 7); n--) {
+    *d++ = c;
+  }
+  for (; n >= 8; n -= 8, d += 8) {
+    *(word *)d = pattern;
+  }
+  for (; n > 0; n--) {
+    *d++ = c;
+  }
+  return dst;
+}
@@ -25,10 +25,29 @@ if command -v pkg-config >/dev/null; then
     LIBELF_FLAGS=$(pkg-config --cflags --libs libelf 2>/dev/null)
     if [ $? -eq 0 ]; then
         echo "building riscv64..."
-        c++ -std=c++23 $CFLAGS -o riscv64 riscv64.cc $LIBELF_FLAGS
+        # -Wno-psabi: the vector registers' SIMD types never cross a TU
+        # --build-id: the decode and JIT caches are keyed by it
+        c++ -std=c++23 $CFLAGS -frounding-math -Wno-psabi -pthread \
+            -Wl,--build-id \
+            -o riscv64 riscv64.cc $LIBELF_FLAGS
     else
         echo "libelf not found - skipping riscv64..."
     fi
 else
     echo "pkg-config not found - skipping the rest..."
 fi
+
+if command -v riscv64-linux-gnu-gcc >/dev/null; then
+    echo "building riscv64 benchmarks..."
+    # no libc: bench/rt.h has the little the guests need, and its memset
+    # mustn't be turned into a call to memset
+    RV_CC="riscv64-linux-gnu-gcc -std=c11 -Wall -Wextra -O2 -static -nostdlib \
+        -ffreestanding -fno-tree-loop-distribute-patterns -mabi=lp64d"
+    for name in int mem interp io; do
+        $RV_CC -march=rv64g -o bench/$name.elf bench/$name.c
+    done
+    # the same integer kernels, compressed wherever the encoding allows
+    $RV_CC -march=rv64gc -o bench/int_rvc.elf bench/int.c
+else
+    echo "riscv64-linux-gnu-gcc not found - skipping the riscv64 benchmarks..."
+fi
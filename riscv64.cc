@@ -1,6 +1,5 @@
 // https://docs.riscv.org/reference/isa/unpriv/rv-32-64g.html
 // https://riscv.org/wp-content/uploads/2024/12/riscv-calling.pdf
-// TODO: convert C instructions to normal ones at parse time?
 
 #if !defined(__cplusplus) || __cplusplus < 202302L
 #error "C++23 or later is required. Either get a newer compiler " \
@@ -8,14 +7,42 @@
        "instead of <print> and remove this check."
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <cstring>
-#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fenv.h>
+#include <format>
 #include <gelf.h>
-#include <iostream>
+#include <initializer_list>
+#include <limits>
+#include <link.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <string>
+#include <string_view>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using i8 = int8_t;
@@ -32,99 +59,241 @@ static_assert(sizeof(size_t) == sizeof(u64), "u64 must be 64-bit");
 static_assert(std::endian::native == std::endian::little,
               "Big endianness not supported");
 
-static constexpr u64 MEMORY_SIZE =
+// guest address space size unless --memory says otherwise
+static constexpr u64 DEFAULT_MEMORY_SIZE =
     2ULL * 1024 * 1024 * 1024; // should be enough
+static constexpr u64 STACK_SIZE = 8 * 1024 * 1024;
+// the brk heap can grow this far before running into the mmap area
+static constexpr u64 MAX_BRK_SIZE = 128 * 1024 * 1024;
 
-static constexpr std::array<const char *, 32> REGS = {
+// granularity of guest page permissions, independent of the host page size
+static constexpr u64 GUEST_PAGE_SIZE = 4096;
+static constexpr u64 GUEST_PAGE_SHIFT = 12;
+static_assert(GUEST_PAGE_SIZE == 1 << GUEST_PAGE_SHIFT);
+
+// addr rounded up to a multiple of page_size, which is a power of two
+static constexpr u64 page_align(u64 addr, u64 page_size = GUEST_PAGE_SIZE) {
+  return (addr + page_size - 1) & ~(page_size - 1);
+}
+// entries in each of the direct-mapped read and write TLBs
+static constexpr u64 TLB_SIZE = 256;
+// marks an empty TLB entry, no access can ever compare equal to it
+static constexpr u64 TLB_EMPTY = ~0ULL;
+
+// guest page permissions, same values as PROT_READ/PROT_WRITE/PROT_EXEC.
+// PERM_MAPPED is set on every mapped page, so PROT_NONE pages can be told
+// apart from unmapped ones.
+enum Perm : u8 { PERM_R = 1, PERM_W = 2, PERM_X = 4, PERM_MAPPED = 8 };
+
+// writes to x0 are redirected to this extra register at decode time, so x0
+// never has to be cleared in the execution loop
+static constexpr u8 REG_SINK = 32;
+
+static constexpr std::array<const char *, 33> REGS = {
     "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "fp", "s1", "a0",
     "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
-    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6", "zero"};
+
+static constexpr std::array<const char *, 32> FREGS = {
+    "ft0", "ft1", "ft2",  "ft3",  "ft4", "ft5", "ft6",  "ft7",
+    "fs0", "fs1", "fa0",  "fa1",  "fa2", "fa3", "fa4",  "fa5",
+    "fa6", "fa7", "fs2",  "fs3",  "fs4", "fs5", "fs6",  "fs7",
+    "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11"};
+
+// rounding modes as encoded in the rm field and frm
+enum RoundingMode : u8 {
+  RM_RNE = 0,
+  RM_RTZ = 1,
+  RM_RDN = 2,
+  RM_RUP = 3,
+  RM_RMM = 4,
+  // rm only: use frm
+  RM_DYN = 7
+};
+
+// fflags bits
+enum FpFlag : u8 {
+  FLAG_NX = 1,
+  FLAG_UF = 2,
+  FLAG_OF = 4,
+  FLAG_DZ = 8,
+  FLAG_NV = 16
+};
+
+// host rounding modes for RM_RNE..RM_RMM. The host has no round to nearest,
+// ties to max magnitude, RMM arithmetic rounds to nearest even instead.
+static constexpr std::array<int, 5> HOST_ROUNDING = {
+    FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+
+enum Csr : u16 {
+  CSR_FFLAGS = 0x001,
+  CSR_FRM = 0x002,
+  CSR_FCSR = 0x003,
+  CSR_VSTART = 0x008,
+  CSR_VXSAT = 0x009,
+  CSR_VXRM = 0x00a,
+  CSR_VCSR = 0x00f,
+  CSR_CYCLE = 0xc00,
+  CSR_TIME = 0xc01,
+  CSR_INSTRET = 0xc02,
+  CSR_VL = 0xc20,
+  CSR_VTYPE = 0xc21,
+  CSR_VLENB = 0xc22
+};
+
+// Bits in a vector register. One register is one AVX2 vector, so the
+// element loops below work a whole register per host instruction.
+static constexpr u64 VLEN = 256;
+static constexpr u64 VLENB = VLEN / 8;
+// the widest vector element, in bits
+static constexpr u64 ELEN = 64;
+static constexpr u64 VTYPE_VILL = 1ULL << 63;
+
+// n elements of T as a GCC vector. The compiler lowers these to AVX2 or SSE
+// instructions, whichever the build targets.
+template <typename T, u64 n = VLENB / sizeof(T)> struct SimdType {
+  typedef T type __attribute__((vector_size(n * sizeof(T))));
+};
+template <typename T, u64 n = VLENB / sizeof(T)>
+using Simd = typename SimdType<T, n>::type;
 
-enum Op {
+// where the second source of a vector instruction comes from: vs1, x[rs1],
+// the immediate or f[rs1]
+enum class VSrc { V, X, I, F };
+
+// the integer type of the given size with the signedness of T
+template <typename T, u64 size>
+using IntOfSize = std::tuple_element_t<
+    std::countr_zero(size),
+    std::conditional_t<std::is_signed_v<T>, std::tuple<i8, i16, i32, i64>,
+                       std::tuple<u8, u16, u32, u64>>>;
+
+enum Op : u16 {
   INVALID,
 
   ADD,
+  ADD_UW,
   ADDI,
   ADDIW,
   ADDW,
   AMOADD_D,
   AMOADD_W,
+  AMOAND_D,
+  AMOAND_W,
+  AMOMAX_D,
+  AMOMAX_W,
   AMOMAXU_D,
   AMOMAXU_W,
+  AMOMIN_D,
+  AMOMIN_W,
+  AMOMINU_D,
+  AMOMINU_W,
+  AMOOR_D,
   AMOOR_W,
   AMOSWAP_D,
   AMOSWAP_W,
+  AMOXOR_D,
+  AMOXOR_W,
   AND,
   ANDI,
+  ANDN,
   AUIPC,
+  BCLR,
+  BCLRI,
   BEQ,
+  BEXT,
+  BEXTI,
   BGE,
   BGEU,
+  BINV,
+  BINVI,
   BLT,
   BLTU,
   BNE,
-  C_ADD,
-  C_ADDI,
-  C_ADDIW,
-  C_ADDI16SP,
-  C_ADDI4SPN,
-  C_ADDW,
-  C_AND,
-  C_ANDI,
-  C_BEQZ,
-  C_BNEZ,
-  C_EBREAK,
-  C_FLD,
-  C_FLDSP,
-  C_FSD,
-  C_FSDSP,
-  C_J,
-  C_JALR,
-  C_JR,
-  C_LD,
-  C_LDSP,
-  C_LI,
-  C_LUI,
-  C_LW,
-  C_LWSP,
-  C_MV,
-  C_OR,
-  C_SD,
-  C_SDSP,
-  C_SLLI,
-  C_SRAI,
-  C_SRLI,
-  C_SUB,
-  C_SUBW,
-  C_SW,
-  C_SWSP,
-  C_XOR,
+  BSET,
+  BSETI,
+  CLZ,
+  CLZW,
+  CPOP,
+  CPOPW,
+  CSRRC,
+  CSRRCI,
   CSRRS,
   CSRRSI,
+  CSRRW,
+  CSRRWI,
+  CTZ,
+  CTZW,
   DIV,
   DIVU,
   DIVUW,
   DIVW,
+  EBREAK,
   ECALL,
   FADD_D,
+  FADD_S,
   FCLASS_D,
+  FCLASS_S,
+  FCVT_D_L,
+  FCVT_D_LU,
+  FCVT_D_S,
   FCVT_D_W,
   FCVT_D_WU,
+  FCVT_L_D,
+  FCVT_L_S,
+  FCVT_LU_D,
+  FCVT_LU_S,
+  FCVT_S_D,
+  FCVT_S_L,
+  FCVT_S_LU,
+  FCVT_S_W,
+  FCVT_S_WU,
+  FCVT_W_D,
+  FCVT_W_S,
+  FCVT_WU_D,
+  FCVT_WU_S,
+  FDIV_D,
+  FDIV_S,
   FENCE,
+  FENCE_I,
   FENCE_TSO,
+  FEQ_D,
+  FEQ_S,
   FLD,
+  FLE_D,
+  FLE_S,
+  FLT_D,
+  FLT_S,
   FLW,
+  FMADD_D,
+  FMADD_S,
+  FMAX_D,
+  FMAX_S,
+  FMIN_D,
+  FMIN_S,
+  FMSUB_D,
+  FMSUB_S,
   FMUL_D,
+  FMUL_S,
   FMV_D_X,
   FMV_W_X,
   FMV_X_D,
+  FMV_X_W,
+  FNMADD_D,
+  FNMADD_S,
+  FNMSUB_D,
+  FNMSUB_S,
   FSD,
   FSGNJ_D,
-  FSGNJN_D,
-  FSGNJX_D,
   FSGNJ_S,
+  FSGNJN_D,
   FSGNJN_S,
+  FSGNJX_D,
   FSGNJX_S,
+  FSQRT_D,
+  FSQRT_S,
+  FSUB_D,
+  FSUB_S,
   FSW,
   JAL,
   JALR,
@@ -138,24 +307,46 @@ enum Op {
   LUI,
   LW,
   LWU,
+  MAX,
+  MAXU,
+  MIN,
+  MINU,
   MUL,
   MULH,
   MULHU,
   MULW,
   OR,
+  ORC_B,
   ORI,
+  ORN,
   PAUSE,
   REM,
   REMU,
   REMUW,
   REMW,
+  REV8,
+  ROL,
+  ROLW,
+  ROR,
+  RORI,
+  RORIW,
+  RORW,
   SB,
   SC_D,
   SC_W,
   SD,
+  SEXT_B,
+  SEXT_H,
   SH,
+  SH1ADD,
+  SH1ADD_UW,
+  SH2ADD,
+  SH2ADD_UW,
+  SH3ADD,
+  SH3ADD_UW,
   SLL,
   SLLI,
+  SLLI_UW,
   SLLIW,
   SLLW,
   SLT,
@@ -173,14 +364,330 @@ enum Op {
   SUB,
   SUBW,
   SW,
+  VADD_VI,
+  VADD_VV,
+  VADD_VX,
+  VAND_VI,
+  VAND_VV,
+  VAND_VX,
+  VCOMPRESS_VM,
+  VCPOP_M,
+  VDIV_VV,
+  VDIV_VX,
+  VDIVU_VV,
+  VDIVU_VX,
+  VFADD_VF,
+  VFADD_VV,
+  VFCVT_F_X_V,
+  VFCVT_F_XU_V,
+  VFCVT_RTZ_X_F_V,
+  VFCVT_RTZ_XU_F_V,
+  VFCVT_X_F_V,
+  VFCVT_XU_F_V,
+  VFDIV_VF,
+  VFDIV_VV,
+  VFIRST_M,
+  VFMACC_VF,
+  VFMACC_VV,
+  VFMADD_VF,
+  VFMADD_VV,
+  VFMAX_VF,
+  VFMAX_VV,
+  VFMERGE_VFM,
+  VFMIN_VF,
+  VFMIN_VV,
+  VFMSAC_VF,
+  VFMSAC_VV,
+  VFMSUB_VF,
+  VFMSUB_VV,
+  VFMUL_VF,
+  VFMUL_VV,
+  VFMV_F_S,
+  VFMV_S_F,
+  VFMV_V_F,
+  VFNMACC_VF,
+  VFNMACC_VV,
+  VFNMADD_VF,
+  VFNMADD_VV,
+  VFNMSAC_VF,
+  VFNMSAC_VV,
+  VFNMSUB_VF,
+  VFNMSUB_VV,
+  VFRDIV_VF,
+  VFREDMAX_VS,
+  VFREDMIN_VS,
+  VFREDOSUM_VS,
+  VFREDUSUM_VS,
+  VFRSUB_VF,
+  VFSGNJ_VF,
+  VFSGNJ_VV,
+  VFSGNJN_VF,
+  VFSGNJN_VV,
+  VFSGNJX_VF,
+  VFSGNJX_VV,
+  VFSQRT_V,
+  VFSUB_VF,
+  VFSUB_VV,
+  VID_V,
+  VL1RE16_V,
+  VL1RE32_V,
+  VL1RE64_V,
+  VL1RE8_V,
+  VL2RE16_V,
+  VL2RE32_V,
+  VL2RE64_V,
+  VL2RE8_V,
+  VL4RE16_V,
+  VL4RE32_V,
+  VL4RE64_V,
+  VL4RE8_V,
+  VL8RE16_V,
+  VL8RE32_V,
+  VL8RE64_V,
+  VL8RE8_V,
+  VLE16_V,
+  VLE16FF_V,
+  VLE32_V,
+  VLE32FF_V,
+  VLE64_V,
+  VLE64FF_V,
+  VLE8_V,
+  VLE8FF_V,
+  VLM_V,
+  VLOXEI16_V,
+  VLOXEI32_V,
+  VLOXEI64_V,
+  VLOXEI8_V,
+  VLSE16_V,
+  VLSE32_V,
+  VLSE64_V,
+  VLSE8_V,
+  VLUXEI16_V,
+  VLUXEI32_V,
+  VLUXEI64_V,
+  VLUXEI8_V,
+  VMACC_VV,
+  VMACC_VX,
+  VMADD_VV,
+  VMADD_VX,
+  VMAND_MM,
+  VMANDN_MM,
+  VMAX_VV,
+  VMAX_VX,
+  VMAXU_VV,
+  VMAXU_VX,
+  VMERGE_VIM,
+  VMERGE_VVM,
+  VMERGE_VXM,
+  VMFEQ_VF,
+  VMFEQ_VV,
+  VMFGE_VF,
+  VMFGT_VF,
+  VMFLE_VF,
+  VMFLE_VV,
+  VMFLT_VF,
+  VMFLT_VV,
+  VMFNE_VF,
+  VMFNE_VV,
+  VMIN_VV,
+  VMIN_VX,
+  VMINU_VV,
+  VMINU_VX,
+  VMNAND_MM,
+  VMNOR_MM,
+  VMOR_MM,
+  VMORN_MM,
+  VMSEQ_VI,
+  VMSEQ_VV,
+  VMSEQ_VX,
+  VMSGT_VI,
+  VMSGT_VX,
+  VMSGTU_VI,
+  VMSGTU_VX,
+  VMSLE_VI,
+  VMSLE_VV,
+  VMSLE_VX,
+  VMSLEU_VI,
+  VMSLEU_VV,
+  VMSLEU_VX,
+  VMSLT_VV,
+  VMSLT_VX,
+  VMSLTU_VV,
+  VMSLTU_VX,
+  VMSNE_VI,
+  VMSNE_VV,
+  VMSNE_VX,
+  VMUL_VV,
+  VMUL_VX,
+  VMULH_VV,
+  VMULH_VX,
+  VMULHSU_VV,
+  VMULHSU_VX,
+  VMULHU_VV,
+  VMULHU_VX,
+  VMV_S_X,
+  VMV_V_I,
+  VMV_V_V,
+  VMV_V_X,
+  VMV_X_S,
+  VMV1R_V,
+  VMV2R_V,
+  VMV4R_V,
+  VMV8R_V,
+  VMXNOR_MM,
+  VMXOR_MM,
+  VNMSAC_VV,
+  VNMSAC_VX,
+  VNMSUB_VV,
+  VNMSUB_VX,
+  VNSRA_WI,
+  VNSRA_WV,
+  VNSRA_WX,
+  VNSRL_WI,
+  VNSRL_WV,
+  VNSRL_WX,
+  VOR_VI,
+  VOR_VV,
+  VOR_VX,
+  VREDAND_VS,
+  VREDMAX_VS,
+  VREDMAXU_VS,
+  VREDMIN_VS,
+  VREDMINU_VS,
+  VREDOR_VS,
+  VREDSUM_VS,
+  VREDXOR_VS,
+  VREM_VV,
+  VREM_VX,
+  VREMU_VV,
+  VREMU_VX,
+  VRGATHER_VI,
+  VRGATHER_VV,
+  VRGATHER_VX,
+  VRSUB_VI,
+  VRSUB_VX,
+  VS1R_V,
+  VS2R_V,
+  VS4R_V,
+  VS8R_V,
+  VSE16_V,
+  VSE32_V,
+  VSE64_V,
+  VSE8_V,
+  VSETIVLI,
+  VSETVL,
+  VSETVLI,
+  VSEXT_VF2,
+  VSEXT_VF4,
+  VSEXT_VF8,
+  VSLIDE1DOWN_VX,
+  VSLIDE1UP_VX,
+  VSLIDEDOWN_VI,
+  VSLIDEDOWN_VX,
+  VSLIDEUP_VI,
+  VSLIDEUP_VX,
+  VSLL_VI,
+  VSLL_VV,
+  VSLL_VX,
+  VSM_V,
+  VSOXEI16_V,
+  VSOXEI32_V,
+  VSOXEI64_V,
+  VSOXEI8_V,
+  VSRA_VI,
+  VSRA_VV,
+  VSRA_VX,
+  VSRL_VI,
+  VSRL_VV,
+  VSRL_VX,
+  VSSE16_V,
+  VSSE32_V,
+  VSSE64_V,
+  VSSE8_V,
+  VSUB_VV,
+  VSUB_VX,
+  VSUXEI16_V,
+  VSUXEI32_V,
+  VSUXEI64_V,
+  VSUXEI8_V,
+  VWADD_VV,
+  VWADD_VX,
+  VWADDU_VV,
+  VWADDU_VX,
+  VWMACC_VV,
+  VWMACC_VX,
+  VWMACCU_VV,
+  VWMACCU_VX,
+  VWMUL_VV,
+  VWMUL_VX,
+  VWMULU_VV,
+  VWMULU_VX,
+  VWSUB_VV,
+  VWSUB_VX,
+  VWSUBU_VV,
+  VWSUBU_VX,
+  VXOR_VI,
+  VXOR_VV,
+  VXOR_VX,
+  VZEXT_VF2,
+  VZEXT_VF4,
+  VZEXT_VF8,
+  XNOR,
   XOR,
   XORI,
+  ZEXT_H,
 
   NUM_OPS
 };
 
+// The decoder expands compressed instructions into the base instructions they
+// stand for. COp only remembers the original mnemonic for the disassembler.
+enum COp : u8 {
+  C_NONE,
+
+  C_ADD,
+  C_ADDI,
+  C_ADDIW,
+  C_ADDI16SP,
+  C_ADDI4SPN,
+  C_ADDW,
+  C_AND,
+  C_ANDI,
+  C_BEQZ,
+  C_BNEZ,
+  C_EBREAK,
+  C_FLD,
+  C_FLDSP,
+  C_FSD,
+  C_FSDSP,
+  C_J,
+  C_JALR,
+  C_JR,
+  C_LD,
+  C_LDSP,
+  C_LI,
+  C_LUI,
+  C_LW,
+  C_LWSP,
+  C_MV,
+  C_OR,
+  C_SD,
+  C_SDSP,
+  C_SLLI,
+  C_SRAI,
+  C_SRLI,
+  C_SUB,
+  C_SUBW,
+  C_SW,
+  C_SWSP,
+  C_XOR,
+
+  NUM_C_OPS
+};
+
 struct Ins {
   Op op;
+  COp c_op = C_NONE;
   u8 length;
 
   u8 rd;
@@ -189,21 +696,245 @@ struct Ins {
     u8 rs2;
     u8 shamt;
   };
+  // FP only, the third source of fused multiply-adds
+  u8 rs3;
+  union {
+    // FP: the rounding mode
+    u8 rm = RM_DYN;
+    // V: 1 if unmasked, 0 if masked by v0
+    u8 vm;
+  };
   i32 imm;
 };
 
+enum class Engine { SWITCH, THREADED, JIT };
+
+// translated blocks take m_regs and m_memory and return the next guest pc, or
+// with bit 0 set the pc of the instruction the interpreter has to continue
+// the block at: a load/store that missed the TLB or one the JIT can't do
+using JitFn = u64 (*)(i64 *regs, u8 *memory);
+
+// A straight-line run of decoded instructions, ending at the first branch,
+// jump, ECALL/EBREAK or invalid instruction. ins has a trailing dummy entry
+// and handlers a trailing end-of-block target, so running past the last
+// instruction leaves the block through the fallthrough link.
+struct Block {
+  u64 start;
+  std::vector<Ins> ins;
+  std::vector<const void *> handlers;
+  u64 end;
+  Block *taken = nullptr;
+  Block *fallthrough = nullptr;
+  u64 exec_count = 0;
+  JitFn jit = nullptr;
+  // times the block was entered, for print_profile()
+  u64 runs = 0;
+  // the cost of its instructions for the cycle CSR
+  u64 cycles = 0;
+};
+
+static constexpr u64 MAX_BLOCK_INS = 256;
+
+// Decoded instructions are kept per guest page, one slot for every 2-byte
+// aligned address. A slot with length 0 hasn't been decoded yet.
+static constexpr u64 CODE_PAGE_SIZE = 4096;
+struct CodePage {
+  std::array<Ins, CODE_PAGE_SIZE / 2> ins{};
+  // pages from decode_code() are complete and read-only
+  bool shared = false;
+};
+static_assert(CODE_PAGE_SIZE == GUEST_PAGE_SIZE);
+
+static_assert(std::is_trivially_copyable_v<CodePage>);
+
+// Decoded pages of one executable, shared between instances running it. The
+// pages live either in owned or in a read-only mapping of a decode cache
+// file.
+struct SharedCode {
+  std::unordered_map<u64, const CodePage *> pages;
+  std::vector<CodePage> owned;
+  void *mapping = nullptr;
+  u64 mapping_size = 0;
+
+  SharedCode() = default;
+  SharedCode(const SharedCode &) = delete;
+  SharedCode &operator=(const SharedCode &) = delete;
+  ~SharedCode() {
+    if (mapping != nullptr) {
+      munmap(mapping, mapping_size);
+    }
+  }
+};
+
+// A decode cache file is this header, the page numbers and then the pages.
+// Files written by another build of the emulator or for other code are
+// ignored.
+struct DecodeCacheHeader {
+  char magic[8];
+  u64 build_id;
+  u64 code_hash;
+  u64 page_count;
+};
+static constexpr char DECODE_CACHE_MAGIC[8] = "RV64DEC";
+
+// A JIT cache file is this header, count entries sorted by pc and then the
+// translated code from code_offset on. Files written by another build, on a
+// host with other CPU features or for other code are ignored, and so are
+// files whose entries and code don't hash to content_hash, since the code
+// is run as is.
+struct JitCacheHeader {
+  char magic[8];
+  u64 build_id;
+  u64 code_hash;
+  u64 host_features;
+  u64 count;
+  u64 code_offset;
+  u64 code_size;
+  u64 content_hash;
+};
+struct JitCacheEntry {
+  u64 pc;
+  // relative to code_offset
+  u64 offset;
+  u64 size;
+};
+static constexpr char JIT_CACHE_MAGIC[8] = "RV64JIT";
+
+// A fast 64-bit hash of data, for keying caches by content.
+static u64 hash_bytes(const u8 *data, u64 len, u64 seed = 0) {
+  u64 h = seed ^ (len * 0x9e3779b97f4a7c15);
+  auto mix = [&](u64 w) {
+    h ^= w * 0x9e3779b97f4a7c15;
+    h = std::rotl(h, 31) * 0xbf58476d1ce4e5b9;
+  };
+  u64 n = 0;
+  for (; n + 8 <= len; n += 8) {
+    u64 w;
+    std::memcpy(&w, data + n, sizeof(w));
+    mix(w);
+  }
+  u64 tail = 0;
+  if (n < len) {
+    std::memcpy(&tail, data + n, len - n);
+  }
+  mix(tail);
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  return h ^ (h >> 31);
+}
+
+// Identifies this build of the emulator, since decoding may change between
+// builds: by the GNU build ID the linker wrote into the executable, or by
+// when it was compiled if there is none.
+static u64 emulator_build_id() {
+  static const u64 id = [] {
+    std::string_view build_id;
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, size_t, void *data) {
+          // the executable comes first
+          for (u64 i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_NOTE) {
+              continue;
+            }
+            u64 align = phdr.p_align == 8 ? 8 : 4;
+            auto note = (const char *)(info->dlpi_addr + phdr.p_vaddr);
+            const char *end = note + phdr.p_memsz;
+            ElfW(Nhdr) nhdr;
+            while (end - note >= (i64)sizeof(nhdr)) {
+              std::memcpy(&nhdr, note, sizeof(nhdr));
+              const char *name = note + sizeof(nhdr);
+              const char *desc = name + ((nhdr.n_namesz + align - 1) & -align);
+              if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+                  std::memcmp(name, "GNU", 4) == 0) {
+                *(std::string_view *)data = {desc, nhdr.n_descsz};
+                return 1;
+              }
+              note = desc + ((nhdr.n_descsz + align - 1) & -align);
+            }
+          }
+          return 1;
+        },
+        &build_id);
+    if (build_id.empty()) {
+      build_id = __DATE__ " " __TIME__;
+    }
+    return hash_bytes((const u8 *)build_id.data(), build_id.size(),
+                      sizeof(Ins) << 32 | NUM_OPS);
+  }();
+  return id;
+}
+
+// number of runs after which the JIT engine translates a block
+static constexpr u64 JIT_THRESHOLD = 50;
+
+// Set by the SIGPROF handler start_sampling() installs. The engines only
+// check it between blocks, or on taken jumps in the switch engine, where
+// m_pc and m_regs are up to date, and take the sample there.
+static std::atomic<bool> sample_due = false;
+// whether start_sampling() ran, else the engines never check sample_due
+static bool sampling = false;
+
+// frames a sample follows the frame pointer chain for at most
+static constexpr u64 MAX_SAMPLE_DEPTH = 256;
+// host CPU time between samples
+static constexpr u64 SAMPLE_INTERVAL_US = 1000;
+
+// Thrown once an error that ends a guest has been printed. A single run
+// exits on it; --batch only fails the job it came from.
+struct GuestFault {};
+
+template <typename... Args>
+[[noreturn]] static void guest_fault(std::format_string<Args...> format,
+                                     Args &&...args) {
+  std::println(stderr, format, std::forward<Args>(args)...);
+  throw GuestFault{};
+}
+
 struct Section {
+  std::string name;
   u64 offset;
   u64 size;
-  u64 entrypoint;
 };
 
+struct Symbol {
+  u64 addr;
+  std::string name;
+};
+
+// struct stat as RISC-V Linux lays it out, the asm-generic one
+struct GuestStat {
+  u64 dev;
+  u64 ino;
+  u32 mode;
+  u32 nlink;
+  u32 uid;
+  u32 gid;
+  u64 rdev;
+  u64 pad1;
+  i64 size;
+  i32 blksize;
+  i32 pad2;
+  i64 blocks;
+  i64 atime;
+  u64 atime_nsec;
+  i64 mtime;
+  u64 mtime_nsec;
+  i64 ctime;
+  u64 ctime_nsec;
+  u32 unused[2];
+};
+static_assert(sizeof(GuestStat) == 128);
+
 enum class Format {
   NONE,
   R,
   I,
   I_LOAD,
   I_SHIFT,
+  R1,
   S,
   B,
   CB,
@@ -218,7 +949,44 @@ enum class Format {
   R_ATOMIC,
   R_ATOMIC_LR,
   CSR,
-  CSRI
+  CSRI,
+  // operands in the FP register file (f), the integer one (x) or both
+  F_R,      // fd, fs1, fs2
+  F_R1,     // fd, fs1
+  F_R4,     // fd, fs1, fs2, fs3
+  F_CMP,    // xd, fs1, fs2
+  F_TO_X,   // xd, fs1
+  F_FROM_X, // fd, xs1
+  F_LOAD,   // fd, imm(xs1)
+  F_STORE,  // fs2, imm(xs1)
+  // vector operands, an optional mask (v0.t) comes last
+  V_VV,          // vd, vs2, vs1
+  V_VX,          // vd, vs2, xs1
+  V_VI,          // vd, vs2, imm
+  V_VF,          // vd, vs2, fs1
+  V_VVM,         // vd, vs2, vs1, v0
+  V_VXM,         // vd, vs2, xs1, v0
+  V_VIM,         // vd, vs2, imm, v0
+  V_VFM,         // vd, vs2, fs1, v0
+  V_MACC_VV,     // vd, vs1, vs2
+  V_MACC_VX,     // vd, xs1, vs2
+  V_MACC_VF,     // vd, fs1, vs2
+  V_MV_V,        // vd, vs1
+  V_MV_X,        // vd, xs1
+  V_MV_I,        // vd, imm
+  V_MV_F,        // vd, fs1
+  V_UNARY,       // vd, vs2
+  V_ID,          // vd
+  V_TO_X,        // xd, vs2
+  V_FROM_X,      // vd, xs1
+  V_TO_F,        // fd, vs2
+  V_FROM_F,      // vd, fs1
+  V_MEM,         // vd, (xs1)
+  V_MEM_STRIDED, // vd, (xs1), xs2
+  V_MEM_INDEXED, // vd, (xs1), vs2
+  VSETVLI,       // xd, xs1, vtype
+  VSETIVLI,      // xd, uimm, vtype
+  VSETVL         // xd, xs1, xs2
 };
 
 struct OpDef {
@@ -229,88 +997,129 @@ struct OpDef {
 static constexpr auto OP_TABLE = std::to_array<OpDef>({
     {"???", Format::NONE},
     {"add", Format::R},
+    {"add.uw", Format::R},
     {"addi", Format::I},
     {"addiw", Format::I},
     {"addw", Format::R},
     {"amoadd.d", Format::R_ATOMIC},
     {"amoadd.w", Format::R_ATOMIC},
+    {"amoand.d", Format::R_ATOMIC},
+    {"amoand.w", Format::R_ATOMIC},
+    {"amomax.d", Format::R_ATOMIC},
+    {"amomax.w", Format::R_ATOMIC},
     {"amomaxu.d", Format::R_ATOMIC},
     {"amomaxu.w", Format::R_ATOMIC},
+    {"amomin.d", Format::R_ATOMIC},
+    {"amomin.w", Format::R_ATOMIC},
+    {"amominu.d", Format::R_ATOMIC},
+    {"amominu.w", Format::R_ATOMIC},
+    {"amoor.d", Format::R_ATOMIC},
     {"amoor.w", Format::R_ATOMIC},
     {"amoswap.d", Format::R_ATOMIC},
     {"amoswap.w", Format::R_ATOMIC},
+    {"amoxor.d", Format::R_ATOMIC},
+    {"amoxor.w", Format::R_ATOMIC},
     {"and", Format::R},
     {"andi", Format::I},
+    {"andn", Format::R},
     {"auipc", Format::U},
+    {"bclr", Format::R},
+    {"bclri", Format::I_SHIFT},
     {"beq", Format::B},
+    {"bext", Format::R},
+    {"bexti", Format::I_SHIFT},
     {"bge", Format::B},
     {"bgeu", Format::B},
+    {"binv", Format::R},
+    {"binvi", Format::I_SHIFT},
     {"blt", Format::B},
     {"bltu", Format::B},
     {"bne", Format::B},
-    {"c.add", Format::CR},
-    {"c.addi", Format::CI},
-    {"c.addiw", Format::CI},
-    {"c.addi16sp", Format::CI},
-    {"c.addi4spn", Format::CI},
-    {"c.addw", Format::CR},
-    {"c.and", Format::CR},
-    {"c.andi", Format::CI},
-    {"c.beqz", Format::CB},
-    {"c.bnez", Format::CB},
-    {"c.ebreak", Format::NONE},
-    {"c.fld", Format::CL},
-    {"c.fldsp", Format::CI},
-    {"c.fsd", Format::S},
-    {"c.fsdsp", Format::CSS},
-    {"c.j", Format::CJ},
-    {"c.jalr", Format::CR1},
-    {"c.jr", Format::CR1},
-    {"c.ld", Format::CL},
-    {"c.ldsp", Format::CL},
-    {"c.li", Format::CI},
-    {"c.lui", Format::CI},
-    {"c.lw", Format::CL},
-    {"c.lwsp", Format::CL},
-    {"c.mv", Format::CR},
-    {"c.or", Format::CR},
-    {"c.sd", Format::S},
-    {"c.sdsp", Format::CSS},
-    {"c.slli", Format::CI},
-    {"c.srai", Format::CI},
-    {"c.srli", Format::CI},
-    {"c.sub", Format::CR},
-    {"c.subw", Format::CR},
-    {"c.sw", Format::S},
-    {"c.swsp", Format::CSS},
-    {"c.xor", Format::CR},
+    {"bset", Format::R},
+    {"bseti", Format::I_SHIFT},
+    {"clz", Format::R1},
+    {"clzw", Format::R1},
+    {"cpop", Format::R1},
+    {"cpopw", Format::R1},
+    {"csrrc", Format::CSR},
+    {"csrrci", Format::CSRI},
     {"csrrs", Format::CSR},
     {"csrrsi", Format::CSRI},
+    {"csrrw", Format::CSR},
+    {"csrrwi", Format::CSRI},
+    {"ctz", Format::R1},
+    {"ctzw", Format::R1},
     {"div", Format::R},
     {"divu", Format::R},
     {"divuw", Format::R},
     {"divw", Format::R},
+    {"ebreak", Format::NONE},
     {"ecall", Format::NONE},
-    {"fadd.d", Format::R},
-    {"fclass.d", Format::R},
-    {"fcvt.d.w", Format::R},
-    {"fcvt.d.wu", Format::R},
+    {"fadd.d", Format::F_R},
+    {"fadd.s", Format::F_R},
+    {"fclass.d", Format::F_TO_X},
+    {"fclass.s", Format::F_TO_X},
+    {"fcvt.d.l", Format::F_FROM_X},
+    {"fcvt.d.lu", Format::F_FROM_X},
+    {"fcvt.d.s", Format::F_R1},
+    {"fcvt.d.w", Format::F_FROM_X},
+    {"fcvt.d.wu", Format::F_FROM_X},
+    {"fcvt.l.d", Format::F_TO_X},
+    {"fcvt.l.s", Format::F_TO_X},
+    {"fcvt.lu.d", Format::F_TO_X},
+    {"fcvt.lu.s", Format::F_TO_X},
+    {"fcvt.s.d", Format::F_R1},
+    {"fcvt.s.l", Format::F_FROM_X},
+    {"fcvt.s.lu", Format::F_FROM_X},
+    {"fcvt.s.w", Format::F_FROM_X},
+    {"fcvt.s.wu", Format::F_FROM_X},
+    {"fcvt.w.d", Format::F_TO_X},
+    {"fcvt.w.s", Format::F_TO_X},
+    {"fcvt.wu.d", Format::F_TO_X},
+    {"fcvt.wu.s", Format::F_TO_X},
+    {"fdiv.d", Format::F_R},
+    {"fdiv.s", Format::F_R},
     {"fence", Format::NONE},
+    {"fence.i", Format::NONE},
     {"fence.tso", Format::NONE},
-    {"fld", Format::I},
-    {"flw", Format::I},
-    {"fmul.d", Format::R},
-    {"fmv.d.x", Format::R},
-    {"fmv.x.d", Format::R},
-    {"fmv.w.x", Format::R},
-    {"fsw", Format::S},
-    {"fsd", Format::S},
-    {"fsgnj.d", Format::R},
-    {"fsgnjn.d", Format::R},
-    {"fsgnjx.d", Format::R},
-    {"fsgnj.s", Format::R},
-    {"fsgnjn.s", Format::R},
-    {"fsgnjx.s", Format::R},
+    {"feq.d", Format::F_CMP},
+    {"feq.s", Format::F_CMP},
+    {"fld", Format::F_LOAD},
+    {"fle.d", Format::F_CMP},
+    {"fle.s", Format::F_CMP},
+    {"flt.d", Format::F_CMP},
+    {"flt.s", Format::F_CMP},
+    {"flw", Format::F_LOAD},
+    {"fmadd.d", Format::F_R4},
+    {"fmadd.s", Format::F_R4},
+    {"fmax.d", Format::F_R},
+    {"fmax.s", Format::F_R},
+    {"fmin.d", Format::F_R},
+    {"fmin.s", Format::F_R},
+    {"fmsub.d", Format::F_R4},
+    {"fmsub.s", Format::F_R4},
+    {"fmul.d", Format::F_R},
+    {"fmul.s", Format::F_R},
+    {"fmv.d.x", Format::F_FROM_X},
+    {"fmv.w.x", Format::F_FROM_X},
+    {"fmv.x.d", Format::F_TO_X},
+    {"fmv.x.w", Format::F_TO_X},
+    {"fnmadd.d", Format::F_R4},
+    {"fnmadd.s", Format::F_R4},
+    {"fnmsub.d", Format::F_R4},
+    {"fnmsub.s", Format::F_R4},
+    {"fsd", Format::F_STORE},
+    {"fsgnj.d", Format::F_R},
+    {"fsgnj.s", Format::F_R},
+    {"fsgnjn.d", Format::F_R},
+    {"fsgnjn.s", Format::F_R},
+    {"fsgnjx.d", Format::F_R},
+    {"fsgnjx.s", Format::F_R},
+    {"fsqrt.d", Format::F_R1},
+    {"fsqrt.s", Format::F_R1},
+    {"fsub.d", Format::F_R},
+    {"fsub.s", Format::F_R},
+    {"fsw", Format::F_STORE},
     {"jal", Format::J},
     {"jalr", Format::I},
     {"lb", Format::I_LOAD},
@@ -323,24 +1132,46 @@ static constexpr auto OP_TABLE = std::to_array<OpDef>({
     {"lui", Format::U},
     {"lw", Format::I_LOAD},
     {"lwu", Format::I_LOAD},
+    {"max", Format::R},
+    {"maxu", Format::R},
+    {"min", Format::R},
+    {"minu", Format::R},
     {"mul", Format::R},
     {"mulh", Format::R},
     {"mulhu", Format::R},
     {"mulw", Format::R},
     {"or", Format::R},
+    {"orc.b", Format::R1},
     {"ori", Format::I},
+    {"orn", Format::R},
     {"pause", Format::NONE},
     {"rem", Format::R},
     {"remu", Format::R},
     {"remuw", Format::R},
     {"remw", Format::R},
+    {"rev8", Format::R1},
+    {"rol", Format::R},
+    {"rolw", Format::R},
+    {"ror", Format::R},
+    {"rori", Format::I_SHIFT},
+    {"roriw", Format::I_SHIFT},
+    {"rorw", Format::R},
     {"sb", Format::S},
     {"sc.d", Format::R_ATOMIC},
     {"sc.w", Format::R_ATOMIC},
     {"sd", Format::S},
+    {"sext.b", Format::R1},
+    {"sext.h", Format::R1},
     {"sh", Format::S},
+    {"sh1add", Format::R},
+    {"sh1add.uw", Format::R},
+    {"sh2add", Format::R},
+    {"sh2add.uw", Format::R},
+    {"sh3add", Format::R},
+    {"sh3add.uw", Format::R},
     {"sll", Format::R},
     {"slli", Format::I_SHIFT},
+    {"slli.uw", Format::I_SHIFT},
     {"slliw", Format::I_SHIFT},
     {"sllw", Format::R},
     {"slt", Format::R},
@@ -358,1737 +1189,8983 @@ static constexpr auto OP_TABLE = std::to_array<OpDef>({
     {"sub", Format::R},
     {"subw", Format::R},
     {"sw", Format::S},
+    {"vadd.vi", Format::V_VI},
+    {"vadd.vv", Format::V_VV},
+    {"vadd.vx", Format::V_VX},
+    {"vand.vi", Format::V_VI},
+    {"vand.vv", Format::V_VV},
+    {"vand.vx", Format::V_VX},
+    {"vcompress.vm", Format::V_VV},
+    {"vcpop.m", Format::V_TO_X},
+    {"vdiv.vv", Format::V_VV},
+    {"vdiv.vx", Format::V_VX},
+    {"vdivu.vv", Format::V_VV},
+    {"vdivu.vx", Format::V_VX},
+    {"vfadd.vf", Format::V_VF},
+    {"vfadd.vv", Format::V_VV},
+    {"vfcvt.f.x.v", Format::V_UNARY},
+    {"vfcvt.f.xu.v", Format::V_UNARY},
+    {"vfcvt.rtz.x.f.v", Format::V_UNARY},
+    {"vfcvt.rtz.xu.f.v", Format::V_UNARY},
+    {"vfcvt.x.f.v", Format::V_UNARY},
+    {"vfcvt.xu.f.v", Format::V_UNARY},
+    {"vfdiv.vf", Format::V_VF},
+    {"vfdiv.vv", Format::V_VV},
+    {"vfirst.m", Format::V_TO_X},
+    {"vfmacc.vf", Format::V_MACC_VF},
+    {"vfmacc.vv", Format::V_MACC_VV},
+    {"vfmadd.vf", Format::V_MACC_VF},
+    {"vfmadd.vv", Format::V_MACC_VV},
+    {"vfmax.vf", Format::V_VF},
+    {"vfmax.vv", Format::V_VV},
+    {"vfmerge.vfm", Format::V_VFM},
+    {"vfmin.vf", Format::V_VF},
+    {"vfmin.vv", Format::V_VV},
+    {"vfmsac.vf", Format::V_MACC_VF},
+    {"vfmsac.vv", Format::V_MACC_VV},
+    {"vfmsub.vf", Format::V_MACC_VF},
+    {"vfmsub.vv", Format::V_MACC_VV},
+    {"vfmul.vf", Format::V_VF},
+    {"vfmul.vv", Format::V_VV},
+    {"vfmv.f.s", Format::V_TO_F},
+    {"vfmv.s.f", Format::V_FROM_F},
+    {"vfmv.v.f", Format::V_MV_F},
+    {"vfnmacc.vf", Format::V_MACC_VF},
+    {"vfnmacc.vv", Format::V_MACC_VV},
+    {"vfnmadd.vf", Format::V_MACC_VF},
+    {"vfnmadd.vv", Format::V_MACC_VV},
+    {"vfnmsac.vf", Format::V_MACC_VF},
+    {"vfnmsac.vv", Format::V_MACC_VV},
+    {"vfnmsub.vf", Format::V_MACC_VF},
+    {"vfnmsub.vv", Format::V_MACC_VV},
+    {"vfrdiv.vf", Format::V_VF},
+    {"vfredmax.vs", Format::V_VV},
+    {"vfredmin.vs", Format::V_VV},
+    {"vfredosum.vs", Format::V_VV},
+    {"vfredusum.vs", Format::V_VV},
+    {"vfrsub.vf", Format::V_VF},
+    {"vfsgnj.vf", Format::V_VF},
+    {"vfsgnj.vv", Format::V_VV},
+    {"vfsgnjn.vf", Format::V_VF},
+    {"vfsgnjn.vv", Format::V_VV},
+    {"vfsgnjx.vf", Format::V_VF},
+    {"vfsgnjx.vv", Format::V_VV},
+    {"vfsqrt.v", Format::V_UNARY},
+    {"vfsub.vf", Format::V_VF},
+    {"vfsub.vv", Format::V_VV},
+    {"vid.v", Format::V_ID},
+    {"vl1re16.v", Format::V_MEM},
+    {"vl1re32.v", Format::V_MEM},
+    {"vl1re64.v", Format::V_MEM},
+    {"vl1re8.v", Format::V_MEM},
+    {"vl2re16.v", Format::V_MEM},
+    {"vl2re32.v", Format::V_MEM},
+    {"vl2re64.v", Format::V_MEM},
+    {"vl2re8.v", Format::V_MEM},
+    {"vl4re16.v", Format::V_MEM},
+    {"vl4re32.v", Format::V_MEM},
+    {"vl4re64.v", Format::V_MEM},
+    {"vl4re8.v", Format::V_MEM},
+    {"vl8re16.v", Format::V_MEM},
+    {"vl8re32.v", Format::V_MEM},
+    {"vl8re64.v", Format::V_MEM},
+    {"vl8re8.v", Format::V_MEM},
+    {"vle16.v", Format::V_MEM},
+    {"vle16ff.v", Format::V_MEM},
+    {"vle32.v", Format::V_MEM},
+    {"vle32ff.v", Format::V_MEM},
+    {"vle64.v", Format::V_MEM},
+    {"vle64ff.v", Format::V_MEM},
+    {"vle8.v", Format::V_MEM},
+    {"vle8ff.v", Format::V_MEM},
+    {"vlm.v", Format::V_MEM},
+    {"vloxei16.v", Format::V_MEM_INDEXED},
+    {"vloxei32.v", Format::V_MEM_INDEXED},
+    {"vloxei64.v", Format::V_MEM_INDEXED},
+    {"vloxei8.v", Format::V_MEM_INDEXED},
+    {"vlse16.v", Format::V_MEM_STRIDED},
+    {"vlse32.v", Format::V_MEM_STRIDED},
+    {"vlse64.v", Format::V_MEM_STRIDED},
+    {"vlse8.v", Format::V_MEM_STRIDED},
+    {"vluxei16.v", Format::V_MEM_INDEXED},
+    {"vluxei32.v", Format::V_MEM_INDEXED},
+    {"vluxei64.v", Format::V_MEM_INDEXED},
+    {"vluxei8.v", Format::V_MEM_INDEXED},
+    {"vmacc.vv", Format::V_MACC_VV},
+    {"vmacc.vx", Format::V_MACC_VX},
+    {"vmadd.vv", Format::V_MACC_VV},
+    {"vmadd.vx", Format::V_MACC_VX},
+    {"vmand.mm", Format::V_VV},
+    {"vmandn.mm", Format::V_VV},
+    {"vmax.vv", Format::V_VV},
+    {"vmax.vx", Format::V_VX},
+    {"vmaxu.vv", Format::V_VV},
+    {"vmaxu.vx", Format::V_VX},
+    {"vmerge.vim", Format::V_VIM},
+    {"vmerge.vvm", Format::V_VVM},
+    {"vmerge.vxm", Format::V_VXM},
+    {"vmfeq.vf", Format::V_VF},
+    {"vmfeq.vv", Format::V_VV},
+    {"vmfge.vf", Format::V_VF},
+    {"vmfgt.vf", Format::V_VF},
+    {"vmfle.vf", Format::V_VF},
+    {"vmfle.vv", Format::V_VV},
+    {"vmflt.vf", Format::V_VF},
+    {"vmflt.vv", Format::V_VV},
+    {"vmfne.vf", Format::V_VF},
+    {"vmfne.vv", Format::V_VV},
+    {"vmin.vv", Format::V_VV},
+    {"vmin.vx", Format::V_VX},
+    {"vminu.vv", Format::V_VV},
+    {"vminu.vx", Format::V_VX},
+    {"vmnand.mm", Format::V_VV},
+    {"vmnor.mm", Format::V_VV},
+    {"vmor.mm", Format::V_VV},
+    {"vmorn.mm", Format::V_VV},
+    {"vmseq.vi", Format::V_VI},
+    {"vmseq.vv", Format::V_VV},
+    {"vmseq.vx", Format::V_VX},
+    {"vmsgt.vi", Format::V_VI},
+    {"vmsgt.vx", Format::V_VX},
+    {"vmsgtu.vi", Format::V_VI},
+    {"vmsgtu.vx", Format::V_VX},
+    {"vmsle.vi", Format::V_VI},
+    {"vmsle.vv", Format::V_VV},
+    {"vmsle.vx", Format::V_VX},
+    {"vmsleu.vi", Format::V_VI},
+    {"vmsleu.vv", Format::V_VV},
+    {"vmsleu.vx", Format::V_VX},
+    {"vmslt.vv", Format::V_VV},
+    {"vmslt.vx", Format::V_VX},
+    {"vmsltu.vv", Format::V_VV},
+    {"vmsltu.vx", Format::V_VX},
+    {"vmsne.vi", Format::V_VI},
+    {"vmsne.vv", Format::V_VV},
+    {"vmsne.vx", Format::V_VX},
+    {"vmul.vv", Format::V_VV},
+    {"vmul.vx", Format::V_VX},
+    {"vmulh.vv", Format::V_VV},
+    {"vmulh.vx", Format::V_VX},
+    {"vmulhsu.vv", Format::V_VV},
+    {"vmulhsu.vx", Format::V_VX},
+    {"vmulhu.vv", Format::V_VV},
+    {"vmulhu.vx", Format::V_VX},
+    {"vmv.s.x", Format::V_FROM_X},
+    {"vmv.v.i", Format::V_MV_I},
+    {"vmv.v.v", Format::V_MV_V},
+    {"vmv.v.x", Format::V_MV_X},
+    {"vmv.x.s", Format::V_TO_X},
+    {"vmv1r.v", Format::V_UNARY},
+    {"vmv2r.v", Format::V_UNARY},
+    {"vmv4r.v", Format::V_UNARY},
+    {"vmv8r.v", Format::V_UNARY},
+    {"vmxnor.mm", Format::V_VV},
+    {"vmxor.mm", Format::V_VV},
+    {"vnmsac.vv", Format::V_MACC_VV},
+    {"vnmsac.vx", Format::V_MACC_VX},
+    {"vnmsub.vv", Format::V_MACC_VV},
+    {"vnmsub.vx", Format::V_MACC_VX},
+    {"vnsra.wi", Format::V_VI},
+    {"vnsra.wv", Format::V_VV},
+    {"vnsra.wx", Format::V_VX},
+    {"vnsrl.wi", Format::V_VI},
+    {"vnsrl.wv", Format::V_VV},
+    {"vnsrl.wx", Format::V_VX},
+    {"vor.vi", Format::V_VI},
+    {"vor.vv", Format::V_VV},
+    {"vor.vx", Format::V_VX},
+    {"vredand.vs", Format::V_VV},
+    {"vredmax.vs", Format::V_VV},
+    {"vredmaxu.vs", Format::V_VV},
+    {"vredmin.vs", Format::V_VV},
+    {"vredminu.vs", Format::V_VV},
+    {"vredor.vs", Format::V_VV},
+    {"vredsum.vs", Format::V_VV},
+    {"vredxor.vs", Format::V_VV},
+    {"vrem.vv", Format::V_VV},
+    {"vrem.vx", Format::V_VX},
+    {"vremu.vv", Format::V_VV},
+    {"vremu.vx", Format::V_VX},
+    {"vrgather.vi", Format::V_VI},
+    {"vrgather.vv", Format::V_VV},
+    {"vrgather.vx", Format::V_VX},
+    {"vrsub.vi", Format::V_VI},
+    {"vrsub.vx", Format::V_VX},
+    {"vs1r.v", Format::V_MEM},
+    {"vs2r.v", Format::V_MEM},
+    {"vs4r.v", Format::V_MEM},
+    {"vs8r.v", Format::V_MEM},
+    {"vse16.v", Format::V_MEM},
+    {"vse32.v", Format::V_MEM},
+    {"vse64.v", Format::V_MEM},
+    {"vse8.v", Format::V_MEM},
+    {"vsetivli", Format::VSETIVLI},
+    {"vsetvl", Format::VSETVL},
+    {"vsetvli", Format::VSETVLI},
+    {"vsext.vf2", Format::V_UNARY},
+    {"vsext.vf4", Format::V_UNARY},
+    {"vsext.vf8", Format::V_UNARY},
+    {"vslide1down.vx", Format::V_VX},
+    {"vslide1up.vx", Format::V_VX},
+    {"vslidedown.vi", Format::V_VI},
+    {"vslidedown.vx", Format::V_VX},
+    {"vslideup.vi", Format::V_VI},
+    {"vslideup.vx", Format::V_VX},
+    {"vsll.vi", Format::V_VI},
+    {"vsll.vv", Format::V_VV},
+    {"vsll.vx", Format::V_VX},
+    {"vsm.v", Format::V_MEM},
+    {"vsoxei16.v", Format::V_MEM_INDEXED},
+    {"vsoxei32.v", Format::V_MEM_INDEXED},
+    {"vsoxei64.v", Format::V_MEM_INDEXED},
+    {"vsoxei8.v", Format::V_MEM_INDEXED},
+    {"vsra.vi", Format::V_VI},
+    {"vsra.vv", Format::V_VV},
+    {"vsra.vx", Format::V_VX},
+    {"vsrl.vi", Format::V_VI},
+    {"vsrl.vv", Format::V_VV},
+    {"vsrl.vx", Format::V_VX},
+    {"vsse16.v", Format::V_MEM_STRIDED},
+    {"vsse32.v", Format::V_MEM_STRIDED},
+    {"vsse64.v", Format::V_MEM_STRIDED},
+    {"vsse8.v", Format::V_MEM_STRIDED},
+    {"vsub.vv", Format::V_VV},
+    {"vsub.vx", Format::V_VX},
+    {"vsuxei16.v", Format::V_MEM_INDEXED},
+    {"vsuxei32.v", Format::V_MEM_INDEXED},
+    {"vsuxei64.v", Format::V_MEM_INDEXED},
+    {"vsuxei8.v", Format::V_MEM_INDEXED},
+    {"vwadd.vv", Format::V_VV},
+    {"vwadd.vx", Format::V_VX},
+    {"vwaddu.vv", Format::V_VV},
+    {"vwaddu.vx", Format::V_VX},
+    {"vwmacc.vv", Format::V_MACC_VV},
+    {"vwmacc.vx", Format::V_MACC_VX},
+    {"vwmaccu.vv", Format::V_MACC_VV},
+    {"vwmaccu.vx", Format::V_MACC_VX},
+    {"vwmul.vv", Format::V_VV},
+    {"vwmul.vx", Format::V_VX},
+    {"vwmulu.vv", Format::V_VV},
+    {"vwmulu.vx", Format::V_VX},
+    {"vwsub.vv", Format::V_VV},
+    {"vwsub.vx", Format::V_VX},
+    {"vwsubu.vv", Format::V_VV},
+    {"vwsubu.vx", Format::V_VX},
+    {"vxor.vi", Format::V_VI},
+    {"vxor.vv", Format::V_VV},
+    {"vxor.vx", Format::V_VX},
+    {"vzext.vf2", Format::V_UNARY},
+    {"vzext.vf4", Format::V_UNARY},
+    {"vzext.vf8", Format::V_UNARY},
+    {"xnor", Format::R},
     {"xor", Format::R},
     {"xori", Format::I},
+    {"zext.h", Format::R1},
 });
 
 static_assert(OP_TABLE.size() == NUM_OPS, "len(OP_TABLE) != len(Op::*)");
 
-class RISCV64 {
-public:
-  RISCV64(const std::vector<char> &exe_bytes) {
-    m_memory = (u8 *)mmap(nullptr, MEMORY_SIZE, PROT_READ | PROT_WRITE,
-                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (m_memory == MAP_FAILED) {
-      std::println(stderr, "Failed to mmap memory");
-      exit(1);
-    }
+// Classes of instructions the cycle CSR can charge different costs for.
+enum CostClass : u8 {
+  COST_ALU,
+  COST_MUL,
+  COST_DIV,
+  COST_MEM,
+  COST_BRANCH,
+  COST_FP,
+  COST_FDIV,
+  COST_VECTOR,
+  NUM_COST_CLASSES
+};
 
-    Elf *elf =
-        elf_memory(const_cast<char *>(exe_bytes.data()), exe_bytes.size());
-    GElf_Ehdr ehdr;
-    gelf_getehdr(elf, &ehdr);
+static constexpr std::array<const char *, NUM_COST_CLASSES> COST_CLASS_NAMES = {
+    "alu", "mul", "div", "mem", "branch", "fp", "fdiv", "vector"};
 
-    if (ehdr.e_machine != EM_RISCV) {
-      std::println(stderr, "ehdr.e_machine != EM_RISCV");
-      exit(1);
+// cycles per instruction of each CostClass
+using CycleCosts = std::array<u32, NUM_COST_CLASSES>;
+static constexpr CycleCosts DEFAULT_CYCLE_COSTS = {1, 1, 1, 1, 1, 1, 1, 1};
+
+static CostClass cost_class(Op op) {
+  switch (op) {
+  case Op::MUL:
+  case Op::MULH:
+  case Op::MULHU:
+  case Op::MULW:
+    return COST_MUL;
+  case Op::DIV:
+  case Op::DIVU:
+  case Op::DIVUW:
+  case Op::DIVW:
+  case Op::REM:
+  case Op::REMU:
+  case Op::REMUW:
+  case Op::REMW:
+    return COST_DIV;
+  case Op::FDIV_D:
+  case Op::FDIV_S:
+  case Op::FSQRT_D:
+  case Op::FSQRT_S:
+    return COST_FDIV;
+  case Op::JALR:
+    return COST_BRANCH;
+  default:
+    break;
+  }
+  Format format = OP_TABLE[op].format;
+  switch (format) {
+  case Format::I_LOAD:
+  case Format::S:
+  case Format::R_ATOMIC:
+  case Format::R_ATOMIC_LR:
+  case Format::F_LOAD:
+  case Format::F_STORE:
+    return COST_MEM;
+  case Format::B:
+  case Format::J:
+    return COST_BRANCH;
+  default:
+    if (format >= Format::V_VV) {
+      return COST_VECTOR;
     }
+    if (format >= Format::F_R) {
+      return COST_FP;
+    }
+    return COST_ALU;
+  }
+}
+
+static constexpr auto C_OP_TABLE = std::to_array<OpDef>({
+    {"???", Format::NONE},
+    {"c.add", Format::CR},
+    {"c.addi", Format::CI},
+    {"c.addiw", Format::CI},
+    {"c.addi16sp", Format::CI},
+    {"c.addi4spn", Format::CI},
+    {"c.addw", Format::CR},
+    {"c.and", Format::CR},
+    {"c.andi", Format::CI},
+    {"c.beqz", Format::CB},
+    {"c.bnez", Format::CB},
+    {"c.ebreak", Format::NONE},
+    {"c.fld", Format::F_LOAD},
+    {"c.fldsp", Format::F_LOAD},
+    {"c.fsd", Format::F_STORE},
+    {"c.fsdsp", Format::F_STORE},
+    {"c.j", Format::CJ},
+    {"c.jalr", Format::CR1},
+    {"c.jr", Format::CR1},
+    {"c.ld", Format::CL},
+    {"c.ldsp", Format::CL},
+    {"c.li", Format::CI},
+    {"c.lui", Format::CI},
+    {"c.lw", Format::CL},
+    {"c.lwsp", Format::CL},
+    {"c.mv", Format::CR},
+    {"c.or", Format::CR},
+    {"c.sd", Format::S},
+    {"c.sdsp", Format::CSS},
+    {"c.slli", Format::CI},
+    {"c.srai", Format::CI},
+    {"c.srli", Format::CI},
+    {"c.sub", Format::CR},
+    {"c.subw", Format::CR},
+    {"c.sw", Format::S},
+    {"c.swsp", Format::CSS},
+    {"c.xor", Format::CR},
+});
 
-    m_code_section = get_code_section(elf, ehdr);
-    m_pc = m_code_section.offset;
+static_assert(C_OP_TABLE.size() == NUM_C_OPS,
+              "len(C_OP_TABLE) != len(COp::*)");
 
-    u64 max_addr = 0;
-    for (u64 i = 0; i < ehdr.e_phnum; i++) {
-      GElf_Phdr phdr;
-      gelf_getphdr(elf, i, &phdr);
-      if (phdr.p_type == PT_LOAD) {
-        // TODO: probably should disassemble all of those instead of just .text?
-        std::copy_n(exe_bytes.data() + phdr.p_offset, phdr.p_filesz,
-                    m_memory + phdr.p_vaddr);
-        max_addr = std::max(max_addr, phdr.p_vaddr + phdr.p_memsz);
-      }
-    }
-    elf_end(elf);
+// OP-V ops by funct6, in the order of the forms: vector-vector,
+// vector-scalar and (OPIV only) vector-immediate. INVALID where a form
+// doesn't exist. The unary groups, where vs1 or vs2 selects the op, are
+// decoded by hand.
+static constexpr auto OPIV_OPS = [] {
+  std::array<std::array<Op, 3>, 64> t{};
+  t[0b000000] = {VADD_VV, VADD_VX, VADD_VI};
+  t[0b000010] = {VSUB_VV, VSUB_VX, INVALID};
+  t[0b000011] = {INVALID, VRSUB_VX, VRSUB_VI};
+  t[0b000100] = {VMINU_VV, VMINU_VX, INVALID};
+  t[0b000101] = {VMIN_VV, VMIN_VX, INVALID};
+  t[0b000110] = {VMAXU_VV, VMAXU_VX, INVALID};
+  t[0b000111] = {VMAX_VV, VMAX_VX, INVALID};
+  t[0b001001] = {VAND_VV, VAND_VX, VAND_VI};
+  t[0b001010] = {VOR_VV, VOR_VX, VOR_VI};
+  t[0b001011] = {VXOR_VV, VXOR_VX, VXOR_VI};
+  t[0b001100] = {VRGATHER_VV, VRGATHER_VX, VRGATHER_VI};
+  t[0b001110] = {INVALID, VSLIDEUP_VX, VSLIDEUP_VI};
+  t[0b001111] = {INVALID, VSLIDEDOWN_VX, VSLIDEDOWN_VI};
+  t[0b010111] = {VMERGE_VVM, VMERGE_VXM, VMERGE_VIM};
+  t[0b011000] = {VMSEQ_VV, VMSEQ_VX, VMSEQ_VI};
+  t[0b011001] = {VMSNE_VV, VMSNE_VX, VMSNE_VI};
+  t[0b011010] = {VMSLTU_VV, VMSLTU_VX, INVALID};
+  t[0b011011] = {VMSLT_VV, VMSLT_VX, INVALID};
+  t[0b011100] = {VMSLEU_VV, VMSLEU_VX, VMSLEU_VI};
+  t[0b011101] = {VMSLE_VV, VMSLE_VX, VMSLE_VI};
+  t[0b011110] = {INVALID, VMSGTU_VX, VMSGTU_VI};
+  t[0b011111] = {INVALID, VMSGT_VX, VMSGT_VI};
+  t[0b100101] = {VSLL_VV, VSLL_VX, VSLL_VI};
+  t[0b101000] = {VSRL_VV, VSRL_VX, VSRL_VI};
+  t[0b101001] = {VSRA_VV, VSRA_VX, VSRA_VI};
+  t[0b101100] = {VNSRL_WV, VNSRL_WX, VNSRL_WI};
+  t[0b101101] = {VNSRA_WV, VNSRA_WX, VNSRA_WI};
+  return t;
+}();
+
+// OPIVI ops whose immediate is unsigned: shift amounts, slide offsets,
+// indices and vmv<nr>r.v's register count
+static constexpr auto OPIVI_UNSIGNED = [] {
+  std::array<bool, 64> t{};
+  for (u8 funct6 : {0b001100, 0b001110, 0b001111, 0b100101, 0b100111,
+                    0b101000, 0b101001, 0b101100, 0b101101}) {
+    t[funct6] = true;
+  }
+  return t;
+}();
+
+static constexpr auto OPM_OPS = [] {
+  std::array<std::array<Op, 2>, 64> t{};
+  t[0b000000] = {VREDSUM_VS, INVALID};
+  t[0b000001] = {VREDAND_VS, INVALID};
+  t[0b000010] = {VREDOR_VS, INVALID};
+  t[0b000011] = {VREDXOR_VS, INVALID};
+  t[0b000100] = {VREDMINU_VS, INVALID};
+  t[0b000101] = {VREDMIN_VS, INVALID};
+  t[0b000110] = {VREDMAXU_VS, INVALID};
+  t[0b000111] = {VREDMAX_VS, INVALID};
+  t[0b001110] = {INVALID, VSLIDE1UP_VX};
+  t[0b001111] = {INVALID, VSLIDE1DOWN_VX};
+  t[0b010111] = {VCOMPRESS_VM, INVALID};
+  t[0b011000] = {VMANDN_MM, INVALID};
+  t[0b011001] = {VMAND_MM, INVALID};
+  t[0b011010] = {VMOR_MM, INVALID};
+  t[0b011011] = {VMXOR_MM, INVALID};
+  t[0b011100] = {VMORN_MM, INVALID};
+  t[0b011101] = {VMNAND_MM, INVALID};
+  t[0b011110] = {VMNOR_MM, INVALID};
+  t[0b011111] = {VMXNOR_MM, INVALID};
+  t[0b100000] = {VDIVU_VV, VDIVU_VX};
+  t[0b100001] = {VDIV_VV, VDIV_VX};
+  t[0b100010] = {VREMU_VV, VREMU_VX};
+  t[0b100011] = {VREM_VV, VREM_VX};
+  t[0b100100] = {VMULHU_VV, VMULHU_VX};
+  t[0b100101] = {VMUL_VV, VMUL_VX};
+  t[0b100110] = {VMULHSU_VV, VMULHSU_VX};
+  t[0b100111] = {VMULH_VV, VMULH_VX};
+  t[0b101001] = {VMADD_VV, VMADD_VX};
+  t[0b101011] = {VNMSUB_VV, VNMSUB_VX};
+  t[0b101101] = {VMACC_VV, VMACC_VX};
+  t[0b101111] = {VNMSAC_VV, VNMSAC_VX};
+  t[0b110000] = {VWADDU_VV, VWADDU_VX};
+  t[0b110001] = {VWADD_VV, VWADD_VX};
+  t[0b110010] = {VWSUBU_VV, VWSUBU_VX};
+  t[0b110011] = {VWSUB_VV, VWSUB_VX};
+  t[0b111000] = {VWMULU_VV, VWMULU_VX};
+  t[0b111011] = {VWMUL_VV, VWMUL_VX};
+  t[0b111100] = {VWMACCU_VV, VWMACCU_VX};
+  t[0b111101] = {VWMACC_VV, VWMACC_VX};
+  return t;
+}();
+
+static constexpr auto OPF_OPS = [] {
+  std::array<std::array<Op, 2>, 64> t{};
+  t[0b000000] = {VFADD_VV, VFADD_VF};
+  t[0b000001] = {VFREDUSUM_VS, INVALID};
+  t[0b000010] = {VFSUB_VV, VFSUB_VF};
+  t[0b000011] = {VFREDOSUM_VS, INVALID};
+  t[0b000100] = {VFMIN_VV, VFMIN_VF};
+  t[0b000101] = {VFREDMIN_VS, INVALID};
+  t[0b000110] = {VFMAX_VV, VFMAX_VF};
+  t[0b000111] = {VFREDMAX_VS, INVALID};
+  t[0b001000] = {VFSGNJ_VV, VFSGNJ_VF};
+  t[0b001001] = {VFSGNJN_VV, VFSGNJN_VF};
+  t[0b001010] = {VFSGNJX_VV, VFSGNJX_VF};
+  t[0b010111] = {INVALID, VFMERGE_VFM};
+  t[0b011000] = {VMFEQ_VV, VMFEQ_VF};
+  t[0b011001] = {VMFLE_VV, VMFLE_VF};
+  t[0b011011] = {VMFLT_VV, VMFLT_VF};
+  t[0b011100] = {VMFNE_VV, VMFNE_VF};
+  t[0b011101] = {INVALID, VMFGT_VF};
+  t[0b011111] = {INVALID, VMFGE_VF};
+  t[0b100000] = {VFDIV_VV, VFDIV_VF};
+  t[0b100001] = {INVALID, VFRDIV_VF};
+  t[0b100100] = {VFMUL_VV, VFMUL_VF};
+  t[0b100111] = {INVALID, VFRSUB_VF};
+  t[0b101000] = {VFMADD_VV, VFMADD_VF};
+  t[0b101001] = {VFNMADD_VV, VFNMADD_VF};
+  t[0b101010] = {VFMSUB_VV, VFMSUB_VF};
+  t[0b101011] = {VFNMSUB_VV, VFNMSUB_VF};
+  t[0b101100] = {VFMACC_VV, VFMACC_VF};
+  t[0b101101] = {VFNMACC_VV, VFNMACC_VF};
+  t[0b101110] = {VFMSAC_VV, VFMSAC_VF};
+  t[0b101111] = {VFNMSAC_VV, VFNMSAC_VF};
+  return t;
+}();
 
-    m_brk = m_brk_base = (max_addr + 4095ULL) & ~4095ULL; // page align
-    m_next_mmap_addr = m_brk_base + 128 * 1024 * 1024;
+// operand suffixes for static rounding modes, nothing for RM_DYN
+static constexpr std::array<const char *, 8> RM_SUFFIX = {
+    ", rne", ", rtz", ", rdn", ", rup", ", rmm", ", 5", ", 6", ""};
 
-    u64 num_ins = m_code_section.size / 2;
-    m_decoded.resize(num_ins);
+// CSRs the emulator knows by name, the rest print as numbers
+static std::string csr_name(i64 csr) {
+  switch (csr) {
+  case CSR_FFLAGS:
+    return "fflags";
+  case CSR_FRM:
+    return "frm";
+  case CSR_FCSR:
+    return "fcsr";
+  case CSR_VSTART:
+    return "vstart";
+  case CSR_VXSAT:
+    return "vxsat";
+  case CSR_VXRM:
+    return "vxrm";
+  case CSR_VCSR:
+    return "vcsr";
+  case CSR_CYCLE:
+    return "cycle";
+  case CSR_TIME:
+    return "time";
+  case CSR_INSTRET:
+    return "instret";
+  case CSR_VL:
+    return "vl";
+  case CSR_VTYPE:
+    return "vtype";
+  case CSR_VLENB:
+    return "vlenb";
+  default:
+    return std::format("0x{:x}", csr);
+  }
+}
 
-    u64 offset = 0;
-    while (offset < m_code_section.size) {
-      u32 raw;
-      std::memcpy(&raw, m_memory + m_code_section.offset + offset, sizeof(raw));
+// the mask operand of vector instructions, indexed by the vm bit
+static constexpr std::array<const char *, 2> VMASK_SUFFIX = {", v0.t", ""};
+
+// vtype the way vsetvli takes it, e.g. "e32, m1, ta, mu"
+static std::string vtype_name(u64 vtype) {
+  static constexpr std::array<const char *, 8> LMULS = {
+      "m1", "m2", "m4", "m8", "m?", "mf8", "mf4", "mf2"};
+  u64 vsew = (vtype >> 3) & 0b111;
+  if (vsew > 3 || (vtype >> 8) != 0) {
+    return std::format("0x{:x}", vtype);
+  }
+  return std::format("e{}, {}, {}, {}", 8 << vsew, LMULS[vtype & 0b111],
+                     (vtype >> 6) & 1 ? "ta" : "tu",
+                     (vtype >> 7) & 1 ? "ma" : "mu");
+}
 
-      Ins ins = decode_raw(raw);
-      ins.length = ((raw & 0b11) == 0b11) ? 4 : 2;
-      m_decoded[offset / 2] = ins;
-      disassemble_ins(ins);
+// mnemonic suffixes for the aq/rl bits of atomics, indexed by aq << 1 | rl
+static constexpr std::array<const char *, 4> AQRL = {"", ".rl", ".aq",
+                                                     ".aqrl"};
 
-      offset += ins.length;
+#ifdef __x86_64__
+// Translates hot blocks into x86-64 code. Guest registers stay in the m_regs
+// array (rdi) and guest memory is addressed relative to m_memory (rsi); every
+// translated block returns the next guest pc in rax. Instructions the
+// translator does not handle end the translated prefix of the block, and the
+// interpreter picks up from there.
+class X64Jit {
+public:
+  // Translated loads and stores look up the guest's TLBs directly. They are
+  // found at these byte offsets from the m_regs array passed in rdi.
+  X64Jit(i32 read_tlb_offset, i32 write_tlb_offset)
+      : m_read_tlb_offset(read_tlb_offset),
+        m_write_tlb_offset(write_tlb_offset),
+        m_has_popcnt(__builtin_cpu_supports("popcnt")) {
+    // never writable and executable at once, compile() switches the pages
+    // it writes
+    m_code = (u8 *)mmap(nullptr, CODE_CACHE_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_code == MAP_FAILED) {
+      guest_fault("Failed to mmap the JIT code cache");
     }
   }
 
-  ~RISCV64() { munmap(m_memory, MEMORY_SIZE); }
+  ~X64Jit() { munmap(m_code, CODE_CACHE_SIZE); }
 
-  void disassemble_all() {
-    m_pc = m_code_section.offset;
-    while (m_pc < m_code_section.offset + m_code_section.size) {
-      Ins ins = m_decoded[(m_pc - m_code_section.offset) / 2];
-      disassemble_ins(ins);
-      m_pc += ins.length;
+  // the guest pc and code cache range of each block compile() translated
+  struct Translation {
+    u64 pc;
+    u64 offset;
+    u64 size;
+  };
+
+  // the caller has to drop every JitFn it holds before calling reset()
+  bool full() const { return CODE_CACHE_SIZE - m_size < MAX_BLOCK_CODE; }
+  void reset() {
+    m_size = 0;
+    m_translations.clear();
+  }
+
+  const u8 *code() const { return m_code; }
+  const std::vector<Translation> &translations() const {
+    return m_translations;
+  }
+
+  // The host CPU features the generated code depends on. Everything else it
+  // depends on is fixed for a build of the emulator: guest state is only
+  // addressed relative to rdi and rsi, and jumps stay within a block, so
+  // the code can run from anywhere.
+  u64 host_features() const { return m_has_popcnt; }
+
+  // Returns nullptr if not even the first instruction can be translated.
+  JitFn compile(const Block &block) {
+    u64 begin = m_size = (m_size + 15) & ~15ULL;
+    protect(begin, PROT_READ | PROT_WRITE);
+    JitFn fn = translate_block(block, begin);
+    protect(begin, PROT_READ | PROT_EXEC);
+    return fn;
+  }
+
+private:
+  static constexpr u64 CODE_CACHE_SIZE = 64ULL * 1024 * 1024;
+  static constexpr u64 MAX_BLOCK_CODE = 64 * 1024;
+
+  // Sets prot on the pages a block's code starting at begin can take up.
+  void protect(u64 begin, int prot) {
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 start = begin & ~(page_size - 1);
+    u64 end = std::min(CODE_CACHE_SIZE, (begin + MAX_BLOCK_CODE +
+                                         page_size - 1) & ~(page_size - 1));
+    if (mprotect(m_code + start, end - start, prot) != 0) {
+      guest_fault("Failed to mprotect the JIT code cache");
     }
   }
 
-  // TODO: the registers in floating-point instructions should use the f0-f31
-  // registers but that would require rewriting a lot of stuff and its not gonna
-  // be a problem in execution so we'll live with that for now
-  void disassemble_ins(Ins ins) {
-    assert((u64)ins.op < OP_TABLE.size());
+  JitFn translate_block(const Block &block, u64 begin) {
+    u64 pc = block.start;
 
-    const OpDef &def = OP_TABLE[ins.op];
+    for (u64 n = 0; n + 1 < block.ins.size(); n++) {
+      const Ins &i = block.ins[n];
+      if (!translate(i, pc)) {
+        if (n == 0) {
+          m_size = begin;
+          return nullptr;
+        }
+        break;
+      }
+      if (m_terminated) {
+        return finish(block, begin);
+      }
+      pc += i.length;
+    }
 
-    switch (def.format) {
-    case Format::NONE:
-      std::println("{}", def.mnemonic);
+    // ran out of translatable instructions, the interpreter continues the
+    // block at pc
+    ret_pc(pc == block.end ? pc : pc | 1);
+    return finish(block, begin);
+  }
+
+  enum Reg : u8 { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+
+  // condition codes, as used by Jcc/SETcc/CMOVcc
+  enum Cond : u8 {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_G = 0xf
+  };
+
+  // ALU opcodes of the "op r, r/m" form; the /digit of the imm32 form is
+  // the opcode shifted right by 3
+  enum Alu : u8 {
+    ALU_ADD = 0x03,
+    ALU_OR = 0x0b,
+    ALU_AND = 0x23,
+    ALU_SUB = 0x2b,
+    ALU_XOR = 0x33,
+    ALU_CMP = 0x3b
+  };
+
+  enum Shift : u8 {
+    SHIFT_ROL = 0,
+    SHIFT_ROR = 1,
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7
+  };
+
+  // the 0F BA /digit of bt, bts, btr and btc with an imm8 bit index; the
+  // register forms are 0F A3 + 8 * (digit - 4)
+  enum BitOp : u8 { BIT_TEST = 4, BIT_SET = 5, BIT_CLEAR = 6, BIT_INVERT = 7 };
+
+  i32 m_read_tlb_offset;
+  i32 m_write_tlb_offset;
+  // CPOP needs popcnt, which predates x86-64-v2 but not x86-64 itself
+  bool m_has_popcnt;
+  u8 *m_code;
+  u64 m_size = 0;
+  bool m_terminated = false;
+  std::vector<Translation> m_translations;
+
+  JitFn finish(const Block &block, u64 begin) {
+    m_translations.push_back(
+        {.pc = block.start, .offset = begin, .size = m_size - begin});
+    return (JitFn)(m_code + begin);
+  }
+
+  void emit8(u8 v) { m_code[m_size++] = v; }
+  void emit32(u32 v) {
+    std::memcpy(m_code + m_size, &v, sizeof(v));
+    m_size += sizeof(v);
+  }
+  void emit64(u64 v) {
+    std::memcpy(m_code + m_size, &v, sizeof(v));
+    m_size += sizeof(v);
+  }
+
+  void rex(bool w, u8 reg, u8 rm) {
+    u8 b = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (b != 0x40) {
+      emit8(b);
+    }
+  }
+
+  // ModRM for [rdi + 8 * guest_reg], i.e. m_regs[guest_reg]
+  void modrm_guest(u8 reg, u8 guest_reg) {
+    emit8(0x80 | ((reg & 7) << 3) | RDI);
+    emit32(guest_reg * 8);
+  }
+
+  // ModRM + SIB for [rsi + rax], i.e. m_memory[rax]
+  void modrm_mem(u8 reg) {
+    emit8(((reg & 7) << 3) | 0b100);
+    emit8((RAX << 3) | RSI);
+  }
+
+  void modrm_reg(u8 reg, u8 rm) { emit8(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+  // mov r64, r64
+  void mov_reg(u8 dst, u8 src) {
+    rex(true, src, dst);
+    emit8(0x89);
+    modrm_reg(src, dst);
+  }
+
+  // mov r64, m_regs[g]
+  void load(u8 reg, u8 g) {
+    rex(true, reg, RDI);
+    emit8(0x8b);
+    modrm_guest(reg, g);
+  }
+
+  // mov m_regs[g], r64
+  void store(u8 g, u8 reg) {
+    rex(true, reg, RDI);
+    emit8(0x89);
+    modrm_guest(reg, g);
+  }
+
+  void mov_imm(u8 reg, u64 imm) {
+    if ((i64)imm == (i64)(i32)imm) {
+      rex(true, 0, reg);
+      emit8(0xc7);
+      modrm_reg(0, reg);
+      emit32((u32)imm);
+    } else {
+      rex(true, 0, reg);
+      emit8(0xb8 | (reg & 7));
+      emit64(imm);
+    }
+  }
+
+  // op r, m_regs[g]
+  void alu_guest(Alu op, bool w, u8 reg, u8 g) {
+    rex(w, reg, RDI);
+    emit8(op);
+    modrm_guest(reg, g);
+  }
+
+  // op dst, src
+  void alu_reg(Alu op, u8 dst, u8 src) {
+    rex(true, dst, src);
+    emit8(op);
+    modrm_reg(dst, src);
+  }
+
+  // op r, imm32
+  void alu_imm(Alu op, bool w, u8 reg, i32 imm) {
+    rex(w, 0, reg);
+    emit8(0x81);
+    modrm_reg(op >> 3, reg);
+    emit32((u32)imm);
+  }
+
+  void shift_imm(Shift op, bool w, u8 reg, u8 amount) {
+    rex(w, 0, reg);
+    emit8(0xc1);
+    modrm_reg(op, reg);
+    emit8(amount);
+  }
+
+  // shift by cl
+  void shift_cl(Shift op, bool w, u8 reg) {
+    rex(w, 0, reg);
+    emit8(0xd3);
+    modrm_reg(op, reg);
+  }
+
+  // movsxd r64, r32
+  void sext32(u8 reg) {
+    rex(true, reg, reg);
+    emit8(0x63);
+    modrm_reg(reg, reg);
+  }
+
+  // mov r32, r32, which clears the upper half
+  void zext32(u8 reg) {
+    rex(false, reg, reg);
+    emit8(0x89);
+    modrm_reg(reg, reg);
+  }
+
+  // cmovcc dst, src
+  void cmov(Cond cc, u8 dst, u8 src) {
+    rex(true, dst, src);
+    emit8(0x0f);
+    emit8(0x40 | cc);
+    modrm_reg(dst, src);
+  }
+
+  void test(u8 a, u8 b) {
+    rex(true, b, a);
+    emit8(0x85);
+    modrm_reg(b, a);
+  }
+
+  // F7 group with an m_regs[g] operand: /4 mul, /5 imul, /6 div, /7 idiv
+  void group3_guest(u8 ext, bool w, u8 g) {
+    rex(w, 0, RDI);
+    emit8(0xf7);
+    modrm_guest(ext, g);
+  }
+
+  void group3_reg(u8 ext, bool w, u8 reg) {
+    rex(w, 0, reg);
+    emit8(0xf7);
+    modrm_reg(ext, reg);
+  }
+
+  // jcc rel32 / jmp rel32 with the target patched in later by bind()
+  u64 jcc(Cond cc) {
+    emit8(0x0f);
+    emit8(0x80 | cc);
+    emit32(0);
+    return m_size;
+  }
+  u64 jmp() {
+    emit8(0xe9);
+    emit32(0);
+    return m_size;
+  }
+  void bind(u64 jump_end) {
+    u32 rel = (u32)(m_size - jump_end);
+    std::memcpy(m_code + jump_end - 4, &rel, sizeof(rel));
+  }
+
+  void ret_pc(u64 pc) {
+    mov_imm(RAX, pc);
+    emit8(0xc3);
+    m_terminated = true;
+  }
+
+  // rax = m_regs[base] + imm, then load/store through m_memory[rax]. The
+  // same one-compare TLB check as RISCV64::mem_read() guards the access; on
+  // a miss the block is left with pc | 1 and the interpreter takes over at
+  // the instruction at pc.
+  void address(u8 base, i32 imm, u8 size, u64 pc, i32 tlb_offset) {
+    load(RAX, base);
+    if (imm != 0) {
+      alu_imm(ALU_ADD, true, RAX, imm);
+    }
+    mov_reg(RCX, RAX);
+    shift_imm(SHIFT_SHR, true, RCX, GUEST_PAGE_SHIFT);
+    alu_imm(ALU_AND, false, RCX, TLB_SIZE - 1);
+    emit8(0x48); // mov rdx, [rdi + 8 * rcx + tlb_offset]
+    emit8(0x8b);
+    emit8(0x94);
+    emit8(0xcf);
+    emit32((u32)tlb_offset);
+    mov_reg(RCX, RAX);
+    alu_imm(ALU_AND, true, RCX, (i32)(~(GUEST_PAGE_SIZE - 1) | (size - 1)));
+    rex(true, RCX, RDX); // cmp rcx, rdx
+    emit8(ALU_CMP);
+    modrm_reg(RCX, RDX);
+    u64 hit = jcc(CC_E);
+    mov_imm(RAX, pc | 1);
+    emit8(0xc3);
+    bind(hit);
+  }
+
+  void load_mem(u8 rd, u8 base, i32 imm, u8 size, u64 pc, bool w, u8 op0,
+                u8 op1 = 0) {
+    address(base, imm, size, pc, m_read_tlb_offset);
+    rex(w, RCX, RSI);
+    emit8(op0);
+    if (op1 != 0) {
+      emit8(op1);
+    }
+    modrm_mem(RCX);
+    store(rd, RCX);
+  }
+
+  void store_mem(u8 base, i32 imm, u8 rs, u8 size, u64 pc) {
+    address(base, imm, size, pc, m_write_tlb_offset);
+    load(RCX, rs);
+    if (size == 2) {
+      emit8(0x66);
+    }
+    rex(size == 8, RCX, RSI);
+    emit8(size == 1 ? 0x88 : 0x89);
+    modrm_mem(RCX);
+  }
+
+  // rd = rs1 op rs2, with an optional sign extension of the low 32 bits
+  void alu3(Alu op, u8 rd, u8 rs1, u8 rs2, bool word = false) {
+    load(RAX, rs1);
+    alu_guest(op, !word, RAX, rs2);
+    if (word) {
+      sext32(RAX);
+    }
+    store(rd, RAX);
+  }
+
+  void alu_i(Alu op, u8 rd, u8 rs1, i32 imm, bool word = false) {
+    load(RAX, rs1);
+    alu_imm(op, !word, RAX, imm);
+    if (word) {
+      sext32(RAX);
+    }
+    store(rd, RAX);
+  }
+
+  void shift_i(Shift op, u8 rd, u8 rs1, u8 amount, bool word = false) {
+    load(RAX, rs1);
+    shift_imm(op, !word, RAX, amount);
+    if (word) {
+      sext32(RAX);
+    }
+    store(rd, RAX);
+  }
+
+  void shift_r(Shift op, u8 rd, u8 rs1, u8 rs2, bool word = false) {
+    load(RCX, rs2);
+    load(RAX, rs1);
+    shift_cl(op, !word, RAX);
+    if (word) {
+      sext32(RAX);
+    }
+    store(rd, RAX);
+  }
+
+  void set_cond(Cond cc, u8 rd) {
+    emit8(0x0f);
+    emit8(0x90 | cc);
+    modrm_reg(0, RAX);
+    emit8(0x0f); // movzx eax, al
+    emit8(0xb6);
+    modrm_reg(RAX, RAX);
+    store(rd, RAX);
+  }
+
+  // rax = cond ? taken : fallthrough
+  void branch(Cond cc, u64 taken, u64 fallthrough) {
+    mov_imm(RAX, fallthrough);
+    mov_imm(RCX, taken);
+    rex(true, RAX, RCX);
+    emit8(0x0f);
+    emit8(0x40 | cc);
+    modrm_reg(RAX, RCX);
+    emit8(0xc3);
+    m_terminated = true;
+  }
+
+  void branch_cmp(Cond cc, u8 rs1, u8 rs2, u64 taken, u64 fallthrough) {
+    load(RAX, rs1);
+    alu_guest(ALU_CMP, true, RAX, rs2);
+    branch(cc, taken, fallthrough);
+  }
+
+  // RISC-V division never traps: x / 0 gives all ones and x % 0 gives x,
+  // INT_MIN / -1 gives INT_MIN and INT_MIN % -1 gives 0
+  void divide(u8 rd, u8 rs1, u8 rs2, bool is_signed, bool rem, bool word) {
+    bool w = !word;
+    load(RAX, rs1);
+    load(RCX, rs2);
+    if (word) {
+      // so the zero check below only sees the low half
+      sext32(RCX);
+    }
+
+    test(RCX, RCX);
+    u64 by_zero = jcc(CC_E);
+
+    u64 by_minus_one = 0;
+    if (is_signed) {
+      alu_imm(ALU_CMP, w, RCX, -1);
+      by_minus_one = jcc(CC_E);
+      if (w) {
+        emit8(0x48);
+      }
+      emit8(0x99); // cqo/cdq
+      group3_reg(7, w, RCX); // idiv
+    } else {
+      zero_rdx();
+      group3_reg(6, w, RCX); // div
+    }
+    u64 divided = jmp();
+
+    u64 negated = 0;
+    if (is_signed) {
+      bind(by_minus_one);
+      if (rem) {
+        zero_rdx();
+      } else {
+        group3_reg(3, w, RAX); // neg
+      }
+      negated = jmp();
+    }
+
+    bind(by_zero);
+    if (rem) {
+      rex(true, RAX, RDX); // mov rdx, rax
+      emit8(0x89);
+      modrm_reg(RAX, RDX);
+    } else {
+      mov_imm(RAX, ~0ULL);
+    }
+
+    bind(divided);
+    if (is_signed) {
+      bind(negated);
+    }
+
+    u8 result = rem ? RDX : RAX;
+    if (word) {
+      sext32(result);
+    }
+    store(rd, result);
+  }
+
+  void zero_rdx() {
+    emit8(0x31); // xor edx, edx
+    modrm_reg(RDX, RDX);
+  }
+
+  // rd = rs2 + (rs1 << amount), rs1 zero-extended from 32 bits for .uw
+  void shift_add(u8 rd, u8 rs1, u8 rs2, u8 amount, bool uw) {
+    load(RAX, rs1);
+    if (uw) {
+      zext32(RAX);
+    }
+    if (amount != 0) {
+      shift_imm(SHIFT_SHL, true, RAX, amount);
+    }
+    alu_guest(ALU_ADD, true, RAX, rs2);
+    store(rd, RAX);
+  }
+
+  // rd = rs1 op ~rs2
+  void alu_not(Alu op, u8 rd, u8 rs1, u8 rs2) {
+    load(RCX, rs2);
+    group3_reg(2, true, RCX); // not
+    load(RAX, rs1);
+    alu_reg(op, RAX, RCX);
+    store(rd, RAX);
+  }
+
+  // rd = cc holds for the comparison of rs1 with rs2 ? rs2 : rs1
+  void select(Cond cc, u8 rd, u8 rs1, u8 rs2) {
+    load(RAX, rs1);
+    load(RCX, rs2);
+    alu_reg(ALU_CMP, RAX, RCX);
+    cmov(cc, RAX, RCX);
+    store(rd, RAX);
+  }
+
+  // rd = rs1 with the bit picked by rs2 or amount set, cleared or inverted
+  void bit_r(BitOp op, u8 rd, u8 rs1, u8 rs2) {
+    load(RAX, rs1);
+    load(RCX, rs2);
+    rex(true, RCX, RAX);
+    emit8(0x0f);
+    emit8(0xa3 + 8 * (op - BIT_TEST));
+    modrm_reg(RCX, RAX);
+    store(rd, RAX);
+  }
+  void bit_i(BitOp op, u8 rd, u8 rs1, u8 amount) {
+    load(RAX, rs1);
+    rex(true, 0, RAX);
+    emit8(0x0f);
+    emit8(0xba);
+    modrm_reg(op, RAX);
+    emit8(amount);
+    store(rd, RAX);
+  }
+
+  // rd = (rs1 >> rs2) & 1, or (rs1 >> amount) & 1 for bexti
+  void bit_extract(u8 rd, u8 rs1, u8 rs2, bool imm, u8 amount) {
+    if (!imm) {
+      load(RCX, rs2);
+    }
+    load(RAX, rs1);
+    if (imm) {
+      shift_imm(SHIFT_SHR, true, RAX, amount);
+    } else {
+      shift_cl(SHIFT_SHR, true, RAX);
+    }
+    alu_imm(ALU_AND, true, RAX, 1);
+    store(rd, RAX);
+  }
+
+  // rd = the index bsr/bsf (op) finds in the low 32 or all 64 bits of rs1,
+  // xor flip. if_zero is what a zero rs1 gives, before the flip.
+  void bit_scan(u8 rd, u8 rs1, bool w, u8 op, i32 if_zero, i32 flip) {
+    mov_imm(RCX, if_zero);
+    rex(w, RAX, RDI);
+    emit8(0x0f);
+    emit8(op);
+    modrm_guest(RAX, rs1);
+    cmov(CC_E, RAX, RCX);
+    if (flip != 0) {
+      alu_imm(ALU_XOR, true, RAX, flip);
+    }
+    store(rd, RAX);
+  }
+
+  // movsx/movzx rax, the low byte or half of m_regs[rs1]
+  void extend(u8 rd, u8 rs1, bool w, u8 op) {
+    rex(w, RAX, RDI);
+    emit8(0x0f);
+    emit8(op);
+    modrm_guest(RAX, rs1);
+    store(rd, RAX);
+  }
+
+  bool translate(const Ins &i, u64 pc) {
+    m_terminated = false;
+
+    switch (i.op) {
+    case Op::ADD:
+      alu3(ALU_ADD, i.rd, i.rs1, i.rs2);
       break;
-    case Format::R:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rd], REGS[ins.rs1],
-                   REGS[ins.rs2]);
+    case Op::ADD_UW:
+      shift_add(i.rd, i.rs1, i.rs2, 0, true);
       break;
-    case Format::I:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rd], REGS[ins.rs1],
-                   ins.imm);
+    case Op::ADDI:
+      alu_i(ALU_ADD, i.rd, i.rs1, i.imm);
       break;
-    case Format::I_LOAD:
-      std::println("{} {}, {}({})", def.mnemonic, REGS[ins.rd], ins.imm,
-                   REGS[ins.rs1]);
+    case Op::ADDIW:
+      alu_i(ALU_ADD, i.rd, i.rs1, i.imm, true);
       break;
-    case Format::I_SHIFT:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rd], REGS[ins.rs1],
-                   ins.shamt);
+    case Op::ADDW:
+      alu3(ALU_ADD, i.rd, i.rs1, i.rs2, true);
       break;
-    case Format::U:
-      std::println("{} {}, {}", def.mnemonic, REGS[ins.rd], ins.imm);
+    case Op::AND:
+      alu3(ALU_AND, i.rd, i.rs1, i.rs2);
       break;
-    case Format::S:
-      std::println("{} {}, {}({})", def.mnemonic, REGS[ins.rs2], ins.imm,
-                   REGS[ins.rs1]);
+    case Op::ANDI:
+      alu_i(ALU_AND, i.rd, i.rs1, i.imm);
       break;
-    case Format::B:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rs1], REGS[ins.rs2],
-                   ins.imm);
+    case Op::ANDN:
+      alu_not(ALU_AND, i.rd, i.rs1, i.rs2);
       break;
-    case Format::CB:
-      std::println("{} {}, {}", def.mnemonic, REGS[ins.rs1], ins.imm);
+    case Op::AUIPC:
+      mov_imm(RAX, pc + (i64)(i32)((u32)i.imm << 12));
+      store(i.rd, RAX);
       break;
-    case Format::J:
-      std::println("{} {}, {}", def.mnemonic, REGS[ins.rd], ins.imm);
+    case Op::BCLR:
+      bit_r(BIT_CLEAR, i.rd, i.rs1, i.rs2);
       break;
-    case Format::CI:
-      std::println("{} {}, {}", def.mnemonic, REGS[ins.rd], ins.imm);
+    case Op::BCLRI:
+      bit_i(BIT_CLEAR, i.rd, i.rs1, i.shamt);
       break;
-    case Format::CJ:
-      std::println("{} {}", def.mnemonic, ins.imm);
+    case Op::BEQ:
+      branch_cmp(CC_E, i.rs1, i.rs2, pc + i.imm, pc + i.length);
       break;
-    case Format::CSS:
-      std::println("{} {}, {}(sp)", def.mnemonic, REGS[ins.rs2], ins.imm);
+    case Op::BEXT:
+      bit_extract(i.rd, i.rs1, i.rs2, false, 0);
       break;
-    case Format::CR:
-      std::println("{} {}, {}", def.mnemonic, REGS[ins.rd], REGS[ins.rs2]);
+    case Op::BEXTI:
+      bit_extract(i.rd, i.rs1, 0, true, i.shamt);
       break;
-    case Format::CR1:
-      std::println("{} {}", def.mnemonic, REGS[ins.rs1]);
+    case Op::BGE:
+      branch_cmp(CC_GE, i.rs1, i.rs2, pc + i.imm, pc + i.length);
       break;
-    case Format::CL:
-      std::println("{} {}, {}({})", def.mnemonic, REGS[ins.rd], ins.imm,
-                   REGS[ins.rs1]);
+    case Op::BGEU:
+      branch_cmp(CC_AE, i.rs1, i.rs2, pc + i.imm, pc + i.length);
       break;
-    case Format::R_ATOMIC_LR:
-      std::println("{} {}, ({})", def.mnemonic, REGS[ins.rd], REGS[ins.rs1]);
+    case Op::BINV:
+      bit_r(BIT_INVERT, i.rd, i.rs1, i.rs2);
       break;
-    case Format::R_ATOMIC:
-      std::println("{} {}, {}, ({})", def.mnemonic, REGS[ins.rd], REGS[ins.rs2],
-                   REGS[ins.rs1]);
+    case Op::BINVI:
+      bit_i(BIT_INVERT, i.rd, i.rs1, i.shamt);
       break;
-    case Format::CSR:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rd], ins.imm,
-                   REGS[ins.rs1]);
+    case Op::BLT:
+      branch_cmp(CC_L, i.rs1, i.rs2, pc + i.imm, pc + i.length);
       break;
-    case Format::CSRI:
-      std::println("{} {}, {}, {}", def.mnemonic, REGS[ins.rd], ins.imm,
-                   ins.rs1);
+    case Op::BLTU:
+      branch_cmp(CC_B, i.rs1, i.rs2, pc + i.imm, pc + i.length);
+      break;
+    case Op::BNE:
+      branch_cmp(CC_NE, i.rs1, i.rs2, pc + i.imm, pc + i.length);
+      break;
+    case Op::BSET:
+      bit_r(BIT_SET, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::BSETI:
+      bit_i(BIT_SET, i.rd, i.rs1, i.shamt);
+      break;
+    case Op::CLZ:
+      bit_scan(i.rd, i.rs1, true, 0xbd, 127, 63); // bsr
+      break;
+    case Op::CLZW:
+      bit_scan(i.rd, i.rs1, false, 0xbd, 63, 31);
+      break;
+    case Op::CPOP:
+      if (!m_has_popcnt) {
+        return false;
+      }
+      emit8(0xf3);
+      extend(i.rd, i.rs1, true, 0xb8); // popcnt
+      break;
+    case Op::CPOPW:
+      if (!m_has_popcnt) {
+        return false;
+      }
+      emit8(0xf3);
+      extend(i.rd, i.rs1, false, 0xb8);
+      break;
+    case Op::CTZ:
+      bit_scan(i.rd, i.rs1, true, 0xbc, 64, 0); // bsf
+      break;
+    case Op::CTZW:
+      bit_scan(i.rd, i.rs1, false, 0xbc, 32, 0);
+      break;
+    case Op::DIV:
+      divide(i.rd, i.rs1, i.rs2, true, false, false);
+      break;
+    case Op::DIVU:
+      divide(i.rd, i.rs1, i.rs2, false, false, false);
+      break;
+    case Op::DIVUW:
+      divide(i.rd, i.rs1, i.rs2, false, false, true);
+      break;
+    case Op::DIVW:
+      divide(i.rd, i.rs1, i.rs2, true, false, true);
+      break;
+    case Op::FENCE:
+    case Op::FENCE_TSO:
+      emit8(0x0f); // mfence
+      emit8(0xae);
+      emit8(0xf0);
+      break;
+    case Op::JAL:
+      mov_imm(RAX, pc + i.length);
+      store(i.rd, RAX);
+      ret_pc(pc + i.imm);
+      break;
+    case Op::JALR:
+      load(RAX, i.rs1);
+      alu_imm(ALU_ADD, true, RAX, i.imm);
+      alu_imm(ALU_AND, true, RAX, ~1);
+      mov_imm(RCX, pc + i.length);
+      store(i.rd, RCX);
+      emit8(0xc3);
+      m_terminated = true;
+      break;
+    case Op::LB:
+      load_mem(i.rd, i.rs1, i.imm, 1, pc, true, 0x0f, 0xbe);
+      break;
+    case Op::LBU:
+      load_mem(i.rd, i.rs1, i.imm, 1, pc, false, 0x0f, 0xb6);
+      break;
+    case Op::LD:
+      load_mem(i.rd, i.rs1, i.imm, 8, pc, true, 0x8b);
+      break;
+    case Op::LH:
+      load_mem(i.rd, i.rs1, i.imm, 2, pc, true, 0x0f, 0xbf);
+      break;
+    case Op::LHU:
+      load_mem(i.rd, i.rs1, i.imm, 2, pc, false, 0x0f, 0xb7);
+      break;
+    case Op::LUI:
+      mov_imm(RAX, (i64)(i32)((u32)i.imm << 12));
+      store(i.rd, RAX);
+      break;
+    case Op::LW:
+      load_mem(i.rd, i.rs1, i.imm, 4, pc, true, 0x63);
+      break;
+    case Op::LWU:
+      load_mem(i.rd, i.rs1, i.imm, 4, pc, false, 0x8b);
+      break;
+    case Op::MAX:
+      select(CC_L, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::MAXU:
+      select(CC_B, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::MIN:
+      select(CC_G, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::MINU:
+      select(CC_A, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::MUL:
+      load(RAX, i.rs1);
+      rex(true, RAX, RDI); // imul rax, m_regs[rs2]
+      emit8(0x0f);
+      emit8(0xaf);
+      modrm_guest(RAX, i.rs2);
+      store(i.rd, RAX);
+      break;
+    case Op::MULH:
+    case Op::MULHU:
+      load(RAX, i.rs1);
+      group3_guest(i.op == Op::MULH ? 5 : 4, true, i.rs2);
+      store(i.rd, RDX);
+      break;
+    case Op::MULW:
+      load(RAX, i.rs1);
+      emit8(0x0f); // imul eax, m_regs[rs2]
+      emit8(0xaf);
+      modrm_guest(RAX, i.rs2);
+      sext32(RAX);
+      store(i.rd, RAX);
+      break;
+    case Op::OR:
+      alu3(ALU_OR, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::ORC_B:
+      // see HANDLER(ORC_B)
+      load(RAX, i.rs1);
+      mov_imm(RCX, 0x7f7f7f7f7f7f7f7f);
+      mov_reg(RDX, RAX);
+      alu_reg(ALU_AND, RDX, RCX);
+      alu_reg(ALU_ADD, RDX, RCX);
+      alu_reg(ALU_OR, RDX, RAX);
+      mov_imm(RCX, 0x8080808080808080);
+      alu_reg(ALU_AND, RDX, RCX);
+      shift_imm(SHIFT_SHR, true, RDX, 7);
+      rex(true, RDX, RDX); // imul rdx, rdx, 0xff
+      emit8(0x69);
+      modrm_reg(RDX, RDX);
+      emit32(0xff);
+      store(i.rd, RDX);
+      break;
+    case Op::ORI:
+      alu_i(ALU_OR, i.rd, i.rs1, i.imm);
+      break;
+    case Op::ORN:
+      alu_not(ALU_OR, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::FENCE_I:
+    case Op::PAUSE:
+      break;
+    case Op::REM:
+      divide(i.rd, i.rs1, i.rs2, true, true, false);
+      break;
+    case Op::REMU:
+      divide(i.rd, i.rs1, i.rs2, false, true, false);
       break;
+    case Op::REMUW:
+      divide(i.rd, i.rs1, i.rs2, false, true, true);
+      break;
+    case Op::REMW:
+      divide(i.rd, i.rs1, i.rs2, true, true, true);
+      break;
+    case Op::REV8:
+      load(RAX, i.rs1);
+      rex(true, 0, RAX); // bswap rax
+      emit8(0x0f);
+      emit8(0xc8 | RAX);
+      store(i.rd, RAX);
+      break;
+    case Op::ROL:
+      shift_r(SHIFT_ROL, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::ROLW:
+      shift_r(SHIFT_ROL, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::ROR:
+      shift_r(SHIFT_ROR, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::RORI:
+      shift_i(SHIFT_ROR, i.rd, i.rs1, i.shamt);
+      break;
+    case Op::RORIW:
+      shift_i(SHIFT_ROR, i.rd, i.rs1, i.shamt, true);
+      break;
+    case Op::RORW:
+      shift_r(SHIFT_ROR, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::SB:
+      store_mem(i.rs1, i.imm, i.rs2, 1, pc);
+      break;
+    case Op::SD:
+      store_mem(i.rs1, i.imm, i.rs2, 8, pc);
+      break;
+    case Op::SEXT_B:
+      extend(i.rd, i.rs1, true, 0xbe); // movsx
+      break;
+    case Op::SEXT_H:
+      extend(i.rd, i.rs1, true, 0xbf);
+      break;
+    case Op::SH:
+      store_mem(i.rs1, i.imm, i.rs2, 2, pc);
+      break;
+    case Op::SH1ADD:
+      shift_add(i.rd, i.rs1, i.rs2, 1, false);
+      break;
+    case Op::SH1ADD_UW:
+      shift_add(i.rd, i.rs1, i.rs2, 1, true);
+      break;
+    case Op::SH2ADD:
+      shift_add(i.rd, i.rs1, i.rs2, 2, false);
+      break;
+    case Op::SH2ADD_UW:
+      shift_add(i.rd, i.rs1, i.rs2, 2, true);
+      break;
+    case Op::SH3ADD:
+      shift_add(i.rd, i.rs1, i.rs2, 3, false);
+      break;
+    case Op::SH3ADD_UW:
+      shift_add(i.rd, i.rs1, i.rs2, 3, true);
+      break;
+    case Op::SLL:
+      shift_r(SHIFT_SHL, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::SLLI:
+      shift_i(SHIFT_SHL, i.rd, i.rs1, i.shamt);
+      break;
+    case Op::SLLI_UW:
+      load(RAX, i.rs1);
+      zext32(RAX);
+      shift_imm(SHIFT_SHL, true, RAX, i.shamt);
+      store(i.rd, RAX);
+      break;
+    case Op::SLLIW:
+      shift_i(SHIFT_SHL, i.rd, i.rs1, i.shamt, true);
+      break;
+    case Op::SLLW:
+      shift_r(SHIFT_SHL, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::SLT:
+      load(RAX, i.rs1);
+      alu_guest(ALU_CMP, true, RAX, i.rs2);
+      set_cond(CC_L, i.rd);
+      break;
+    case Op::SLTIU:
+      load(RAX, i.rs1);
+      alu_imm(ALU_CMP, true, RAX, i.imm);
+      set_cond(CC_B, i.rd);
+      break;
+    case Op::SLTU:
+      load(RAX, i.rs1);
+      alu_guest(ALU_CMP, true, RAX, i.rs2);
+      set_cond(CC_B, i.rd);
+      break;
+    case Op::SRAI:
+      shift_i(SHIFT_SAR, i.rd, i.rs1, i.shamt);
+      break;
+    case Op::SRAIW:
+      shift_i(SHIFT_SAR, i.rd, i.rs1, i.shamt, true);
+      break;
+    case Op::SRAW:
+      shift_r(SHIFT_SAR, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::SRLI:
+      shift_i(SHIFT_SHR, i.rd, i.rs1, i.shamt);
+      break;
+    case Op::SRLIW:
+      shift_i(SHIFT_SHR, i.rd, i.rs1, i.shamt, true);
+      break;
+    case Op::SRLW:
+      shift_r(SHIFT_SHR, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::SUB:
+      alu3(ALU_SUB, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::SUBW:
+      alu3(ALU_SUB, i.rd, i.rs1, i.rs2, true);
+      break;
+    case Op::SW:
+      store_mem(i.rs1, i.imm, i.rs2, 4, pc);
+      break;
+    case Op::XNOR:
+      alu_not(ALU_XOR, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::XOR:
+      alu3(ALU_XOR, i.rd, i.rs1, i.rs2);
+      break;
+    case Op::XORI:
+      alu_i(ALU_XOR, i.rd, i.rs1, i.imm);
+      break;
+    case Op::ZEXT_H:
+      extend(i.rd, i.rs1, false, 0xb7); // movzx
+      break;
+    default:
+      return false;
     }
-  }
 
-  void dump() {
-    for (u64 i = 0; i < 32; i++) {
-      std::print("{}=0x{:x} ", REGS[i], m_regs[i]);
-    }
-    std::println();
+    return true;
   }
+};
+#endif
 
-  void push_u64(u64 v) {
-    m_regs[2] -= 8;
-    mem_write<u64>(m_regs[2], v);
-  }
+class RISCV64 {
+public:
+  // memory_size is the size of the guest address space. It is only reserved
+  // up front; pages get committed as the ELF, the stack, brk and mmap need
+  // them. Throws GuestFault if path can't be loaded.
+  RISCV64(const char *path, u64 memory_size = DEFAULT_MEMORY_SIZE)
+      : RISCV64(memory_size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      guest_fault("Failed to open: {}", path);
+    }
 
-  void execute() {
-    m_pc = m_code_section.entrypoint;
+    // libelf reads the headers and tables through a private mapping, so only
+    // the pages it looks at are read from disk
+    u64 file_size = st.st_size;
+    char *file = (char *)mmap(nullptr, file_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+      close(fd);
+      guest_fault("Failed to mmap: {}", path);
+    }
 
-    // set up the stack
-    i64 &sp = m_regs[2];
-    sp = MEMORY_SIZE - 1024;
-
-    // push "program"
-    const char *prog = "program";
-    u64 len = strlen(prog) + 1;
-    sp -= len;
-    std::memcpy(m_memory + sp, prog, len);
-    u64 prog_ptr = sp;
-    sp &= ~15;
+    Elf *elf = elf_memory(file, file_size);
+    u64 max_addr = 0;
+    try {
+      max_addr = load_elf(elf, fd, (const u8 *)file, file_size, path);
+    } catch (const GuestFault &) {
+      elf_end(elf);
+      munmap(file, file_size);
+      close(fd);
+      throw;
+    }
+    elf_end(elf);
+    munmap(file, file_size);
+    close(fd);
 
-    // auxv = {0}
-    push_u64(0);
-    push_u64(0);
-    // envp = {0}
-    push_u64(0);
-    // argv = {prog_ptr, 0}
-    push_u64(0);
-    push_u64(prog_ptr);
-    // argc = 1
-    push_u64(1);
+    m_brk = m_brk_base = page_align(max_addr);
+    m_stack_base = m_memory_size - STACK_SIZE;
+    if (m_brk_base >= m_stack_base) {
+      guest_fault("Guest memory too small for this executable");
+    }
+    // small address spaces split what is left between brk and mmap
+    u64 brk_size = ((m_stack_base - m_brk_base) / 2) & ~4095ULL;
+    m_max_brk = m_brk_base + std::min(MAX_BRK_SIZE, brk_size);
+    m_free_ranges[m_max_brk] = m_stack_base;
+    commit(m_stack_base, STACK_SIZE, PERM_R | PERM_W);
+  }
 
-    while (m_pc < MEMORY_SIZE) {
-      m_regs[0] = 0; // clear the zero register
+  ~RISCV64() {
+    munmap(m_memory, m_memory_size);
+    for (i32 fd : m_fds) {
+      if (fd > 2) {
+        close(fd);
+      }
+    }
+    if (m_snapshot != nullptr) {
+      munmap(m_snapshot->memory, m_memory_size);
+      for (i32 fd : m_snapshot->fds) {
+        if (fd > 2) {
+          close(fd);
+        }
+      }
+    }
+#ifdef __x86_64__
+    if (m_jit_cache != nullptr) {
+      munmap(m_jit_cache, m_jit_cache_size);
+    }
+#endif
+  }
 
-      Ins i = m_decoded[(m_pc - m_code_section.offset) / 2];
+  // Collects guest stdout and writes it to the host in blocks of about size
+  // bytes, instead of one host write per guest write. 0 turns it off.
+  void set_output_buffer(u64 size) {
+    m_output_buffer_size = size;
+    m_output_buffer.reserve(size);
+  }
 
-      switch (i.op) {
-      case Op::INVALID: {
-        std::println(stderr, "Tried to execute Op::INVALID");
-        exit(1);
-      }; break;
-      case Op::ADD: {
-        m_regs[i.rd] = m_regs[i.rs1] + m_regs[i.rs2];
-      }; break;
-      case Op::ADDI: {
-        m_regs[i.rd] = m_regs[i.rs1] + i.imm;
-      }; break;
-      case Op::ADDIW: {
-        m_regs[i.rd] = (i32)m_regs[i.rs1] + (i32)i.imm;
-      }; break;
-      case Op::ADDW: {
-        m_regs[i.rd] = (i32)(m_regs[i.rs1] + m_regs[i.rs2]);
-      }; break;
-      case Op::AND: {
-        m_regs[i.rd] = m_regs[i.rs1] & m_regs[i.rs2];
-      }; break;
-      case Op::ANDI: {
-        m_regs[i.rd] = m_regs[i.rs1] & i.imm;
-      }; break;
-      case Op::AUIPC: {
-        m_regs[i.rd] = m_pc + (i64)(i32)((u32)i.imm << 12);
-      }; break;
-      case Op::BEQ: {
-        if (m_regs[i.rs1] == m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::BGE: {
-        if (m_regs[i.rs1] >= m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::BGEU: {
-        if ((u64)m_regs[i.rs1] >= (u64)m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::BLT: {
-        if (m_regs[i.rs1] < m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::BLTU: {
-        if ((u64)m_regs[i.rs1] < (u64)m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::BNE: {
-        if (m_regs[i.rs1] != m_regs[i.rs2]) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::C_ADD: {
-        m_regs[i.rd] += m_regs[i.rs2];
-      }; break;
-      case Op::C_ADDI: {
-        m_regs[i.rd] += i.imm;
-      }; break;
-      case Op::C_ADDIW: {
-        m_regs[i.rd] = (i64)(i32)m_regs[i.rd] + i.imm;
-      }; break;
-      case Op::C_ADDI16SP: {
-        sp += i.imm;
-      }; break;
-      case Op::C_ADDI4SPN: {
-        m_regs[i.rd] = sp + i.imm;
-      }; break;
-      case Op::C_ADDW: {
-        m_regs[i.rd] = (i64)((i32)m_regs[i.rd] + (i32)m_regs[i.rs2]);
-      }; break;
-      case Op::C_AND: {
-        m_regs[i.rd] &= m_regs[i.rs2];
-      }; break;
-      case Op::C_ANDI: {
-        m_regs[i.rd] = m_regs[i.rs1] & i.imm;
-      }; break;
-      case Op::C_BEQZ: {
-        if (m_regs[i.rs1] == 0) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::C_BNEZ: {
-        if (m_regs[i.rs1] != 0) {
-          m_pc += i.imm;
-          continue;
-        }
-      }; break;
-      case Op::C_EBREAK: {
-        std::println(stderr, "EBREAK at pc=0x{:x}", m_pc);
-        dump();
-        exit(1);
-      }; break;
-      case Op::C_J: {
-        m_pc += i.imm;
-        continue;
-      }; break;
-      case Op::C_JALR: {
-        m_regs[1] = m_pc + 2;
-        m_pc = m_regs[i.rs1] & ~1ULL;
-        continue;
-      }; break;
-      case Op::C_JR: {
-        m_pc = m_regs[i.rs1] & ~1ULL;
-        continue;
-      }; break;
-      case Op::C_LD: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        m_regs[i.rd] = mem_read<u64>(addr);
-      }; break;
-      case Op::C_LDSP: {
-        u64 addr = sp + i.imm;
-        m_regs[i.rd] = mem_read<u64>(addr);
-      }; break;
-      case Op::C_LI: {
-        m_regs[i.rd] = i.imm;
-      }; break;
-      case Op::C_LUI: {
-        m_regs[i.rd] = (i64)(i32)((u32)i.imm << 12);
-      }; break;
-      case Op::C_LW: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        m_regs[i.rd] = (i64)mem_read<i32>(addr);
-      }; break;
-      case Op::C_MV: {
-        m_regs[i.rd] = m_regs[i.rs2];
-      }; break;
-      case Op::C_OR: {
-        m_regs[i.rd] |= m_regs[i.rs2];
-      }; break;
-      case Op::C_SDSP: {
-        u64 addr = sp + i.imm;
-        mem_write<u64>(addr, m_regs[i.rs2]);
-      }; break;
-      case Op::C_SLLI: {
-        m_regs[i.rd] = (i64)((u64)m_regs[i.rd] << i.imm);
-      }; break;
-      case Op::C_SRAI: {
-        m_regs[i.rd] >>= i.imm;
-      }; break;
-      case Op::C_SRLI: {
-        m_regs[i.rd] = (i64)((u64)m_regs[i.rd] >> i.imm);
-      }; break;
-      case Op::C_SUB: {
-        m_regs[i.rd] -= m_regs[i.rs2];
-      }; break;
-      case Op::C_SUBW: {
-        m_regs[i.rd] = (i32)(m_regs[i.rd] - m_regs[i.rs2]);
-      }; break;
-      case Op::C_SWSP: {
-        u64 addr = (u64)sp + (u64)i.imm;
-        mem_write<u32>(addr, m_regs[i.rs2]);
-      }; break;
-      case Op::C_LWSP: {
-        u64 addr = (u64)sp + (u64)i.imm;
-        m_regs[i.rd] = (i32)mem_read<u32>(addr);
-      }; break;
-      case Op::C_XOR: {
-        m_regs[i.rd] ^= m_regs[i.rs2];
-      }; break;
-      case Op::DIV: {
-        if (m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = -1;
-        } else {
-          m_regs[i.rd] = m_regs[i.rs1] / m_regs[i.rs2];
-        }
-      }; break;
-      case Op::DIVU: {
-        if ((u64)m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = -1;
-        } else {
-          m_regs[i.rd] = (i64)((u64)m_regs[i.rs1] / (u64)m_regs[i.rs2]);
-        }
-      }; break;
-      case Op::DIVUW: {
-        if ((u32)m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = -1;
-        } else {
-          m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] / (u32)m_regs[i.rs2]);
-        }
-      }; break;
-      case Op::DIVW: {
-        i32 a = m_regs[i.rs1];
-        i32 b = m_regs[i.rs2];
-        if (b == 0) {
-          m_regs[i.rd] = (u64)(i64)(-1);
-        } else if (a == INT32_MIN && b == -1) {
-          m_regs[i.rd] = (i64)INT32_MIN;
-        } else {
-          m_regs[i.rd] = (i64)(a / b);
-        }
-      }; break;
-      case Op::ECALL: {
-        // https://jborza.com/post/2021-05-11-riscv-linux-syscalls/
-        // ^ already got 2 syscalls wrong
-        switch (m_regs[17]) {
-        case 29: { // ioctl
-          u32 fd = m_regs[10];
-          u32 cmd = m_regs[11];
-          u64 arg = m_regs[12];
+  struct MemoryUsage {
+    // size of the guest address space
+    u64 reserved_bytes;
+    // mapped guest pages: ELF segments, stack, brk heap and mmap regions
+    u64 committed_bytes;
+    // committed pages actually backed by host memory
+    u64 resident_bytes;
+  };
 
-          switch (cmd) {
-          case 0x5413: { // TIOCGWINSZ
-            m_regs[10] = -ENOTTY;
-          }; break;
-          default: {
-            std::println(stderr, "ioctl(fd={}, cmd={}, arg={}) unimplemented",
-                         fd, cmd, arg);
-            exit(1);
-          }; break;
-          }
-        }; break;
-        case 62: { // lseek
-          u32 fd = m_regs[10];
-          // i64 offset = m_regs[11];
-          // u32 whence = m_regs[12];
+  MemoryUsage memory_usage() const {
+    u64 resident = 0;
+    std::vector<u8> in_core(m_memory_size / m_host_page_size);
+    if (mincore(m_memory, m_memory_size, in_core.data()) == 0) {
+      for (u64 page = 0; page < m_page_perms.size(); page++) {
+        u64 host_page = page * GUEST_PAGE_SIZE / m_host_page_size;
+        if (m_page_perms[page] != 0 && (in_core[host_page] & 1)) {
+          resident++;
+        }
+      }
+    }
+    return MemoryUsage{.reserved_bytes = m_memory_size,
+                       .committed_bytes = m_committed_pages * GUEST_PAGE_SIZE,
+                       .resident_bytes = resident * GUEST_PAGE_SIZE};
+  }
 
-          if (fd != 0) {
-            std::println(stderr, "lseek syscall implemented only for stdin");
-            exit(1);
-          }
+  // Prints an objdump-style listing of every executable section. It decodes
+  // without touching the code map and formats into one big buffer, since
+  // listings of large binaries easily run into the hundreds of megabytes.
+  void disassemble_all() {
+    static constexpr u64 FLUSH_SIZE = 4 * 1024 * 1024;
+    std::string out;
+    out.reserve(FLUSH_SIZE + 4096);
 
-          // TODO
-          m_regs[10] = -ESPIPE;
-        }; break;
-        case 63: { // read
-          u32 fd = m_regs[10];
-          u64 buf = m_regs[11];
-          u64 count = m_regs[12];
+    for (const Section &section : m_code_sections) {
+      std::format_to(std::back_inserter(out),
+                     "\nDisassembly of section {}:\n", section.name);
 
-          if (fd != 0) {
-            std::println(stderr, "read syscall implemented only for stdin");
-            exit(1);
-          }
+      auto symbol = std::lower_bound(
+          m_symbols.begin(), m_symbols.end(), section.offset,
+          [](const Symbol &sym, u64 addr) { return sym.addr < addr; });
 
-          u64 bytes_read = 0;
-          for (u64 i = 0; i < count; i++) {
-            char c;
-            if (!std::cin.get(c))
-              break;
-            m_memory[buf + i] = (u8)c;
-            bytes_read++;
-            if (c == '\n')
-              break;
+      u64 pc = section.offset;
+      u64 end = section.offset + section.size;
+      while (pc < end) {
+        while (symbol != m_symbols.end() && symbol->addr <= pc) {
+          if (symbol->addr == pc) {
+            std::format_to(std::back_inserter(out), "\n{:016x} <{}>:\n", pc,
+                           symbol->name);
           }
+          symbol++;
+        }
 
-          m_regs[10] = bytes_read;
-        }; break;
-        case 64: { // write
-          u32 fd = m_regs[10];
-          u64 buf = m_regs[11];
-          u64 count = m_regs[12];
+        pc += disassemble_line(out, pc);
 
-          if (fd != 1) {
-            std::println(stderr, "write syscall implemented only for stdout.");
-            exit(1);
-          }
+        if (out.size() >= FLUSH_SIZE) {
+          fwrite(out.data(), 1, out.size(), stdout);
+          out.clear();
+        }
+      }
+    }
 
-          u64 end = buf + count;
-          for (u64 i = buf; i < end; i++) {
-            std::cout.put(m_memory[i]);
-          }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+  }
 
-          m_regs[10] = count;
-        }; break;
-        case 66: { // writev
-          u32 fd = m_regs[10];
-          u64 vec = m_regs[11];
-          u64 vlen = m_regs[12];
+  // Appends the listing line for the instruction at pc to out and returns
+  // its length.
+  u64 disassemble_line(std::string &out, u64 pc) {
+    u32 raw = read_ins(pc);
+    Ins ins = decode_raw(raw);
+    if (ins.length == 2) {
+      std::format_to(std::back_inserter(out), "{:8x}:\t{:04x}    \t", pc,
+                     raw & 0xffff);
+    } else {
+      std::format_to(std::back_inserter(out), "{:8x}:\t{:08x}\t", pc, raw);
+    }
+    disassemble_ins(out, ins);
+    return ins.length;
+  }
 
-          if (fd != 1) {
-            std::println(stderr, "writev syscall implemented only for stdout.");
-            exit(1);
-          }
+  // Prints the instructions run in each function, hottest first, then the
+  // hottest functions' disassembly with a count for each instruction.
+  // Counts come from how often each block was entered, so the switch engine
+  // has none, and a block an exit or fault left early counts in full.
+  void print_profile() {
+    static constexpr u64 ANNOTATED_FUNCTIONS = 10;
 
-          u64 total_written = 0;
-          for (u64 i = 0; i < vlen; i++) {
-            u64 iov_entry = vec + i * 16;
-            u64 buf = mem_read<u64>(iov_entry);
-            u64 len = mem_read<u64>(iov_entry + 8);
+    std::map<u64, u64> counts;
+    u64 total = 0;
+    for (const auto &[start, block] : m_blocks) {
+      u64 pc = start;
+      for (u64 n = 0; block->runs != 0 && n + 1 < block->ins.size(); n++) {
+        counts[pc] += block->runs;
+        total += block->runs;
+        pc += block->ins[n].length;
+      }
+    }
 
-            for (u64 j = 0; j < len; j++) {
-              std::cout.put(m_memory[buf + j]);
-            }
-            total_written += len;
-          }
+    // by index into m_symbols, m_symbols.size() for code before the first
+    // symbol
+    std::unordered_map<u64, u64> function_counts;
+    for (auto [pc, count] : counts) {
+      function_counts[symbol_index(pc)] += count;
+    }
+    std::vector<std::pair<u64, u64>> functions(function_counts.begin(),
+                                               function_counts.end());
+    std::ranges::sort(functions, [](auto a, auto b) {
+      return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
 
-          m_regs[10] = total_written;
-        } break;
+    std::string out = std::format("{:>14} {:>7}  function\n", "instructions",
+                                  "%");
+    for (auto [index, count] : functions) {
+      std::format_to(std::back_inserter(out), "{:>14} {:>7.2f}  {}\n", count,
+                     100.0 * count / total,
+                     index < m_symbols.size() ? m_symbols[index].name : "?");
+    }
 
-        case 93:   // exit
-        case 94: { // exit_group
-          std::println("Program exited with code {}.", m_regs[10]);
-          return;
-        }; break;
-        case 96: { // set_tid_address
-          i64 tidptr = m_regs[10];
-          i32 tid = 123;
-          memcpy(&m_memory[tidptr], &tid, sizeof(tid));
-          m_regs[10] = tid;
-        }; break;
-        case 169: { // gettimeofday
-          i64 tv_addr = m_regs[10];
-          i64 tz_addr = m_regs[11];
+    u64 annotated = 0;
+    for (auto [index, count] : functions) {
+      if (index == m_symbols.size()) {
+        continue;
+      }
+      if (annotated++ == ANNOTATED_FUNCTIONS) {
+        break;
+      }
+      u64 pc = m_symbols[index].addr;
+      u64 end = index + 1 < m_symbols.size()
+                    ? m_symbols[index + 1].addr
+                    : std::prev(counts.end())->first + 1;
+      std::format_to(std::back_inserter(out), "\n{:016x} <{}>:\n", pc,
+                     m_symbols[index].name);
+      while (pc < end && is_executable(pc)) {
+        auto it = counts.find(pc);
+        if (it != counts.end()) {
+          std::format_to(std::back_inserter(out), "{:>14} ", it->second);
+        } else {
+          out.append(15, ' ');
+        }
+        pc += disassemble_line(out, pc);
+      }
+    }
+    fwrite(out.data(), 1, out.size(), stderr);
+  }
 
-          struct timeval tv;
-          struct timezone tz;
+  // Writes the samples taken so far as folded stacks, one
+  // "outer;...;inner count" line per distinct stack, which flamegraph.pl and
+  // most other flame graph tools read.
+  void write_samples(FILE *out) const {
+    for (const auto &[stack, count] : m_samples) {
+      std::string line;
+      for (u64 n = stack.size(); n-- > 0;) {
+        u64 index = symbol_index(stack[n]);
+        if (index < m_symbols.size() && m_symbols[index].addr == stack[n]) {
+          line += m_symbols[index].name;
+        } else {
+          std::format_to(std::back_inserter(line), "0x{:x}", stack[n]);
+        }
+        line += n > 0 ? ';' : ' ';
+      }
+      std::println(out, "{}{}", line, count);
+    }
+  }
 
-          i32 ret = gettimeofday(&tv, (tz_addr != 0) ? &tz : nullptr);
-          if (ret == 0) {
-            memcpy(&m_memory[tv_addr], &tv, sizeof(tv));
-            if (tz_addr != 0) {
-              memcpy(&m_memory[tz_addr], &tz, sizeof(tz));
-            }
-            m_regs[10] = 0;
-          } else {
-            m_regs[10] = -errno;
-          }
-        }; break;
-        case 214: { // brk
-          u64 brk = m_regs[10];
+  // the index in m_symbols of the last symbol at or before pc, or
+  // m_symbols.size() if there is none
+  u64 symbol_index(u64 pc) const {
+    auto it = std::upper_bound(
+        m_symbols.begin(), m_symbols.end(), pc,
+        [](u64 addr, const Symbol &sym) { return addr < sym.addr; });
+    return it == m_symbols.begin() ? m_symbols.size()
+                                   : it - m_symbols.begin() - 1;
+  }
 
-          if (brk >= m_brk_base) {
-            m_brk = brk;
-          }
-          m_regs[10] = (i64)m_brk;
-        }; break;
-        case 222: { // mmap
-          u64 addr = m_regs[10];
-          u64 length = m_regs[11];
-          // i32 prot = m_regs[12];
-          i32 flags = m_regs[13];
-          // i32 fd = m_regs[14];
-          // i64 offset = m_regs[15];
-
-          if (!(flags & MAP_PRIVATE) || !(flags & MAP_ANONYMOUS)) {
-            std::println(
-                stderr,
-                "mmap implemented only for flags=(MAP_PRIVATE|MAP_ANONYMOUS)",
-                flags);
-            exit(1);
-          }
+  // appends one line for ins to out
+  void disassemble_ins(std::string &out, Ins ins) {
+    assert((u64)ins.op < OP_TABLE.size());
+    assert((u64)ins.c_op < C_OP_TABLE.size());
 
-          if (!(flags & MAP_FIXED)) {
-            length = (length + 4095) & ~4095;
-            addr = m_next_mmap_addr;
-            m_next_mmap_addr += length;
-          }
+    const OpDef &def =
+        ins.c_op != C_NONE ? C_OP_TABLE[ins.c_op] : OP_TABLE[ins.op];
 
-          std::memset(m_memory + addr, 0, length);
-          m_regs[10] = addr;
-        }; break;
-        default:
-          std::println(stderr, "Unimplemented syscall: {}", m_regs[17]);
-          exit(1);
-        }
-      }; break;
-      case Op::JAL: {
-        m_regs[i.rd] = m_pc + 4;
-        m_pc += i.imm;
-        continue;
-      }; break;
-      case Op::JALR: {
-        u64 target = (m_regs[i.rs1] + i.imm) & ~(u64)1;
-        m_regs[i.rd] = m_pc + 4;
-        m_pc = target;
+    auto it = std::back_inserter(out);
+    switch (def.format) {
+    case Format::NONE:
+      std::format_to(it, "{}\n", def.mnemonic);
+      break;
+    case Format::R:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1], REGS[ins.rs2]);
+      break;
+    case Format::I:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1], ins.imm);
+      break;
+    case Format::I_LOAD:
+      std::format_to(it, "{} {}, {}({})\n", def.mnemonic, REGS[ins.rd],
+                     ins.imm, REGS[ins.rs1]);
+      break;
+    case Format::I_SHIFT:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1], ins.shamt);
+      break;
+    case Format::R1:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1]);
+      break;
+    case Format::U:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rd], ins.imm);
+      break;
+    case Format::S:
+      std::format_to(it, "{} {}, {}({})\n", def.mnemonic, REGS[ins.rs2],
+                     ins.imm, REGS[ins.rs1]);
+      break;
+    case Format::B:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rs1],
+                     REGS[ins.rs2], ins.imm);
+      break;
+    case Format::CB:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rs1], ins.imm);
+      break;
+    case Format::J:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rd], ins.imm);
+      break;
+    case Format::CI:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rd], ins.imm);
+      break;
+    case Format::CJ:
+      std::format_to(it, "{} {}\n", def.mnemonic, ins.imm);
+      break;
+    case Format::CSS:
+      std::format_to(it, "{} {}, {}(sp)\n", def.mnemonic, REGS[ins.rs2],
+                     ins.imm);
+      break;
+    case Format::CR:
+      std::format_to(it, "{} {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs2]);
+      break;
+    case Format::CR1:
+      std::format_to(it, "{} {}\n", def.mnemonic, REGS[ins.rs1]);
+      break;
+    case Format::CL:
+      std::format_to(it, "{} {}, {}({})\n", def.mnemonic, REGS[ins.rd],
+                     ins.imm, REGS[ins.rs1]);
+      break;
+    case Format::R_ATOMIC_LR:
+      std::format_to(it, "{}{} {}, ({})\n", def.mnemonic, AQRL[ins.imm],
+                     REGS[ins.rd], REGS[ins.rs1]);
+      break;
+    case Format::R_ATOMIC:
+      std::format_to(it, "{}{} {}, {}, ({})\n", def.mnemonic, AQRL[ins.imm],
+                     REGS[ins.rd], REGS[ins.rs2], REGS[ins.rs1]);
+      break;
+    case Format::CSR:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     csr_name(ins.imm), REGS[ins.rs1]);
+      break;
+    case Format::CSRI:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     csr_name(ins.imm), ins.rs1);
+      break;
+    case Format::F_R:
+      std::format_to(it, "{} {}, {}, {}{}\n", def.mnemonic, FREGS[ins.rd],
+                     FREGS[ins.rs1], FREGS[ins.rs2], RM_SUFFIX[ins.rm]);
+      break;
+    case Format::F_R1:
+      std::format_to(it, "{} {}, {}{}\n", def.mnemonic, FREGS[ins.rd],
+                     FREGS[ins.rs1], RM_SUFFIX[ins.rm]);
+      break;
+    case Format::F_R4:
+      std::format_to(it, "{} {}, {}, {}, {}{}\n", def.mnemonic,
+                     FREGS[ins.rd], FREGS[ins.rs1], FREGS[ins.rs2],
+                     FREGS[ins.rs3], RM_SUFFIX[ins.rm]);
+      break;
+    case Format::F_CMP:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     FREGS[ins.rs1], FREGS[ins.rs2]);
+      break;
+    case Format::F_TO_X:
+      std::format_to(it, "{} {}, {}{}\n", def.mnemonic, REGS[ins.rd],
+                     FREGS[ins.rs1], RM_SUFFIX[ins.rm]);
+      break;
+    case Format::F_FROM_X:
+      std::format_to(it, "{} {}, {}{}\n", def.mnemonic, FREGS[ins.rd],
+                     REGS[ins.rs1], RM_SUFFIX[ins.rm]);
+      break;
+    case Format::F_LOAD:
+      std::format_to(it, "{} {}, {}({})\n", def.mnemonic, FREGS[ins.rd],
+                     ins.imm, REGS[ins.rs1]);
+      break;
+    case Format::F_STORE:
+      std::format_to(it, "{} {}, {}({})\n", def.mnemonic, FREGS[ins.rs2],
+                     ins.imm, REGS[ins.rs1]);
+      break;
+    case Format::V_VV:
+      std::format_to(it, "{} v{}, v{}, v{}{}\n", def.mnemonic, ins.rd, ins.rs2,
+                     ins.rs1, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_VX:
+      std::format_to(it, "{} v{}, v{}, {}{}\n", def.mnemonic, ins.rd, ins.rs2,
+                     REGS[ins.rs1], VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_VI:
+      std::format_to(it, "{} v{}, v{}, {}{}\n", def.mnemonic, ins.rd, ins.rs2,
+                     ins.imm, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_VF:
+      std::format_to(it, "{} v{}, v{}, {}{}\n", def.mnemonic, ins.rd, ins.rs2,
+                     FREGS[ins.rs1], VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_VVM:
+      std::format_to(it, "{} v{}, v{}, v{}, v0\n", def.mnemonic, ins.rd,
+                     ins.rs2, ins.rs1);
+      break;
+    case Format::V_VXM:
+      std::format_to(it, "{} v{}, v{}, {}, v0\n", def.mnemonic, ins.rd, ins.rs2,
+                     REGS[ins.rs1]);
+      break;
+    case Format::V_VIM:
+      std::format_to(it, "{} v{}, v{}, {}, v0\n", def.mnemonic, ins.rd, ins.rs2,
+                     ins.imm);
+      break;
+    case Format::V_VFM:
+      std::format_to(it, "{} v{}, v{}, {}, v0\n", def.mnemonic, ins.rd, ins.rs2,
+                     FREGS[ins.rs1]);
+      break;
+    case Format::V_MACC_VV:
+      std::format_to(it, "{} v{}, v{}, v{}{}\n", def.mnemonic, ins.rd, ins.rs1,
+                     ins.rs2, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_MACC_VX:
+      std::format_to(it, "{} v{}, {}, v{}{}\n", def.mnemonic, ins.rd,
+                     REGS[ins.rs1], ins.rs2, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_MACC_VF:
+      std::format_to(it, "{} v{}, {}, v{}{}\n", def.mnemonic, ins.rd,
+                     FREGS[ins.rs1], ins.rs2, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_MV_V:
+      std::format_to(it, "{} v{}, v{}\n", def.mnemonic, ins.rd, ins.rs1);
+      break;
+    case Format::V_MV_X:
+    case Format::V_FROM_X:
+      std::format_to(it, "{} v{}, {}\n", def.mnemonic, ins.rd, REGS[ins.rs1]);
+      break;
+    case Format::V_MV_I:
+      std::format_to(it, "{} v{}, {}\n", def.mnemonic, ins.rd, ins.imm);
+      break;
+    case Format::V_MV_F:
+    case Format::V_FROM_F:
+      std::format_to(it, "{} v{}, {}\n", def.mnemonic, ins.rd, FREGS[ins.rs1]);
+      break;
+    case Format::V_UNARY:
+      std::format_to(it, "{} v{}, v{}{}\n", def.mnemonic, ins.rd, ins.rs2,
+                     VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_ID:
+      std::format_to(it, "{} v{}{}\n", def.mnemonic, ins.rd,
+                     VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_TO_X:
+      std::format_to(it, "{} {}, v{}{}\n", def.mnemonic, REGS[ins.rd], ins.rs2,
+                     VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_TO_F:
+      std::format_to(it, "{} {}, v{}\n", def.mnemonic, FREGS[ins.rd], ins.rs2);
+      break;
+    case Format::V_MEM:
+      std::format_to(it, "{} v{}, ({}){}\n", def.mnemonic, ins.rd,
+                     REGS[ins.rs1], VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_MEM_STRIDED:
+      std::format_to(it, "{} v{}, ({}), {}{}\n", def.mnemonic, ins.rd,
+                     REGS[ins.rs1], REGS[ins.rs2], VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::V_MEM_INDEXED:
+      std::format_to(it, "{} v{}, ({}), v{}{}\n", def.mnemonic, ins.rd,
+                     REGS[ins.rs1], ins.rs2, VMASK_SUFFIX[ins.vm]);
+      break;
+    case Format::VSETVLI:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1], vtype_name(ins.imm));
+      break;
+    case Format::VSETIVLI:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     ins.rs1, vtype_name(ins.imm));
+      break;
+    case Format::VSETVL:
+      std::format_to(it, "{} {}, {}, {}\n", def.mnemonic, REGS[ins.rd],
+                     REGS[ins.rs1], REGS[ins.rs2]);
+      break;
+    }
+  }
+
+  void dump() {
+    for (u64 i = 0; i < 32; i++) {
+      std::print("{}=0x{:x} ", REGS[i], m_regs[i]);
+    }
+    std::println();
+  }
+
+  void push_u64(u64 v) {
+    m_regs[2] -= 8;
+    mem_write<u64>(m_regs[2], v);
+  }
+
+  // Runs the guest until it exits and returns its exit code.
+  int execute(Engine engine) {
+    start();
+    return resume(engine);
+  }
+
+  // Runs the guest from its entry point until it gets to pc, where it stops
+  // so snapshot() can be taken. Returns false if it exited instead. pc is
+  // only caught at the start of a block (the switch engine catches it
+  // anywhere), which function entries always are.
+  bool execute_until(Engine engine, u64 pc) {
+    start();
+    m_stop_pc = pc;
+    resume(engine);
+    m_stop_pc = NO_STOP_PC;
+    return m_pc == pc;
+  }
+
+  // Runs the guest from where it is until it exits and returns its exit
+  // code.
+  int resume(Engine engine) {
+    switch (engine) {
+    case Engine::SWITCH:
+      run<Engine::SWITCH>();
+      break;
+    case Engine::THREADED:
+      run<Engine::THREADED>();
+      break;
+    case Engine::JIT:
+#ifdef __x86_64__
+      if (m_jit == nullptr) {
+        m_jit = std::make_unique<X64Jit>(tlb_offset(m_read_tlb),
+                                         tlb_offset(m_write_tlb));
+        if (!m_jit_cache_dir.empty()) {
+          load_jit_cache();
+        }
+      }
+      run<Engine::JIT>();
+      if (!m_jit_cache_dir.empty()) {
+        save_jit_cache();
+      }
+#endif
+      break;
+    }
+    return m_exit_code;
+  }
+
+  // address of the symbol called name, 0 if there is none
+  u64 symbol_addr(std::string_view name) const {
+    for (const Symbol &symbol : m_symbols) {
+      if (symbol.name == name) {
+        return symbol.addr;
+      }
+    }
+    return 0;
+  }
+
+  // Saves the guest's registers, counters, memory, page table, brk and mmap
+  // state and fds, for reset() to go back to. From here on the first write
+  // to each page, and anything that maps, unmaps or protects it, marks it
+  // dirty.
+  void snapshot() {
+    // reset() would write the snapshot's contents back to the file
+    if (std::ranges::find(m_page_file_shared, true) !=
+        m_page_file_shared.end()) {
+      guest_fault("Can't snapshot a guest with MAP_SHARED file mappings");
+    }
+    if (m_snapshot == nullptr) {
+      m_snapshot = std::make_unique<Snapshot>();
+      m_snapshot->memory =
+          (u8 *)mmap(nullptr, m_memory_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (m_snapshot->memory == MAP_FAILED) {
+        m_snapshot = nullptr;
+        guest_fault("Failed to mmap snapshot memory");
+      }
+      m_page_dirty.resize(m_page_perms.size());
+    } else {
+      madvise(m_snapshot->memory, m_memory_size, MADV_DONTNEED);
+    }
+    Snapshot &snap = *m_snapshot;
+
+    // the snapshot's pages start out zero, so only the rest is copied
+    for (u64 page = 0; page < m_page_perms.size(); page++) {
+      u64 addr = page << GUEST_PAGE_SHIFT;
+      if (m_page_perms[page] != 0 && !is_zero_page(m_memory + addr)) {
+        std::memcpy(snap.memory + addr, m_memory + addr, GUEST_PAGE_SIZE);
+      }
+    }
+    snap.page_perms = m_page_perms;
+    for (u64 page : m_dirty_pages) {
+      m_page_dirty[page] = false;
+    }
+    m_dirty_pages.clear();
+    flush_tlb();
+
+    snap.pc = m_pc;
+    snap.regs = m_regs;
+    snap.fregs = m_fregs;
+    snap.frm = m_frm;
+    snap.fflags = fflags();
+    snap.vregs = m_vregs;
+    snap.vtype = m_vtype;
+    snap.vl = m_vl;
+    snap.vsew = m_vsew;
+    snap.vlmax = m_vlmax;
+    snap.vxrm = m_vxrm;
+    snap.vxsat = m_vxsat;
+    snap.instret = m_instret;
+    snap.cycles = m_cycles;
+    snap.brk = m_brk;
+    snap.free_ranges = m_free_ranges;
+
+    // dups share the file offset, which gets rewound as well
+    for (i32 fd : snap.fds) {
+      if (fd > 2) {
+        close(fd);
+      }
+    }
+    snap.fds.clear();
+    snap.fd_offsets.clear();
+    for (i32 fd : m_fds) {
+      snap.fds.push_back(fd > 2 ? dup(fd) : fd);
+      snap.fd_offsets.push_back(fd >= 0 ? lseek(fd, 0, SEEK_CUR) : -1);
+    }
+  }
+
+  // Puts the guest back the way snapshot() found it. Only pages dirtied
+  // since then are restored, so the cost follows what the guest touched,
+  // not how big it is.
+  void reset() {
+    Snapshot &snap = *m_snapshot;
+
+    // commit() and decommit() find the pages already marked and leave the
+    // list alone
+    for (u64 page : m_dirty_pages) {
+      u64 addr = page << GUEST_PAGE_SHIFT;
+      u8 perms = snap.page_perms[page];
+      // anything shared with a file was mapped since, and has to be
+      // unmapped before the copy can go back
+      if (m_page_file_shared[page]) {
+        decommit(addr, GUEST_PAGE_SIZE);
+      }
+      if (perms == 0) {
+        if (m_page_perms[page] != 0) {
+          decommit(addr, GUEST_PAGE_SIZE);
+        }
         continue;
+      }
+      if (m_page_perms[page] == 0) {
+        commit(addr, GUEST_PAGE_SIZE, perms);
+      }
+      m_page_perms[page] = perms;
+      std::memcpy(m_memory + addr, snap.memory + addr, GUEST_PAGE_SIZE);
+      if (m_page_has_code[page]) {
+        invalidate_code(addr, GUEST_PAGE_SIZE);
+      }
+    }
+    for (u64 page : m_dirty_pages) {
+      m_page_dirty[page] = false;
+    }
+    m_dirty_pages.clear();
+    flush_tlb();
+
+    m_pc = snap.pc;
+    m_regs = snap.regs;
+    m_fregs = snap.fregs;
+    set_frm(snap.frm);
+    set_fflags(snap.fflags);
+    m_vregs = snap.vregs;
+    m_vtype = snap.vtype;
+    m_vl = snap.vl;
+    m_vsew = snap.vsew;
+    m_vlmax = snap.vlmax;
+    m_vxrm = snap.vxrm;
+    m_vxsat = snap.vxsat;
+    m_instret = snap.instret;
+    m_cycles = snap.cycles;
+    m_reservation = {};
+    m_brk = snap.brk;
+    m_free_ranges = snap.free_ranges;
+    m_exit_code = 0;
+
+    for (i32 fd : m_fds) {
+      if (fd > 2) {
+        close(fd);
+      }
+    }
+    m_fds.clear();
+    for (u64 i = 0; i < snap.fds.size(); i++) {
+      i32 fd = snap.fds[i] > 2 ? dup(snap.fds[i]) : snap.fds[i];
+      if (snap.fd_offsets[i] >= 0) {
+        lseek(fd, snap.fd_offsets[i], SEEK_SET);
+      }
+      m_fds.push_back(fd);
+    }
+  }
+
+  // Gives the guest the host fd as guest_fd (0, 1 or 2), in place of
+  // whatever it was.
+  void set_fd(i32 guest_fd, i32 fd) {
+    if (m_fds[guest_fd] > 2) {
+      close(m_fds[guest_fd]);
+    }
+    m_fds[guest_fd] = fd;
+  }
+
+  // the guest's argv, {"program"} unless set
+  void set_args(std::vector<std::string> args) { m_args = std::move(args); }
+
+  // instructions retired so far
+  u64 instructions() const { return m_instret; }
+
+  // Sets what each class of instruction adds to the cycle CSR. Must be
+  // called before running anything, blocks add up their cost once.
+  void set_cycle_costs(const CycleCosts &costs) {
+    for (u64 op = 0; op < NUM_OPS; op++) {
+      m_op_cycles[op] = costs[cost_class((Op)op)];
+    }
+  }
+
+  // Decodes every executable page up front, for share_code() in other
+  // instances running the same executable.
+  std::shared_ptr<const SharedCode> decode_code() {
+    auto code = std::make_shared<SharedCode>();
+    std::vector<u64> page_numbers = executable_pages();
+    code->owned.resize(page_numbers.size());
+    for (u64 n = 0; n < page_numbers.size(); n++) {
+      u64 page = page_numbers[n];
+      CodePage &code_page = code->owned[n];
+      code_page.shared = true;
+      for (u64 slot = 0; slot < CODE_PAGE_SIZE / 2; slot++) {
+        // the same checks fetch() makes, slots that fail them stay empty
+        u64 pc = page * CODE_PAGE_SIZE + slot * 2;
+        if ((m_memory[pc] & 0b11) != 0b11 || is_executable(pc + 2)) {
+          code_page.ins[slot] = decode_raw(read_ins(pc));
+        }
+      }
+      code->pages.emplace(page, &code_page);
+    }
+    return code;
+  }
+
+  // A hash of the executable pages' addresses and contents, which is all
+  // decode_code() looks at.
+  u64 code_hash() const {
+    u64 h = 0;
+    for (u64 page : executable_pages()) {
+      h = hash_bytes(m_memory + page * CODE_PAGE_SIZE, CODE_PAGE_SIZE,
+                     h ^ page);
+    }
+    return h;
+  }
+
+  // Like decode_code(), but maps the pages from a file in dir written by an
+  // earlier run of the same code when there is one, and writes that file
+  // otherwise. Only the pages that get run are read from the file.
+  std::shared_ptr<const SharedCode> cached_code(const char *dir) {
+    u64 hash = code_hash();
+    std::string path = std::format("{}/{:016x}.dec", dir, hash);
+    if (auto code = load_decode_cache(path, hash)) {
+      return code;
+    }
+    auto code = decode_code();
+    save_decode_cache(path, hash, *code);
+    return code;
+  }
+
+  // Runs on code another instance of the same executable decoded. Must be
+  // called before running anything.
+  void share_code(std::shared_ptr<const SharedCode> code) {
+    m_shared_code = std::move(code);
+    for (const auto &[page, code_page] : m_shared_code->pages) {
+      mark_code(page);
+      if (code_page->ins.back().length == 4) {
+        mark_code(page + 1);
+      }
+    }
+  }
+
+  // Starts the JIT engine off with the translations an earlier run of the
+  // same code saved in a file in dir, and saves its own there. Must be
+  // called before running anything.
+  void set_jit_cache(std::string dir) { m_jit_cache_dir = std::move(dir); }
+
+private:
+  // The process state the guest starts in: pc at the entry point and argc,
+  // argv, envp and auxv on the stack.
+  void start() {
+    m_pc = m_entrypoint;
+    set_frm(RM_RNE);
+    set_fflags(0);
+
+    // set up the stack
+    i64 &sp = m_regs[2];
+    sp = m_memory_size - 1024;
+
+    // push the argument strings
+    std::vector<u64> arg_ptrs;
+    for (const std::string &arg : m_args) {
+      u64 len = arg.size() + 1;
+      sp -= len;
+      std::memcpy(guest_ptr(sp, len, PERM_W), arg.c_str(), len);
+      arg_ptrs.push_back(sp);
+    }
+    sp &= ~15;
+    // keeps sp 16-byte aligned once argc is pushed
+    if (arg_ptrs.size() % 2 == 0) {
+      push_u64(0);
+    }
+
+    // auxv = {0}
+    push_u64(0);
+    push_u64(0);
+    // envp = {0}
+    push_u64(0);
+    // argv = {arg_ptrs..., 0}
+    push_u64(0);
+    for (u64 n = arg_ptrs.size(); n-- > 0;) {
+      push_u64(arg_ptrs[n]);
+    }
+    push_u64(arg_ptrs.size());
+  }
+
+  u8 *m_memory;
+  u64 m_memory_size;
+  u64 m_host_page_size;
+  // the guest page table: Perm bits for every guest page, 0 if unmapped
+  std::vector<u8> m_page_perms;
+  u64 m_committed_pages = 0;
+  // direct-mapped caches of guest page addresses that allow reading and
+  // writing, indexed by page number modulo TLB_SIZE
+  std::array<u64, TLB_SIZE> m_read_tlb;
+  std::array<u64, TLB_SIZE> m_write_tlb;
+  // pages code was decoded or translated from, which are kept out of the
+  // write TLB so that check_access() sees the stores that change the code
+  std::vector<bool> m_page_has_code;
+  // pages mapped MAP_SHARED from a file, which writes go through to
+  std::vector<bool> m_page_file_shared;
+  u64 m_stack_base;
+  u64 m_max_brk;
+  std::unordered_map<u64, std::unique_ptr<CodePage>> m_code_pages;
+  // decoded pages of the same executable, shared with other instances
+  std::shared_ptr<const SharedCode> m_shared_code;
+  // the page fetch() used last, to skip the hash lookup while running
+  // straight-line code
+  u64 m_last_code_page_number = ~0ULL;
+  CodePage *m_last_code_page = nullptr;
+  std::unordered_map<u64, std::unique_ptr<Block>> m_blocks;
+  // blocks invalidate_code() dropped, kept until the engine has left them
+  std::vector<std::unique_ptr<Block>> m_dead_blocks;
+  u64 m_pc;
+  // m_regs[REG_SINK] absorbs writes to x0, see decode_raw()
+  std::array<i64, 33> m_regs{};
+  u64 m_entrypoint;
+  // SHF_EXECINSTR sections, only used for disassembly
+  std::vector<Section> m_code_sections;
+  std::vector<Symbol> m_symbols;
+  int m_exit_code = 0;
+  // sampled call stacks, innermost function first, by how often they were
+  // seen. Functions are by symbol address, or by pc without a symbol.
+  std::map<std::vector<u64>, u64> m_samples;
+#ifdef __x86_64__
+  std::unique_ptr<X64Jit> m_jit;
+  // translations mapped from the JIT cache file by guest pc, and the pages
+  // and page hash the file is keyed by
+  std::unordered_map<u64, JitCacheEntry> m_cached_jit;
+  u8 *m_jit_cache = nullptr;
+  u64 m_jit_cache_size = 0;
+  const u8 *m_jit_cache_code = nullptr;
+  std::vector<u64> m_jit_cache_pages;
+  u64 m_jit_cache_hash = 0;
+  // how many of m_jit's translations the file has already
+  u64 m_jit_cache_saved = 0;
+#endif
+  std::string m_jit_cache_dir;
+  // raw bits, singles are NaN-boxed in the low half
+  std::array<u64, 32> m_fregs{};
+  u8 m_frm = RM_RNE;
+  // the mode the host FPU rounds in, equal to frm unless frm has no host
+  // equivalent
+  u8 m_host_rm = RM_RNE;
+  // flags raised in software, on top of what the host FPU accrued
+  u8 m_fflags = 0;
+  // v0..v31, so a register group is contiguous
+  alignas(VLENB) std::array<u8, 32 * VLENB> m_vregs{};
+  u64 m_vtype = VTYPE_VILL;
+  u64 m_vl = 0;
+  // from vtype: SEW in bytes, and VLMAX, which is 0 while vill is set
+  u64 m_vsew = 1;
+  u64 m_vlmax = 0;
+  // fixed-point rounding mode and saturation, only kept for the CSRs
+  u8 m_vxrm = 0;
+  u8 m_vxsat = 0;
+  // set by LR, size 0 if there is no reservation
+  struct Reservation {
+    u64 addr;
+    u64 size;
+    u64 value;
+  } m_reservation{};
+  u64 m_brk;
+  u64 m_brk_base;
+  // unmapped parts of the mmap area between m_max_brk and m_stack_base, as
+  // start -> end
+  std::map<u64, u64> m_free_ranges;
+  // guest stdout not written to the host yet, see write_out()
+  std::vector<u8> m_output_buffer;
+  u64 m_output_buffer_size = 0;
+  // host fd behind each guest fd, -1 for a closed one
+  std::vector<i32> m_fds = {0, 1, 2};
+  std::vector<std::string> m_args = {"program"};
+  // counted per block in the threaded and JIT engines
+  u64 m_instret = 0;
+  // the cost model's cycles, counted along with m_instret
+  u64 m_cycles = 0;
+  std::array<u32, NUM_OPS> m_op_cycles;
+  // run() returns once execution gets to this pc, see execute_until()
+  static constexpr u64 NO_STOP_PC = ~0ULL;
+  u64 m_stop_pc = NO_STOP_PC;
+  struct Snapshot {
+    // laid out like m_memory, with only the pages mapped at the time
+    // filled in
+    u8 *memory;
+    std::vector<u8> page_perms;
+    u64 pc;
+    std::array<i64, 33> regs;
+    std::array<u64, 32> fregs;
+    u8 frm;
+    u8 fflags;
+    std::array<u8, 32 * VLENB> vregs;
+    u64 vtype;
+    u64 vl;
+    u64 vsew;
+    u64 vlmax;
+    u8 vxrm;
+    u8 vxsat;
+    u64 instret;
+    u64 cycles;
+    u64 brk;
+    std::map<u64, u64> free_ranges;
+    // dups of the guest's fds, except for the emulator's own stdio, and
+    // their offsets, -1 where there is none
+    std::vector<i32> fds;
+    std::vector<i64> fd_offsets;
+  };
+  std::unique_ptr<Snapshot> m_snapshot;
+  // pages changed since the snapshot, as a list and a flag per page
+  std::vector<u64> m_dirty_pages;
+  std::vector<bool> m_page_dirty;
+
+// Both engines share the instruction bodies in run(). In the switch engine
+// HANDLER is just a case label and NEXT/JUMP go back around the loop. In the
+// threaded engine every HANDLER is also a computed-goto target: each Block
+// holds the resolved target for each of its instructions, so NEXT jumps
+// straight into the following instruction's body, and JUMP leaves the block
+// through its taken link. The JIT engine is the threaded engine plus native
+// code for hot blocks.
+#define HANDLER(op)                                                            \
+  case Op::op:                                                                 \
+  handler_##op:
+#define NEXT()                                                                 \
+  if constexpr (E != Engine::SWITCH) {                                         \
+    m_pc += i.length;                                                          \
+    i = *++ins;                                                                \
+    goto **++handlers;                                                         \
+  } else                                                                       \
+    break
+// The switch engine samples on taken jumps, where the others would start a
+// block.
+#define JUMP()                                                                 \
+  if constexpr (E != Engine::SWITCH) {                                         \
+    goto block_taken;                                                          \
+  } else {                                                                     \
+    if (sample && sample_due.load(std::memory_order_relaxed)) [[unlikely]] {  \
+      take_sample();                                                           \
+    }                                                                          \
+    continue;                                                                  \
+  }
+
+// labels as values and computed goto are GNU extensions, and the block
+// transition labels are only reached from the threaded instantiation
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Wunused-label"
+
+  // Runs the instance that samples only with --sample, so the others don't
+  // pay for checking the flag.
+  template <Engine E> void run() {
+    if (sampling) {
+      run<E, true>();
+    } else {
+      run<E, false>();
+    }
+  }
+
+  template <Engine E, bool sample> void run() {
+    // one entry per Op, in enum order
+    static const void *const op_handlers[] = {
+        &&handler_INVALID, &&handler_ADD, &&handler_ADD_UW, &&handler_ADDI,
+        &&handler_ADDIW, &&handler_ADDW, &&handler_AMOADD_D, &&handler_AMOADD_W,
+        &&handler_AMOAND_D, &&handler_AMOAND_W, &&handler_AMOMAX_D,
+        &&handler_AMOMAX_W, &&handler_AMOMAXU_D, &&handler_AMOMAXU_W,
+        &&handler_AMOMIN_D, &&handler_AMOMIN_W, &&handler_AMOMINU_D,
+        &&handler_AMOMINU_W, &&handler_AMOOR_D, &&handler_AMOOR_W,
+        &&handler_AMOSWAP_D, &&handler_AMOSWAP_W, &&handler_AMOXOR_D,
+        &&handler_AMOXOR_W, &&handler_AND, &&handler_ANDI, &&handler_ANDN,
+        &&handler_AUIPC, &&handler_BCLR, &&handler_BCLRI, &&handler_BEQ,
+        &&handler_BEXT, &&handler_BEXTI, &&handler_BGE, &&handler_BGEU,
+        &&handler_BINV, &&handler_BINVI, &&handler_BLT, &&handler_BLTU,
+        &&handler_BNE, &&handler_BSET, &&handler_BSETI, &&handler_CLZ,
+        &&handler_CLZW, &&handler_CPOP, &&handler_CPOPW, &&handler_CSRRC,
+        &&handler_CSRRCI, &&handler_CSRRS, &&handler_CSRRSI, &&handler_CSRRW,
+        &&handler_CSRRWI, &&handler_CTZ, &&handler_CTZW, &&handler_DIV,
+        &&handler_DIVU, &&handler_DIVUW, &&handler_DIVW, &&handler_EBREAK,
+        &&handler_ECALL, &&handler_FADD_D, &&handler_FADD_S, &&handler_FCLASS_D,
+        &&handler_FCLASS_S, &&handler_FCVT_D_L, &&handler_FCVT_D_LU,
+        &&handler_FCVT_D_S, &&handler_FCVT_D_W, &&handler_FCVT_D_WU,
+        &&handler_FCVT_L_D, &&handler_FCVT_L_S, &&handler_FCVT_LU_D,
+        &&handler_FCVT_LU_S, &&handler_FCVT_S_D, &&handler_FCVT_S_L,
+        &&handler_FCVT_S_LU, &&handler_FCVT_S_W, &&handler_FCVT_S_WU,
+        &&handler_FCVT_W_D, &&handler_FCVT_W_S, &&handler_FCVT_WU_D,
+        &&handler_FCVT_WU_S, &&handler_FDIV_D, &&handler_FDIV_S,
+        &&handler_FENCE, &&handler_FENCE_I, &&handler_FENCE_TSO,
+        &&handler_FEQ_D, &&handler_FEQ_S, &&handler_FLD, &&handler_FLE_D,
+        &&handler_FLE_S, &&handler_FLT_D, &&handler_FLT_S, &&handler_FLW,
+        &&handler_FMADD_D, &&handler_FMADD_S, &&handler_FMAX_D,
+        &&handler_FMAX_S, &&handler_FMIN_D, &&handler_FMIN_S, &&handler_FMSUB_D,
+        &&handler_FMSUB_S, &&handler_FMUL_D, &&handler_FMUL_S,
+        &&handler_FMV_D_X, &&handler_FMV_W_X, &&handler_FMV_X_D,
+        &&handler_FMV_X_W, &&handler_FNMADD_D, &&handler_FNMADD_S,
+        &&handler_FNMSUB_D, &&handler_FNMSUB_S, &&handler_FSD,
+        &&handler_FSGNJ_D, &&handler_FSGNJ_S, &&handler_FSGNJN_D,
+        &&handler_FSGNJN_S, &&handler_FSGNJX_D, &&handler_FSGNJX_S,
+        &&handler_FSQRT_D, &&handler_FSQRT_S, &&handler_FSUB_D,
+        &&handler_FSUB_S, &&handler_FSW, &&handler_JAL, &&handler_JALR,
+        &&handler_LB, &&handler_LBU, &&handler_LD, &&handler_LH, &&handler_LHU,
+        &&handler_LR_D, &&handler_LR_W, &&handler_LUI, &&handler_LW,
+        &&handler_LWU, &&handler_MAX, &&handler_MAXU, &&handler_MIN,
+        &&handler_MINU, &&handler_MUL, &&handler_MULH, &&handler_MULHU,
+        &&handler_MULW, &&handler_OR, &&handler_ORC_B, &&handler_ORI,
+        &&handler_ORN, &&handler_PAUSE, &&handler_REM, &&handler_REMU,
+        &&handler_REMUW, &&handler_REMW, &&handler_REV8, &&handler_ROL,
+        &&handler_ROLW, &&handler_ROR, &&handler_RORI, &&handler_RORIW,
+        &&handler_RORW, &&handler_SB, &&handler_SC_D, &&handler_SC_W,
+        &&handler_SD, &&handler_SEXT_B, &&handler_SEXT_H, &&handler_SH,
+        &&handler_SH1ADD, &&handler_SH1ADD_UW, &&handler_SH2ADD,
+        &&handler_SH2ADD_UW, &&handler_SH3ADD, &&handler_SH3ADD_UW,
+        &&handler_SLL, &&handler_SLLI, &&handler_SLLI_UW, &&handler_SLLIW,
+        &&handler_SLLW, &&handler_SLT, &&handler_default, &&handler_SLTIU,
+        &&handler_SLTU, &&handler_default, &&handler_SRAI, &&handler_SRAIW,
+        &&handler_SRAW, &&handler_default, &&handler_SRLI, &&handler_SRLIW,
+        &&handler_SRLW, &&handler_SUB, &&handler_SUBW, &&handler_SW,
+        &&handler_VADD_VI, &&handler_VADD_VV, &&handler_VADD_VX,
+        &&handler_VAND_VI, &&handler_VAND_VV, &&handler_VAND_VX,
+        &&handler_VCOMPRESS_VM, &&handler_VCPOP_M, &&handler_VDIV_VV,
+        &&handler_VDIV_VX, &&handler_VDIVU_VV, &&handler_VDIVU_VX,
+        &&handler_VFADD_VF, &&handler_VFADD_VV, &&handler_VFCVT_F_X_V,
+        &&handler_VFCVT_F_XU_V, &&handler_VFCVT_RTZ_X_F_V,
+        &&handler_VFCVT_RTZ_XU_F_V, &&handler_VFCVT_X_F_V,
+        &&handler_VFCVT_XU_F_V, &&handler_VFDIV_VF, &&handler_VFDIV_VV,
+        &&handler_VFIRST_M, &&handler_VFMACC_VF, &&handler_VFMACC_VV,
+        &&handler_VFMADD_VF, &&handler_VFMADD_VV, &&handler_VFMAX_VF,
+        &&handler_VFMAX_VV, &&handler_VFMERGE_VFM, &&handler_VFMIN_VF,
+        &&handler_VFMIN_VV, &&handler_VFMSAC_VF, &&handler_VFMSAC_VV,
+        &&handler_VFMSUB_VF, &&handler_VFMSUB_VV, &&handler_VFMUL_VF,
+        &&handler_VFMUL_VV, &&handler_VFMV_F_S, &&handler_VFMV_S_F,
+        &&handler_VFMV_V_F, &&handler_VFNMACC_VF, &&handler_VFNMACC_VV,
+        &&handler_VFNMADD_VF, &&handler_VFNMADD_VV, &&handler_VFNMSAC_VF,
+        &&handler_VFNMSAC_VV, &&handler_VFNMSUB_VF, &&handler_VFNMSUB_VV,
+        &&handler_VFRDIV_VF, &&handler_VFREDMAX_VS, &&handler_VFREDMIN_VS,
+        &&handler_VFREDOSUM_VS, &&handler_VFREDUSUM_VS, &&handler_VFRSUB_VF,
+        &&handler_VFSGNJ_VF, &&handler_VFSGNJ_VV, &&handler_VFSGNJN_VF,
+        &&handler_VFSGNJN_VV, &&handler_VFSGNJX_VF, &&handler_VFSGNJX_VV,
+        &&handler_VFSQRT_V, &&handler_VFSUB_VF, &&handler_VFSUB_VV,
+        &&handler_VID_V, &&handler_VL1RE16_V, &&handler_VL1RE32_V,
+        &&handler_VL1RE64_V, &&handler_VL1RE8_V, &&handler_VL2RE16_V,
+        &&handler_VL2RE32_V, &&handler_VL2RE64_V, &&handler_VL2RE8_V,
+        &&handler_VL4RE16_V, &&handler_VL4RE32_V, &&handler_VL4RE64_V,
+        &&handler_VL4RE8_V, &&handler_VL8RE16_V, &&handler_VL8RE32_V,
+        &&handler_VL8RE64_V, &&handler_VL8RE8_V, &&handler_VLE16_V,
+        &&handler_VLE16FF_V, &&handler_VLE32_V, &&handler_VLE32FF_V,
+        &&handler_VLE64_V, &&handler_VLE64FF_V, &&handler_VLE8_V,
+        &&handler_VLE8FF_V, &&handler_VLM_V, &&handler_VLOXEI16_V,
+        &&handler_VLOXEI32_V, &&handler_VLOXEI64_V, &&handler_VLOXEI8_V,
+        &&handler_VLSE16_V, &&handler_VLSE32_V, &&handler_VLSE64_V,
+        &&handler_VLSE8_V, &&handler_VLUXEI16_V, &&handler_VLUXEI32_V,
+        &&handler_VLUXEI64_V, &&handler_VLUXEI8_V, &&handler_VMACC_VV,
+        &&handler_VMACC_VX, &&handler_VMADD_VV, &&handler_VMADD_VX,
+        &&handler_VMAND_MM, &&handler_VMANDN_MM, &&handler_VMAX_VV,
+        &&handler_VMAX_VX, &&handler_VMAXU_VV, &&handler_VMAXU_VX,
+        &&handler_VMERGE_VIM, &&handler_VMERGE_VVM, &&handler_VMERGE_VXM,
+        &&handler_VMFEQ_VF, &&handler_VMFEQ_VV, &&handler_VMFGE_VF,
+        &&handler_VMFGT_VF, &&handler_VMFLE_VF, &&handler_VMFLE_VV,
+        &&handler_VMFLT_VF, &&handler_VMFLT_VV, &&handler_VMFNE_VF,
+        &&handler_VMFNE_VV, &&handler_VMIN_VV, &&handler_VMIN_VX,
+        &&handler_VMINU_VV, &&handler_VMINU_VX, &&handler_VMNAND_MM,
+        &&handler_VMNOR_MM, &&handler_VMOR_MM, &&handler_VMORN_MM,
+        &&handler_VMSEQ_VI, &&handler_VMSEQ_VV, &&handler_VMSEQ_VX,
+        &&handler_VMSGT_VI, &&handler_VMSGT_VX, &&handler_VMSGTU_VI,
+        &&handler_VMSGTU_VX, &&handler_VMSLE_VI, &&handler_VMSLE_VV,
+        &&handler_VMSLE_VX, &&handler_VMSLEU_VI, &&handler_VMSLEU_VV,
+        &&handler_VMSLEU_VX, &&handler_VMSLT_VV, &&handler_VMSLT_VX,
+        &&handler_VMSLTU_VV, &&handler_VMSLTU_VX, &&handler_VMSNE_VI,
+        &&handler_VMSNE_VV, &&handler_VMSNE_VX, &&handler_VMUL_VV,
+        &&handler_VMUL_VX, &&handler_VMULH_VV, &&handler_VMULH_VX,
+        &&handler_VMULHSU_VV, &&handler_VMULHSU_VX, &&handler_VMULHU_VV,
+        &&handler_VMULHU_VX, &&handler_VMV_S_X, &&handler_VMV_V_I,
+        &&handler_VMV_V_V, &&handler_VMV_V_X, &&handler_VMV_X_S,
+        &&handler_VMV1R_V, &&handler_VMV2R_V, &&handler_VMV4R_V,
+        &&handler_VMV8R_V, &&handler_VMXNOR_MM, &&handler_VMXOR_MM,
+        &&handler_VNMSAC_VV, &&handler_VNMSAC_VX, &&handler_VNMSUB_VV,
+        &&handler_VNMSUB_VX, &&handler_VNSRA_WI, &&handler_VNSRA_WV,
+        &&handler_VNSRA_WX, &&handler_VNSRL_WI, &&handler_VNSRL_WV,
+        &&handler_VNSRL_WX, &&handler_VOR_VI, &&handler_VOR_VV,
+        &&handler_VOR_VX, &&handler_VREDAND_VS, &&handler_VREDMAX_VS,
+        &&handler_VREDMAXU_VS, &&handler_VREDMIN_VS, &&handler_VREDMINU_VS,
+        &&handler_VREDOR_VS, &&handler_VREDSUM_VS, &&handler_VREDXOR_VS,
+        &&handler_VREM_VV, &&handler_VREM_VX, &&handler_VREMU_VV,
+        &&handler_VREMU_VX, &&handler_VRGATHER_VI, &&handler_VRGATHER_VV,
+        &&handler_VRGATHER_VX, &&handler_VRSUB_VI, &&handler_VRSUB_VX,
+        &&handler_VS1R_V, &&handler_VS2R_V, &&handler_VS4R_V, &&handler_VS8R_V,
+        &&handler_VSE16_V, &&handler_VSE32_V, &&handler_VSE64_V,
+        &&handler_VSE8_V, &&handler_VSETIVLI, &&handler_VSETVL,
+        &&handler_VSETVLI, &&handler_VSEXT_VF2, &&handler_VSEXT_VF4,
+        &&handler_VSEXT_VF8, &&handler_VSLIDE1DOWN_VX, &&handler_VSLIDE1UP_VX,
+        &&handler_VSLIDEDOWN_VI, &&handler_VSLIDEDOWN_VX, &&handler_VSLIDEUP_VI,
+        &&handler_VSLIDEUP_VX, &&handler_VSLL_VI, &&handler_VSLL_VV,
+        &&handler_VSLL_VX, &&handler_VSM_V, &&handler_VSOXEI16_V,
+        &&handler_VSOXEI32_V, &&handler_VSOXEI64_V, &&handler_VSOXEI8_V,
+        &&handler_VSRA_VI, &&handler_VSRA_VV, &&handler_VSRA_VX,
+        &&handler_VSRL_VI, &&handler_VSRL_VV, &&handler_VSRL_VX,
+        &&handler_VSSE16_V, &&handler_VSSE32_V, &&handler_VSSE64_V,
+        &&handler_VSSE8_V, &&handler_VSUB_VV, &&handler_VSUB_VX,
+        &&handler_VSUXEI16_V, &&handler_VSUXEI32_V, &&handler_VSUXEI64_V,
+        &&handler_VSUXEI8_V, &&handler_VWADD_VV, &&handler_VWADD_VX,
+        &&handler_VWADDU_VV, &&handler_VWADDU_VX, &&handler_VWMACC_VV,
+        &&handler_VWMACC_VX, &&handler_VWMACCU_VV, &&handler_VWMACCU_VX,
+        &&handler_VWMUL_VV, &&handler_VWMUL_VX, &&handler_VWMULU_VV,
+        &&handler_VWMULU_VX, &&handler_VWSUB_VV, &&handler_VWSUB_VX,
+        &&handler_VWSUBU_VV, &&handler_VWSUBU_VX, &&handler_VXOR_VI,
+        &&handler_VXOR_VV, &&handler_VXOR_VX, &&handler_VZEXT_VF2,
+        &&handler_VZEXT_VF4, &&handler_VZEXT_VF8, &&handler_XNOR, &&handler_XOR,
+        &&handler_XORI, &&handler_ZEXT_H,
+    };
+    static_assert(std::size(op_handlers) == NUM_OPS,
+                  "len(op_handlers) != len(Op::*)");
+
+    Ins i;
+    Block *block = nullptr;
+    const Ins *ins = nullptr;
+    const void *const *handlers = nullptr;
+
+    // Blocks count all their instructions at block_enter and the switch
+    // engine counts each one before running it, so cycle and instret are
+    // read with what's counted from the current instruction on taken off.
+    auto read_csr = [&](u16 csr) {
+      if (csr != CSR_CYCLE && csr != CSR_INSTRET) {
+        return csr_read(csr);
+      }
+      u64 instret_ahead = 1;
+      u64 cycles_ahead = m_op_cycles[i.op];
+      if constexpr (E != Engine::SWITCH) {
+        for (const Ins *next = ins + 1; next->length != 0; next++) {
+          instret_ahead++;
+          cycles_ahead += m_op_cycles[next->op];
+        }
+      }
+      return csr == CSR_CYCLE ? m_cycles - cycles_ahead
+                              : m_instret - instret_ahead;
+    };
+
+    if (m_pc == m_stop_pc) {
+      return;
+    }
+    if constexpr (E != Engine::SWITCH) {
+      block = get_block(m_pc, op_handlers, &&block_end);
+      goto block_enter;
+    }
+
+    while (true) {
+      if (m_pc == m_stop_pc) [[unlikely]] {
+        return;
+      }
+      i = fetch(m_pc);
+      m_instret++;
+      m_cycles += m_op_cycles[i.op];
+
+      switch (i.op) {
+      HANDLER(INVALID) {
+        // unknown encodings only become an error once they are executed
+        illegal_instruction();
+      }; NEXT();
+      HANDLER(ADD) {
+        m_regs[i.rd] = m_regs[i.rs1] + m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(ADD_UW) {
+        m_regs[i.rd] = m_regs[i.rs2] + (u32)m_regs[i.rs1];
+      }; NEXT();
+      HANDLER(ADDI) {
+        m_regs[i.rd] = m_regs[i.rs1] + i.imm;
+      }; NEXT();
+      HANDLER(ADDIW) {
+        m_regs[i.rd] = (i32)m_regs[i.rs1] + (i32)i.imm;
+      }; NEXT();
+      HANDLER(ADDW) {
+        m_regs[i.rd] = (i32)(m_regs[i.rs1] + m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(AMOADD_D) {
+        m_regs[i.rd] = atomic_at<i64>(m_regs[i.rs1])
+                           .fetch_add(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOADD_W) {
+        m_regs[i.rd] = atomic_at<i32>(m_regs[i.rs1])
+                           .fetch_add(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOAND_D) {
+        m_regs[i.rd] = atomic_at<i64>(m_regs[i.rs1])
+                           .fetch_and(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOAND_W) {
+        m_regs[i.rd] = atomic_at<i32>(m_regs[i.rs1])
+                           .fetch_and(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOMAX_D) {
+        i64 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<i64>(
+            m_regs[i.rs1], i.imm, [v](i64 old) { return std::max(old, v); });
+      }; NEXT();
+      HANDLER(AMOMAX_W) {
+        i32 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<i32>(
+            m_regs[i.rs1], i.imm, [v](i32 old) { return std::max(old, v); });
+      }; NEXT();
+      HANDLER(AMOMAXU_D) {
+        u64 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<u64>(
+            m_regs[i.rs1], i.imm, [v](u64 old) { return std::max(old, v); });
+      }; NEXT();
+      HANDLER(AMOMAXU_W) {
+        u32 v = m_regs[i.rs2];
+        m_regs[i.rd] = (i32)atomic_update<u32>(
+            m_regs[i.rs1], i.imm, [v](u32 old) { return std::max(old, v); });
+      }; NEXT();
+      HANDLER(AMOMIN_D) {
+        i64 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<i64>(
+            m_regs[i.rs1], i.imm, [v](i64 old) { return std::min(old, v); });
+      }; NEXT();
+      HANDLER(AMOMIN_W) {
+        i32 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<i32>(
+            m_regs[i.rs1], i.imm, [v](i32 old) { return std::min(old, v); });
+      }; NEXT();
+      HANDLER(AMOMINU_D) {
+        u64 v = m_regs[i.rs2];
+        m_regs[i.rd] = atomic_update<u64>(
+            m_regs[i.rs1], i.imm, [v](u64 old) { return std::min(old, v); });
+      }; NEXT();
+      HANDLER(AMOMINU_W) {
+        u32 v = m_regs[i.rs2];
+        m_regs[i.rd] = (i32)atomic_update<u32>(
+            m_regs[i.rs1], i.imm, [v](u32 old) { return std::min(old, v); });
+      }; NEXT();
+      HANDLER(AMOOR_D) {
+        m_regs[i.rd] = atomic_at<i64>(m_regs[i.rs1])
+                           .fetch_or(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOOR_W) {
+        m_regs[i.rd] = atomic_at<i32>(m_regs[i.rs1])
+                           .fetch_or(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOSWAP_D) {
+        m_regs[i.rd] = atomic_at<i64>(m_regs[i.rs1])
+                           .exchange(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOSWAP_W) {
+        m_regs[i.rd] = atomic_at<i32>(m_regs[i.rs1])
+                           .exchange(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOXOR_D) {
+        m_regs[i.rd] = atomic_at<i64>(m_regs[i.rs1])
+                           .fetch_xor(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AMOXOR_W) {
+        m_regs[i.rd] = atomic_at<i32>(m_regs[i.rs1])
+                           .fetch_xor(m_regs[i.rs2], memory_order(i.imm));
+      }; NEXT();
+      HANDLER(AND) {
+        m_regs[i.rd] = m_regs[i.rs1] & m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(ANDI) {
+        m_regs[i.rd] = m_regs[i.rs1] & i.imm;
+      }; NEXT();
+      HANDLER(ANDN) {
+        m_regs[i.rd] = m_regs[i.rs1] & ~m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(AUIPC) {
+        m_regs[i.rd] = m_pc + (i64)(i32)((u32)i.imm << 12);
+      }; NEXT();
+      HANDLER(BCLR) {
+        m_regs[i.rd] = m_regs[i.rs1] & ~(1ULL << (m_regs[i.rs2] & 0b111111));
+      }; NEXT();
+      HANDLER(BCLRI) {
+        m_regs[i.rd] = m_regs[i.rs1] & ~(1ULL << i.shamt);
+      }; NEXT();
+      HANDLER(BEQ) {
+        if (m_regs[i.rs1] == m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BEXT) {
+        m_regs[i.rd] = ((u64)m_regs[i.rs1] >> (m_regs[i.rs2] & 0b111111)) & 1;
+      }; NEXT();
+      HANDLER(BEXTI) {
+        m_regs[i.rd] = ((u64)m_regs[i.rs1] >> i.shamt) & 1;
+      }; NEXT();
+      HANDLER(BGE) {
+        if (m_regs[i.rs1] >= m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BGEU) {
+        if ((u64)m_regs[i.rs1] >= (u64)m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BINV) {
+        m_regs[i.rd] = m_regs[i.rs1] ^ (1ULL << (m_regs[i.rs2] & 0b111111));
+      }; NEXT();
+      HANDLER(BINVI) {
+        m_regs[i.rd] = m_regs[i.rs1] ^ (1ULL << i.shamt);
+      }; NEXT();
+      HANDLER(BLT) {
+        if (m_regs[i.rs1] < m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BLTU) {
+        if ((u64)m_regs[i.rs1] < (u64)m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BNE) {
+        if (m_regs[i.rs1] != m_regs[i.rs2]) {
+          m_pc += i.imm;
+          JUMP();
+        }
+      }; NEXT();
+      HANDLER(BSET) {
+        m_regs[i.rd] = m_regs[i.rs1] | (1ULL << (m_regs[i.rs2] & 0b111111));
+      }; NEXT();
+      HANDLER(BSETI) {
+        m_regs[i.rd] = m_regs[i.rs1] | (1ULL << i.shamt);
+      }; NEXT();
+      HANDLER(CLZ) {
+        m_regs[i.rd] = std::countl_zero((u64)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(CLZW) {
+        m_regs[i.rd] = std::countl_zero((u32)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(CPOP) {
+        m_regs[i.rd] = std::popcount((u64)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(CPOPW) {
+        m_regs[i.rd] = std::popcount((u32)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(CSRRC) {
+        u64 old = read_csr(i.imm);
+        if (i.rs1 != 0) {
+          csr_write(i.imm, old & ~m_regs[i.rs1]);
+        }
+        m_regs[i.rd] = old;
+      }; NEXT();
+      HANDLER(CSRRCI) {
+        u64 old = read_csr(i.imm);
+        if (i.rs1 != 0) {
+          csr_write(i.imm, old & ~(u64)i.rs1);
+        }
+        m_regs[i.rd] = old;
+      }; NEXT();
+      HANDLER(CSRRS) {
+        u64 old = read_csr(i.imm);
+        if (i.rs1 != 0) {
+          csr_write(i.imm, old | m_regs[i.rs1]);
+        }
+        m_regs[i.rd] = old;
+      }; NEXT();
+      HANDLER(CSRRSI) {
+        u64 old = read_csr(i.imm);
+        if (i.rs1 != 0) {
+          csr_write(i.imm, old | i.rs1);
+        }
+        m_regs[i.rd] = old;
+      }; NEXT();
+      HANDLER(CSRRW) {
+        u64 v = m_regs[i.rs1];
+        m_regs[i.rd] = read_csr(i.imm);
+        csr_write(i.imm, v);
+      }; NEXT();
+      HANDLER(CSRRWI) {
+        m_regs[i.rd] = read_csr(i.imm);
+        csr_write(i.imm, i.rs1);
+      }; NEXT();
+      HANDLER(CTZ) {
+        m_regs[i.rd] = std::countr_zero((u64)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(CTZW) {
+        m_regs[i.rd] = std::countr_zero((u32)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(DIV) {
+        if (m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = -1;
+        } else if (m_regs[i.rs1] == INT64_MIN && m_regs[i.rs2] == -1) {
+          m_regs[i.rd] = INT64_MIN;
+        } else {
+          m_regs[i.rd] = m_regs[i.rs1] / m_regs[i.rs2];
+        }
+      }; NEXT();
+      HANDLER(DIVU) {
+        if ((u64)m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = -1;
+        } else {
+          m_regs[i.rd] = (i64)((u64)m_regs[i.rs1] / (u64)m_regs[i.rs2]);
+        }
+      }; NEXT();
+      HANDLER(DIVUW) {
+        if ((u32)m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = -1;
+        } else {
+          m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] / (u32)m_regs[i.rs2]);
+        }
+      }; NEXT();
+      HANDLER(DIVW) {
+        i32 a = m_regs[i.rs1];
+        i32 b = m_regs[i.rs2];
+        if (b == 0) {
+          m_regs[i.rd] = (u64)(i64)(-1);
+        } else if (a == INT32_MIN && b == -1) {
+          m_regs[i.rd] = (i64)INT32_MIN;
+        } else {
+          m_regs[i.rd] = (i64)(a / b);
+        }
+      }; NEXT();
+      HANDLER(EBREAK) {
+        flush_output();
+        dump();
+        fatal("EBREAK at pc=0x{:x}", m_pc);
+      }; NEXT();
+      HANDLER(ECALL) {
+        // https://jborza.com/post/2021-05-11-riscv-linux-syscalls/
+        // ^ already got 2 syscalls wrong
+        switch (m_regs[17]) {
+        case 29: { // ioctl
+          u32 fd = m_regs[10];
+          u32 cmd = m_regs[11];
+          u64 arg = m_regs[12];
+
+          switch (cmd) {
+          case 0x5413: { // TIOCGWINSZ
+            m_regs[10] = -ENOTTY;
+          }; break;
+          default: {
+            fatal("ioctl(fd={}, cmd={}, arg={}) unimplemented", fd, cmd, arg);
+          }; break;
+          }
+        }; break;
+        case 56: { // openat
+          i32 dirfd = host_dirfd(m_regs[10]);
+          const char *path = guest_string(m_regs[11]);
+          i32 flags = m_regs[12];
+          u32 mode = m_regs[13];
+
+          if (path == nullptr) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+
+          // the O_* flags have the same values on x86-64 and RISC-V
+          i32 fd = openat(dirfd, path, flags, mode);
+          m_regs[10] = fd < 0 ? -errno : new_fd(fd);
+        }; break;
+        case 57: { // close
+          i64 fd = m_regs[10];
+          i32 host = host_fd(fd);
+
+          if (host < 0) {
+            m_regs[10] = -EBADF;
+            break;
+          }
+          m_fds[fd] = -1;
+          // the guest's stdio is the emulator's as well, which stays open
+          if (host <= 2) {
+            flush_output();
+            m_regs[10] = 0;
+          } else {
+            m_regs[10] = close(host) < 0 ? -errno : 0;
+          }
+        }; break;
+        case 61: { // getdents64
+          i32 fd = host_fd(m_regs[10]);
+          u64 dirp = m_regs[11];
+          u64 count = m_regs[12];
+
+          u8 *dirents = syscall_ptr(dirp, count, PERM_W);
+          if (dirents == nullptr) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          // struct linux_dirent64 is the same everywhere
+          ssize_t n = getdents64(fd, dirents, count);
+          m_regs[10] = n < 0 ? -errno : n;
+        }; break;
+        case 62: { // lseek
+          i32 fd = host_fd(m_regs[10]);
+          i64 offset = m_regs[11];
+          i32 whence = m_regs[12];
+
+          // pipes and terminals fail with ESPIPE on the host as well
+          off_t pos = lseek(fd, offset, whence);
+          m_regs[10] = pos < 0 ? -errno : pos;
+        }; break;
+        case 63: { // read
+          i32 fd = host_fd(m_regs[10]);
+          u64 buf = m_regs[11];
+          u64 count = m_regs[12];
+
+          iovec iov = {.iov_base = syscall_ptr(buf, count, PERM_W),
+                       .iov_len = count};
+          m_regs[10] = iov.iov_base != nullptr ? read_in(fd, &iov, 1) : -EFAULT;
+        }; break;
+        case 65: { // readv
+          i32 fd = host_fd(m_regs[10]);
+          u64 vec = m_regs[11];
+          u64 vlen = m_regs[12];
+
+          if (vlen > IOV_MAX) {
+            m_regs[10] = -EINVAL;
+            break;
+          }
+          iovec iov[IOV_MAX];
+          if (!host_iov(vec, vlen, PERM_W, iov)) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          m_regs[10] = read_in(fd, iov, vlen);
+        }; break;
+        case 64: { // write
+          i32 fd = host_fd(m_regs[10]);
+          u64 buf = m_regs[11];
+          u64 count = m_regs[12];
+
+          iovec iov = {.iov_base = syscall_ptr(buf, count, PERM_R),
+                       .iov_len = count};
+          m_regs[10] =
+              iov.iov_base != nullptr ? write_out(fd, &iov, 1) : -EFAULT;
+        }; break;
+        case 66: { // writev
+          i32 fd = host_fd(m_regs[10]);
+          u64 vec = m_regs[11];
+          u64 vlen = m_regs[12];
+
+          if (vlen > IOV_MAX) {
+            m_regs[10] = -EINVAL;
+            break;
+          }
+
+          iovec iov[IOV_MAX];
+          if (!host_iov(vec, vlen, PERM_R, iov)) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          m_regs[10] = write_out(fd, iov, vlen);
+        } break;
+        case 67: { // pread64
+          i32 fd = host_fd(m_regs[10]);
+          u64 buf = m_regs[11];
+          u64 count = m_regs[12];
+          i64 offset = m_regs[13];
+
+          u8 *dst = syscall_ptr(buf, count, PERM_W);
+          if (dst == nullptr) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          ssize_t n = pread(fd, dst, count, offset);
+          m_regs[10] = n < 0 ? -errno : n;
+        }; break;
+        case 68: { // pwrite64
+          i32 fd = host_fd(m_regs[10]);
+          u64 buf = m_regs[11];
+          u64 count = m_regs[12];
+          i64 offset = m_regs[13];
+
+          const u8 *src = syscall_ptr(buf, count, PERM_R);
+          if (src == nullptr) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          ssize_t n = pwrite(fd, src, count, offset);
+          m_regs[10] = n < 0 ? -errno : n;
+        }; break;
+        case 79: { // newfstatat
+          i32 dirfd = host_dirfd(m_regs[10]);
+          const char *path = guest_string(m_regs[11]);
+          u64 statbuf = m_regs[12];
+          i32 flags = m_regs[13];
+
+          if (path == nullptr) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          // so are the AT_* flags
+          struct stat st;
+          if (fstatat(dirfd, path, &st, flags) < 0) {
+            m_regs[10] = -errno;
+            break;
+          }
+          m_regs[10] = write_stat(statbuf, st) ? 0 : -EFAULT;
+        }; break;
+        case 80: { // fstat
+          i32 fd = host_fd(m_regs[10]);
+          u64 statbuf = m_regs[11];
+
+          struct stat st;
+          if (fstat(fd, &st) < 0) {
+            m_regs[10] = -errno;
+            break;
+          }
+          m_regs[10] = write_stat(statbuf, st) ? 0 : -EFAULT;
+        }; break;
+
+        case 93:   // exit
+        case 94: { // exit_group
+          m_exit_code = (int)m_regs[10];
+          flush_output();
+          return;
+        }; break;
+        case 96: { // set_tid_address
+          i64 tidptr = m_regs[10];
+          i32 tid = 123;
+          mem_write<i32>(tidptr, tid);
+          m_regs[10] = tid;
+        }; break;
+        case 169: { // gettimeofday
+          i64 tv_addr = m_regs[10];
+          i64 tz_addr = m_regs[11];
+
+          struct timeval tv;
+          struct timezone tz;
+
+          u8 *tv_buf = syscall_ptr(tv_addr, sizeof(tv), PERM_W);
+          u8 *tz_buf = syscall_ptr(tz_addr, sizeof(tz), PERM_W);
+          if (tv_buf == nullptr || (tz_addr != 0 && tz_buf == nullptr)) {
+            m_regs[10] = -EFAULT;
+            break;
+          }
+          i32 ret = gettimeofday(&tv, (tz_addr != 0) ? &tz : nullptr);
+          if (ret == 0) {
+            memcpy(tv_buf, &tv, sizeof(tv));
+            if (tz_addr != 0) {
+              memcpy(tz_buf, &tz, sizeof(tz));
+            }
+            m_regs[10] = 0;
+          } else {
+            m_regs[10] = -errno;
+          }
+        }; break;
+        case 214: { // brk
+          u64 brk = m_regs[10];
+
+          if (brk >= m_brk_base && brk <= m_max_brk) {
+            u64 old_end = page_align(m_brk);
+            u64 new_end = page_align(brk);
+            if (brk > m_brk) {
+              commit(m_brk, brk - m_brk, PERM_R | PERM_W);
+            } else if (new_end < old_end) {
+              decommit(new_end, old_end - new_end);
+            }
+            m_brk = brk;
+          }
+          m_regs[10] = (i64)m_brk;
+        }; break;
+        case 222: { // mmap
+          u64 addr = m_regs[10];
+          u64 length = m_regs[11];
+          i32 prot = m_regs[12];
+          i32 flags = m_regs[13];
+          i32 fd = host_fd(m_regs[14]);
+          i64 offset = m_regs[15];
+
+          struct stat st;
+          if (flags & MAP_ANONYMOUS) {
+            st = {};
+          } else if (offset % GUEST_PAGE_SIZE != 0) {
+            m_regs[10] = -EINVAL;
+            break;
+          } else if (fstat(fd, &st) < 0) {
+            m_regs[10] = -errno;
+            break;
+          }
+
+          if (length == 0 || length > m_memory_size) {
+            m_regs[10] = length == 0 ? -EINVAL : -ENOMEM;
+            break;
+          }
+          length = page_align(length);
+          if (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) {
+            if (addr % GUEST_PAGE_SIZE != 0) {
+              m_regs[10] = -EINVAL;
+              break;
+            }
+            if (addr > m_memory_size - length) {
+              m_regs[10] = -ENOMEM;
+              break;
+            }
+            if (!(flags & MAP_FIXED) && is_mapped(addr, length, false)) {
+              m_regs[10] = -EEXIST;
+              break;
+            }
+            decommit(addr, length);
+            take_range(addr, addr + length);
+          } else {
+            addr = find_range(addr, length);
+            if (addr == 0) {
+              m_regs[10] = -ENOMEM;
+              break;
+            }
+            take_range(addr, addr + length);
+          }
+
+          // decommitted pages are zero already, only files need filling in
+          commit(addr, length, prot & (PERM_R | PERM_W | PERM_X));
+          if (!(flags & MAP_ANONYMOUS)) {
+            map_file(addr, length, fd, st, offset, flags & MAP_SHARED);
+          }
+          m_regs[10] = addr;
+        }; break;
+        case 215: { // munmap
+          u64 addr = m_regs[10];
+          u64 length = m_regs[11];
+
+          if (addr % GUEST_PAGE_SIZE != 0 || length == 0 ||
+              length > m_memory_size || addr > m_memory_size - length) {
+            m_regs[10] = -EINVAL;
+            break;
+          }
+          length = page_align(length);
+          decommit(addr, length);
+          free_range(addr, addr + length);
+          m_regs[10] = 0;
+        }; break;
+        case 226: { // mprotect
+          u64 addr = m_regs[10];
+          u64 length = m_regs[11];
+          i32 prot = m_regs[12];
+
+          if (addr % GUEST_PAGE_SIZE != 0 || length > m_memory_size) {
+            m_regs[10] = -EINVAL;
+            break;
+          }
+          length = page_align(length);
+          if (addr > m_memory_size - length || !is_mapped(addr, length, true)) {
+            m_regs[10] = -ENOMEM;
+            break;
+          }
+          mark_dirty(addr, length);
+          for (u64 page = addr >> GUEST_PAGE_SHIFT;
+               page < (addr + length) >> GUEST_PAGE_SHIFT; page++) {
+            m_page_perms[page] =
+                PERM_MAPPED | (prot & (PERM_R | PERM_W | PERM_X));
+          }
+          flush_tlb();
+          // code may have been written while the pages weren't executable,
+          // and decoded code mustn't run once they aren't
+          invalidate_code(addr, length);
+          m_regs[10] = 0;
+        }; break;
+        case 233: { // madvise
+          u64 addr = m_regs[10];
+          u64 length = m_regs[11];
+          i32 advice = m_regs[12];
+
+          if (addr % GUEST_PAGE_SIZE != 0 || length > m_memory_size) {
+            m_regs[10] = -EINVAL;
+            break;
+          }
+          length = page_align(length);
+          if (addr > m_memory_size - length || !is_mapped(addr, length, true)) {
+            m_regs[10] = -ENOMEM;
+            break;
+          }
+          // everything else is only a hint
+          if (advice == MADV_DONTNEED || advice == MADV_FREE) {
+            drop_pages(addr, length, advice);
+          }
+          m_regs[10] = 0;
+        }; break;
+        default:
+          fatal("Unimplemented syscall: {}", m_regs[17]);
+        }
+      }; NEXT();
+      HANDLER(FADD_D) {
+        fp_arith<double>(i, [](double a, double b) { return a + b; });
+      }; NEXT();
+      HANDLER(FADD_S) {
+        fp_arith<float>(i, [](float a, float b) { return a + b; });
+      }; NEXT();
+      HANDLER(FCLASS_D) {
+        m_regs[i.rd] = fp_class(freg<double>(i.rs1));
+      }; NEXT();
+      HANDLER(FCLASS_S) {
+        m_regs[i.rd] = fp_class(freg<float>(i.rs1));
+      }; NEXT();
+      HANDLER(FCVT_D_L) {
+        int_to_fp<double, i64>(i);
+      }; NEXT();
+      HANDLER(FCVT_D_LU) {
+        int_to_fp<double, u64>(i);
+      }; NEXT();
+      HANDLER(FCVT_D_S) {
+        set_freg<double>(i.rd, canonical((double)freg<float>(i.rs1)));
+      }; NEXT();
+      HANDLER(FCVT_D_W) {
+        int_to_fp<double, i32>(i);
+      }; NEXT();
+      HANDLER(FCVT_D_WU) {
+        int_to_fp<double, u32>(i);
+      }; NEXT();
+      HANDLER(FCVT_L_D) {
+        fp_to_int<double, i64>(i);
+      }; NEXT();
+      HANDLER(FCVT_L_S) {
+        fp_to_int<float, i64>(i);
+      }; NEXT();
+      HANDLER(FCVT_LU_D) {
+        fp_to_int<double, u64>(i);
+      }; NEXT();
+      HANDLER(FCVT_LU_S) {
+        fp_to_int<float, u64>(i);
+      }; NEXT();
+      HANDLER(FCVT_S_D) {
+        double v = freg<double>(i.rs1);
+        set_freg<float>(i.rd,
+                        canonical(rounded(i.rm, [v] { return (float)v; })));
+      }; NEXT();
+      HANDLER(FCVT_S_L) {
+        int_to_fp<float, i64>(i);
+      }; NEXT();
+      HANDLER(FCVT_S_LU) {
+        int_to_fp<float, u64>(i);
+      }; NEXT();
+      HANDLER(FCVT_S_W) {
+        int_to_fp<float, i32>(i);
+      }; NEXT();
+      HANDLER(FCVT_S_WU) {
+        int_to_fp<float, u32>(i);
+      }; NEXT();
+      HANDLER(FCVT_W_D) {
+        fp_to_int<double, i32>(i);
+      }; NEXT();
+      HANDLER(FCVT_W_S) {
+        fp_to_int<float, i32>(i);
+      }; NEXT();
+      HANDLER(FCVT_WU_D) {
+        fp_to_int<double, u32>(i);
+      }; NEXT();
+      HANDLER(FCVT_WU_S) {
+        fp_to_int<float, u32>(i);
+      }; NEXT();
+      HANDLER(FDIV_D) {
+        fp_arith<double>(i, [](double a, double b) { return a / b; });
+      }; NEXT();
+      HANDLER(FDIV_S) {
+        fp_arith<float>(i, [](float a, float b) { return a / b; });
+      }; NEXT();
+      HANDLER(FENCE) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }; NEXT();
+      // stores have invalidated the code they changed already, ending the
+      // block gets the rest of it decoded again
+      HANDLER(FENCE_I) {
+      }; NEXT();
+      HANDLER(FENCE_TSO) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }; NEXT();
+      HANDLER(FEQ_D) {
+        fp_compare<double>(i, true, [](double a, double b) { return a == b; });
+      }; NEXT();
+      HANDLER(FEQ_S) {
+        fp_compare<float>(i, true, [](float a, float b) { return a == b; });
+      }; NEXT();
+      HANDLER(FLD) {
+        m_fregs[i.rd] = mem_read<u64>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(FLE_D) {
+        fp_compare<double>(i, false, [](double a, double b) { return a <= b; });
+      }; NEXT();
+      HANDLER(FLE_S) {
+        fp_compare<float>(i, false, [](float a, float b) { return a <= b; });
+      }; NEXT();
+      HANDLER(FLT_D) {
+        fp_compare<double>(i, false, [](double a, double b) { return a < b; });
+      }; NEXT();
+      HANDLER(FLT_S) {
+        fp_compare<float>(i, false, [](float a, float b) { return a < b; });
+      }; NEXT();
+      HANDLER(FLW) {
+        set_freg_bits<float>(i.rd, mem_read<u32>(m_regs[i.rs1] + i.imm));
+      }; NEXT();
+      HANDLER(FMADD_D) {
+        fp_fma<double>(i, false, false);
+      }; NEXT();
+      HANDLER(FMADD_S) {
+        fp_fma<float>(i, false, false);
+      }; NEXT();
+      HANDLER(FMAX_D) {
+        fp_min_max<double>(i, true);
+      }; NEXT();
+      HANDLER(FMAX_S) {
+        fp_min_max<float>(i, true);
+      }; NEXT();
+      HANDLER(FMIN_D) {
+        fp_min_max<double>(i, false);
+      }; NEXT();
+      HANDLER(FMIN_S) {
+        fp_min_max<float>(i, false);
+      }; NEXT();
+      HANDLER(FMSUB_D) {
+        fp_fma<double>(i, false, true);
+      }; NEXT();
+      HANDLER(FMSUB_S) {
+        fp_fma<float>(i, false, true);
+      }; NEXT();
+      HANDLER(FMUL_D) {
+        fp_arith<double>(i, [](double a, double b) { return a * b; });
+      }; NEXT();
+      HANDLER(FMUL_S) {
+        fp_arith<float>(i, [](float a, float b) { return a * b; });
+      }; NEXT();
+      HANDLER(FMV_D_X) {
+        m_fregs[i.rd] = m_regs[i.rs1];
+      }; NEXT();
+      HANDLER(FMV_W_X) {
+        set_freg_bits<float>(i.rd, (u32)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(FMV_X_D) {
+        m_regs[i.rd] = m_fregs[i.rs1];
+      }; NEXT();
+      HANDLER(FMV_X_W) {
+        m_regs[i.rd] = (i32)m_fregs[i.rs1];
+      }; NEXT();
+      HANDLER(FNMADD_D) {
+        fp_fma<double>(i, true, true);
+      }; NEXT();
+      HANDLER(FNMADD_S) {
+        fp_fma<float>(i, true, true);
+      }; NEXT();
+      HANDLER(FNMSUB_D) {
+        fp_fma<double>(i, true, false);
+      }; NEXT();
+      HANDLER(FNMSUB_S) {
+        fp_fma<float>(i, true, false);
+      }; NEXT();
+      HANDLER(FSD) {
+        mem_write<u64>(m_regs[i.rs1] + i.imm, m_fregs[i.rs2]);
+      }; NEXT();
+      HANDLER(FSGNJ_D) {
+        fp_sign_inject<double>(i, [](auto, auto b) { return b; });
+      }; NEXT();
+      HANDLER(FSGNJ_S) {
+        fp_sign_inject<float>(i, [](auto, auto b) { return b; });
+      }; NEXT();
+      HANDLER(FSGNJN_D) {
+        fp_sign_inject<double>(i, [](auto, auto b) { return ~b; });
+      }; NEXT();
+      HANDLER(FSGNJN_S) {
+        fp_sign_inject<float>(i, [](auto, auto b) { return ~b; });
+      }; NEXT();
+      HANDLER(FSGNJX_D) {
+        fp_sign_inject<double>(i, [](auto a, auto b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(FSGNJX_S) {
+        fp_sign_inject<float>(i, [](auto a, auto b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(FSQRT_D) {
+        fp_arith<double>(i, [](double a, double) { return std::sqrt(a); });
+      }; NEXT();
+      HANDLER(FSQRT_S) {
+        fp_arith<float>(i, [](float a, float) { return std::sqrt(a); });
+      }; NEXT();
+      HANDLER(FSUB_D) {
+        fp_arith<double>(i, [](double a, double b) { return a - b; });
+      }; NEXT();
+      HANDLER(FSUB_S) {
+        fp_arith<float>(i, [](float a, float b) { return a - b; });
+      }; NEXT();
+      HANDLER(FSW) {
+        mem_write<u32>(m_regs[i.rs1] + i.imm, (u32)m_fregs[i.rs2]);
+      }; NEXT();
+      HANDLER(JAL) {
+        m_regs[i.rd] = m_pc + i.length;
+        m_pc += i.imm;
+        JUMP();
+      }; NEXT();
+      HANDLER(JALR) {
+        u64 target = (m_regs[i.rs1] + i.imm) & ~(u64)1;
+        m_regs[i.rd] = m_pc + i.length;
+        m_pc = target;
+        JUMP();
+      }; NEXT();
+      HANDLER(LB) {
+        m_regs[i.rd] = mem_read<i8>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LBU) {
+        m_regs[i.rd] = mem_read<u8>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LD) {
+        m_regs[i.rd] = mem_read<u64>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LH) {
+        m_regs[i.rd] = mem_read<i16>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LHU) {
+        m_regs[i.rd] = mem_read<u16>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LR_D) {
+        load_reserved<i64>(i);
+      }; NEXT();
+      HANDLER(LR_W) {
+        load_reserved<i32>(i);
+      }; NEXT();
+      HANDLER(LUI) {
+        m_regs[i.rd] = (i64)(i32)((u32)i.imm << 12);
+      }; NEXT();
+      HANDLER(LW) {
+        m_regs[i.rd] = mem_read<i32>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(LWU) {
+        m_regs[i.rd] = mem_read<u32>(m_regs[i.rs1] + i.imm);
+      }; NEXT();
+      HANDLER(MAX) {
+        m_regs[i.rd] = std::max(m_regs[i.rs1], m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(MAXU) {
+        m_regs[i.rd] = std::max((u64)m_regs[i.rs1], (u64)m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(MIN) {
+        m_regs[i.rd] = std::min(m_regs[i.rs1], m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(MINU) {
+        m_regs[i.rd] = std::min((u64)m_regs[i.rs1], (u64)m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(MUL) {
+        m_regs[i.rd] = m_regs[i.rs1] * m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(MULH) {
+        i64 rs1 = m_regs[i.rs1];
+        i64 rs2 = m_regs[i.rs2];
+        u64 u = rs1;
+        u64 v = rs2;
+        u64 u0 = u & 0xffffffff;
+        u64 u1 = u >> 32;
+        u64 v0 = v & 0xffffffff;
+        u64 v1 = v >> 32;
+        u64 t = u0 * v0;
+        u64 k = t >> 32;
+        t = u1 * v0 + k;
+        u64 w1 = t & 0xffffffff;
+        u64 w2 = t >> 32;
+        t = u0 * v1 + w1;
+        k = t >> 32;
+        u64 res = u1 * v1 + w2 + k;
+        if (rs1 < 0)
+          res -= u64(rs2);
+        if (rs2 < 0)
+          res -= u64(rs1);
+        m_regs[i.rd] = (i64)res;
+      }; NEXT();
+      HANDLER(MULHU) {
+        u64 a = m_regs[i.rs1];
+        u64 b = m_regs[i.rs2];
+        u64 a0 = a & 0xffffffff;
+        u64 a1 = a >> 32;
+        u64 b0 = b & 0xffffffff;
+        u64 b1 = b >> 32;
+        u64 t = a0 * b0;
+        u64 k = t >> 32;
+        t = a1 * b0 + k;
+        u64 w1 = t & 0xffffffff;
+        u64 w2 = t >> 32;
+        t = a0 * b1 + w1;
+        k = t >> 32;
+        m_regs[i.rd] = a1 * b1 + w2 + k;
+      }; NEXT();
+      HANDLER(MULW) {
+        m_regs[i.rd] = (i32)(m_regs[i.rs1] * m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(OR) {
+        m_regs[i.rd] = m_regs[i.rs1] | m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(ORC_B) {
+        // bit 7 of a byte ends up set iff the byte is non-zero: adding 0x7f
+        // to its low 7 bits never carries into the next byte
+        u64 v = m_regs[i.rs1];
+        u64 low = (v & 0x7f7f7f7f7f7f7f7f) + 0x7f7f7f7f7f7f7f7f;
+        m_regs[i.rd] = (((low | v) & 0x8080808080808080) >> 7) * 0xff;
+      }; NEXT();
+      HANDLER(ORI) {
+        m_regs[i.rd] = m_regs[i.rs1] | (i64)i.imm;
+      }; NEXT();
+      HANDLER(ORN) {
+        m_regs[i.rd] = m_regs[i.rs1] | ~m_regs[i.rs2];
+      }; NEXT();
+      // only a spin-loop hint
+      HANDLER(PAUSE) {
+      }; NEXT();
+      HANDLER(REM) {
+        if (m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = m_regs[i.rs1];
+        } else if (m_regs[i.rs1] == INT64_MIN && m_regs[i.rs2] == -1) {
+          m_regs[i.rd] = 0;
+        } else {
+          m_regs[i.rd] = m_regs[i.rs1] % m_regs[i.rs2];
+        }
+      }; NEXT();
+      HANDLER(REMU) {
+        if (m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = m_regs[i.rs1];
+        } else {
+          m_regs[i.rd] = (u64)m_regs[i.rs1] % (u64)m_regs[i.rs2];
+        }
+      }; NEXT();
+      HANDLER(REMUW) {
+        if ((u32)m_regs[i.rs2] == 0) {
+          m_regs[i.rd] = (i32)m_regs[i.rs1];
+        } else {
+          m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] % (u32)m_regs[i.rs2]);
+        }
+      }; NEXT();
+      HANDLER(REMW) {
+        i32 a = (i32)m_regs[i.rs1];
+        i32 b = (i32)m_regs[i.rs2];
+
+        if (b == 0) {
+          m_regs[i.rd] = (i64)a;
+        } else if (a == INT32_MIN && b == -1) {
+          m_regs[i.rd] = 0;
+        } else {
+          m_regs[i.rd] = (i64)(a % b);
+        }
+      }; NEXT();
+      HANDLER(REV8) {
+        m_regs[i.rd] = std::byteswap((u64)m_regs[i.rs1]);
+      }; NEXT();
+      HANDLER(ROL) {
+        m_regs[i.rd] = std::rotl((u64)m_regs[i.rs1], m_regs[i.rs2] & 0b111111);
+      }; NEXT();
+      HANDLER(ROLW) {
+        m_regs[i.rd] =
+            (i32)std::rotl((u32)m_regs[i.rs1], m_regs[i.rs2] & 0b11111);
+      }; NEXT();
+      HANDLER(ROR) {
+        m_regs[i.rd] = std::rotr((u64)m_regs[i.rs1], m_regs[i.rs2] & 0b111111);
+      }; NEXT();
+      HANDLER(RORI) {
+        m_regs[i.rd] = std::rotr((u64)m_regs[i.rs1], i.shamt);
+      }; NEXT();
+      HANDLER(RORIW) {
+        m_regs[i.rd] = (i32)std::rotr((u32)m_regs[i.rs1], i.shamt);
+      }; NEXT();
+      HANDLER(RORW) {
+        m_regs[i.rd] =
+            (i32)std::rotr((u32)m_regs[i.rs1], m_regs[i.rs2] & 0b11111);
+      }; NEXT();
+      HANDLER(SB) {
+        u64 addr = m_regs[i.rs1] + i.imm;
+        mem_write<u8>(addr, m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(SC_D) {
+        store_conditional<i64>(i);
+      }; NEXT();
+      HANDLER(SC_W) {
+        store_conditional<i32>(i);
+      }; NEXT();
+      HANDLER(SD) {
+        u64 addr = m_regs[i.rs1] + i.imm;
+        mem_write<u64>(addr, m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(SEXT_B) {
+        m_regs[i.rd] = (i8)m_regs[i.rs1];
+      }; NEXT();
+      HANDLER(SEXT_H) {
+        m_regs[i.rd] = (i16)m_regs[i.rs1];
+      }; NEXT();
+      HANDLER(SH) {
+        u64 addr = m_regs[i.rs1] + i.imm;
+        mem_write<u16>(addr, m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(SH1ADD) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)m_regs[i.rs1] << 1);
+      }; NEXT();
+      HANDLER(SH1ADD_UW) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)(u32)m_regs[i.rs1] << 1);
+      }; NEXT();
+      HANDLER(SH2ADD) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)m_regs[i.rs1] << 2);
+      }; NEXT();
+      HANDLER(SH2ADD_UW) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)(u32)m_regs[i.rs1] << 2);
+      }; NEXT();
+      HANDLER(SH3ADD) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)m_regs[i.rs1] << 3);
+      }; NEXT();
+      HANDLER(SH3ADD_UW) {
+        m_regs[i.rd] = m_regs[i.rs2] + ((u64)(u32)m_regs[i.rs1] << 3);
+      }; NEXT();
+      HANDLER(SLL) {
+        m_regs[i.rd] = (u64)m_regs[i.rs1] << ((u64)m_regs[i.rs2] & 0b111111);
+      }; NEXT();
+      HANDLER(SLLI) {
+        m_regs[i.rd] = m_regs[i.rs1] << i.shamt;
+      }; NEXT();
+      HANDLER(SLLI_UW) {
+        m_regs[i.rd] = (u64)(u32)m_regs[i.rs1] << i.shamt;
+      }; NEXT();
+      HANDLER(SLLIW) {
+        m_regs[i.rd] = (i32)m_regs[i.rs1] << i.shamt;
+      }; NEXT();
+      HANDLER(SLLW) {
+        m_regs[i.rd] =
+            (i32)(u32)((u32)m_regs[i.rs1] << ((u32)m_regs[i.rs2] & 0b11111));
+      }; NEXT();
+      HANDLER(SLT) {
+        m_regs[i.rd] = (m_regs[i.rs1] < m_regs[i.rs2]) ? 1 : 0;
+      }; NEXT();
+      HANDLER(SLTIU) {
+        m_regs[i.rd] = ((u64)m_regs[i.rs1] < (u64)(i64)i.imm) ? 1 : 0;
+      }; NEXT();
+      HANDLER(SLTU) {
+        m_regs[i.rd] = ((u64)m_regs[i.rs1] < (u64)m_regs[i.rs2]) ? 1 : 0;
+      }; NEXT();
+      HANDLER(SRAI) {
+        m_regs[i.rd] = (i64)m_regs[i.rs1] >> i.shamt;
+      }; NEXT();
+      HANDLER(SRAIW) {
+        m_regs[i.rd] = (i32)m_regs[i.rs1] >> i.shamt;
+      }; NEXT();
+      HANDLER(SRAW) {
+        m_regs[i.rd] = ((i32)m_regs[i.rs1]) >> ((u32)m_regs[i.rs2] & 0b11111);
+      }; NEXT();
+      HANDLER(SRLI) {
+        m_regs[i.rd] = (u64)m_regs[i.rs1] >> i.shamt;
+      }; NEXT();
+      HANDLER(SRLIW) {
+        m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] >> i.shamt);
+      }; NEXT();
+      HANDLER(SRLW) {
+        m_regs[i.rd] =
+            (i32)((u32)m_regs[i.rs1] >> ((u32)m_regs[i.rs2] & 0b11111));
+      }; NEXT();
+      HANDLER(SUB) {
+        m_regs[i.rd] = m_regs[i.rs1] - m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(SUBW) {
+        m_regs[i.rd] = (i32)(m_regs[i.rs1] - m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(SW) {
+        u64 addr = m_regs[i.rs1] + i.imm;
+        mem_write<u32>(addr, m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(VADD_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VADD_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VADD_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VAND_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) { return a & b; });
+      }; NEXT();
+      HANDLER(VAND_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a & b; });
+      }; NEXT();
+      HANDLER(VAND_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a & b; });
+      }; NEXT();
+      HANDLER(VCOMPRESS_VM) {
+        with_sew<false>([&](auto t) { v_compress<decltype(t)>(i); });
+      }; NEXT();
+      HANDLER(VCPOP_M) {
+        const u8 *vs2 = vreg_single(i.rs2);
+        u64 n = 0;
+        for (u64 k = 0; k < m_vl; k++) {
+          n += mask_bit(vs2, k) && active(i, k);
+        }
+        m_regs[i.rd] = n;
+      }; NEXT();
+      HANDLER(VDIV_VV) {
+        v_int_each<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return divide(a, b); });
+      }; NEXT();
+      HANDLER(VDIV_VX) {
+        v_int_each<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return divide(a, b); });
+      }; NEXT();
+      HANDLER(VDIVU_VV) {
+        v_int_each<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return divide(a, b); });
+      }; NEXT();
+      HANDLER(VDIVU_VX) {
+        v_int_each<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return divide(a, b); });
+      }; NEXT();
+      HANDLER(VFADD_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VFADD_VV) {
+        v_fp<VSrc::V>(i, [](auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VFCVT_F_X_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<i8, sizeof(T)>;
+          v_unary<I, T>(i, [](I a) { return (T)a; });
+        });
+      }; NEXT();
+      HANDLER(VFCVT_F_XU_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<u8, sizeof(T)>;
+          v_unary<I, T>(i, [](I a) { return (T)a; });
+        });
+      }; NEXT();
+      HANDLER(VFCVT_RTZ_X_F_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<i8, sizeof(T)>;
+          v_unary<T, I>(i, [this](T a) { return to_int<T, I>(a, RM_RTZ); });
+        });
+      }; NEXT();
+      HANDLER(VFCVT_RTZ_XU_F_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<u8, sizeof(T)>;
+          v_unary<T, I>(i, [this](T a) { return to_int<T, I>(a, RM_RTZ); });
+        });
+      }; NEXT();
+      HANDLER(VFCVT_X_F_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<i8, sizeof(T)>;
+          v_unary<T, I>(i, [this](T a) { return to_int<T, I>(a, RM_DYN); });
+        });
+      }; NEXT();
+      HANDLER(VFCVT_XU_F_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          using I = IntOfSize<u8, sizeof(T)>;
+          v_unary<T, I>(i, [this](T a) { return to_int<T, I>(a, RM_DYN); });
+        });
+      }; NEXT();
+      HANDLER(VFDIV_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return a / b; });
+      }; NEXT();
+      HANDLER(VFDIV_VV) {
+        v_fp<VSrc::V>(i, [](auto a, auto b) { return a / b; });
+      }; NEXT();
+      HANDLER(VFIRST_M) {
+        const u8 *vs2 = vreg_single(i.rs2);
+        m_regs[i.rd] = -1;
+        for (u64 k = 0; k < m_vl; k++) {
+          if (mask_bit(vs2, k) && active(i, k)) {
+            m_regs[i.rd] = k;
+            break;
+          }
+        }
+      }; NEXT();
+      HANDLER(VFMACC_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, a, d); });
+      }; NEXT();
+      HANDLER(VFMACC_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, a, d); });
+      }; NEXT();
+      HANDLER(VFMADD_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, d, a); });
+      }; NEXT();
+      HANDLER(VFMADD_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, d, a); });
+      }; NEXT();
+      HANDLER(VFMAX_VF) {
+        v_fp_each<VSrc::F>(
+            i, [this](auto, auto a, auto b) { return min_max(a, b, true); });
+      }; NEXT();
+      HANDLER(VFMAX_VV) {
+        v_fp_each<VSrc::V>(
+            i, [this](auto, auto a, auto b) { return min_max(a, b, true); });
+      }; NEXT();
+      HANDLER(VFMERGE_VFM) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          v_merge<FpBits<T>, VSrc::F>(i, freg_bits<T>(i.rs1));
+        });
+      }; NEXT();
+      HANDLER(VFMIN_VF) {
+        v_fp_each<VSrc::F>(
+            i, [this](auto, auto a, auto b) { return min_max(a, b, false); });
+      }; NEXT();
+      HANDLER(VFMIN_VV) {
+        v_fp_each<VSrc::V>(
+            i, [this](auto, auto a, auto b) { return min_max(a, b, false); });
+      }; NEXT();
+      HANDLER(VFMSAC_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, a, -d); });
+      }; NEXT();
+      HANDLER(VFMSAC_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, a, -d); });
+      }; NEXT();
+      HANDLER(VFMSUB_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, d, -a); });
+      }; NEXT();
+      HANDLER(VFMSUB_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(b, d, -a); });
+      }; NEXT();
+      HANDLER(VFMUL_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VFMUL_VV) {
+        v_fp<VSrc::V>(i, [](auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VFMV_F_S) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          set_freg_bits<T>(i.rd, load_as<FpBits<T>>(vreg_single(i.rs2)));
+        });
+      }; NEXT();
+      HANDLER(VFMV_S_F) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          if (m_vl > 0) {
+            store_as(vreg_single(i.rd), freg_bits<T>(i.rs1));
+          }
+        });
+      }; NEXT();
+      HANDLER(VFMV_V_F) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          v_binary<FpBits<T>, VSrc::F>(i, freg_bits<T>(i.rs1),
+                                       [](auto, auto b) { return b; });
+        });
+      }; NEXT();
+      HANDLER(VFNMACC_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, a, -d); });
+      }; NEXT();
+      HANDLER(VFNMACC_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, a, -d); });
+      }; NEXT();
+      HANDLER(VFNMADD_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, d, -a); });
+      }; NEXT();
+      HANDLER(VFNMADD_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, d, -a); });
+      }; NEXT();
+      HANDLER(VFNMSAC_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, a, d); });
+      }; NEXT();
+      HANDLER(VFNMSAC_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, a, d); });
+      }; NEXT();
+      HANDLER(VFNMSUB_VF) {
+        v_fp_each<VSrc::F>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, d, a); });
+      }; NEXT();
+      HANDLER(VFNMSUB_VV) {
+        v_fp_each<VSrc::V>(
+            i, [](auto d, auto a, auto b) { return std::fma(-b, d, a); });
+      }; NEXT();
+      HANDLER(VFRDIV_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return b / a; });
+      }; NEXT();
+      HANDLER(VFREDMAX_VS) {
+        v_fp_reduce(
+            i, [this](auto acc, auto v) { return min_max(acc, v, true); });
+      }; NEXT();
+      HANDLER(VFREDMIN_VS) {
+        v_fp_reduce(
+            i, [this](auto acc, auto v) { return min_max(acc, v, false); });
+      }; NEXT();
+      HANDLER(VFREDOSUM_VS) {
+        v_fp_reduce(i, [](auto acc, auto v) { return acc + v; });
+      }; NEXT();
+      HANDLER(VFREDUSUM_VS) {
+        v_fp_reduce(i, [](auto acc, auto v) { return acc + v; });
+      }; NEXT();
+      HANDLER(VFRSUB_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return b - a; });
+      }; NEXT();
+      HANDLER(VFSGNJ_VF) {
+        v_fp_sign_inject<VSrc::F>(i, [](auto a, auto b, auto sign) {
+          return (a & ~sign) | (b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSGNJ_VV) {
+        v_fp_sign_inject<VSrc::V>(i, [](auto a, auto b, auto sign) {
+          return (a & ~sign) | (b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSGNJN_VF) {
+        v_fp_sign_inject<VSrc::F>(i, [](auto a, auto b, auto sign) {
+          return (a & ~sign) | (~b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSGNJN_VV) {
+        v_fp_sign_inject<VSrc::V>(i, [](auto a, auto b, auto sign) {
+          return (a & ~sign) | (~b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSGNJX_VF) {
+        v_fp_sign_inject<VSrc::F>(i, [](auto a, auto b, auto sign) {
+          return a ^ (b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSGNJX_VV) {
+        v_fp_sign_inject<VSrc::V>(i, [](auto a, auto b, auto sign) {
+          return a ^ (b & sign);
+        });
+      }; NEXT();
+      HANDLER(VFSQRT_V) {
+        with_fp_sew([&](auto t) {
+          using T = decltype(t);
+          v_unary<T, T>(i, [](T a) { return canonical(std::sqrt(a)); });
+        });
+      }; NEXT();
+      HANDLER(VFSUB_VF) {
+        v_fp<VSrc::F>(i, [](auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VFSUB_VV) {
+        v_fp<VSrc::V>(i, [](auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VID_V) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          u8 *vd = vreg(i.rd, sizeof(T));
+          for (u64 k = 0; k < m_vl; k++) {
+            if (active(i, k)) {
+              store_as<T>(vd + k * sizeof(T), k);
+            }
+          }
+        });
+      }; NEXT();
+      HANDLER(VL1RE16_V) {
+        v_load_whole(i, 1);
+      }; NEXT();
+      HANDLER(VL1RE32_V) {
+        v_load_whole(i, 1);
+      }; NEXT();
+      HANDLER(VL1RE64_V) {
+        v_load_whole(i, 1);
+      }; NEXT();
+      HANDLER(VL1RE8_V) {
+        v_load_whole(i, 1);
+      }; NEXT();
+      HANDLER(VL2RE16_V) {
+        v_load_whole(i, 2);
+      }; NEXT();
+      HANDLER(VL2RE32_V) {
+        v_load_whole(i, 2);
+      }; NEXT();
+      HANDLER(VL2RE64_V) {
+        v_load_whole(i, 2);
+      }; NEXT();
+      HANDLER(VL2RE8_V) {
+        v_load_whole(i, 2);
+      }; NEXT();
+      HANDLER(VL4RE16_V) {
+        v_load_whole(i, 4);
+      }; NEXT();
+      HANDLER(VL4RE32_V) {
+        v_load_whole(i, 4);
+      }; NEXT();
+      HANDLER(VL4RE64_V) {
+        v_load_whole(i, 4);
+      }; NEXT();
+      HANDLER(VL4RE8_V) {
+        v_load_whole(i, 4);
+      }; NEXT();
+      HANDLER(VL8RE16_V) {
+        v_load_whole(i, 8);
+      }; NEXT();
+      HANDLER(VL8RE32_V) {
+        v_load_whole(i, 8);
+      }; NEXT();
+      HANDLER(VL8RE64_V) {
+        v_load_whole(i, 8);
+      }; NEXT();
+      HANDLER(VL8RE8_V) {
+        v_load_whole(i, 8);
+      }; NEXT();
+      HANDLER(VLE16_V) {
+        v_load<u16>(i);
+      }; NEXT();
+      HANDLER(VLE16FF_V) {
+        v_load_first_fault<u16>(i);
+      }; NEXT();
+      HANDLER(VLE32_V) {
+        v_load<u32>(i);
+      }; NEXT();
+      HANDLER(VLE32FF_V) {
+        v_load_first_fault<u32>(i);
+      }; NEXT();
+      HANDLER(VLE64_V) {
+        v_load<u64>(i);
+      }; NEXT();
+      HANDLER(VLE64FF_V) {
+        v_load_first_fault<u64>(i);
+      }; NEXT();
+      HANDLER(VLE8_V) {
+        v_load<u8>(i);
+      }; NEXT();
+      HANDLER(VLE8FF_V) {
+        v_load_first_fault<u8>(i);
+      }; NEXT();
+      HANDLER(VLM_V) {
+        v_load_mask(i);
+      }; NEXT();
+      HANDLER(VLOXEI16_V) {
+        v_load_indexed<u16>(i);
+      }; NEXT();
+      HANDLER(VLOXEI32_V) {
+        v_load_indexed<u32>(i);
+      }; NEXT();
+      HANDLER(VLOXEI64_V) {
+        v_load_indexed<u64>(i);
+      }; NEXT();
+      HANDLER(VLOXEI8_V) {
+        v_load_indexed<u8>(i);
+      }; NEXT();
+      HANDLER(VLSE16_V) {
+        v_load_strided<u16>(i);
+      }; NEXT();
+      HANDLER(VLSE32_V) {
+        v_load_strided<u32>(i);
+      }; NEXT();
+      HANDLER(VLSE64_V) {
+        v_load_strided<u64>(i);
+      }; NEXT();
+      HANDLER(VLSE8_V) {
+        v_load_strided<u8>(i);
+      }; NEXT();
+      HANDLER(VLUXEI16_V) {
+        v_load_indexed<u16>(i);
+      }; NEXT();
+      HANDLER(VLUXEI32_V) {
+        v_load_indexed<u32>(i);
+      }; NEXT();
+      HANDLER(VLUXEI64_V) {
+        v_load_indexed<u64>(i);
+      }; NEXT();
+      HANDLER(VLUXEI8_V) {
+        v_load_indexed<u8>(i);
+      }; NEXT();
+      HANDLER(VMACC_VV) {
+        v_int_ternary<false, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VMACC_VX) {
+        v_int_ternary<false, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VMADD_VV) {
+        v_int_ternary<false, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return b * d + a; });
+      }; NEXT();
+      HANDLER(VMADD_VX) {
+        v_int_ternary<false, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return b * d + a; });
+      }; NEXT();
+      HANDLER(VMAND_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return a & b; });
+      }; NEXT();
+      HANDLER(VMANDN_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return a & ~b; });
+      }; NEXT();
+      HANDLER(VMAX_VV) {
+        v_int<true, VSrc::V>(i, [](auto a, auto b) { return a > b ? a : b; });
+      }; NEXT();
+      HANDLER(VMAX_VX) {
+        v_int<true, VSrc::X>(i, [](auto a, auto b) { return a > b ? a : b; });
+      }; NEXT();
+      HANDLER(VMAXU_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a > b ? a : b; });
+      }; NEXT();
+      HANDLER(VMAXU_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a > b ? a : b; });
+      }; NEXT();
+      HANDLER(VMERGE_VIM) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          v_merge<T, VSrc::I>(i, v_scalar<T, VSrc::I>(i));
+        });
+      }; NEXT();
+      HANDLER(VMERGE_VVM) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          v_merge<T, VSrc::V>(i, v_scalar<T, VSrc::V>(i));
+        });
+      }; NEXT();
+      HANDLER(VMERGE_VXM) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          v_merge<T, VSrc::X>(i, v_scalar<T, VSrc::X>(i));
+        });
+      }; NEXT();
+      HANDLER(VMFEQ_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a == b; });
+      }; NEXT();
+      HANDLER(VMFEQ_VV) {
+        v_fp_compare<VSrc::V>(i, [](auto a, auto b) { return a == b; });
+      }; NEXT();
+      HANDLER(VMFGE_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a >= b; });
+      }; NEXT();
+      HANDLER(VMFGT_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a > b; });
+      }; NEXT();
+      HANDLER(VMFLE_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMFLE_VV) {
+        v_fp_compare<VSrc::V>(i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMFLT_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMFLT_VV) {
+        v_fp_compare<VSrc::V>(i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMFNE_VF) {
+        v_fp_compare<VSrc::F>(i, [](auto a, auto b) { return a != b; });
+      }; NEXT();
+      HANDLER(VMFNE_VV) {
+        v_fp_compare<VSrc::V>(i, [](auto a, auto b) { return a != b; });
+      }; NEXT();
+      HANDLER(VMIN_VV) {
+        v_int<true, VSrc::V>(i, [](auto a, auto b) { return a < b ? a : b; });
+      }; NEXT();
+      HANDLER(VMIN_VX) {
+        v_int<true, VSrc::X>(i, [](auto a, auto b) { return a < b ? a : b; });
+      }; NEXT();
+      HANDLER(VMINU_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a < b ? a : b; });
+      }; NEXT();
+      HANDLER(VMINU_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a < b ? a : b; });
+      }; NEXT();
+      HANDLER(VMNAND_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return ~(a & b); });
+      }; NEXT();
+      HANDLER(VMNOR_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return ~(a | b); });
+      }; NEXT();
+      HANDLER(VMOR_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return a | b; });
+      }; NEXT();
+      HANDLER(VMORN_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return a | ~b; });
+      }; NEXT();
+      HANDLER(VMSEQ_VI) {
+        v_int_compare<false, VSrc::I>(
+            i, [](auto a, auto b) { return a == b; });
+      }; NEXT();
+      HANDLER(VMSEQ_VV) {
+        v_int_compare<false, VSrc::V>(
+            i, [](auto a, auto b) { return a == b; });
+      }; NEXT();
+      HANDLER(VMSEQ_VX) {
+        v_int_compare<false, VSrc::X>(
+            i, [](auto a, auto b) { return a == b; });
+      }; NEXT();
+      HANDLER(VMSGT_VI) {
+        v_int_compare<true, VSrc::I>(
+            i, [](auto a, auto b) { return a > b; });
+      }; NEXT();
+      HANDLER(VMSGT_VX) {
+        v_int_compare<true, VSrc::X>(
+            i, [](auto a, auto b) { return a > b; });
+      }; NEXT();
+      HANDLER(VMSGTU_VI) {
+        v_int_compare<false, VSrc::I>(
+            i, [](auto a, auto b) { return a > b; });
+      }; NEXT();
+      HANDLER(VMSGTU_VX) {
+        v_int_compare<false, VSrc::X>(
+            i, [](auto a, auto b) { return a > b; });
+      }; NEXT();
+      HANDLER(VMSLE_VI) {
+        v_int_compare<true, VSrc::I>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLE_VV) {
+        v_int_compare<true, VSrc::V>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLE_VX) {
+        v_int_compare<true, VSrc::X>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLEU_VI) {
+        v_int_compare<false, VSrc::I>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLEU_VV) {
+        v_int_compare<false, VSrc::V>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLEU_VX) {
+        v_int_compare<false, VSrc::X>(
+            i, [](auto a, auto b) { return a <= b; });
+      }; NEXT();
+      HANDLER(VMSLT_VV) {
+        v_int_compare<true, VSrc::V>(
+            i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMSLT_VX) {
+        v_int_compare<true, VSrc::X>(
+            i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMSLTU_VV) {
+        v_int_compare<false, VSrc::V>(
+            i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMSLTU_VX) {
+        v_int_compare<false, VSrc::X>(
+            i, [](auto a, auto b) { return a < b; });
+      }; NEXT();
+      HANDLER(VMSNE_VI) {
+        v_int_compare<false, VSrc::I>(
+            i, [](auto a, auto b) { return a != b; });
+      }; NEXT();
+      HANDLER(VMSNE_VV) {
+        v_int_compare<false, VSrc::V>(
+            i, [](auto a, auto b) { return a != b; });
+      }; NEXT();
+      HANDLER(VMSNE_VX) {
+        v_int_compare<false, VSrc::X>(
+            i, [](auto a, auto b) { return a != b; });
+      }; NEXT();
+      HANDLER(VMUL_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VMUL_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VMULH_VV) {
+        v_int_each<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return mul_high(a, b); });
+      }; NEXT();
+      HANDLER(VMULH_VX) {
+        v_int_each<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return mul_high(a, b); });
+      }; NEXT();
+      HANDLER(VMULHSU_VV) {
+        v_int_each<true, VSrc::V>(i, [](auto, auto a, auto b) {
+          return mul_high(a, (std::make_unsigned_t<decltype(b)>)b);
+        });
+      }; NEXT();
+      HANDLER(VMULHSU_VX) {
+        v_int_each<true, VSrc::X>(i, [](auto, auto a, auto b) {
+          return mul_high(a, (std::make_unsigned_t<decltype(b)>)b);
+        });
+      }; NEXT();
+      HANDLER(VMULHU_VV) {
+        v_int_each<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return mul_high(a, b); });
+      }; NEXT();
+      HANDLER(VMULHU_VX) {
+        v_int_each<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return mul_high(a, b); });
+      }; NEXT();
+      HANDLER(VMV_S_X) {
+        with_sew<false>([&](auto t) {
+          if (m_vl > 0) {
+            store_as<decltype(t)>(vreg_single(i.rd), m_regs[i.rs1]);
+          }
+        });
+      }; NEXT();
+      HANDLER(VMV_V_I) {
+        v_int<false, VSrc::I>(i, [](auto, auto b) { return b; });
+      }; NEXT();
+      HANDLER(VMV_V_V) {
+        v_int<false, VSrc::V>(i, [](auto, auto b) { return b; });
+      }; NEXT();
+      HANDLER(VMV_V_X) {
+        v_int<false, VSrc::X>(i, [](auto, auto b) { return b; });
+      }; NEXT();
+      HANDLER(VMV_X_S) {
+        with_sew<true>([&](auto t) {
+          m_regs[i.rd] = load_as<decltype(t)>(vreg_single(i.rs2));
+        });
+      }; NEXT();
+      HANDLER(VMV1R_V) {
+        v_move_whole(i, 1);
+      }; NEXT();
+      HANDLER(VMV2R_V) {
+        v_move_whole(i, 2);
+      }; NEXT();
+      HANDLER(VMV4R_V) {
+        v_move_whole(i, 4);
+      }; NEXT();
+      HANDLER(VMV8R_V) {
+        v_move_whole(i, 8);
+      }; NEXT();
+      HANDLER(VMXNOR_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return ~(a ^ b); });
+      }; NEXT();
+      HANDLER(VMXOR_MM) {
+        v_mask_logical(i, [](u8 a, u8 b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(VNMSAC_VV) {
+        v_int_ternary<false, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return d - b * a; });
+      }; NEXT();
+      HANDLER(VNMSAC_VX) {
+        v_int_ternary<false, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return d - b * a; });
+      }; NEXT();
+      HANDLER(VNMSUB_VV) {
+        v_int_ternary<false, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return a - b * d; });
+      }; NEXT();
+      HANDLER(VNMSUB_VX) {
+        v_int_ternary<false, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return a - b * d; });
+      }; NEXT();
+      HANDLER(VNSRA_WI) {
+        with_sew<true, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::I>(i); });
+      }; NEXT();
+      HANDLER(VNSRA_WV) {
+        with_sew<true, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::V>(i); });
+      }; NEXT();
+      HANDLER(VNSRA_WX) {
+        with_sew<true, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::X>(i); });
+      }; NEXT();
+      HANDLER(VNSRL_WI) {
+        with_sew<false, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::I>(i); });
+      }; NEXT();
+      HANDLER(VNSRL_WV) {
+        with_sew<false, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::V>(i); });
+      }; NEXT();
+      HANDLER(VNSRL_WX) {
+        with_sew<false, 1, 4>(
+            [&](auto t) { v_narrow_shift<decltype(t), VSrc::X>(i); });
+      }; NEXT();
+      HANDLER(VOR_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) { return a | b; });
+      }; NEXT();
+      HANDLER(VOR_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a | b; });
+      }; NEXT();
+      HANDLER(VOR_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a | b; });
+      }; NEXT();
+      HANDLER(VREDAND_VS) {
+        v_int_reduce<false>(i, [](auto acc, auto v) { return acc & v; });
+      }; NEXT();
+      HANDLER(VREDMAX_VS) {
+        v_int_reduce<true>(
+            i, [](auto acc, auto v) { return std::max(acc, v); });
+      }; NEXT();
+      HANDLER(VREDMAXU_VS) {
+        v_int_reduce<false>(
+            i, [](auto acc, auto v) { return std::max(acc, v); });
+      }; NEXT();
+      HANDLER(VREDMIN_VS) {
+        v_int_reduce<true>(
+            i, [](auto acc, auto v) { return std::min(acc, v); });
+      }; NEXT();
+      HANDLER(VREDMINU_VS) {
+        v_int_reduce<false>(
+            i, [](auto acc, auto v) { return std::min(acc, v); });
+      }; NEXT();
+      HANDLER(VREDOR_VS) {
+        v_int_reduce<false>(i, [](auto acc, auto v) { return acc | v; });
+      }; NEXT();
+      HANDLER(VREDSUM_VS) {
+        v_int_reduce<false>(i, [](auto acc, auto v) { return acc + v; });
+      }; NEXT();
+      HANDLER(VREDXOR_VS) {
+        v_int_reduce<false>(i, [](auto acc, auto v) { return acc ^ v; });
+      }; NEXT();
+      HANDLER(VREM_VV) {
+        v_int_each<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return remainder_of(a, b); });
+      }; NEXT();
+      HANDLER(VREM_VX) {
+        v_int_each<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return remainder_of(a, b); });
+      }; NEXT();
+      HANDLER(VREMU_VV) {
+        v_int_each<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return remainder_of(a, b); });
+      }; NEXT();
+      HANDLER(VREMU_VX) {
+        v_int_each<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return remainder_of(a, b); });
+      }; NEXT();
+      HANDLER(VRGATHER_VI) {
+        with_sew<false>([&](auto t) { v_gather<decltype(t), VSrc::I>(i); });
+      }; NEXT();
+      HANDLER(VRGATHER_VV) {
+        with_sew<false>([&](auto t) { v_gather<decltype(t), VSrc::V>(i); });
+      }; NEXT();
+      HANDLER(VRGATHER_VX) {
+        with_sew<false>([&](auto t) { v_gather<decltype(t), VSrc::X>(i); });
+      }; NEXT();
+      HANDLER(VRSUB_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) { return b - a; });
+      }; NEXT();
+      HANDLER(VRSUB_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return b - a; });
+      }; NEXT();
+      HANDLER(VS1R_V) {
+        v_store_whole(i, 1);
+      }; NEXT();
+      HANDLER(VS2R_V) {
+        v_store_whole(i, 2);
+      }; NEXT();
+      HANDLER(VS4R_V) {
+        v_store_whole(i, 4);
+      }; NEXT();
+      HANDLER(VS8R_V) {
+        v_store_whole(i, 8);
+      }; NEXT();
+      HANDLER(VSE16_V) {
+        v_store<u16>(i);
+      }; NEXT();
+      HANDLER(VSE32_V) {
+        v_store<u32>(i);
+      }; NEXT();
+      HANDLER(VSE64_V) {
+        v_store<u64>(i);
+      }; NEXT();
+      HANDLER(VSE8_V) {
+        v_store<u8>(i);
+      }; NEXT();
+      HANDLER(VSETIVLI) {
+        set_vl(i, i.rs1, i.imm);
+      }; NEXT();
+      HANDLER(VSETVL) {
+        set_vl(i, avl(i), m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(VSETVLI) {
+        set_vl(i, avl(i), i.imm);
+      }; NEXT();
+      HANDLER(VSEXT_VF2) {
+        with_sew<true, 2>(
+            [&](auto t) { v_extend<decltype(t), 2>(i); });
+      }; NEXT();
+      HANDLER(VSEXT_VF4) {
+        with_sew<true, 4>(
+            [&](auto t) { v_extend<decltype(t), 4>(i); });
+      }; NEXT();
+      HANDLER(VSEXT_VF8) {
+        with_sew<true, 8>(
+            [&](auto t) { v_extend<decltype(t), 8>(i); });
+      }; NEXT();
+      HANDLER(VSLIDE1DOWN_VX) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          v_slide_down<T>(i, 1);
+          if (m_vl > 0 && active(i, m_vl - 1)) {
+            store_as<T>(vreg(i.rd, sizeof(T)) + (m_vl - 1) * sizeof(T),
+                        m_regs[i.rs1]);
+          }
+        });
+      }; NEXT();
+      HANDLER(VSLIDE1UP_VX) {
+        with_sew<false>([&](auto t) {
+          using T = decltype(t);
+          v_slide_up<T>(i, 1);
+          if (m_vl > 0 && active(i, 0)) {
+            store_as<T>(vreg(i.rd, sizeof(T)), m_regs[i.rs1]);
+          }
+        });
+      }; NEXT();
+      HANDLER(VSLIDEDOWN_VI) {
+        with_sew<false>([&](auto t) { v_slide_down<decltype(t)>(i, i.imm); });
+      }; NEXT();
+      HANDLER(VSLIDEDOWN_VX) {
+        with_sew<false>(
+            [&](auto t) { v_slide_down<decltype(t)>(i, m_regs[i.rs1]); });
+      }; NEXT();
+      HANDLER(VSLIDEUP_VI) {
+        with_sew<false>([&](auto t) { v_slide_up<decltype(t)>(i, i.imm); });
+      }; NEXT();
+      HANDLER(VSLIDEUP_VX) {
+        with_sew<false>(
+            [&](auto t) { v_slide_up<decltype(t)>(i, m_regs[i.rs1]); });
+      }; NEXT();
+      HANDLER(VSLL_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) {
+          return a << (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSLL_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) {
+          return a << (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSLL_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) {
+          return a << (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSM_V) {
+        v_store_mask(i);
+      }; NEXT();
+      HANDLER(VSOXEI16_V) {
+        v_store_indexed<u16>(i);
+      }; NEXT();
+      HANDLER(VSOXEI32_V) {
+        v_store_indexed<u32>(i);
+      }; NEXT();
+      HANDLER(VSOXEI64_V) {
+        v_store_indexed<u64>(i);
+      }; NEXT();
+      HANDLER(VSOXEI8_V) {
+        v_store_indexed<u8>(i);
+      }; NEXT();
+      HANDLER(VSRA_VI) {
+        v_int<true, VSrc::I>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSRA_VV) {
+        v_int<true, VSrc::V>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSRA_VX) {
+        v_int<true, VSrc::X>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSRL_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSRL_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSRL_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) {
+          return a >> (b & (8 * sizeof(a[0]) - 1));
+        });
+      }; NEXT();
+      HANDLER(VSSE16_V) {
+        v_store_strided<u16>(i);
+      }; NEXT();
+      HANDLER(VSSE32_V) {
+        v_store_strided<u32>(i);
+      }; NEXT();
+      HANDLER(VSSE64_V) {
+        v_store_strided<u64>(i);
+      }; NEXT();
+      HANDLER(VSSE8_V) {
+        v_store_strided<u8>(i);
+      }; NEXT();
+      HANDLER(VSUB_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VSUB_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VSUXEI16_V) {
+        v_store_indexed<u16>(i);
+      }; NEXT();
+      HANDLER(VSUXEI32_V) {
+        v_store_indexed<u32>(i);
+      }; NEXT();
+      HANDLER(VSUXEI64_V) {
+        v_store_indexed<u64>(i);
+      }; NEXT();
+      HANDLER(VSUXEI8_V) {
+        v_store_indexed<u8>(i);
+      }; NEXT();
+      HANDLER(VWADD_VV) {
+        v_int_widen<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VWADD_VX) {
+        v_int_widen<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VWADDU_VV) {
+        v_int_widen<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VWADDU_VX) {
+        v_int_widen<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a + b; });
+      }; NEXT();
+      HANDLER(VWMACC_VV) {
+        v_int_widen<true, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VWMACC_VX) {
+        v_int_widen<true, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VWMACCU_VV) {
+        v_int_widen<false, VSrc::V>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VWMACCU_VX) {
+        v_int_widen<false, VSrc::X>(
+            i, [](auto d, auto a, auto b) { return d + b * a; });
+      }; NEXT();
+      HANDLER(VWMUL_VV) {
+        v_int_widen<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VWMUL_VX) {
+        v_int_widen<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VWMULU_VV) {
+        v_int_widen<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VWMULU_VX) {
+        v_int_widen<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a * b; });
+      }; NEXT();
+      HANDLER(VWSUB_VV) {
+        v_int_widen<true, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VWSUB_VX) {
+        v_int_widen<true, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VWSUBU_VV) {
+        v_int_widen<false, VSrc::V>(
+            i, [](auto, auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VWSUBU_VX) {
+        v_int_widen<false, VSrc::X>(
+            i, [](auto, auto a, auto b) { return a - b; });
+      }; NEXT();
+      HANDLER(VXOR_VI) {
+        v_int<false, VSrc::I>(i, [](auto a, auto b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(VXOR_VV) {
+        v_int<false, VSrc::V>(i, [](auto a, auto b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(VXOR_VX) {
+        v_int<false, VSrc::X>(i, [](auto a, auto b) { return a ^ b; });
+      }; NEXT();
+      HANDLER(VZEXT_VF2) {
+        with_sew<false, 2>(
+            [&](auto t) { v_extend<decltype(t), 2>(i); });
+      }; NEXT();
+      HANDLER(VZEXT_VF4) {
+        with_sew<false, 4>(
+            [&](auto t) { v_extend<decltype(t), 4>(i); });
+      }; NEXT();
+      HANDLER(VZEXT_VF8) {
+        with_sew<false, 8>(
+            [&](auto t) { v_extend<decltype(t), 8>(i); });
+      }; NEXT();
+      HANDLER(XNOR) {
+        m_regs[i.rd] = ~(m_regs[i.rs1] ^ m_regs[i.rs2]);
+      }; NEXT();
+      HANDLER(XOR) {
+        m_regs[i.rd] = m_regs[i.rs1] ^ m_regs[i.rs2];
+      }; NEXT();
+      HANDLER(XORI) {
+        m_regs[i.rd] = m_regs[i.rs1] ^ i.imm;
+      }; NEXT();
+      HANDLER(ZEXT_H) {
+        m_regs[i.rd] = (u16)m_regs[i.rs1];
+      }; NEXT();
+      default:
+      handler_default: {
+        fatal("{} not implemented", OP_TABLE[i.op].mnemonic);
+      }; NEXT();
+      }
+
+      m_pc += i.length;
+    }
+    return;
+
+    // the last instruction jumped: follow the taken link, which for JALR acts
+    // as a cache of the last target
+  block_taken:
+    if (block->taken == nullptr || block->taken->start != m_pc) {
+      // the first time pc starts a block is the only time to check for
+      // m_stop_pc
+      if (m_pc == m_stop_pc) [[unlikely]] {
+        return;
+      }
+      block->taken = get_block(m_pc, op_handlers, &&block_end);
+      block = block->taken;
+      // only the block that just ran could have been invalidated
+      m_dead_blocks.clear();
+      goto block_enter;
+    }
+    block = block->taken;
+    goto block_enter;
+
+    // execution ran past the last instruction
+  block_end:
+    if (block->fallthrough == nullptr) {
+      if (m_pc == m_stop_pc) [[unlikely]] {
+        return;
+      }
+      block->fallthrough = get_block(m_pc, op_handlers, &&block_end);
+      block = block->fallthrough;
+      m_dead_blocks.clear();
+      goto block_enter;
+    }
+    block = block->fallthrough;
+
+  block_enter:
+    // blocks only end early by exiting or faulting
+    m_instret += block->ins.size() - 1;
+    m_cycles += block->cycles;
+    block->runs++;
+    if (sample && sample_due.load(std::memory_order_relaxed)) [[unlikely]] {
+      take_sample();
+    }
+#ifdef __x86_64__
+    if constexpr (E == Engine::JIT) {
+      if (block->jit == nullptr && ++block->exec_count == JIT_THRESHOLD) {
+        compile_block(block);
+      }
+      if (block->jit != nullptr) {
+        m_pc = block->jit(m_regs.data(), m_memory);
+        if (!(m_pc & 1)) {
+          if (m_pc == block->end) {
+            goto block_end;
+          }
+          goto block_taken;
+        }
+
+        // a load or store missed the TLB or the translation stopped short:
+        // interpret the rest of the block, starting with that instruction
+        m_pc &= ~1ULL;
+        u64 n = 0;
+        for (u64 pc = block->start; pc != m_pc; pc += block->ins[n++].length) {
+        }
+        ins = block->ins.data() + n;
+        handlers = block->handlers.data() + n;
+        i = *ins;
+        goto **handlers;
+      }
+    }
+#endif
+    ins = block->ins.data();
+    handlers = block->handlers.data();
+    i = *ins;
+    goto **handlers;
+  }
+
+#pragma GCC diagnostic pop
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+
+#ifdef __x86_64__
+  void compile_block(Block *block) {
+    if (m_jit->full()) {
+      // dropping the whole cache is simpler than tracking which blocks live
+      // where, and hot blocks get translated again soon enough
+      for (auto &[pc, b] : m_blocks) {
+        b->jit = nullptr;
+        b->exec_count = 0;
+      }
+      m_jit->reset();
+      m_jit_cache_saved = 0;
+    }
+    block->jit = cached_jit(block->start);
+    if (block->jit == nullptr) {
+      block->jit = m_jit->compile(*block);
+    }
+  }
+
+  JitFn cached_jit(u64 pc) const {
+    auto it = m_cached_jit.find(pc);
+    if (it == m_cached_jit.end()) {
+      return nullptr;
+    }
+    return (JitFn)(m_jit_cache_code + it->second.offset);
+  }
+
+  std::string jit_cache_path() const {
+    return std::format("{}/{:016x}.jit", m_jit_cache_dir, m_jit_cache_hash);
+  }
+
+  static u64 jit_cache_hash(const JitCacheEntry *entries, u64 count,
+                            const u8 *code, u64 code_size) {
+    return hash_bytes((const u8 *)entries, count * sizeof(JitCacheEntry),
+                      hash_bytes(code, code_size));
+  }
+
+  bool in_jit_cache_pages(u64 addr) const {
+    return std::ranges::binary_search(m_jit_cache_pages,
+                                      addr / GUEST_PAGE_SIZE);
+  }
+
+  // Maps the translations an earlier run of the same code saved, unless the
+  // file is for another build, host or code. Keyed by the code as it's
+  // loaded, before the guest maps anything else.
+  void load_jit_cache() {
+    m_jit_cache_pages = executable_pages();
+    m_jit_cache_hash = code_hash();
+    u64 size;
+    void *file = map_cache_file(jit_cache_path(), PROT_READ | PROT_EXEC,
+                                sizeof(JitCacheHeader), size);
+    if (file == nullptr) {
+      return;
+    }
+    JitCacheHeader header;
+    std::memcpy(&header, file, sizeof(header));
+    if (std::memcmp(header.magic, JIT_CACHE_MAGIC, sizeof(header.magic)) ||
+        header.build_id != emulator_build_id() ||
+        header.code_hash != m_jit_cache_hash ||
+        header.host_features != m_jit->host_features() ||
+        header.count > size / sizeof(JitCacheEntry) ||
+        header.code_offset <
+            sizeof(header) + header.count * sizeof(JitCacheEntry) ||
+        header.code_offset > size ||
+        header.code_size != size - header.code_offset) {
+      munmap(file, size);
+      return;
+    }
+    auto entries = (const JitCacheEntry *)((const u8 *)file + sizeof(header));
+    if (jit_cache_hash(entries, header.count,
+                       (const u8 *)file + header.code_offset,
+                       header.code_size) != header.content_hash) {
+      munmap(file, size);
+      return;
+    }
+    for (u64 n = 0; n < header.count; n++) {
+      const JitCacheEntry &entry = entries[n];
+      if (entry.offset > header.code_size ||
+          entry.size > header.code_size - entry.offset ||
+          !in_jit_cache_pages(entry.pc)) {
+        m_cached_jit.clear();
+        munmap(file, size);
+        return;
+      }
+      m_cached_jit.emplace(entry.pc, entry);
+    }
+    m_jit_cache = (u8 *)file;
+    m_jit_cache_size = size;
+    m_jit_cache_code = m_jit_cache + header.code_offset;
+    // the translations are of the code as it was loaded
+    for (u64 page : m_jit_cache_pages) {
+      mark_code(page);
+    }
+  }
+
+  // Saves the loaded translations together with the ones made since, if
+  // there are new ones. Blocks outside the pages the file is keyed by are
+  // left out, since whatever the guest maps there can differ between runs.
+  void save_jit_cache() {
+    if (m_jit->translations().size() == m_jit_cache_saved) {
+      return;
+    }
+    m_jit_cache_saved = m_jit->translations().size();
+
+    std::map<u64, std::pair<const u8 *, u64>> code;
+    for (const X64Jit::Translation &t : m_jit->translations()) {
+      // blocks invalidate_code() dropped are gone, and their pages too
+      auto it = m_blocks.find(t.pc);
+      if (it == m_blocks.end()) {
+        continue;
+      }
+      const Block &block = *it->second;
+      if (in_jit_cache_pages(block.start) &&
+          in_jit_cache_pages(block.end - 1)) {
+        code.emplace(t.pc, std::pair{m_jit->code() + t.offset, t.size});
+      }
+    }
+    for (const auto &[pc, entry] : m_cached_jit) {
+      code.emplace(pc, std::pair{m_jit_cache_code + entry.offset, entry.size});
+    }
+
+    std::vector<JitCacheEntry> entries;
+    std::vector<u8> blob;
+    for (const auto &[pc, translation] : code) {
+      auto [data, size] = translation;
+      blob.resize((blob.size() + 15) & ~15ULL);
+      entries.push_back({.pc = pc, .offset = blob.size(), .size = size});
+      blob.insert(blob.end(), data, data + size);
+    }
+    u64 entries_end = sizeof(JitCacheHeader) +
+                      entries.size() * sizeof(JitCacheEntry);
+    JitCacheHeader header{.magic = {},
+                          .build_id = emulator_build_id(),
+                          .code_hash = m_jit_cache_hash,
+                          .host_features = m_jit->host_features(),
+                          .count = entries.size(),
+                          .code_offset = (entries_end + 15) & ~15ULL,
+                          .code_size = blob.size(),
+                          .content_hash =
+                              jit_cache_hash(entries.data(), entries.size(),
+                                             blob.data(), blob.size())};
+    std::memcpy(header.magic, JIT_CACHE_MAGIC, sizeof(header.magic));
+    std::array<u8, 16> padding{};
+    write_cache_file(
+        jit_cache_path(),
+        {{&header, sizeof(header)},
+         {entries.data(), entries.size() * sizeof(JitCacheEntry)},
+         {padding.data(), header.code_offset - entries_end},
+         {blob.data(), blob.size()}});
+  }
+#endif
+
+  // Reserves the address space. The object is complete from here on, so the
+  // destructor releases it if loading the ELF fails.
+  explicit RISCV64(u64 memory_size) : m_memory_size(memory_size) {
+    m_host_page_size = sysconf(_SC_PAGESIZE);
+    if (m_memory_size % m_host_page_size != 0 ||
+        m_memory_size % GUEST_PAGE_SIZE != 0 ||
+        m_memory_size < 2 * STACK_SIZE) {
+      guest_fault("Invalid guest memory size: {}", m_memory_size);
+    }
+
+    m_memory = (u8 *)mmap(nullptr, m_memory_size, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m_memory == MAP_FAILED) {
+      guest_fault("Failed to mmap memory");
+    }
+    m_page_perms.resize(m_memory_size / GUEST_PAGE_SIZE);
+    m_page_has_code.resize(m_page_perms.size());
+    m_page_file_shared.resize(m_page_perms.size());
+    flush_tlb();
+    set_cycle_costs(DEFAULT_CYCLE_COSTS);
+  }
+
+  // Loads the executable's symbols and segments and returns where the
+  // highest segment ends.
+  u64 load_elf(Elf *elf, int fd, const u8 *file, u64 file_size,
+               const char *path) {
+    GElf_Ehdr ehdr;
+    if (elf == nullptr || gelf_getehdr(elf, &ehdr) != &ehdr) {
+      guest_fault("Not an ELF file: {}", path);
+    }
+
+    if (ehdr.e_machine != EM_RISCV) {
+      guest_fault("ehdr.e_machine != EM_RISCV");
+    }
+
+    m_entrypoint = ehdr.e_entry;
+    m_code_sections = get_code_sections(elf);
+    m_symbols = get_symbols(elf);
+
+    u64 max_addr = 0;
+    u64 mapped_end = 0;
+    for (u64 i = 0; i < ehdr.e_phnum; i++) {
+      GElf_Phdr phdr;
+      if (gelf_getphdr(elf, i, &phdr) != &phdr) {
+        guest_fault("gelf_getphdr failed: {}", elf_errmsg(-1));
+      }
+      if (phdr.p_type == PT_LOAD) {
+        load_segment(fd, file, file_size, phdr, mapped_end);
+        max_addr = std::max(max_addr, phdr.p_vaddr + phdr.p_memsz);
+      }
+    }
+    return max_addr;
+  }
+
+  // Maps the file-backed part of a PT_LOAD segment straight to its guest
+  // address. The mapping is private, so guest writes stay local, and pages
+  // the guest never touches are never read. Only the part of the last page
+  // past p_filesz, where .bss starts, has to be cleared. PT_LOAD segments
+  // come sorted by address; mapped_end is where the previous ones' pages,
+  // .bss included, end, and nothing below it may be mapped over again.
+  void load_segment(int fd, const u8 *file, u64 file_size,
+                    const GElf_Phdr &phdr, u64 &mapped_end) {
+    if (phdr.p_vaddr > m_memory_size ||
+        phdr.p_memsz > m_memory_size - phdr.p_vaddr) {
+      guest_fault("Segment at 0x{:x} doesn't fit in guest memory",
+                  phdr.p_vaddr);
+    }
+    // a truncated file would fault the copy or the mapping below
+    if (phdr.p_offset > file_size ||
+        phdr.p_filesz > file_size - phdr.p_offset) {
+      guest_fault("Segment at 0x{:x} is past the end of the file",
+                  phdr.p_vaddr);
+    }
+    if (phdr.p_filesz > phdr.p_memsz) {
+      guest_fault("Segment at 0x{:x} has more file than memory size",
+                  phdr.p_vaddr);
+    }
+    u8 perms = 0;
+    if (phdr.p_flags & PF_R) {
+      perms |= PERM_R;
+    }
+    if (phdr.p_flags & PF_W) {
+      perms |= PERM_W;
+    }
+    if (phdr.p_flags & PF_X) {
+      perms |= PERM_X;
+    }
+    commit(phdr.p_vaddr, phdr.p_memsz, perms);
+
+    u64 page_size = m_host_page_size;
+    u64 vaddr = phdr.p_vaddr;
+    u64 offset = phdr.p_offset;
+    u64 filesz = phdr.p_filesz;
+    u64 previous_end = mapped_end;
+    mapped_end = std::max(mapped_end, (phdr.p_vaddr + phdr.p_memsz +
+                                       page_size - 1) & ~(page_size - 1));
+
+    // can't be mapped at all, fall back to copying
+    if (vaddr % page_size != offset % page_size) {
+      std::memcpy(m_memory + vaddr, file + offset, filesz);
+      return;
+    }
+
+    // copy whatever shares a page with the previous segment
+    if (vaddr < previous_end) {
+      u64 n = std::min(filesz, previous_end - vaddr);
+      std::memcpy(m_memory + vaddr, file + offset, n);
+      vaddr += n;
+      offset += n;
+      filesz -= n;
+    }
+    if (filesz == 0) {
+      return;
+    }
+
+    u64 map_start = vaddr & ~(page_size - 1);
+    u64 map_end = (vaddr + filesz + page_size - 1) & ~(page_size - 1);
+    void *mapped = mmap(m_memory + map_start, map_end - map_start,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                        offset - (vaddr - map_start));
+    if (mapped == MAP_FAILED) {
+      guest_fault("Failed to map segment at 0x{:x}", phdr.p_vaddr);
+    }
+    std::memset(m_memory + vaddr + filesz, 0, map_end - (vaddr + filesz));
+  }
+
+  [[noreturn]] void bad_jump(u64 pc) {
+    fatal("Jump outside of the executable segments: pc=0x{:x}", pc);
+  }
+
+  bool is_executable(u64 pc) const { return page_perms(pc) & PERM_X; }
+
+  // Instruction bits at pc. The upper half is only read for a 32-bit
+  // encoding, so a compressed instruction can end a mapped region.
+  u32 read_ins(u64 pc) const {
+    u16 lo;
+    std::memcpy(&lo, m_memory + pc, sizeof(lo));
+    if ((lo & 0b11) != 0b11) {
+      return lo;
+    }
+    u16 hi;
+    std::memcpy(&hi, m_memory + pc + 2, sizeof(hi));
+    return lo | (u32)hi << 16;
+  }
+
+  std::vector<u64> executable_pages() const {
+    std::vector<u64> pages;
+    for (u64 page = 0; page < m_page_perms.size(); page++) {
+      if (m_page_perms[page] & PERM_X) {
+        pages.push_back(page);
+      }
+    }
+    return pages;
+  }
+
+  // Returns nullptr if there is no cache file at path or it's for another
+  // build or other code, so that it gets rewritten.
+  std::shared_ptr<const SharedCode> load_decode_cache(const std::string &path,
+                                                      u64 hash) const {
+    u64 size;
+    void *file = map_cache_file(path, PROT_READ, sizeof(DecodeCacheHeader),
+                                size);
+    if (file == nullptr) {
+      return nullptr;
+    }
+    auto code = std::make_shared<SharedCode>();
+    code->mapping = file;
+    code->mapping_size = size;
+
+    DecodeCacheHeader header;
+    std::memcpy(&header, file, sizeof(header));
+    u64 count = header.page_count;
+    if (std::memcmp(header.magic, DECODE_CACHE_MAGIC, sizeof(header.magic)) ||
+        header.build_id != emulator_build_id() || header.code_hash != hash ||
+        count > m_page_perms.size() ||
+        size != sizeof(header) + count * (sizeof(u64) + sizeof(CodePage))) {
+      return nullptr;
+    }
+    auto page_numbers = (const u64 *)((const u8 *)file + sizeof(header));
+    auto pages = (const CodePage *)(page_numbers + count);
+    for (u64 n = 0; n < count; n++) {
+      u64 page = page_numbers[n];
+      if (page >= m_page_perms.size() || !(m_page_perms[page] & PERM_X)) {
+        return nullptr;
+      }
+      code->pages.emplace(page, &pages[n]);
+    }
+    return code;
+  }
+
+  // code is from decode_code(), which has the pages in executable_pages()
+  // order.
+  void save_decode_cache(const std::string &path, u64 hash,
+                         const SharedCode &code) const {
+    DecodeCacheHeader header{.magic = {},
+                             .build_id = emulator_build_id(),
+                             .code_hash = hash,
+                             .page_count = code.owned.size()};
+    std::memcpy(header.magic, DECODE_CACHE_MAGIC, sizeof(header.magic));
+    std::vector<u64> page_numbers = executable_pages();
+    write_cache_file(
+        path, {{&header, sizeof(header)},
+               {page_numbers.data(), page_numbers.size() * sizeof(u64)},
+               {code.owned.data(), code.owned.size() * sizeof(CodePage)}});
+  }
+
+  // Maps the cache file at path with prot and sets size to its size, or
+  // returns nullptr if there is none or it's smaller than min_size. The
+  // contents get run, so files anyone but this user could have written are
+  // ignored.
+  static void *map_cache_file(const std::string &path, int prot, u64 min_size,
+                              u64 &size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    void *file = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+        (u64)st.st_size >= min_size) {
+      size = st.st_size;
+      file = mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return file != MAP_FAILED ? file : nullptr;
+  }
+
+  // Writes the parts to a temporary file first and then renames it to path,
+  // so that runs reading the cache concurrently never see a partial file.
+  // mkstemp() leaves it readable and writable only by this user.
+  static void write_cache_file(
+      const std::string &path,
+      std::initializer_list<std::pair<const void *, u64>> parts) {
+    std::string temp_path = path + ".XXXXXX";
+    int fd = mkstemp(temp_path.data());
+    if (fd < 0) {
+      std::println(stderr, "Failed to create: {}", temp_path);
+      return;
+    }
+    bool ok = true;
+    for (auto [data, len] : parts) {
+      for (u64 done = 0; ok && done < len;) {
+        ssize_t n = write(fd, (const u8 *)data + done, len - done);
+        ok = n > 0;
+        done += ok ? n : 0;
+      }
+    }
+    close(fd);
+    if (!ok || rename(temp_path.c_str(), path.c_str()) < 0) {
+      std::println(stderr, "Failed to write: {}", path);
+      unlink(temp_path.c_str());
+    }
+  }
+
+  // Shared pages are never written to, fetch() checks CodePage::shared
+  // before it decodes anything. They may be in a read-only mapping.
+  CodePage *find_shared_code(u64 page_number) const {
+    if (m_shared_code == nullptr) {
+      return nullptr;
+    }
+    auto it = m_shared_code->pages.find(page_number);
+    if (it == m_shared_code->pages.end()) {
+      return nullptr;
+    }
+    return const_cast<CodePage *>(it->second);
+  }
+
+  // Returns the decoded instruction at pc, decoding it on first use.
+  const Ins &fetch(u64 pc) {
+    u64 page_number = pc / CODE_PAGE_SIZE;
+    if (page_number != m_last_code_page_number) {
+      auto it = m_code_pages.find(page_number);
+      if (it != m_code_pages.end()) {
+        m_last_code_page = it->second.get();
+      } else if (auto shared = find_shared_code(page_number)) {
+        m_last_code_page = shared;
+      } else {
+        if (!is_executable(pc)) {
+          bad_jump(pc);
+        }
+        it = m_code_pages.emplace(page_number, std::make_unique<CodePage>())
+                 .first;
+        m_last_code_page = it->second.get();
+      }
+      m_last_code_page_number = page_number;
+      mark_code(page_number);
+    }
+
+    Ins &ins = m_last_code_page->ins[(pc % CODE_PAGE_SIZE) / 2];
+    if (ins.length == 0) {
+      // a page can be shared with a non-executable segment, and a 32-bit
+      // instruction can straddle two pages. Shared pages have everything
+      // else decoded already.
+      if (m_last_code_page->shared || !is_executable(pc) ||
+          ((m_memory[pc] & 0b11) == 0b11 && !is_executable(pc + 2))) {
+        bad_jump(pc);
+      }
+      ins = decode_raw(read_ins(pc));
+      if ((pc + ins.length - 1) / CODE_PAGE_SIZE != page_number) {
+        mark_code(page_number + 1);
+      }
+    }
+    return ins;
+  }
+
+  // Notes that code was decoded from page, so that stores to it take the
+  // slow path and invalidate the code.
+  void mark_code(u64 page) {
+    m_page_has_code[page] = true;
+    if (m_write_tlb[page % TLB_SIZE] == page << GUEST_PAGE_SHIFT) {
+      m_write_tlb[page % TLB_SIZE] = TLB_EMPTY;
+    }
+  }
+
+  static bool ends_block(Op op) {
+    switch (op) {
+    case Op::INVALID:
+    case Op::BEQ:
+    case Op::BGE:
+    case Op::BGEU:
+    case Op::BLT:
+    case Op::BLTU:
+    case Op::BNE:
+    case Op::EBREAK:
+    case Op::ECALL:
+    case Op::FENCE_I:
+    case Op::JAL:
+    case Op::JALR:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Records the guest's call stack: the function at pc, then those of the
+  // return addresses along the frame pointer chain. A frame saves ra at
+  // fp - 8 and the caller's fp at fp - 16, and the caller's frame is above.
+  // A leaf function that keeps no frame hides its caller, as with any frame
+  // pointer unwinder.
+  void take_sample() {
+    sample_due.store(false, std::memory_order_relaxed);
+    std::vector<u64> stack = {function_key(m_pc)};
+    u64 fp = m_regs[8];
+    u64 ra = 0;
+    u64 caller_fp = 0;
+    bool has_frame = read_frame(fp, ra, caller_fp);
+
+    // Samples are taken at block starts, so a function's frame is only
+    // missing at its first instruction, where ra still has its caller. A
+    // symbol can also be a label inside a function, where ra is the one the
+    // frame holds or a stale one back into the function. The entry of a
+    // call a function makes to itself looks like that too and loses a level.
+    u64 ret = m_regs[1];
+    if (stack[0] == m_pc && symbol_index(m_pc) < m_symbols.size() &&
+        ret != 0 && !(has_frame && ret == ra) &&
+        function_key(ret - 1) != stack[0]) {
+      stack.push_back(function_key(ret - 1));
+    }
+
+    while (stack.size() < MAX_SAMPLE_DEPTH && has_frame && ra != 0) {
+      // ra is just past the call, which may be the last instruction of the
+      // caller
+      stack.push_back(function_key(ra - 1));
+      if (caller_fp <= fp) {
+        break;
+      }
+      fp = caller_fp;
+      has_frame = read_frame(fp, ra, caller_fp);
+    }
+    m_samples[stack]++;
+  }
+
+  // the return address and caller's fp the frame at fp saved, false if
+  // there can't be one there
+  bool read_frame(u64 fp, u64 &ra, u64 &caller_fp) const {
+    if (fp % 8 != 0 || fp < 16 || !(page_perms(fp - 16) & PERM_R) ||
+        !(page_perms(fp - 1) & PERM_R)) {
+      return false;
+    }
+    std::memcpy(&ra, m_memory + fp - 8, sizeof(ra));
+    std::memcpy(&caller_fp, m_memory + fp - 16, sizeof(caller_fp));
+    return true;
+  }
+
+  // the address of the symbol pc is under, pc itself if there is none
+  u64 function_key(u64 pc) const {
+    u64 index = symbol_index(pc);
+    return index < m_symbols.size() ? m_symbols[index].addr : pc;
+  }
+
+  // Returns the cached block starting at pc, decoding it on first use.
+  // op_handlers and block_end come from the threaded engine, which is the
+  // only place their addresses are known.
+  Block *get_block(u64 pc, const void *const *op_handlers,
+                   const void *block_end) {
+    auto it = m_blocks.find(pc);
+    if (it != m_blocks.end()) {
+      return it->second.get();
+    }
+
+    auto block = std::make_unique<Block>();
+    block->start = pc;
+    for (u64 n = 0; n < MAX_BLOCK_INS; n++) {
+      // leave running off the end of a segment to the next get_block(), so
+      // the error happens when execution actually gets there
+      if (n > 0 && !is_executable(pc)) {
+        break;
+      }
+      Ins ins = fetch(pc);
+      block->ins.push_back(ins);
+      block->handlers.push_back(op_handlers[ins.op]);
+      block->cycles += m_op_cycles[ins.op];
+      pc += ins.length;
+      if (ends_block(ins.op)) {
+        break;
+      }
+    }
+    block->end = pc;
+    block->ins.push_back(Ins{});
+    block->handlers.push_back(block_end);
+
+#ifdef __x86_64__
+    // translations from an earlier run get used right away
+    if (m_jit != nullptr) {
+      block->jit = cached_jit(block->start);
+    }
+#endif
+
+    Block *result = block.get();
+    m_blocks.emplace(result->start, std::move(block));
+    return result;
+  }
+
+  // Forgets what was decoded and translated from [addr, addr + len), where
+  // the guest is mapping other code or changing it. The block running may
+  // be one of those dropped, so they are only freed on the next link miss.
+  void invalidate_code(u64 addr, u64 len) {
+    if (len == 0) {
+      return;
+    }
+    u64 first = addr / CODE_PAGE_SIZE;
+    u64 last = (addr + len - 1) / CODE_PAGE_SIZE;
+    std::fill(m_page_has_code.begin() + first,
+              m_page_has_code.begin() + last + 1, false);
+    auto in_range = [&](u64 page) { return page >= first && page <= last; };
+    bool had_code = std::erase_if(m_code_pages, [&](const auto &entry) {
+      return in_range(entry.first);
+    }) != 0;
+    if (m_shared_code != nullptr) {
+      // an empty private page hides the shared one from fetch()
+      for (const auto &[page, code] : m_shared_code->pages) {
+        if (in_range(page) ||
+            (page == first - 1 && code->ins.back().length == 4)) {
+          m_code_pages.emplace(page, std::make_unique<CodePage>());
+          had_code = true;
+        }
+      }
+    }
+    // the last instruction of the page before can extend into the range
+    if (auto it = m_code_pages.find(first - 1);
+        it != m_code_pages.end() && it->second->ins.back().length == 4) {
+      it->second->ins.back() = {};
+      had_code = true;
+    }
+    if (!had_code) {
+      return;
+    }
+    m_last_code_page_number = ~0ULL;
+    m_last_code_page = nullptr;
+
+    u64 start = first * CODE_PAGE_SIZE;
+    u64 end = (last + 1) * CODE_PAGE_SIZE;
+    auto overlaps = [&](const Block *block) {
+      return block->start < end && block->end > start;
+    };
+    for (auto it = m_blocks.begin(); it != m_blocks.end();) {
+      if (overlaps(it->second.get())) {
+        it->second->taken = nullptr;
+        it->second->fallthrough = nullptr;
+        m_dead_blocks.push_back(std::move(it->second));
+        it = m_blocks.erase(it);
+      } else {
+        it++;
+      }
+    }
+    for (auto &[pc, block] : m_blocks) {
+      if (block->taken != nullptr && overlaps(block->taken)) {
+        block->taken = nullptr;
+      }
+      if (block->fallthrough != nullptr && overlaps(block->fallthrough)) {
+        block->fallthrough = nullptr;
+      }
+    }
+
+#ifdef __x86_64__
+    // a cached translation can be of a block that starts up to a page
+    // earlier, and the file mustn't get translations of the new code
+    u64 cached_start = start < CODE_PAGE_SIZE ? 0 : start - CODE_PAGE_SIZE;
+    std::erase_if(m_cached_jit, [&](const auto &entry) {
+      return entry.first >= cached_start && entry.first < end;
+    });
+    std::erase_if(m_jit_cache_pages, in_range);
+#endif
+  }
+
+  static std::vector<Section> get_code_sections(Elf *elf) {
+    u64 str_table_index;
+    if (elf_getshdrstrndx(elf, &str_table_index) != 0) {
+      guest_fault("elf_getshdrstrndx failed: {}", elf_errmsg(-1));
+    }
+
+    std::vector<Section> sections;
+    Elf_Scn *section = nullptr;
+    while ((section = elf_nextscn(elf, section)) != nullptr) {
+      GElf_Shdr header;
+      if (gelf_getshdr(section, &header) != &header)
+        continue;
+
+      if ((header.sh_flags & SHF_EXECINSTR) && (header.sh_flags & SHF_ALLOC) &&
+          header.sh_type == SHT_PROGBITS) {
+        const char *name = elf_strptr(elf, str_table_index, header.sh_name);
+        sections.push_back(Section{.name = name ? name : "?",
+                                   .offset = header.sh_addr,
+                                   .size = header.sh_size});
+      }
+    }
+
+    return sections;
+  }
+
+  // Function and label symbols from .symtab, sorted by address with one
+  // entry per address.
+  static std::vector<Symbol> get_symbols(Elf *elf) {
+    std::vector<Symbol> symbols;
+
+    Elf_Scn *section = nullptr;
+    while ((section = elf_nextscn(elf, section)) != nullptr) {
+      GElf_Shdr header;
+      if (gelf_getshdr(section, &header) != &header ||
+          header.sh_type != SHT_SYMTAB)
+        continue;
+
+      Elf_Data *data = elf_getdata(section, nullptr);
+      u64 count = header.sh_entsize ? header.sh_size / header.sh_entsize : 0;
+      for (u64 i = 0; i < count; i++) {
+        GElf_Sym sym;
+        if (gelf_getsym(data, i, &sym) != &sym)
+          continue;
+
+        u8 type = GELF_ST_TYPE(sym.st_info);
+        if ((type != STT_FUNC && type != STT_NOTYPE) ||
+            sym.st_shndx == SHN_UNDEF || sym.st_name == 0)
+          continue;
+
+        const char *str = elf_strptr(elf, header.sh_link, sym.st_name);
+        if (!str)
+          continue;
+
+        // skip local assembler labels and RISC-V mapping symbols
+        std::string_view name = str;
+        if (name.starts_with(".L") || name.starts_with("$")) {
+          continue;
+        }
+        symbols.push_back(
+            Symbol{.addr = sym.st_value, .name = std::string(name)});
+      }
+    }
+
+    // stable, so the first symbol at an address wins
+    std::stable_sort(
+        symbols.begin(), symbols.end(),
+        [](const Symbol &a, const Symbol &b) { return a.addr < b.addr; });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                              [](const Symbol &a, const Symbol &b) {
+                                return a.addr == b.addr;
+                              }),
+                  symbols.end());
+    return symbols;
+  }
+
+  // f0 is a normal register, so FP destinations are never redirected
+  static bool writes_freg(Op op) {
+    switch (OP_TABLE[op].format) {
+    case Format::F_R:
+    case Format::F_R1:
+    case Format::F_R4:
+    case Format::F_FROM_X:
+    case Format::F_LOAD:
+    case Format::V_TO_F:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // rd is vd, or vs3 for vector stores
+  static bool rd_is_vreg(Op op) {
+    switch (OP_TABLE[op].format) {
+    case Format::V_VV:
+    case Format::V_VX:
+    case Format::V_VI:
+    case Format::V_VF:
+    case Format::V_VVM:
+    case Format::V_VXM:
+    case Format::V_VIM:
+    case Format::V_VFM:
+    case Format::V_MACC_VV:
+    case Format::V_MACC_VX:
+    case Format::V_MACC_VF:
+    case Format::V_MV_V:
+    case Format::V_MV_X:
+    case Format::V_MV_I:
+    case Format::V_MV_F:
+    case Format::V_UNARY:
+    case Format::V_ID:
+    case Format::V_FROM_X:
+    case Format::V_FROM_F:
+    case Format::V_MEM:
+    case Format::V_MEM_STRIDED:
+    case Format::V_MEM_INDEXED:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  Ins decode_raw(u32 raw) {
+    Ins ins;
+    if ((raw & 0b11) != 0b11) {
+      ins = decode_raw_16bit((u16)raw);
+    } else {
+      ins = decode_raw_32bit(raw);
+    }
+    if (ins.rd == 0 && !writes_freg(ins.op) && !rd_is_vreg(ins.op)) {
+      ins.rd = REG_SINK;
+    }
+    ins.length = ((raw & 0b11) == 0b11) ? 4 : 2;
+    return ins;
+  }
+
+  // https://docs.riscv.org/reference/isa/unpriv/c-st-ext.html#27-8-rvc-instruction-set-listings
+  // Compressed instructions are expanded to the base instruction they stand
+  // for, only the length and c_op (for the disassembler) tell them apart.
+  Ins decode_raw_16bit(u16 raw) {
+    u8 opcode = raw & 0b11;
+    u32 funct3 = (raw >> 13) & 0b111;
+
+    Ins i;
+    i.op = Op::INVALID;
+
+    i.rd = (raw >> 7) & 0b11111;
+
+    switch (opcode) {
+    case 0b00: {
+      switch (funct3) {
+      case 0b000: {
+        // all zeros is the defined illegal instruction and stays Op::INVALID
+        if (raw != 0) {
+          i.rd = ((raw >> 2) & 0b111) + 8;
+          i.rs1 = 2;
+          i.imm = (((raw >> 11) & 0b11) << 4) | (((raw >> 7) & 0b1111) << 6) |
+                  (((raw >> 6) & 0b1) << 2) | (((raw >> 5) & 0b1) << 3);
+          i.op = Op::ADDI;
+          i.c_op = C_ADDI4SPN;
+        }
+      }; break;
+      case 0b001: {
+        i.rd = ((raw >> 2) & 0b111) + 8;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
+        i.op = Op::FLD;
+        i.c_op = C_FLD;
+      }; break;
+      case 0b010: {
+        i.rd = ((raw >> 2) & 0b111) + 8;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 6) & 0b1) << 2) |
+                (((raw >> 5) & 0b1) << 6);
+        i.op = Op::LW;
+        i.c_op = C_LW;
+      }; break;
+      case 0b011: {
+        i.rd = ((raw >> 2) & 0b111) + 8;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
+        i.op = Op::LD;
+        i.c_op = C_LD;
+      }; break;
+      case 0b101: {
+        i.rd = 0;
+        i.rs2 = ((raw >> 2) & 0b111) + 8;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
+        i.op = Op::FSD;
+        i.c_op = C_FSD;
+      }; break;
+      case 0b110: {
+        i.rd = 0;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.rs2 = ((raw >> 2) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 6) & 0b1) << 2) |
+                (((raw >> 5) & 0b1) << 6);
+        i.op = Op::SW;
+        i.c_op = C_SW;
+      }; break;
+      case 0b111: {
+        i.rd = 0;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.rs2 = ((raw >> 2) & 0b111) + 8;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
+        i.op = Op::SD;
+        i.c_op = C_SD;
+      }; break;
+      default: {
+        i.op = Op::INVALID;
+      }; break;
+      }
+    }; break;
+    case 0b01: {
+      switch (funct3) {
+      case 0b000: {
+        i.rs1 = i.rd;
+        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+        i.imm = (i.imm << 26) >> 26;
+        i.op = Op::ADDI;
+        i.c_op = C_ADDI;
+      }; break;
+      case 0b001: {
+        i.rs1 = i.rd;
+        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+        i.imm = (i.imm << 26) >> 26;
+        i.op = Op::ADDIW;
+        i.c_op = C_ADDIW;
+      }; break;
+      case 0b010: {
+        i.rs1 = 0;
+        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+        i.imm = (i.imm << 26) >> 26;
+        i.op = Op::ADDI;
+        i.c_op = C_LI;
+      }; break;
+      case 0b011: {
+        if (i.rd == 2) {
+          i.rs1 = 2;
+          i.imm = (((raw >> 12) & 0b1) << 9) | (((raw >> 3) & 0b11) << 7) |
+                  (((raw >> 5) & 0b1) << 6) | (((raw >> 2) & 0b1) << 5) |
+                  (((raw >> 6) & 0b1) << 4);
+          i.imm = (i.imm << 22) >> 22;
+          i.op = Op::ADDI;
+          i.c_op = C_ADDI16SP;
+        } else {
+          i.imm = (((raw >> 12) & 0b1) << 5) | ((raw >> 2) & 0b11111);
+          i.imm = (i.imm << 26) >> 26;
+          i.op = Op::LUI;
+          i.c_op = C_LUI;
+        }
+      }; break;
+      case 0b100: {
+        u8 funct2 = (raw >> 10) & 0b11;
+
+        if (funct2 == 0b11) {
+          i.rs1 = ((raw >> 7) & 0b111) + 8;
+          i.rd = i.rs1;
+
+          bool bit12 = (raw >> 12) & 0b1;
+          i.rs2 = ((raw >> 2) & 0b111) + 8;
+          u8 sub_op = (raw >> 5) & 0b11;
+
+          if (bit12 == 0) {
+            switch (sub_op) {
+            case 0b00:
+              i.op = Op::SUB;
+              i.c_op = C_SUB;
+              break;
+            case 0b01:
+              i.op = Op::XOR;
+              i.c_op = C_XOR;
+              break;
+            case 0b10:
+              i.op = Op::OR;
+              i.c_op = C_OR;
+              break;
+            case 0b11:
+              i.op = Op::AND;
+              i.c_op = C_AND;
+              break;
+            default:
+              i.op = Op::INVALID;
+            }
+          } else {
+            switch (sub_op) {
+            case 0b00:
+              i.op = Op::SUBW;
+              i.c_op = C_SUBW;
+              break;
+            case 0b01:
+              i.op = Op::ADDW;
+              i.c_op = C_ADDW;
+              break;
+            default:
+              i.op = Op::INVALID;
+            }
+          }
+        } else {
+          i.rd = ((raw >> 7) & 0b111) + 8;
+          i.rs1 = i.rd;
+          i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+          i.shamt = i.imm;
+
+          switch (funct2) {
+          case 0b00:
+            i.op = Op::SRLI;
+            i.c_op = C_SRLI;
+            break;
+          case 0b01:
+            i.op = Op::SRAI;
+            i.c_op = C_SRAI;
+            break;
+          case 0b10:
+            i.imm = (i.imm << 26) >> 26;
+            i.op = Op::ANDI;
+            i.c_op = C_ANDI;
+            break;
+          default:
+            i.op = Op::INVALID;
+          }
+        }
+      }; break;
+      case 0b101: {
+        i.rd = 0;
+        i.imm = (((raw >> 12) & 0b1) << 11) | (((raw >> 11) & 0b1) << 4) |
+                (((raw >> 9) & 0b11) << 8) | (((raw >> 8) & 0b1) << 10) |
+                (((raw >> 7) & 0b1) << 6) | (((raw >> 6) & 0b1) << 7) |
+                (((raw >> 5) & 0b1) << 3) | (((raw >> 3) & 0b11) << 1) |
+                (((raw >> 2) & 0b1) << 5);
+        i.imm = (i.imm << 20) >> 20;
+        i.op = Op::JAL;
+        i.c_op = C_J;
+      }; break;
+      case 0b110: {
+        i.rd = 0;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.rs2 = 0;
+        i.imm = (((raw >> 12) & 0b1) << 8) | (((raw >> 10) & 0b11) << 3) |
+                (((raw >> 5) & 0b11) << 6) | (((raw >> 3) & 0b11) << 1) |
+                (((raw >> 2) & 0b1) << 5);
+        i.imm = (i.imm << 23) >> 23;
+        i.op = Op::BEQ;
+        i.c_op = C_BEQZ;
+      }; break;
+      case 0b111: {
+        i.rd = 0;
+        i.rs1 = ((raw >> 7) & 0b111) + 8;
+        i.rs2 = 0;
+        i.imm = (((raw >> 12) & 0b1) << 8) | (((raw >> 10) & 0b11) << 3) |
+                (((raw >> 5) & 0b11) << 6) | (((raw >> 3) & 0b11) << 1) |
+                (((raw >> 2) & 0b1) << 5);
+        i.imm = (i.imm << 23) >> 23;
+        i.op = Op::BNE;
+        i.c_op = C_BNEZ;
+      }; break;
+      default: {
+        i.op = Op::INVALID;
+      }; break;
+      }
+    }; break;
+    case 0b10: {
+      switch (funct3) {
+      case 0b000: {
+        i.rs1 = i.rd;
+        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+        i.shamt = i.imm;
+        i.op = Op::SLLI;
+        i.c_op = C_SLLI;
+      }; break;
+      case 0b001: {
+        i.rs1 = 2;
+        i.imm = (((raw >> 12) & 0b1) << 5) | (((raw >> 5) & 0b11) << 3) |
+                (((raw >> 2) & 0b111) << 6);
+        i.op = Op::FLD;
+        i.c_op = C_FLDSP;
+      }; break;
+      case 0b010: {
+        i.rs1 = 2;
+        i.imm = (((raw >> 2) & 0b11) << 6) | (((raw >> 12) & 0b1) << 5) |
+                (((raw >> 4) & 0b111) << 2);
+        i.op = Op::LW;
+        i.c_op = C_LWSP;
+      }; break;
+      case 0b011: {
+        i.rs1 = 2;
+        i.imm = (((raw >> 12) & 0b1) << 5) | (((raw >> 5) & 0b11) << 3) |
+                (((raw >> 2) & 0b111) << 6);
+        i.op = Op::LD;
+        i.c_op = C_LDSP;
+      }; break;
+      case 0b100: {
+        bool bit12 = (raw >> 12) & 0b1;
+        i.rs2 = (raw >> 2) & 0b11111;
+
+        if (bit12 == 0) {
+          if (i.rs2 == 0) {
+            i.rs1 = i.rd;
+            i.rd = 0;
+            i.imm = 0;
+            i.op = Op::JALR;
+            i.c_op = C_JR;
+          } else {
+            i.rs1 = 0;
+            i.op = Op::ADD;
+            i.c_op = C_MV;
+          }
+        } else {
+          if (i.rs2 == 0) {
+            if (i.rd == 0) {
+              i.op = Op::EBREAK;
+              i.c_op = C_EBREAK;
+            } else {
+              i.rs1 = i.rd;
+              i.rd = 1;
+              i.imm = 0;
+              i.op = Op::JALR;
+              i.c_op = C_JALR;
+            }
+          } else {
+            i.rs1 = i.rd;
+            i.op = Op::ADD;
+            i.c_op = C_ADD;
+          }
+        }
+      }; break;
+      case 0b101: {
+        i.rd = 0;
+        i.rs2 = (raw >> 2) & 0b11111;
+        i.rs1 = 2;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 7) & 0b111) << 6);
+        i.op = Op::FSD;
+        i.c_op = C_FSDSP;
+      }; break;
+      case 0b110: {
+        i.rd = 0;
+        i.rs2 = (raw >> 2) & 0b11111;
+        i.rs1 = 2;
+        i.imm = (((raw >> 9) & 0b1111) << 2) | (((raw >> 7) & 0b11) << 6);
+        i.op = Op::SW;
+        i.c_op = C_SWSP;
+      }; break;
+      case 0b111: {
+        i.rd = 0;
+        i.rs2 = (raw >> 2) & 0b11111;
+        i.rs1 = 2;
+        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 7) & 0b111) << 6);
+        i.op = Op::SD;
+        i.c_op = C_SDSP;
+      }; break;
+      default: {
+        i.op = Op::INVALID;
+      }; break;
+      }
+    }; break;
+    default: {
+      i.op = Op::INVALID;
+    }; break;
+    }
+
+    return i;
+  }
+
+  // https://docs.riscv.org/reference/isa/unpriv/rv-32-64g.html
+  Ins decode_raw_32bit(u32 raw) {
+    u8 opcode = raw & 0b1111111;
+
+    Ins i;
+    i.op = Op::INVALID;
+
+    switch (opcode) {
+    case 0b1100011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+      i32 imm_12 = (raw >> 31) & 0b1;
+      i32 imm_10_5 = (raw >> 25) & 0b111111;
+      i32 imm_4_1 = (raw >> 8) & 0b1111;
+      i32 imm_11 = (raw >> 7) & 0b1;
+      i.imm =
+          (imm_12 << 12) | (imm_11 << 11) | (imm_10_5 << 5) | (imm_4_1 << 1);
+      i.imm = (i.imm << 19) >> 19;
+
+      if (funct3 == 0b000) {
+        i.op = Op::BEQ;
+      } else if (funct3 == 0b001) {
+        i.op = Op::BNE;
+      } else if (funct3 == 0b100) {
+        i.op = Op::BLT;
+      } else if (funct3 == 0b101) {
+        i.op = Op::BGE;
+      } else if (funct3 == 0b110) {
+        i.op = Op::BLTU;
+      } else if (funct3 == 0b111) {
+        i.op = Op::BGEU;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0010011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct6 = (raw >> 26) & 0b111111;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.imm = ((i32)raw) >> 20;
+      i.shamt = (raw >> 20) & 0b111111;
+
+      if (funct3 == 0b000) {
+        i.op = Op::ADDI;
+      } else if (funct3 == 0b001) {
+        if (funct6 == 0b000000) {
+          i.op = Op::SLLI;
+        } else if (funct6 == 0b001010) {
+          i.op = Op::BSETI;
+        } else if (funct6 == 0b010010) {
+          i.op = Op::BCLRI;
+        } else if (funct6 == 0b011010) {
+          i.op = Op::BINVI;
+        } else if (funct6 == 0b011000) {
+          // Zbb unary ops, told apart by the rs2 field
+          switch (i.imm & 0b111111111111) {
+          case 0x600:
+            i.op = Op::CLZ;
+            break;
+          case 0x601:
+            i.op = Op::CTZ;
+            break;
+          case 0x602:
+            i.op = Op::CPOP;
+            break;
+          case 0x604:
+            i.op = Op::SEXT_B;
+            break;
+          case 0x605:
+            i.op = Op::SEXT_H;
+            break;
+          default:
+            i.op = Op::INVALID;
+          }
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b010) {
+        i.op = Op::SLTI;
+      } else if (funct3 == 0b011) {
+        i.op = Op::SLTIU;
+      } else if (funct3 == 0b100) {
+        i.op = Op::XORI;
+      } else if (funct3 == 0b101) {
+        i.shamt = (raw >> 20) & 0b111111;
+        funct6 = (raw >> 26) & 0b111111;
+
+        if (funct6 == 0b000000) {
+          i.op = Op::SRLI;
+        } else if (funct6 == 0b010000) {
+          i.op = Op::SRAI;
+        } else if (funct6 == 0b011000) {
+          i.op = Op::RORI;
+        } else if (funct6 == 0b010010) {
+          i.op = Op::BEXTI;
+        } else if ((i.imm & 0b111111111111) == 0x287) {
+          i.op = Op::ORC_B;
+        } else if ((i.imm & 0b111111111111) == 0x6b8) {
+          i.op = Op::REV8;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b110) {
+        i.op = Op::ORI;
+      } else if (funct3 == 0b111) {
+        i.op = Op::ANDI;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0000011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.imm = ((i32)raw) >> 20;
+
+      if (funct3 == 0b000) {
+        i.op = Op::LB;
+      } else if (funct3 == 0b001) {
+        i.op = Op::LH;
+      } else if (funct3 == 0b010) {
+        i.op = Op::LW;
+      } else if (funct3 == 0b011) {
+        i.op = Op::LD;
+      } else if (funct3 == 0b100) {
+        i.op = Op::LBU;
+      } else if (funct3 == 0b101) {
+        i.op = Op::LHU;
+      } else if (funct3 == 0b110) {
+        i.op = Op::LWU;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b1100111: {
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.imm = ((i32)raw) >> 20;
+      i.op = Op::JALR;
+    }; break;
+    case 0b1110011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.imm = (raw >> 20) & 0b111111111111;
+
+      switch (funct3) {
+      case 0b000: {
+        if (i.imm == 0) {
+          i.op = Op::ECALL;
+        } else if (i.imm == 1) {
+          i.op = Op::EBREAK;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b001: {
+        i.op = Op::CSRRW;
+      }; break;
+      case 0b010: {
+        i.op = Op::CSRRS;
+      }; break;
+      case 0b011: {
+        i.op = Op::CSRRC;
+      }; break;
+      case 0b101: {
+        i.op = Op::CSRRWI;
+      }; break;
+      case 0b110: {
+        i.op = Op::CSRRSI;
+      }; break;
+      case 0b111: {
+        i.op = Op::CSRRCI;
+      }; break;
+      default:
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b1101111: {
+      i.rd = (raw >> 7) & 0b11111;
+      i32 imm_20 = (raw >> 31) & 0b1;
+      i32 imm_10_1 = (raw >> 21) & 0b1111111111;
+      i32 imm_11 = (raw >> 20) & 0b1;
+      i32 imm_19_12 = (raw >> 12) & 0b11111111;
+      i.imm =
+          (imm_20 << 20) | (imm_19_12 << 12) | (imm_11 << 11) | (imm_10_1 << 1);
+      i.imm = (i.imm << 11) >> 11;
+      i.op = Op::JAL;
+    }; break;
+    case 0b0110011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct7 = (u8)((raw >> 25) & 0b1111111);
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+
+      if (funct3 == 0b000) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::ADD;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::SUB;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::MUL;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b001) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SLL;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::MULH;
+        } else if (funct7 == 0b0110000) {
+          i.op = Op::ROL;
+        } else if (funct7 == 0b0010100) {
+          i.op = Op::BSET;
+        } else if (funct7 == 0b0100100) {
+          i.op = Op::BCLR;
+        } else if (funct7 == 0b0110100) {
+          i.op = Op::BINV;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b010) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SLT;
+        } else if (funct7 == 0b0010000) {
+          i.op = Op::SH1ADD;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b011) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SLTU;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::MULHU;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b100) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::XOR;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::DIV;
+        } else if (funct7 == 0b0010000) {
+          i.op = Op::SH2ADD;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::XNOR;
+        } else if (funct7 == 0b0000101) {
+          i.op = Op::MIN;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b101) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SRL;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::DIVU;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::SRA;
+        } else if (funct7 == 0b0000101) {
+          i.op = Op::MINU;
+        } else if (funct7 == 0b0110000) {
+          i.op = Op::ROR;
+        } else if (funct7 == 0b0100100) {
+          i.op = Op::BEXT;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b110) {
+        if (funct7 == 0b0000001) {
+          i.op = Op::REM;
+        } else if (funct7 == 0b0000000) {
+          i.op = Op::OR;
+        } else if (funct7 == 0b0010000) {
+          i.op = Op::SH3ADD;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::ORN;
+        } else if (funct7 == 0b0000101) {
+          i.op = Op::MAX;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b111) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::AND;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::REMU;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::ANDN;
+        } else if (funct7 == 0b0000101) {
+          i.op = Op::MAXU;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0101111: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct5 = (raw >> 27) & 0b11111;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+      // the aq and rl bits, see memory_order()
+      i.imm = (raw >> 25) & 0b11;
+
+      bool word = funct3 == 0b010;
+      if (funct3 != 0b010 && funct3 != 0b011) {
+        i.op = Op::INVALID;
+        break;
+      }
+      switch (funct5) {
+      case 0b00000: {
+        i.op = word ? Op::AMOADD_W : Op::AMOADD_D;
       }; break;
-      case Op::LB: {
-        m_regs[i.rd] = (i8)m_memory[m_regs[i.rs1] + i.imm];
+      case 0b00001: {
+        i.op = word ? Op::AMOSWAP_W : Op::AMOSWAP_D;
       }; break;
-      case Op::LBU: {
-        m_regs[i.rd] = m_memory[m_regs[i.rs1] + i.imm];
+      case 0b00010: {
+        i.op = i.rs2 != 0 ? Op::INVALID : word ? Op::LR_W : Op::LR_D;
       }; break;
-      case Op::LD: {
-        m_regs[i.rd] = mem_read<u64>(m_regs[i.rs1] + i.imm);
+      case 0b00011: {
+        i.op = word ? Op::SC_W : Op::SC_D;
       }; break;
-      case Op::LH: {
-        m_regs[i.rd] = mem_read<i16>(m_regs[i.rs1] + i.imm);
+      case 0b00100: {
+        i.op = word ? Op::AMOXOR_W : Op::AMOXOR_D;
       }; break;
-      case Op::LHU: {
-        m_regs[i.rd] = mem_read<u16>(m_regs[i.rs1] + i.imm);
+      case 0b01000: {
+        i.op = word ? Op::AMOOR_W : Op::AMOOR_D;
       }; break;
-      case Op::LUI: {
-        m_regs[i.rd] = (i64)(i32)((u32)i.imm << 12);
+      case 0b01100: {
+        i.op = word ? Op::AMOAND_W : Op::AMOAND_D;
       }; break;
-      case Op::LW: {
-        m_regs[i.rd] = mem_read<i32>(m_regs[i.rs1] + i.imm);
+      case 0b10000: {
+        i.op = word ? Op::AMOMIN_W : Op::AMOMIN_D;
       }; break;
-      case Op::LWU: {
-        m_regs[i.rd] = mem_read<u32>(m_regs[i.rs1] + i.imm);
+      case 0b10100: {
+        i.op = word ? Op::AMOMAX_W : Op::AMOMAX_D;
+      }; break;
+      case 0b11000: {
+        i.op = word ? Op::AMOMINU_W : Op::AMOMINU_D;
+      }; break;
+      case 0b11100: {
+        i.op = word ? Op::AMOMAXU_W : Op::AMOMAXU_D;
+      }; break;
+      default: {
+        i.op = Op::INVALID;
+      }; break;
+      }
+    }; break;
+    case 0b0111011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct7 = (u8)((raw >> 25) & 0b1111111);
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+
+      if (funct3 == 0b000) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::ADDW;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::SUBW;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::MULW;
+        } else if (funct7 == 0b0000100) {
+          i.op = Op::ADD_UW;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b001) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SLLW;
+        } else if (funct7 == 0b0110000) {
+          i.op = Op::ROLW;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b010) {
+        i.op = funct7 == 0b0010000 ? Op::SH1ADD_UW : Op::INVALID;
+      } else if (funct3 == 0b100) {
+        if (funct7 == 0b0000001) {
+          i.op = Op::DIVW;
+        } else if (funct7 == 0b0010000) {
+          i.op = Op::SH2ADD_UW;
+        } else if (funct7 == 0b0000100 && i.rs2 == 0) {
+          i.op = Op::ZEXT_H;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b101) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SRLW;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::SRAW;
+        } else if (funct7 == 0b0000001) {
+          i.op = Op::DIVUW;
+        } else if (funct7 == 0b0110000) {
+          i.op = Op::RORW;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b110) {
+        if (funct7 == 0b0000001) {
+          i.op = Op::REMW;
+        } else if (funct7 == 0b0010000) {
+          i.op = Op::SH3ADD_UW;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b111) {
+        i.op = funct7 == 0b0000001 ? Op::REMUW : Op::INVALID;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0011011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct7 = (raw >> 25) & 0b1111111;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.imm = ((i32)raw) >> 20;
+      i.shamt = (raw >> 20) & 0b11111;
+
+      if (funct3 == 0b000) {
+        i.op = Op::ADDIW;
+      } else if (funct3 == 0b001) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SLLIW;
+        } else if ((funct7 >> 1) == 0b000010) {
+          // the shift amount is 6 bits, like SLLI's
+          i.shamt = (raw >> 20) & 0b111111;
+          i.op = Op::SLLI_UW;
+        } else if (funct7 == 0b0110000 && i.shamt <= 0b10) {
+          constexpr Op unary[] = {Op::CLZW, Op::CTZW, Op::CPOPW};
+          i.op = unary[i.shamt];
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else if (funct3 == 0b101) {
+        if (funct7 == 0b0000000) {
+          i.op = Op::SRLIW;
+        } else if (funct7 == 0b0100000) {
+          i.op = Op::SRAIW;
+        } else if (funct7 == 0b0110000) {
+          i.op = Op::RORIW;
+        } else {
+          i.op = Op::INVALID;
+        }
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0000111: {
+      u8 funct3 = (raw >> 12) & 0b111;
+
+      switch (funct3) {
+      case 0b010: {
+        i.rd = (raw >> 7) & 0b11111;
+        i.rs1 = (raw >> 15) & 0b11111;
+        i.imm = (i32)raw >> 20;
+        i.op = Op::FLW;
+      }; break;
+      case 0b011: {
+        i.rd = (raw >> 7) & 0b11111;
+        i.rs1 = (raw >> 15) & 0b11111;
+        i.imm = (i32)raw >> 20;
+        i.op = Op::FLD;
+      }; break;
+      default: {
+        decode_vector_mem(i, raw, false);
+      }; break;
+      }
+    }; break;
+    case 0b1010011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      u8 funct5 = (raw >> 27) & 0b11111;
+      u8 fmt = (raw >> 25) & 0b11;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+      // only meaningful for the ops that round, see Ins::rm
+      i.rm = funct3;
+
+      // only single (fmt 0) and double (fmt 1) precision
+      bool d = fmt == 0b01;
+      if (fmt > 0b01) {
+        i.op = Op::INVALID;
+        break;
+      }
+      switch (funct5) {
+      case 0b00000: {
+        i.op = d ? Op::FADD_D : Op::FADD_S;
+      }; break;
+      case 0b00001: {
+        i.op = d ? Op::FSUB_D : Op::FSUB_S;
+      }; break;
+      case 0b00010: {
+        i.op = d ? Op::FMUL_D : Op::FMUL_S;
+      }; break;
+      case 0b00011: {
+        i.op = d ? Op::FDIV_D : Op::FDIV_S;
+      }; break;
+      case 0b01011: {
+        i.op = i.rs2 != 0 ? Op::INVALID : d ? Op::FSQRT_D : Op::FSQRT_S;
+      }; break;
+      case 0b00100: {
+        i.rm = RM_DYN;
+        if (funct3 == 0b000) {
+          i.op = d ? Op::FSGNJ_D : Op::FSGNJ_S;
+        } else if (funct3 == 0b001) {
+          i.op = d ? Op::FSGNJN_D : Op::FSGNJN_S;
+        } else if (funct3 == 0b010) {
+          i.op = d ? Op::FSGNJX_D : Op::FSGNJX_S;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b00101: {
+        i.rm = RM_DYN;
+        if (funct3 == 0b000) {
+          i.op = d ? Op::FMIN_D : Op::FMIN_S;
+        } else if (funct3 == 0b001) {
+          i.op = d ? Op::FMAX_D : Op::FMAX_S;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b01000: {
+        // fcvt.s.d rounds, fcvt.d.s is exact
+        if (d && i.rs2 == 0b00000) {
+          i.op = Op::FCVT_D_S;
+          i.rm = RM_DYN;
+        } else if (!d && i.rs2 == 0b00001) {
+          i.op = Op::FCVT_S_D;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b10100: {
+        i.rm = RM_DYN;
+        if (funct3 == 0b000) {
+          i.op = d ? Op::FLE_D : Op::FLE_S;
+        } else if (funct3 == 0b001) {
+          i.op = d ? Op::FLT_D : Op::FLT_S;
+        } else if (funct3 == 0b010) {
+          i.op = d ? Op::FEQ_D : Op::FEQ_S;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b11000: {
+        if (i.rs2 == 0b00000) {
+          i.op = d ? Op::FCVT_W_D : Op::FCVT_W_S;
+        } else if (i.rs2 == 0b00001) {
+          i.op = d ? Op::FCVT_WU_D : Op::FCVT_WU_S;
+        } else if (i.rs2 == 0b00010) {
+          i.op = d ? Op::FCVT_L_D : Op::FCVT_L_S;
+        } else if (i.rs2 == 0b00011) {
+          i.op = d ? Op::FCVT_LU_D : Op::FCVT_LU_S;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b11010: {
+        if (i.rs2 == 0b00000) {
+          i.op = d ? Op::FCVT_D_W : Op::FCVT_S_W;
+        } else if (i.rs2 == 0b00001) {
+          i.op = d ? Op::FCVT_D_WU : Op::FCVT_S_WU;
+        } else if (i.rs2 == 0b00010) {
+          i.op = d ? Op::FCVT_D_L : Op::FCVT_S_L;
+        } else if (i.rs2 == 0b00011) {
+          i.op = d ? Op::FCVT_D_LU : Op::FCVT_S_LU;
+        } else {
+          i.op = Op::INVALID;
+        }
+        // int to double conversions are always exact
+        if (d && (i.rs2 == 0b00000 || i.rs2 == 0b00001)) {
+          i.rm = RM_DYN;
+        }
+      }; break;
+      case 0b11100: {
+        i.rm = RM_DYN;
+        if (i.rs2 != 0) {
+          i.op = Op::INVALID;
+        } else if (funct3 == 0b000) {
+          i.op = d ? Op::FMV_X_D : Op::FMV_X_W;
+        } else if (funct3 == 0b001) {
+          i.op = d ? Op::FCLASS_D : Op::FCLASS_S;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      case 0b11110: {
+        i.rm = RM_DYN;
+        if (i.rs2 == 0 && funct3 == 0b000) {
+          i.op = d ? Op::FMV_D_X : Op::FMV_W_X;
+        } else {
+          i.op = Op::INVALID;
+        }
+      }; break;
+      default: {
+        i.op = Op::INVALID;
+      }; break;
+      }
+    }; break;
+    case 0b1000011:
+    case 0b1000111:
+    case 0b1001011:
+    case 0b1001111: {
+      u8 fmt = (raw >> 25) & 0b11;
+      i.rd = (raw >> 7) & 0b11111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+      i.rs3 = (raw >> 27) & 0b11111;
+      i.rm = (raw >> 12) & 0b111;
+
+      bool d = fmt == 0b01;
+      if (fmt > 0b01) {
+        i.op = Op::INVALID;
+        break;
+      }
+      switch (opcode) {
+      case 0b1000011: {
+        i.op = d ? Op::FMADD_D : Op::FMADD_S;
+      }; break;
+      case 0b1000111: {
+        i.op = d ? Op::FMSUB_D : Op::FMSUB_S;
+      }; break;
+      case 0b1001011: {
+        i.op = d ? Op::FNMSUB_D : Op::FNMSUB_S;
+      }; break;
+      default: {
+        i.op = d ? Op::FNMADD_D : Op::FNMADD_S;
+      }; break;
+      }
+    }; break;
+    case 0b0100111: {
+      u8 funct3 = (raw >> 12) & 0b111;
+
+      switch (funct3) {
+      case 0b010: {
+        i.rs1 = (raw >> 15) & 0b11111;
+        i.rs2 = (raw >> 20) & 0b11111;
+        i32 imm_hi = (i32)raw >> 25;
+        i32 imm_lo = (raw >> 7) & 0b11111;
+        i.imm = (imm_hi << 5) | imm_lo;
+        i.op = Op::FSW;
+      }; break;
+      case 0b011: {
+        i.rs1 = (raw >> 15) & 0b11111;
+        i.rs2 = (raw >> 20) & 0b11111;
+        i32 imm_hi = (i32)raw >> 25;
+        i32 imm_lo = (raw >> 7) & 0b11111;
+        i.imm = (imm_hi << 5) | imm_lo;
+        i.op = Op::FSD;
+      }; break;
+      default: {
+        decode_vector_mem(i, raw, true);
+      }; break;
+      }
+    }; break;
+    case 0b0100011: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      i.rs1 = (raw >> 15) & 0b11111;
+      i.rs2 = (raw >> 20) & 0b11111;
+      i32 imm_11_5 = (raw >> 25) & 0b1111111;
+      i32 imm_4_0 = (raw >> 7) & 0b11111;
+      i.imm = (imm_11_5 << 5) | imm_4_0;
+      i.imm = (i.imm << 20) >> 20;
+
+      if (funct3 == 0b000) {
+        i.op = Op::SB;
+      } else if (funct3 == 0b001) {
+        i.op = Op::SH;
+      } else if (funct3 == 0b010) {
+        i.op = Op::SW;
+      } else if (funct3 == 0b011) {
+        i.op = Op::SD;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b0110111: {
+      i.rd = (raw >> 7) & 0b11111;
+      i.imm = raw >> 12;
+      i.op = Op::LUI;
+    }; break;
+    case 0b0010111: {
+      i.rd = (raw >> 7) & 0b11111;
+      i.imm = raw >> 12;
+      i.op = Op::AUIPC;
+    }; break;
+    case 0b0001111: {
+      u8 funct3 = (raw >> 12) & 0b111;
+      if (funct3 == 0b000) {
+        i.imm = (raw >> 20) & 0b111111111111;
+
+        if (i.imm == 0b000000010000) {
+          i.op = Op::PAUSE;
+        } else if (i.imm == 0b100000110011) {
+          i.op = Op::FENCE_TSO;
+        } else {
+          i.op = Op::FENCE;
+        }
+      } else if (funct3 == 0b001) {
+        i.op = Op::FENCE_I;
+      } else {
+        i.op = Op::INVALID;
+      }
+    }; break;
+    case 0b1010111: {
+      decode_vector(i, raw);
+    }; break;
+    default:
+      i.op = Op::INVALID;
+    }
+
+    return i;
+  }
+
+  // https://docs.riscv.org/reference/isa/unpriv/v-st-ext.html#_vector_loads_and_stores
+  // The LOAD-FP/STORE-FP encodings whose width isn't a scalar FP one. Segment
+  // accesses (nf > 0, other than whole register ones) are not supported.
+  static void decode_vector_mem(Ins &i, u32 raw, bool store) {
+    static constexpr std::array<Op, 4> LOADS = {VLE8_V, VLE16_V, VLE32_V,
+                                                VLE64_V};
+    static constexpr std::array<Op, 4> STORES = {VSE8_V, VSE16_V, VSE32_V,
+                                                 VSE64_V};
+    static constexpr std::array<Op, 4> FIRST_FAULT_LOADS = {
+        VLE8FF_V, VLE16FF_V, VLE32FF_V, VLE64FF_V};
+    static constexpr std::array<Op, 4> STRIDED_LOADS = {VLSE8_V, VLSE16_V,
+                                                        VLSE32_V, VLSE64_V};
+    static constexpr std::array<Op, 4> STRIDED_STORES = {VSSE8_V, VSSE16_V,
+                                                         VSSE32_V, VSSE64_V};
+    static constexpr std::array<Op, 4> UNORDERED_LOADS = {
+        VLUXEI8_V, VLUXEI16_V, VLUXEI32_V, VLUXEI64_V};
+    static constexpr std::array<Op, 4> ORDERED_LOADS = {
+        VLOXEI8_V, VLOXEI16_V, VLOXEI32_V, VLOXEI64_V};
+    static constexpr std::array<Op, 4> UNORDERED_STORES = {
+        VSUXEI8_V, VSUXEI16_V, VSUXEI32_V, VSUXEI64_V};
+    static constexpr std::array<Op, 4> ORDERED_STORES = {
+        VSOXEI8_V, VSOXEI16_V, VSOXEI32_V, VSOXEI64_V};
+    // by log2 of the number of registers, then EEW
+    static constexpr std::array<std::array<Op, 4>, 4> WHOLE_LOADS = {{
+        {VL1RE8_V, VL1RE16_V, VL1RE32_V, VL1RE64_V},
+        {VL2RE8_V, VL2RE16_V, VL2RE32_V, VL2RE64_V},
+        {VL4RE8_V, VL4RE16_V, VL4RE32_V, VL4RE64_V},
+        {VL8RE8_V, VL8RE16_V, VL8RE32_V, VL8RE64_V},
+    }};
+    static constexpr std::array<Op, 4> WHOLE_STORES = {VS1R_V, VS2R_V, VS4R_V,
+                                                       VS8R_V};
+
+    u8 width = (raw >> 12) & 0b111;
+    u8 nf = raw >> 29;
+    u8 mew = (raw >> 28) & 0b1;
+    u8 mop = (raw >> 26) & 0b11;
+    i.rd = (raw >> 7) & 0b11111;
+    i.rs1 = (raw >> 15) & 0b11111;
+    i.rs2 = (raw >> 20) & 0b11111;
+    i.vm = (raw >> 25) & 0b1;
+    i.op = Op::INVALID;
+
+    // EEW 8, 16, 32, 64 as 0..3
+    u8 eew;
+    if (width == 0b000) {
+      eew = 0;
+    } else if (width >= 0b101) {
+      eew = width - 0b100;
+    } else {
+      return;
+    }
+    if (mew != 0 || (nf != 0 && !(mop == 0b00 && i.rs2 == 0b01000))) {
+      return;
+    }
+
+    switch (mop) {
+    case 0b00: {
+      // the rs2 field is lumop/sumop
+      switch (i.rs2) {
+      case 0b00000: {
+        i.op = store ? STORES[eew] : LOADS[eew];
+      }; break;
+      case 0b01000: {
+        if (i.vm && std::has_single_bit(nf + 1u)) {
+          if (!store) {
+            i.op = WHOLE_LOADS[std::countr_zero(nf + 1u)][eew];
+          } else if (eew == 0) {
+            i.op = WHOLE_STORES[std::countr_zero(nf + 1u)];
+          }
+        }
       }; break;
-      case Op::MUL: {
-        m_regs[i.rd] = m_regs[i.rs1] * m_regs[i.rs2];
+      case 0b01011: {
+        if (i.vm && eew == 0) {
+          i.op = store ? Op::VSM_V : Op::VLM_V;
+        }
       }; break;
-      case Op::MULH: {
-        i64 rs1 = m_regs[i.rs1];
-        i64 rs2 = m_regs[i.rs2];
-        u64 u = rs1;
-        u64 v = rs2;
-        u64 u0 = u & 0xffffffff;
-        u64 u1 = u >> 32;
-        u64 v0 = v & 0xffffffff;
-        u64 v1 = v >> 32;
-        u64 t = u0 * v0;
-        u64 k = t >> 32;
-        t = u1 * v0 + k;
-        u64 w1 = t & 0xffffffff;
-        u64 w2 = t >> 32;
-        t = u0 * v1 + w1;
-        k = t >> 32;
-        u64 res = u1 * v1 + w2 + k;
-        if (rs1 < 0)
-          res -= u64(rs2);
-        if (rs2 < 0)
-          res -= u64(rs1);
-        m_regs[i.rd] = (i64)res;
+      case 0b10000: {
+        if (!store) {
+          i.op = FIRST_FAULT_LOADS[eew];
+        }
       }; break;
-      case Op::MULHU: {
-        u64 a = m_regs[i.rs1];
-        u64 b = m_regs[i.rs2];
-        u64 a0 = a & 0xffffffff;
-        u64 a1 = a >> 32;
-        u64 b0 = b & 0xffffffff;
-        u64 b1 = b >> 32;
-        u64 t = a0 * b0;
-        u64 k = t >> 32;
-        t = a1 * b0 + k;
-        u64 w1 = t & 0xffffffff;
-        u64 w2 = t >> 32;
-        t = a0 * b1 + w1;
-        k = t >> 32;
-        m_regs[i.rd] = a1 * b1 + w2 + k;
+      }
+    }; break;
+    case 0b01: {
+      i.op = store ? UNORDERED_STORES[eew] : UNORDERED_LOADS[eew];
+    }; break;
+    case 0b10: {
+      i.op = store ? STRIDED_STORES[eew] : STRIDED_LOADS[eew];
+    }; break;
+    case 0b11: {
+      i.op = store ? ORDERED_STORES[eew] : ORDERED_LOADS[eew];
+    }; break;
+    }
+  }
+
+  // https://docs.riscv.org/reference/isa/unpriv/v-st-ext.html#_vector_instruction_formats
+  // OP-V: funct3 selects the operand category, funct6 the operation.
+  static void decode_vector(Ins &i, u32 raw) {
+    u8 funct3 = (raw >> 12) & 0b111;
+    u8 funct6 = raw >> 26;
+    i.rd = (raw >> 7) & 0b11111;
+    i.rs1 = (raw >> 15) & 0b11111;
+    i.rs2 = (raw >> 20) & 0b11111;
+    i.vm = (raw >> 25) & 0b1;
+    // simm5, in place of rs1
+    i.imm = (i32)(raw << 12) >> 27;
+    i.op = Op::INVALID;
+
+    switch (funct3) {
+    case 0b000:   // OPIVV
+    case 0b100:   // OPIVX
+    case 0b011: { // OPIVI
+      u8 form = funct3 == 0b000 ? 0 : funct3 == 0b100 ? 1 : 2;
+      i.op = OPIV_OPS[funct6][form];
+      if (form == 2 && OPIVI_UNSIGNED[funct6]) {
+        i.imm = i.rs1;
+      }
+      if (funct6 == 0b010111 && i.vm) {
+        // vmerge without a mask is vmv.v.*, which takes no vs2
+        static constexpr std::array<Op, 3> MOVES = {VMV_V_V, VMV_V_X, VMV_V_I};
+        i.op = i.rs2 == 0 ? MOVES[form] : Op::INVALID;
+      } else if (funct6 == 0b100111 && form == 2 && i.vm) {
+        switch (i.imm) {
+        case 0:
+          i.op = Op::VMV1R_V;
+          break;
+        case 1:
+          i.op = Op::VMV2R_V;
+          break;
+        case 3:
+          i.op = Op::VMV4R_V;
+          break;
+        case 7:
+          i.op = Op::VMV8R_V;
+          break;
+        }
+      }
+    }; break;
+    case 0b010: { // OPMVV
+      switch (funct6) {
+      case 0b010000: {
+        if (i.rs1 == 0b00000 && i.vm) {
+          i.op = Op::VMV_X_S;
+        } else if (i.rs1 == 0b10000) {
+          i.op = Op::VCPOP_M;
+        } else if (i.rs1 == 0b10001) {
+          i.op = Op::VFIRST_M;
+        }
       }; break;
-      case Op::MULW: {
-        m_regs[i.rd] = (i32)(m_regs[i.rs1] * m_regs[i.rs2]);
+      case 0b010010: {
+        static constexpr std::array<Op, 8> EXTENSIONS = {
+            INVALID,   INVALID,   VZEXT_VF8, VSEXT_VF8,
+            VZEXT_VF4, VSEXT_VF4, VZEXT_VF2, VSEXT_VF2};
+        if (i.rs1 < EXTENSIONS.size()) {
+          i.op = EXTENSIONS[i.rs1];
+        }
       }; break;
-      case Op::OR: {
-        m_regs[i.rd] = m_regs[i.rs1] | m_regs[i.rs2];
+      case 0b010100: {
+        if (i.rs1 == 0b10001 && i.rs2 == 0) {
+          i.op = Op::VID_V;
+        }
       }; break;
-      case Op::ORI: {
-        m_regs[i.rd] = m_regs[i.rs1] | (i64)i.imm;
+      default: {
+        i.op = OPM_OPS[funct6][0];
       }; break;
-      case Op::REM: {
-        if (m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = m_regs[i.rs1];
-        } else {
-          m_regs[i.rd] = m_regs[i.rs1] % m_regs[i.rs2];
+      }
+    }; break;
+    case 0b110: { // OPMVX
+      if (funct6 == 0b010000) {
+        if (i.rs2 == 0 && i.vm) {
+          i.op = Op::VMV_S_X;
+        }
+      } else {
+        i.op = OPM_OPS[funct6][1];
+      }
+    }; break;
+    case 0b001: { // OPFVV
+      switch (funct6) {
+      case 0b010000: {
+        if (i.rs1 == 0 && i.vm) {
+          i.op = Op::VFMV_F_S;
         }
       }; break;
-      case Op::REMU: {
-        if (m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = m_regs[i.rs1];
-        } else {
-          m_regs[i.rd] = (u64)m_regs[i.rs1] % (u64)m_regs[i.rs2];
+      case 0b010010: {
+        static constexpr std::array<Op, 8> CONVERSIONS = {
+            VFCVT_XU_F_V, VFCVT_X_F_V, VFCVT_F_XU_V,     VFCVT_F_X_V,
+            INVALID,      INVALID,     VFCVT_RTZ_XU_F_V, VFCVT_RTZ_X_F_V};
+        if (i.rs1 < CONVERSIONS.size()) {
+          i.op = CONVERSIONS[i.rs1];
         }
       }; break;
-      case Op::REMUW: {
-        if (m_regs[i.rs2] == 0) {
-          m_regs[i.rd] = (i32)m_regs[i.rs1];
-        } else {
-          m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] % (u32)m_regs[i.rs2]);
+      case 0b010011: {
+        if (i.rs1 == 0) {
+          i.op = Op::VFSQRT_V;
         }
       }; break;
-      case Op::REMW: {
-        i32 a = (i32)m_regs[i.rs1];
-        i32 b = (i32)m_regs[i.rs2];
+      default: {
+        i.op = OPF_OPS[funct6][0];
+      }; break;
+      }
+    }; break;
+    case 0b101: { // OPFVF
+      if (funct6 == 0b010000) {
+        if (i.rs2 == 0 && i.vm) {
+          i.op = Op::VFMV_S_F;
+        }
+      } else if (funct6 == 0b010111 && i.vm) {
+        i.op = i.rs2 == 0 ? Op::VFMV_V_F : Op::INVALID;
+      } else {
+        i.op = OPF_OPS[funct6][1];
+      }
+    }; break;
+    case 0b111: { // OPCFG
+      if ((raw >> 31) == 0) {
+        i.imm = (raw >> 20) & 0b11111111111;
+        i.op = Op::VSETVLI;
+      } else if ((raw >> 30) == 0b11) {
+        i.imm = (raw >> 20) & 0b1111111111;
+        i.op = Op::VSETIVLI;
+      } else if ((raw >> 25) == 0b1000000) {
+        i.op = Op::VSETVL;
+      }
+    }; break;
+    }
+  }
+
+  // Maps [addr, addr + len) for the guest with (at least) perms. Host pages
+  // are only backed by memory once touched.
+  void commit(u64 addr, u64 len, u8 perms) {
+    perms |= PERM_MAPPED;
+    if (len == 0) {
+      return;
+    }
+    mark_dirty(addr, len);
+    u64 first = addr / m_host_page_size;
+    u64 last = (addr + len - 1) / m_host_page_size;
+    if (mprotect(m_memory + first * m_host_page_size,
+                 (last - first + 1) * m_host_page_size,
+                 PROT_READ | PROT_WRITE) != 0) {
+      fatal("Failed to commit guest memory at 0x{:x}", addr);
+    }
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page <= (addr + len - 1) >> GUEST_PAGE_SHIFT; page++) {
+      if (m_page_perms[page] == 0) {
+        m_committed_pages++;
+      }
+      m_page_perms[page] |= perms;
+    }
+  }
+
+  // Maps len bytes of the host fd from offset at guest addr, which has to be
+  // freshly committed, st being the file's. Where the host page size allows,
+  // the file's pages are mapped into guest memory directly, copy-on-write
+  // unless shared is set, and past the end of the file the region keeps
+  // reading as zeroes instead of faulting. Anything else, pipes and devices
+  // included, is read in.
+  void map_file(u64 addr, u64 len, i32 fd, const struct stat &st, i64 offset,
+                bool shared) {
+    u64 page_size = m_host_page_size;
+    u64 file_len = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > offset) {
+      file_len = std::min(len, (st.st_size - offset + page_size - 1) &
+                                   ~(page_size - 1));
+    }
+
+    if (addr % page_size == 0 && offset % page_size == 0 && file_len != 0 &&
+        mmap(m_memory + addr, file_len, PROT_READ | PROT_WRITE,
+             (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd,
+             offset) != MAP_FAILED) {
+      if (shared) {
+        u64 first = addr >> GUEST_PAGE_SHIFT;
+        std::fill(m_page_file_shared.begin() + first,
+                  m_page_file_shared.begin() + first +
+                      ((file_len + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT),
+                  true);
+      }
+      return;
+    }
+    for (u64 done = 0; done < len;) {
+      ssize_t n = pread(fd, m_memory + addr + done, len - done, offset + done);
+      if (n <= 0) {
+        break;
+      }
+      done += n;
+    }
+  }
+
+  // Unmaps [addr, addr + len) for the guest and gives the host pages back,
+  // so they read as zero once committed again. Part of a host page that
+  // other guest pages still use can only be cleared. Whatever was decoded
+  // there goes too, so a later mapping of the range runs its own code.
+  void decommit(u64 addr, u64 len) {
+    if (len == 0) {
+      return;
+    }
+    mark_dirty(addr, len);
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page <= (addr + len - 1) >> GUEST_PAGE_SHIFT; page++) {
+      if (m_page_perms[page] != 0) {
+        m_committed_pages--;
+        m_page_perms[page] = 0;
+      }
+      m_page_file_shared[page] = false;
+    }
+    flush_tlb();
+    invalidate_code(addr, len);
+
+    u64 start = addr & ~(m_host_page_size - 1);
+    u64 end = page_align(addr + len, m_host_page_size);
+    if (start != addr && host_page_in_use(start)) {
+      u64 edge = std::min(start + m_host_page_size, addr + len);
+      std::memset(m_memory + addr, 0, edge - addr);
+      start += m_host_page_size;
+    }
+    if (end > start && end != addr + len &&
+        host_page_in_use(end - m_host_page_size)) {
+      end -= m_host_page_size;
+      std::memset(m_memory + end, 0, addr + len - end);
+    }
+    if (start < end &&
+        mmap(m_memory + start, end - start, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1,
+             0) == MAP_FAILED) {
+      fatal("Failed to decommit guest memory at 0x{:x}", addr);
+    }
+  }
+
+  // Does a guest page in the host page at addr still need it?
+  bool host_page_in_use(u64 addr) const {
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page < (addr + m_host_page_size) >> GUEST_PAGE_SHIFT; page++) {
+      if (m_page_perms[page] != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // madvise(MADV_DONTNEED or MADV_FREE) on mapped guest pages. The host
+  // drops whole host pages itself, to zeroes for anonymous memory and to the
+  // file's contents for private file mappings, same as it would for the
+  // guest. For DONTNEED, part of a host page can only be cleared.
+  void drop_pages(u64 addr, u64 len, i32 advice) {
+    u64 start = page_align(addr, m_host_page_size);
+    u64 end = std::max((addr + len) & ~(m_host_page_size - 1), start);
+    mark_dirty(addr, len);
+    if (advice == MADV_DONTNEED) {
+      std::memset(m_memory + addr, 0, std::min(start, addr + len) - addr);
+      std::memset(m_memory + end, 0, addr + len - end);
+    }
+    if (start < end) {
+      madvise(m_memory + start, end - start, advice);
+    }
+  }
+
+  // Is every page of [addr, addr + len) mapped, or with all false, any?
+  bool is_mapped(u64 addr, u64 len, bool all) const {
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page < (addr + len) >> GUEST_PAGE_SHIFT; page++) {
+      if ((m_page_perms[page] != 0) != all) {
+        return !all;
+      }
+    }
+    return all;
+  }
+
+  // Lowest free range of the mmap area that fits len bytes, at hint if that
+  // is free, or 0 if none is left.
+  u64 find_range(u64 hint, u64 len) const {
+    auto it = m_free_ranges.upper_bound(hint);
+    if (hint % GUEST_PAGE_SIZE == 0 && it != m_free_ranges.begin() &&
+        hint < std::prev(it)->second && len <= std::prev(it)->second - hint) {
+      return hint;
+    }
+    for (auto [start, end] : m_free_ranges) {
+      if (end - start >= len) {
+        return start;
+      }
+    }
+    return 0;
+  }
+
+  // Takes [start, end) out of the free ranges of the mmap area.
+  void take_range(u64 start, u64 end) {
+    auto it = m_free_ranges.upper_bound(start);
+    if (it != m_free_ranges.begin() && std::prev(it)->second > start) {
+      it--;
+    }
+    while (it != m_free_ranges.end() && it->first < end) {
+      auto [free_start, free_end] = *it;
+      it = m_free_ranges.erase(it);
+      if (free_start < start) {
+        m_free_ranges[free_start] = start;
+      }
+      if (free_end > end) {
+        m_free_ranges[end] = free_end;
+      }
+    }
+  }
+
+  // Gives [start, end) back to the free ranges, as far as it is in the mmap
+  // area, merging it with its neighbours.
+  void free_range(u64 start, u64 end) {
+    start = std::max(start, m_max_brk);
+    end = std::min(end, m_stack_base);
+    if (start >= end) {
+      return;
+    }
+    take_range(start, end);
+    auto next = m_free_ranges.find(end);
+    if (next != m_free_ranges.end()) {
+      end = next->second;
+      m_free_ranges.erase(next);
+    }
+    auto it = m_free_ranges.lower_bound(start);
+    if (it != m_free_ranges.begin() && std::prev(it)->second == start) {
+      std::prev(it)->second = end;
+    } else {
+      m_free_ranges[start] = end;
+    }
+  }
+
+  // byte offset of a TLB from m_regs, for translated code
+  i32 tlb_offset(const std::array<u64, TLB_SIZE> &tlb) const {
+    return (const u8 *)tlb.data() - (const u8 *)m_regs.data();
+  }
+
+  // has to be called whenever a page loses a permission
+  void flush_tlb() {
+    m_read_tlb.fill(TLB_EMPTY);
+    m_write_tlb.fill(TLB_EMPTY);
+  }
+
+  u8 page_perms(u64 addr) const {
+    u64 page = addr >> GUEST_PAGE_SHIFT;
+    return page < m_page_perms.size() ? m_page_perms[page] : 0;
+  }
+
+  [[noreturn]] void bad_access(u64 addr, u8 perm) {
+    fatal("Invalid {} at addr=0x{:x} pc=0x{:x}",
+          perm == PERM_W ? "write" : "read", addr, m_pc);
+  }
+
+  // The slow path of a load or store: faults unless every page of
+  // [addr, addr + len) allows perm, and caches the page in the TLB when the
+  // access fits in one.
+  void check_access(u64 addr, u64 len, u8 perm) {
+    u64 first = addr >> GUEST_PAGE_SHIFT;
+    u64 last = (addr + len - 1) >> GUEST_PAGE_SHIFT;
+    if (!is_accessible(addr, len, perm)) {
+      bad_access(addr, perm);
+    }
+    if (perm == PERM_W) {
+      for (u64 page = first; page <= last; page++) {
+        if (m_page_has_code[page]) [[unlikely]] {
+          invalidate_code(page << GUEST_PAGE_SHIFT, GUEST_PAGE_SIZE);
+        }
+      }
+    }
+    if (perm == PERM_W && m_snapshot != nullptr) [[unlikely]] {
+      mark_dirty(addr, len);
+    }
+    if (first == last) {
+      auto &tlb = perm == PERM_W ? m_write_tlb : m_read_tlb;
+      tlb[first % TLB_SIZE] = first << GUEST_PAGE_SHIFT;
+    }
+  }
+
+  // whether every page of [addr, addr + len), len > 0, allows perm
+  bool is_accessible(u64 addr, u64 len, u8 perm) const {
+    if (addr + len < addr) {
+      return false;
+    }
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page <= (addr + len - 1) >> GUEST_PAGE_SHIFT; page++) {
+      if (page >= m_page_perms.size() || !(m_page_perms[page] & perm)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Notes [addr, addr + len) as changed since the snapshot. Writes only get
+  // here once per page, as every snapshot and reset flushes the write TLB.
+  void mark_dirty(u64 addr, u64 len) {
+    if (m_snapshot == nullptr || len == 0) {
+      return;
+    }
+    for (u64 page = addr >> GUEST_PAGE_SHIFT;
+         page <= (addr + len - 1) >> GUEST_PAGE_SHIFT; page++) {
+      if (!m_page_dirty[page]) {
+        m_page_dirty[page] = true;
+        m_dirty_pages.push_back(page);
+      }
+    }
+  }
+
+  static bool is_zero_page(const u8 *page) {
+    for (u64 i = 0; i < GUEST_PAGE_SIZE; i += 8) {
+      u64 v;
+      std::memcpy(&v, page + i, 8);
+      if (v != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // What a TLB entry has to hold for an access of size bytes at addr to hit:
+  // its page address, with the low bits kept to send misaligned accesses
+  // down the slow path.
+  static u64 tlb_tag(u64 addr, u64 size) {
+    return addr & (~(GUEST_PAGE_SIZE - 1) | (size - 1));
+  }
+
+  // Host pointer to [addr, addr + len), faulting unless the page table
+  // allows perm on all of it.
+  u8 *guest_ptr(u64 addr, u64 len, u8 perm) {
+    if (len != 0) {
+      check_access(addr, len, perm);
+    }
+    return m_memory + addr;
+  }
+
+  // Host pointer to a syscall's buffer at [addr, addr + len), or nullptr if
+  // the page table doesn't allow perm on all of it, which the guest gets
+  // EFAULT for.
+  u8 *syscall_ptr(u64 addr, u64 len, u8 perm) {
+    if (len != 0 && !is_accessible(addr, len, perm)) {
+      return nullptr;
+    }
+    return guest_ptr(addr, len, perm);
+  }
+
+  template <typename T> T mem_read(u64 addr) {
+    if (m_read_tlb[(addr >> GUEST_PAGE_SHIFT) % TLB_SIZE] !=
+        tlb_tag(addr, sizeof(T))) [[unlikely]] {
+      check_access(addr, sizeof(T), PERM_R);
+    }
+    T v;
+    std::memcpy(&v, m_memory + addr, sizeof(T));
+    return v;
+  }
+  template <typename T> void mem_write(u64 addr, T v) {
+    if (m_write_tlb[(addr >> GUEST_PAGE_SHIFT) % TLB_SIZE] !=
+        tlb_tag(addr, sizeof(T))) [[unlikely]] {
+      check_access(addr, sizeof(T), PERM_W);
+    }
+    std::memcpy(m_memory + addr, &v, sizeof(T));
+  }
 
-        if (b == 0) {
-          m_regs[i.rd] = (i64)a;
-        } else if (a == INT32_MIN && b == -1) {
-          m_regs[i.rd] = 0;
-        } else {
-          m_regs[i.rd] = (i64)(a % b);
-        }
-      }; break;
-      case Op::SB: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        m_memory[addr] = m_regs[i.rs2];
-      }; break;
-      case Op::SD:
-      case Op::C_SD: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        mem_write<u64>(addr, m_regs[i.rs2]);
-      }; break;
-      case Op::SH: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        mem_write<u16>(addr, m_regs[i.rs2]);
-      }; break;
-      case Op::SLL: {
-        m_regs[i.rd] = (u64)m_regs[i.rs1] << ((u64)m_regs[i.rs2] & 0b111111);
-      }; break;
-      case Op::SLLI: {
-        m_regs[i.rd] = m_regs[i.rs1] << i.shamt;
-      }; break;
-      case Op::SLLIW: {
-        m_regs[i.rd] = (i32)m_regs[i.rs1] << i.shamt;
-      }; break;
-      case Op::SLLW: {
-        m_regs[i.rd] =
-            (i32)(u32)((u32)m_regs[i.rs1] << ((u32)m_regs[i.rs2] & 0b11111));
-      }; break;
-      case Op::SLT: {
-        m_regs[i.rd] = (m_regs[i.rs1] < m_regs[i.rs2]) ? 1 : 0;
-      }; break;
-      case Op::SLTIU: {
-        m_regs[i.rd] = ((u64)m_regs[i.rs1] < (u64)(i64)i.imm) ? 1 : 0;
-      }; break;
-      case Op::SLTU: {
-        m_regs[i.rd] = ((u64)m_regs[i.rs1] < (u64)m_regs[i.rs2]) ? 1 : 0;
-      }; break;
-      case Op::SRAI: {
-        m_regs[i.rd] = (i64)m_regs[i.rs1] >> i.shamt;
-      }; break;
-      case Op::SRAIW: {
-        m_regs[i.rd] = (i32)m_regs[i.rs1] >> i.shamt;
-      }; break;
-      case Op::SRAW: {
-        m_regs[i.rd] = ((i32)m_regs[i.rs1]) >> ((u32)m_regs[i.rs2] & 0b11111);
-      }; break;
-      case Op::SRLI: {
-        m_regs[i.rd] = (u64)m_regs[i.rs1] >> i.shamt;
-      }; break;
-      case Op::SRLIW: {
-        m_regs[i.rd] = (i32)((u32)m_regs[i.rs1] >> i.shamt);
-      }; break;
-      case Op::SRLW: {
-        m_regs[i.rd] =
-            (i32)((u32)m_regs[i.rs1] >> ((u32)m_regs[i.rs2] & 0b11111));
-      }; break;
-      case Op::SUB: {
-        m_regs[i.rd] = m_regs[i.rs1] - m_regs[i.rs2];
-      }; break;
-      case Op::SUBW: {
-        m_regs[i.rd] = (i32)(m_regs[i.rs1] - m_regs[i.rs2]);
-      }; break;
-      case Op::C_SW:
-      case Op::SW: {
-        u64 addr = m_regs[i.rs1] + i.imm;
-        mem_write<u32>(addr, m_regs[i.rs2]);
-      }; break;
-      case Op::XOR: {
-        m_regs[i.rd] = m_regs[i.rs1] ^ m_regs[i.rs2];
-      }; break;
-      case Op::XORI: {
-        m_regs[i.rd] = m_regs[i.rs1] ^ i.imm;
-      }; break;
-      default: {
-        std::println(stderr, "{} not implemented", OP_TABLE[i.op].mnemonic);
-        exit(1);
-      }; break;
+  // The guest word at addr as an atomic. The A extension requires natural
+  // alignment, which is also what std::atomic_ref needs.
+  template <typename T> std::atomic_ref<T> atomic_at(u64 addr) {
+    if (addr % sizeof(T) != 0) {
+      fatal("Misaligned atomic at addr=0x{:x} pc=0x{:x}", addr, m_pc);
+    }
+    if (m_write_tlb[(addr >> GUEST_PAGE_SHIFT) % TLB_SIZE] !=
+        tlb_tag(addr, sizeof(T))) [[unlikely]] {
+      check_access(addr, sizeof(T), PERM_R);
+      check_access(addr, sizeof(T), PERM_W);
+    }
+    return std::atomic_ref<T>(*(T *)(m_memory + addr));
+  }
+
+  // ordering for the aq (bit 1) and rl (bit 0) bits of an atomic
+  static std::memory_order memory_order(i32 aqrl) {
+    switch (aqrl) {
+    case 0b00:
+      return std::memory_order_relaxed;
+    case 0b01:
+      return std::memory_order_release;
+    case 0b10:
+      return std::memory_order_acquire;
+    default:
+      return std::memory_order_seq_cst;
+    }
+  }
+
+  // AMOs without a std::atomic_ref equivalent, as a compare-exchange loop.
+  // Returns the old value.
+  template <typename T, typename F> T atomic_update(u64 addr, i32 aqrl, F f) {
+    std::atomic_ref<T> ref = atomic_at<T>(addr);
+    T old = ref.load(std::memory_order_relaxed);
+    while (!ref.compare_exchange_weak(old, f(old), memory_order(aqrl))) {
+    }
+    return old;
+  }
+
+  // LR registers a reservation on the word it loads, and SC only stores if
+  // the word still holds the value LR saw. Comparing values instead of
+  // tracking every store keeps SC a single compare-exchange, which stays
+  // correct with other harts writing to the same memory.
+  template <typename T> void load_reserved(const Ins &i) {
+    u64 addr = m_regs[i.rs1];
+    // a release-only load isn't a thing in C++
+    std::memory_order order =
+        i.imm == 0b01 ? std::memory_order_seq_cst : memory_order(i.imm);
+    T v = atomic_at<T>(addr).load(order);
+    m_reservation =
+        Reservation{.addr = addr, .size = sizeof(T), .value = (u64)v};
+    m_regs[i.rd] = v;
+  }
+
+  template <typename T> void store_conditional(const Ins &i) {
+    u64 addr = m_regs[i.rs1];
+    bool stored = false;
+    if (m_reservation.addr == addr && m_reservation.size == sizeof(T)) {
+      T expected = m_reservation.value;
+      stored = atomic_at<T>(addr).compare_exchange_strong(
+          expected, (T)m_regs[i.rs2], memory_order(i.imm));
+    }
+    // every SC gives up the reservation, whether it succeeds or not
+    m_reservation.size = 0;
+    m_regs[i.rd] = stored ? 0 : 1;
+  }
+
+  // The host fd behind a guest fd, -1 for one the guest hasn't got open,
+  // which makes the host syscall fail with EBADF.
+  i32 host_fd(i64 fd) const {
+    return fd >= 0 && (u64)fd < m_fds.size() ? m_fds[fd] : -1;
+  }
+
+  // host_fd() for the dirfd of the *at() syscalls
+  i32 host_dirfd(i64 fd) const {
+    return fd == AT_FDCWD ? AT_FDCWD : host_fd(fd);
+  }
+
+  // Gives the host fd the lowest free guest fd, like the kernel would.
+  i64 new_fd(i32 host) {
+    auto it = std::find(m_fds.begin(), m_fds.end(), -1);
+    if (it != m_fds.end()) {
+      *it = host;
+      return it - m_fds.begin();
+    }
+    m_fds.push_back(host);
+    return m_fds.size() - 1;
+  }
+
+  // The NUL-terminated guest string at addr, nullptr unless all of it is
+  // readable.
+  const char *guest_string(u64 addr) {
+    for (u64 page = addr;; page = (page | (GUEST_PAGE_SIZE - 1)) + 1) {
+      u64 len = GUEST_PAGE_SIZE - page % GUEST_PAGE_SIZE;
+      if (!is_accessible(page, len, PERM_R)) {
+        return nullptr;
+      }
+      if (std::memchr(m_memory + page, 0, len) != nullptr) {
+        return (const char *)(m_memory + addr);
       }
+    }
+  }
 
-      m_pc += i.length;
+  // false if the guest's buffer isn't writable
+  bool write_stat(u64 addr, const struct stat &st) {
+    GuestStat gst = {.dev = st.st_dev,
+                     .ino = st.st_ino,
+                     .mode = st.st_mode,
+                     .nlink = (u32)st.st_nlink,
+                     .uid = st.st_uid,
+                     .gid = st.st_gid,
+                     .rdev = st.st_rdev,
+                     .pad1 = 0,
+                     .size = st.st_size,
+                     .blksize = (i32)st.st_blksize,
+                     .pad2 = 0,
+                     .blocks = st.st_blocks,
+                     .atime = st.st_atim.tv_sec,
+                     .atime_nsec = (u64)st.st_atim.tv_nsec,
+                     .mtime = st.st_mtim.tv_sec,
+                     .mtime_nsec = (u64)st.st_mtim.tv_nsec,
+                     .ctime = st.st_ctim.tv_sec,
+                     .ctime_nsec = (u64)st.st_ctim.tv_nsec,
+                     .unused = {}};
+    u8 *buf = syscall_ptr(addr, sizeof(gst), PERM_W);
+    if (buf == nullptr) {
+      return false;
     }
+    std::memcpy(buf, &gst, sizeof(gst));
+    return true;
   }
 
-private:
-  u8 *m_memory;
-  std::vector<Ins> m_decoded;
-  u64 m_pc;
-  std::array<i64, 32> m_regs{};
-  Section m_code_section;
-  u64 m_brk;
-  u64 m_brk_base;
-  u64 m_next_mmap_addr;
+  // Translates the guest's array of n struct iovec at vec into iov. The
+  // guest's struct iovec is {u64 base, u64 len}, same as the host's, only
+  // the bases need translating. perm is what the buffers need to allow.
+  // Returns false if the array or one of the buffers doesn't.
+  bool host_iov(u64 vec, u64 n, u8 perm, iovec *iov) {
+    const u8 *src = syscall_ptr(vec, n * 16, PERM_R);
+    if (src == nullptr) {
+      return false;
+    }
+    for (u64 i = 0; i < n; i++) {
+      u64 base, len;
+      std::memcpy(&base, src + i * 16, 8);
+      std::memcpy(&len, src + i * 16 + 8, 8);
+      iov[i] = {.iov_base = syscall_ptr(base, len, perm), .iov_len = len};
+      if (iov[i].iov_base == nullptr) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-  static Section get_code_section(Elf *elf, GElf_Ehdr ehdr) {
-    u64 str_table_index;
-    if (elf_getshdrstrndx(elf, &str_table_index) != 0) {
-      std::println(stderr, "elf_getshdrstrndx failed: {}", elf_errmsg(-1));
-      exit(1);
+  // Reads from the host fd straight into the guest buffers in iov, as much
+  // as a single readv returns. Returns what the syscall returns to the guest.
+  i64 read_in(i32 fd, const iovec *iov, u64 n) {
+    // a prompt written before the read has to show up first
+    flush_output();
+    ssize_t bytes_read = readv(fd, iov, n);
+    return bytes_read < 0 ? -errno : bytes_read;
+  }
+
+  // Writes the guest buffers in iov to the host fd with a single writev,
+  // straight out of guest memory. With --output-buffer, stdout is collected
+  // instead and written out once m_output_buffer_size bytes have piled up.
+  // Returns what the syscall returns to the guest.
+  i64 write_out(i32 fd, const iovec *iov, u64 n) {
+    if (fd == 1 && m_output_buffer_size != 0) {
+      u64 total = 0;
+      for (u64 i = 0; i < n; i++) {
+        const u8 *base = (const u8 *)iov[i].iov_base;
+        m_output_buffer.insert(m_output_buffer.end(), base,
+                               base + iov[i].iov_len);
+        total += iov[i].iov_len;
+      }
+      if (m_output_buffer.size() >= m_output_buffer_size) {
+        flush_output();
+      }
+      return total;
     }
 
-    Elf_Scn *section = nullptr;
-    while ((section = elf_nextscn(elf, section)) != nullptr) {
-      GElf_Shdr header;
-      if (gelf_getshdr(section, &header) != &header)
-        continue;
+    // keeps buffered stdout ahead of stderr, which usually share a terminal
+    flush_output();
+    ssize_t written = writev(fd, iov, n);
+    return written < 0 ? -errno : written;
+  }
 
-      const char *name = elf_strptr(elf, str_table_index, header.sh_name);
-      if (name && std::string_view(name) == ".text") {
-        return Section{.offset = header.sh_addr,
-                       .size = header.sh_size,
-                       .entrypoint = ehdr.e_entry};
+  void flush_output() {
+    u64 done = 0;
+    while (done < m_output_buffer.size()) {
+      ssize_t written = write(1, m_output_buffer.data() + done,
+                              m_output_buffer.size() - done);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        break;
       }
+      done += written;
     }
+    m_output_buffer.clear();
+  }
 
-    std::println(stderr, "Failed to locate .text");
-    exit(1);
+  // Ends the guest on an error it can't go on from, with a GuestFault.
+  // Output it buffered is written out first, ahead of the message.
+  template <typename... Args>
+  [[noreturn]] void fatal(std::format_string<Args...> format, Args &&...args) {
+    flush_output();
+    guest_fault(format, std::forward<Args>(args)...);
   }
 
-  Ins decode_raw(u32 raw) {
-    if ((raw & 0b11) != 0b11) {
-      return decode_raw_16bit((u16)raw);
+  [[noreturn]] void bad_csr(u16 csr) {
+    fatal("Unsupported CSR 0x{:x} at pc=0x{:x}", csr, m_pc);
+  }
+
+  // cycle and instret are read in run(), which knows how far ahead of the
+  // current instruction they have been counted
+  u64 csr_read(u16 csr) {
+    switch (csr) {
+    case CSR_FFLAGS:
+      return fflags();
+    case CSR_FRM:
+      return m_frm;
+    case CSR_FCSR:
+      return (m_frm << 5) | fflags();
+    case CSR_VSTART:
+      // nothing stops halfway through a vector instruction
+      return 0;
+    case CSR_VXSAT:
+      return m_vxsat;
+    case CSR_VXRM:
+      return m_vxrm;
+    case CSR_VCSR:
+      return (m_vxrm << 1) | m_vxsat;
+    case CSR_VL:
+      return m_vl;
+    case CSR_VTYPE:
+      return m_vtype;
+    case CSR_VLENB:
+      return VLENB;
+    case CSR_TIME: {
+      // host nanoseconds, so the timebase the guest sees is 1 GHz
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+    }
+    default:
+      bad_csr(csr);
+    }
+  }
+
+  void csr_write(u16 csr, u64 v) {
+    switch (csr) {
+    case CSR_FFLAGS:
+      set_fflags(v);
+      break;
+    case CSR_FRM:
+      set_frm(v);
+      break;
+    case CSR_FCSR:
+      set_fflags(v);
+      set_frm(v >> 5);
+      break;
+    case CSR_VSTART:
+      // every vector instruction starts at element 0 and leaves vstart 0
+      break;
+    case CSR_VXSAT:
+      m_vxsat = v & 0b1;
+      break;
+    case CSR_VXRM:
+      m_vxrm = v & 0b11;
+      break;
+    case CSR_VCSR:
+      m_vxsat = v & 0b1;
+      m_vxrm = (v >> 1) & 0b11;
+      break;
+    case CSR_CYCLE:
+    case CSR_TIME:
+    case CSR_INSTRET:
+    case CSR_VL:
+    case CSR_VTYPE:
+    case CSR_VLENB:
+      // read-only
+      illegal_instruction();
+    default:
+      bad_csr(csr);
+    }
+  }
+
+  // The host FPU accrues exception flags by itself as guest instructions
+  // run, so they are only collected when the guest reads them.
+  u8 fflags() const {
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    u8 flags = m_fflags;
+    if (raised & FE_INEXACT) {
+      flags |= FLAG_NX;
+    }
+    if (raised & FE_UNDERFLOW) {
+      flags |= FLAG_UF;
+    }
+    if (raised & FE_OVERFLOW) {
+      flags |= FLAG_OF;
+    }
+    if (raised & FE_DIVBYZERO) {
+      flags |= FLAG_DZ;
+    }
+    if (raised & FE_INVALID) {
+      flags |= FLAG_NV;
+    }
+    return flags;
+  }
+
+  void set_fflags(u64 v) {
+    feclearexcept(FE_ALL_EXCEPT);
+    m_fflags = v & 0b11111;
+  }
+
+  // The host keeps rounding like frm, so dynamic rounding costs nothing.
+  void set_frm(u64 v) {
+    m_frm = v & 0b111;
+    m_host_rm = m_frm <= RM_RUP ? m_frm : (u8)RM_RNE;
+    fesetround(HOST_ROUNDING[m_host_rm]);
+  }
+
+  // rm with RM_DYN resolved to frm
+  u8 rounding_mode(u8 rm) {
+    if (rm == RM_DYN) {
+      rm = m_frm;
+    }
+    if (rm > RM_RMM) {
+      fatal("Invalid rounding mode {} at pc=0x{:x}", rm, m_pc);
+    }
+    return rm;
+  }
+
+  // Runs f with the host rounding like rm. Only static rounding modes other
+  // than frm's pay for switching the host mode.
+  template <typename F> auto rounded(u8 rm, F f) {
+    if (rm == m_host_rm || (rm == RM_DYN && m_frm == m_host_rm)) [[likely]] {
+      return f();
+    }
+    fesetround(HOST_ROUNDING[rounding_mode(rm)]);
+    auto result = f();
+    fesetround(HOST_ROUNDING[m_host_rm]);
+    return result;
+  }
+
+  template <typename T>
+  using FpBits = std::conditional_t<std::is_same_v<T, float>, u32, u64>;
+
+  // a single that isn't properly NaN-boxed reads as the canonical NaN
+  template <typename T> FpBits<T> freg_bits(u8 r) const {
+    if constexpr (std::is_same_v<T, float>) {
+      return (m_fregs[r] >> 32) == 0xffffffff ? (u32)m_fregs[r] : 0x7fc00000;
     } else {
-      return decode_raw_32bit(raw);
+      return m_fregs[r];
     }
   }
+  template <typename T> T freg(u8 r) const {
+    return std::bit_cast<T>(freg_bits<T>(r));
+  }
 
-  // https://docs.riscv.org/reference/isa/unpriv/c-st-ext.html#27-8-rvc-instruction-set-listings
-  Ins decode_raw_16bit(u16 raw) {
-    u8 opcode = raw & 0b11;
-    u32 funct3 = (raw >> 13) & 0b111;
+  template <typename T> void set_freg_bits(u8 r, FpBits<T> v) {
+    if constexpr (std::is_same_v<T, float>) {
+      m_fregs[r] = 0xffffffff00000000ULL | v;
+    } else {
+      m_fregs[r] = v;
+    }
+  }
+  template <typename T> void set_freg(u8 r, T v) {
+    set_freg_bits<T>(r, std::bit_cast<FpBits<T>>(v));
+  }
 
-    Ins i;
-    i.op = Op::INVALID;
+  // NaN results never carry a payload or sign
+  template <typename T> static T canonical(T v) {
+    return std::isnan(v) ? std::numeric_limits<T>::quiet_NaN() : v;
+  }
 
-    i.rd = (raw >> 7) & 0b11111;
+  template <typename T> static bool is_snan(T v) {
+    FpBits<T> quiet = FpBits<T>(1) << (std::numeric_limits<T>::digits - 2);
+    return std::isnan(v) && !(std::bit_cast<FpBits<T>>(v) & quiet);
+  }
 
-    switch (opcode) {
-    case 0b00: {
-      switch (funct3) {
-      case 0b000: {
-        if (raw == 0) {
-          std::println(stderr, "Illegal instruction at 0x{:x} (all zeros)",
-                       m_pc);
-        } else {
-          i.rd = ((raw >> 2) & 0b111) + 8;
-          i.rs1 = 2;
-          i.imm = (((raw >> 11) & 0b11) << 4) | (((raw >> 7) & 0b1111) << 6) |
-                  (((raw >> 6) & 0b1) << 2) | (((raw >> 5) & 0b1) << 3);
-          i.op = Op::C_ADDI4SPN;
-        }
-      }; break;
-      case 0b001: {
-        i.rd = ((raw >> 2) & 0b111) + 8;
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
-        i.op = Op::C_FLD;
-      }; break;
-      case 0b010: {
-        i.rd = ((raw >> 2) & 0b111) + 8;
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 6) & 0b1) << 2) |
-                (((raw >> 5) & 0b1) << 6);
-        i.op = Op::C_LW;
-      }; break;
-      case 0b011: {
-        i.rd = ((raw >> 2) & 0b111) + 8;
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
-        i.op = Op::C_LD;
-      }; break;
-      case 0b101: {
-        i.rs2 = ((raw >> 2) & 0b111) + 8;
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
-        i.op = Op::C_FSD;
-      }; break;
-      case 0b110: {
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.rs2 = ((raw >> 2) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 6) & 0b1) << 2) |
-                (((raw >> 5) & 0b1) << 6);
-        i.op = Op::C_SW;
-      }; break;
-      case 0b111: {
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.rs2 = ((raw >> 2) & 0b111) + 8;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 5) & 0b11) << 6);
-        i.op = Op::C_SD;
-      }; break;
-      default: {
-        std::println(stderr, "C: opcode=00: unrecognized funct3: {:03b}",
-                     funct3);
-        exit(1);
-      }; break;
-      }
-    }; break;
-    case 0b01: {
-      switch (funct3) {
-      case 0b000: {
-        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
-        i.imm = (i.imm << 26) >> 26;
-        i.op = Op::C_ADDI;
-      }; break;
-      case 0b001: {
-        i.rs1 = i.rd;
-        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
-        i.imm = (i.imm << 26) >> 26;
-        i.op = Op::C_ADDIW;
-      }; break;
-      case 0b010: {
-        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
-        i.imm = (i.imm << 26) >> 26;
-        i.op = Op::C_LI;
-      }; break;
-      case 0b011: {
-        if (i.rd == 2) {
-          i.imm = (((raw >> 12) & 0b1) << 9) | (((raw >> 3) & 0b11) << 7) |
-                  (((raw >> 5) & 0b1) << 6) | (((raw >> 2) & 0b1) << 5) |
-                  (((raw >> 6) & 0b1) << 4);
-          i.imm = (i.imm << 22) >> 22;
-          i.op = Op::C_ADDI16SP;
-        } else {
-          i.imm = (((raw >> 12) & 0b1) << 5) | ((raw >> 2) & 0b11111);
-          i.imm = (i.imm << 26) >> 26;
-          i.op = Op::C_LUI;
-        }
-      }; break;
-      case 0b100: {
-        u8 funct2 = (raw >> 10) & 0b11;
+  template <typename T, typename F> void fp_arith(const Ins &i, F f) {
+    T a = freg<T>(i.rs1);
+    T b = freg<T>(i.rs2);
+    set_freg<T>(i.rd, canonical(rounded(i.rm, [&] { return f(a, b); })));
+  }
+
+  // rs1 * rs2 + rs3, with the product and/or the addend negated
+  template <typename T>
+  void fp_fma(const Ins &i, bool negate_product, bool negate_addend) {
+    T a = freg<T>(i.rs1);
+    T b = freg<T>(i.rs2);
+    T c = freg<T>(i.rs3);
+    if (negate_product) {
+      a = -a;
+    }
+    if (negate_addend) {
+      c = -c;
+    }
+    set_freg<T>(i.rd,
+                canonical(rounded(i.rm, [&] { return std::fma(a, b, c); })));
+  }
+
+  // a NaN operand loses against a number, and -0 is less than +0
+  template <typename T> void fp_min_max(const Ins &i, bool max) {
+    set_freg<T>(i.rd, min_max(freg<T>(i.rs1), freg<T>(i.rs2), max));
+  }
+
+  template <typename T> T min_max(T a, T b, bool max) {
+    if (is_snan(a) || is_snan(b)) {
+      m_fflags |= FLAG_NV;
+    }
+    if (std::isnan(a) && std::isnan(b)) {
+      return std::numeric_limits<T>::quiet_NaN();
+    } else if (std::isnan(a)) {
+      return b;
+    } else if (std::isnan(b)) {
+      return a;
+    } else if (a == b) {
+      return std::signbit(a) != max ? a : b;
+    } else {
+      return (a < b) != max ? a : b;
+    }
+  }
+
+  // sign(a, b) gives the result's sign bit from those of rs1 and rs2
+  template <typename T, typename F> void fp_sign_inject(const Ins &i, F sign) {
+    using U = FpBits<T>;
+    U sign_bit = U(1) << (sizeof(U) * 8 - 1);
+    U a = freg_bits<T>(i.rs1);
+    U b = freg_bits<T>(i.rs2);
+    set_freg_bits<T>(i.rd, (a & ~sign_bit) | ((U)sign(a, b) & sign_bit));
+  }
 
-        if (funct2 == 0b11) {
-          i.rs1 = ((raw >> 7) & 0b111) + 8;
-          i.rd = i.rs1;
+  // feq only signals on signaling NaNs, flt and fle on any NaN
+  template <typename T, typename F>
+  void fp_compare(const Ins &i, bool quiet, F compare) {
+    T a = freg<T>(i.rs1);
+    T b = freg<T>(i.rs2);
+    if (quiet ? is_snan(a) || is_snan(b) : std::isnan(a) || std::isnan(b)) {
+      m_fflags |= FLAG_NV;
+    }
+    m_regs[i.rd] = compare(a, b);
+  }
 
-          bool bit12 = (raw >> 12) & 0b1;
-          i.rs2 = ((raw >> 2) & 0b111) + 8;
-          u8 sub_op = (raw >> 5) & 0b11;
+  template <typename T> static u64 fp_class(T v) {
+    bool negative = std::signbit(v);
+    switch (std::fpclassify(v)) {
+    case FP_INFINITE:
+      return negative ? 1 << 0 : 1 << 7;
+    case FP_NORMAL:
+      return negative ? 1 << 1 : 1 << 6;
+    case FP_SUBNORMAL:
+      return negative ? 1 << 2 : 1 << 5;
+    case FP_ZERO:
+      return negative ? 1 << 3 : 1 << 4;
+    default:
+      return is_snan(v) ? 1 << 8 : 1 << 9;
+    }
+  }
 
-          if (bit12 == 0) {
-            switch (sub_op) {
-            case 0b00:
-              i.op = Op::C_SUB;
-              break;
-            case 0b01:
-              i.op = Op::C_XOR;
-              break;
-            case 0b10:
-              i.op = Op::C_OR;
-              break;
-            case 0b11:
-              i.op = Op::C_AND;
-              break;
-            default:
-              std::println(
-                  stderr,
-                  "C: opcode=01: funct3=100: bit12=0: unrecognized sub_op");
-              exit(1);
-            }
-          } else {
-            switch (sub_op) {
-            case 0b00:
-              i.op = Op::C_SUBW;
-              break;
-            case 0b01:
-              i.op = Op::C_ADDW;
-              break;
-            default:
-              std::println(stderr,
-                           "C: opcode=01: funct3=100: bit12=1: unrecognized "
-                           "sub_op: {:b}",
-                           sub_op);
-              exit(1);
-            }
-          }
-        } else {
-          i.rd = ((raw >> 7) & 0b111) + 8;
-          i.rs1 = i.rd;
-          i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
+  // Conversions to integers saturate, and NaN converts to the maximum. The
+  // rounding is done in software, so it doesn't depend on the host mode.
+  template <typename T, typename I> void fp_to_int(const Ins &i) {
+    I result = to_int<T, I>(freg<T>(i.rs1), i.rm);
+    // 32-bit results are sign-extended, even unsigned ones
+    if constexpr (sizeof(I) == 4) {
+      m_regs[i.rd] = (i32)result;
+    } else {
+      m_regs[i.rd] = result;
+    }
+  }
 
-          switch (funct2) {
-          case 0b00:
-            i.op = Op::C_SRLI;
-            break;
-          case 0b01:
-            i.op = Op::C_SRAI;
-            break;
-          case 0b10:
-            i.imm = (i.imm << 26) >> 26;
-            i.op = Op::C_ANDI;
-            break;
-          default:
-            std::println(
-                stderr,
-                "C: opcode=01: funct3=100: funct2!=11: unrecognized funct2");
-            exit(1);
-          }
+  // value rounded by rm and saturated to I
+  template <typename T, typename I> I to_int(T value, u8 rm) {
+    double x = value;
+    double hi = std::ldexp(1.0, std::numeric_limits<I>::digits);
+    double lo = std::is_signed_v<I> ? -hi : 0.0;
+
+    // the flags are worked out here, not by the host's rounding helpers
+    fexcept_t host_flags;
+    fegetexceptflag(&host_flags, FE_ALL_EXCEPT);
+    I result;
+    if (std::isnan(x)) {
+      m_fflags |= FLAG_NV;
+      result = std::numeric_limits<I>::max();
+    } else {
+      double r = x;
+      switch (rounding_mode(rm)) {
+      case RM_RNE:
+        if (std::isfinite(x)) {
+          r = x - std::remainder(x, 1.0);
         }
-      }; break;
-      case 0b101: {
-        i.rd = 0;
-        i.imm = (((raw >> 12) & 0b1) << 11) | (((raw >> 11) & 0b1) << 4) |
-                (((raw >> 9) & 0b11) << 8) | (((raw >> 8) & 0b1) << 10) |
-                (((raw >> 7) & 0b1) << 6) | (((raw >> 6) & 0b1) << 7) |
-                (((raw >> 5) & 0b1) << 3) | (((raw >> 3) & 0b11) << 1) |
-                (((raw >> 2) & 0b1) << 5);
-        i.imm = (i.imm << 20) >> 20;
-        i.op = Op::C_J;
-      }; break;
-      case 0b110: {
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.rs2 = 0;
-        i.imm = (((raw >> 12) & 0b1) << 8) | (((raw >> 10) & 0b11) << 3) |
-                (((raw >> 5) & 0b11) << 6) | (((raw >> 3) & 0b11) << 1) |
-                (((raw >> 2) & 0b1) << 5);
-        i.imm = (i.imm << 23) >> 23;
-        i.op = Op::C_BEQZ;
-      }; break;
-      case 0b111: {
-        i.rs1 = ((raw >> 7) & 0b111) + 8;
-        i.rs2 = 0;
-        i.imm = (((raw >> 12) & 0b1) << 8) | (((raw >> 10) & 0b11) << 3) |
-                (((raw >> 5) & 0b11) << 6) | (((raw >> 3) & 0b11) << 1) |
-                (((raw >> 2) & 0b1) << 5);
-        i.imm = (i.imm << 23) >> 23;
-        i.op = Op::C_BNEZ;
-      }; break;
-      default: {
-        std::println(stderr, "C: opcode=01: unrecognized funct3: {:03b}",
-                     funct3);
-        exit(1);
-      }; break;
+        break;
+      case RM_RTZ:
+        r = std::trunc(x);
+        break;
+      case RM_RDN:
+        r = std::floor(x);
+        break;
+      case RM_RUP:
+        r = std::ceil(x);
+        break;
+      case RM_RMM:
+        r = std::round(x);
+        break;
       }
-    }; break;
-    case 0b10: {
-      switch (funct3) {
-      case 0b000: {
-        i.imm = ((raw >> 2) & 0b11111) | (((raw >> 12) & 0b1) << 5);
-        i.op = Op::C_SLLI;
-      }; break;
-      case 0b001: {
-        i.rs1 = 2;
-        i.imm = (((raw >> 12) & 0b1) << 5) | (((raw >> 5) & 0b11) << 3) |
-                (((raw >> 2) & 0b111) << 6);
-        i.op = Op::C_FLDSP;
-      }; break;
-      case 0b010: {
-        i.rs1 = 2;
-        i.imm = (((raw >> 2) & 0b11) << 6) | (((raw >> 12) & 0b1) << 5) |
-                (((raw >> 4) & 0b111) << 2);
-        i.op = Op::C_LWSP;
-      }; break;
-      case 0b011: {
-        i.rs1 = 2;
-        i.imm = (((raw >> 12) & 0b1) << 5) | (((raw >> 5) & 0b11) << 3) |
-                (((raw >> 2) & 0b111) << 6);
-        i.op = Op::C_LDSP;
-      }; break;
-      case 0b100: {
-        bool bit12 = (raw >> 12) & 0b1;
-        i.rs2 = (raw >> 2) & 0b11111;
-
-        if (bit12 == 0) {
-          if (i.rs2 == 0) {
-            i.rs1 = i.rd;
-            i.rd = 0;
-            i.imm = 0;
-            i.op = Op::C_JR;
-          } else {
-            i.rs1 = 0;
-            i.op = Op::C_MV;
-          }
-        } else {
-          if (i.rs2 == 0) {
-            if (i.rd == 0) {
-              i.op = Op::C_EBREAK;
-            } else {
-              i.rs1 = i.rd;
-              i.rd = 1;
-              i.imm = 0;
-              i.op = Op::C_JALR;
-            }
-          } else {
-            i.rs1 = i.rd;
-            i.op = Op::C_ADD;
-          }
+      if (r < lo || r >= hi) {
+        m_fflags |= FLAG_NV;
+        result = r < 0 ? std::numeric_limits<I>::min()
+                       : std::numeric_limits<I>::max();
+      } else {
+        result = (I)r;
+        if (r != x) {
+          m_fflags |= FLAG_NX;
         }
-      }; break;
-      case 0b101: {
-        i.rs2 = (raw >> 2) & 0b11111;
-        i.rs1 = 2;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 7) & 0b111) << 6);
-        i.op = Op::C_FSDSP;
-      }; break;
-      case 0b110: {
-        i.rs2 = (raw >> 2) & 0b11111;
-        i.rs1 = 2;
-        i.imm = (((raw >> 9) & 0b1111) << 2) | (((raw >> 7) & 0b11) << 6);
-        i.op = Op::C_SWSP;
-      }; break;
-      case 0b111: {
-        i.rs2 = (raw >> 2) & 0b11111;
-        i.imm = (((raw >> 10) & 0b111) << 3) | (((raw >> 7) & 0b111) << 6);
-        i.op = Op::C_SDSP;
-      }; break;
-      default: {
-        std::println(stderr, "C: opcode=10: unrecognized funct3: {:03b}",
-                     funct3);
-        exit(1);
-      }; break;
       }
-    }; break;
-    default: {
-      std::println(stderr, "C: unrecognized opcode: {:02b}", opcode);
-      exit(1);
-    }; break;
     }
+    fesetexceptflag(&host_flags, FE_ALL_EXCEPT);
+    return result;
+  }
 
-    return i;
+  template <typename T, typename I> void int_to_fp(const Ins &i) {
+    I v = m_regs[i.rs1];
+    set_freg<T>(i.rd, rounded(i.rm, [v] { return (T)v; }));
   }
 
-  // https://docs.riscv.org/reference/isa/unpriv/rv-32-64g.html
-  Ins decode_raw_32bit(u32 raw) {
-    u8 opcode = raw & 0b1111111;
+  [[noreturn]] void illegal_instruction() {
+    fatal("Illegal instruction 0x{:x} at pc=0x{:x}", read_ins(m_pc), m_pc);
+  }
 
-    Ins i;
-    i.op = Op::INVALID;
+  // Vector registers hold raw bytes, elements are copied in and out.
+  template <typename T> static T load_as(const u8 *p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+  }
+  template <typename T> static void store_as(u8 *p, T v) {
+    std::memcpy(p, &v, sizeof(T));
+  }
 
-    switch (opcode) {
-    case 0b1100011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
-      i32 imm_12 = (raw >> 31) & 0b1;
-      i32 imm_10_5 = (raw >> 25) & 0b111111;
-      i32 imm_4_1 = (raw >> 8) & 0b1111;
-      i32 imm_11 = (raw >> 7) & 0b1;
-      i.imm =
-          (imm_12 << 12) | (imm_11 << 11) | (imm_10_5 << 5) | (imm_4_1 << 1);
-      i.imm = (i.imm << 19) >> 19;
+  // AVL for vsetvl{i}: rs1 = x0 asks for VLMAX, or keeps vl if rd is x0 too
+  u64 avl(const Ins &i) const {
+    if (i.rs1 != 0) {
+      return m_regs[i.rs1];
+    }
+    return i.rd != REG_SINK ? ~0ULL : m_vl;
+  }
 
-      if (funct3 == 0b000) {
-        i.op = Op::BEQ;
-      } else if (funct3 == 0b001) {
-        i.op = Op::BNE;
-      } else if (funct3 == 0b100) {
-        i.op = Op::BLT;
-      } else if (funct3 == 0b101) {
-        i.op = Op::BGE;
-      } else if (funct3 == 0b110) {
-        i.op = Op::BLTU;
-      } else if (funct3 == 0b111) {
-        i.op = Op::BGEU;
-      } else {
-        std::println(stderr, "B-type: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vset{i}vl{i}: an unsupported vtype sets vill, and vl to 0
+  void set_vl(const Ins &i, u64 avl, u64 vtype) {
+    u64 vlmul = vtype & 0b111;
+    u64 vsew = (vtype >> 3) & 0b111;
+    // LMUL as a power of two, negative for the fractional ones
+    int lmul_log2 = vlmul < 4 ? (int)vlmul : (int)vlmul - 8;
+    if (vlmul == 4 || vsew > 3 || (vtype >> 8) != 0 ||
+        (int)vsew + 3 > std::countr_zero(ELEN) + lmul_log2) {
+      m_vtype = VTYPE_VILL;
+      m_vlmax = 0;
+      m_vl = 0;
+    } else {
+      m_vtype = vtype;
+      m_vsew = 1 << vsew;
+      u64 bits = lmul_log2 >= 0 ? VLEN << lmul_log2 : VLEN >> -lmul_log2;
+      m_vlmax = bits / (8 * m_vsew);
+      m_vl = std::min(avl, m_vlmax);
+    }
+    m_regs[i.rd] = m_vl;
+  }
+
+  // The register group starting at v, for elements of size bytes under the
+  // current vtype. A group must be aligned to its size in registers.
+  u8 *vreg(u8 v, u64 size) {
+    u64 regs = (m_vlmax * size + VLENB - 1) / VLENB;
+    if (m_vlmax == 0 || regs > 8 || v % regs != 0) {
+      illegal_instruction();
+    }
+    return m_vregs.data() + v * VLENB;
+  }
+
+  // a single register: a mask, or the scalar operand of a reduction
+  u8 *vreg_single(u8 v) {
+    if (m_vlmax == 0) {
+      illegal_instruction();
+    }
+    return m_vregs.data() + v * VLENB;
+  }
+
+  static bool mask_bit(const u8 *mask, u64 k) {
+    return (mask[k / 8] >> (k % 8)) & 1;
+  }
+
+  // element k takes part unless the instruction is masked and v0 says no
+  bool active(const Ins &i, u64 k) const {
+    return i.vm || mask_bit(m_vregs.data(), k);
+  }
+
+  // Calls f with a zero of the integer type for SEW. SEWs outside [min, max]
+  // bytes are illegal for the instruction.
+  template <bool is_signed, u64 min = 1, u64 max = 8, typename F>
+  void with_sew(F f) {
+    switch (m_vsew) {
+    case 1:
+      return with_int<is_signed, 1, min, max>(f);
+    case 2:
+      return with_int<is_signed, 2, min, max>(f);
+    case 4:
+      return with_int<is_signed, 4, min, max>(f);
+    default:
+      return with_int<is_signed, 8, min, max>(f);
+    }
+  }
+  template <bool is_signed, u64 size, u64 min, u64 max, typename F>
+  void with_int(F f) {
+    if constexpr (size < min || size > max) {
+      illegal_instruction();
+    } else {
+      f(IntOfSize<std::conditional_t<is_signed, i8, u8>, size>{});
+    }
+  }
+
+  // the same for the FP types, SEW 32 and 64 only
+  template <typename F> void with_fp_sew(F f) {
+    switch (m_vsew) {
+    case 4:
+      return f(float{});
+    case 8:
+      return f(double{});
+    default:
+      illegal_instruction();
+    }
+  }
+
+  // the scalar operand of a .vx, .vi or .vf instruction, as an element
+  template <typename T, VSrc src> T v_scalar(const Ins &i) const {
+    if constexpr (src == VSrc::X) {
+      return (T)m_regs[i.rs1];
+    } else if constexpr (src == VSrc::I) {
+      return (T)i.imm;
+    } else if constexpr (src == VSrc::F) {
+      return freg<T>(i.rs1);
+    } else {
+      return T{};
+    }
+  }
+
+  // Stores the lanes of r that are active elements below vl, the first one
+  // being element k of vd. Unmasked chunks wholly below vl are stored as one
+  // host vector. The other elements are left alone, which is what both the
+  // undisturbed and the agnostic policies allow.
+  template <typename T>
+  void v_store_chunk(const Ins &i, u8 *vd, u64 k, Simd<T> r) {
+    constexpr u64 lanes = VLENB / sizeof(T);
+    if (i.vm && k + lanes <= m_vl) {
+      store_as(vd + k * sizeof(T), r);
+      return;
+    }
+    for (u64 j = 0; j < lanes && k + j < m_vl; j++) {
+      if (active(i, k + j)) {
+        store_as<T>(vd + (k + j) * sizeof(T), r[j]);
       }
-    }; break;
-    case 0b0010011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct6 = (raw >> 26) & 0b111111;
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.imm = ((i32)raw) >> 20;
-      i.shamt = (raw >> 20) & 0b111111;
+    }
+  }
+
+  // vd = f(vs2, vs1 or x), a host vector at a time
+  template <typename T, VSrc src, typename F>
+  void v_binary(const Ins &i, T x, F f) {
+    v_ternary<T, src>(i, x, [&](auto, auto a, auto b) { return f(a, b); });
+  }
+
+  // vd = f(vd, vs2, vs1 or x), a host vector at a time
+  template <typename T, VSrc src, typename F>
+  void v_ternary(const Ins &i, T x, F f) {
+    using V = Simd<T>;
+    constexpr u64 lanes = VLENB / sizeof(T);
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(T)) : nullptr;
+    V b = V{} + x;
+    for (u64 k = 0; k < m_vl; k += lanes) {
+      if constexpr (src == VSrc::V) {
+        b = load_as<V>(vs1 + k * sizeof(T));
+      }
+      V d = load_as<V>(vd + k * sizeof(T));
+      V r = f(d, load_as<V>(vs2 + k * sizeof(T)), b);
+      v_store_chunk<T>(i, vd, k, r);
+    }
+  }
+
+  // vd = f(vd, vs2, vs1 or x) an element at a time, for the ops the host
+  // has no vector instructions for
+  template <typename T, VSrc src, typename F>
+  void v_each(const Ins &i, T x, F f) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(T)) : nullptr;
+    for (u64 k = 0; k < m_vl; k++) {
+      if (!active(i, k)) {
+        continue;
+      }
+      T b = src == VSrc::V ? load_as<T>(vs1 + k * sizeof(T)) : x;
+      T d = load_as<T>(vd + k * sizeof(T));
+      store_as<T>(vd + k * sizeof(T),
+                  f(d, load_as<T>(vs2 + k * sizeof(T)), b));
+    }
+  }
+
+  // vd = f(vs2) an element at a time, converting From to To of the same size
+  template <typename From, typename To, typename F>
+  void v_unary(const Ins &i, F f) {
+    static_assert(sizeof(From) == sizeof(To));
+    u8 *vd = vreg(i.rd, sizeof(To));
+    u8 *vs2 = vreg(i.rs2, sizeof(From));
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        store_as<To>(vd + k * sizeof(To),
+                     f(load_as<From>(vs2 + k * sizeof(From))));
+      }
+    }
+  }
+
+  // Mask bit k of vd = f(vs2, vs1 or x), where f compares host vectors. vd
+  // may overlap the sources, so the mask is built on the side.
+  template <typename T, VSrc src, typename F>
+  void v_compare(const Ins &i, T x, F f) {
+    using V = Simd<T>;
+    constexpr u64 lanes = VLENB / sizeof(T);
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(T)) : nullptr;
+    u8 *vd = vreg_single(i.rd);
+    std::array<u8, VLENB> mask;
+    std::memcpy(mask.data(), vd, VLENB);
+    V b = V{} + x;
+    for (u64 k = 0; k < m_vl; k += lanes) {
+      if constexpr (src == VSrc::V) {
+        b = load_as<V>(vs1 + k * sizeof(T));
+      }
+      auto r = f(load_as<V>(vs2 + k * sizeof(T)), b);
+      for (u64 j = 0; j < lanes && k + j < m_vl; j++) {
+        u64 n = k + j;
+        if (active(i, n)) {
+          mask[n / 8] = (mask[n / 8] & ~(1 << (n % 8))) |
+                        ((r[j] != 0) << (n % 8));
+        }
+      }
+    }
+    std::memcpy(vd, mask.data(), VLENB);
+  }
+
+  // vd[0] = vs1[0] folded with the active elements of vs2, in order
+  template <typename T, typename F> void v_reduce(const Ins &i, F f) {
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    T acc = load_as<T>(vreg_single(i.rs1));
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        acc = f(acc, load_as<T>(vs2 + k * sizeof(T)));
+      }
+    }
+    if (m_vl > 0) {
+      store_as<T>(vreg_single(i.rd), acc);
+    }
+  }
+
+  template <bool is_signed, VSrc src, typename F>
+  void v_int(const Ins &i, F f) {
+    with_sew<is_signed>([&](auto t) {
+      using T = decltype(t);
+      v_binary<T, src>(i, v_scalar<T, src>(i), f);
+    });
+  }
+
+  template <bool is_signed, VSrc src, typename F>
+  void v_int_ternary(const Ins &i, F f) {
+    with_sew<is_signed>([&](auto t) {
+      using T = decltype(t);
+      v_ternary<T, src>(i, v_scalar<T, src>(i), f);
+    });
+  }
+
+  template <bool is_signed, VSrc src, typename F>
+  void v_int_each(const Ins &i, F f) {
+    with_sew<is_signed>([&](auto t) {
+      using T = decltype(t);
+      v_each<T, src>(i, v_scalar<T, src>(i), f);
+    });
+  }
+
+  template <bool is_signed, VSrc src, typename F>
+  void v_int_compare(const Ins &i, F f) {
+    with_sew<is_signed>([&](auto t) {
+      using T = decltype(t);
+      v_compare<T, src>(i, v_scalar<T, src>(i), f);
+    });
+  }
 
-      if (funct3 == 0b000) {
-        i.op = Op::ADDI;
-      } else if (funct3 == 0b001) {
-        if (funct6 == 0b000000) {
-          i.op = Op::SLLI;
-        } else {
-          std::println(stderr, "0010011: funct3=001: unrecognized funct6: {:b}",
-                       funct6);
-          exit(1);
-        }
-      } else if (funct3 == 0b010) {
-        i.op = Op::SLTI;
-      } else if (funct3 == 0b011) {
-        i.op = Op::SLTIU;
-      } else if (funct3 == 0b100) {
-        i.op = Op::XORI;
-      } else if (funct3 == 0b101) {
-        i.shamt = (raw >> 20) & 0b111111;
-        funct6 = (raw >> 26) & 0b111111;
+  template <bool is_signed, typename F> void v_int_reduce(const Ins &i, F f) {
+    with_sew<is_signed>([&](auto t) { v_reduce<decltype(t)>(i, f); });
+  }
 
-        if (funct6 == 0b000000) {
-          i.op = Op::SRLI;
-        } else if (funct6 == 0b010000) {
-          i.op = Op::SRAI;
-        } else {
-          std::println(stderr, "0010011: funct3=101: unrecognized funct6: {:b}",
-                       funct6);
-          exit(1);
+  // vd = f(vd, vs2, vs1 or x) with vd twice as wide as SEW, the sources
+  // extended as host vectors first
+  template <bool is_signed, VSrc src, typename F>
+  void v_int_widen(const Ins &i, F f) {
+    with_sew<is_signed, 1, 4>([&](auto t) {
+      using N = decltype(t);
+      using W = IntOfSize<N, 2 * sizeof(N)>;
+      using V = Simd<W>;
+      constexpr u64 lanes = VLENB / sizeof(W);
+      using NarrowV = Simd<N, lanes>;
+      u8 *vd = vreg(i.rd, sizeof(W));
+      u8 *vs2 = vreg(i.rs2, sizeof(N));
+      u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(N)) : nullptr;
+      V b = V{} + (W)v_scalar<N, src>(i);
+      for (u64 k = 0; k < m_vl; k += lanes) {
+        if constexpr (src == VSrc::V) {
+          b = __builtin_convertvector(load_as<NarrowV>(vs1 + k * sizeof(N)),
+                                      V);
         }
-      } else if (funct3 == 0b110) {
-        i.op = Op::ORI;
-      } else if (funct3 == 0b111) {
-        i.op = Op::ANDI;
-      } else {
-        std::println(stderr, "0010011: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+        V a = __builtin_convertvector(load_as<NarrowV>(vs2 + k * sizeof(N)),
+                                      V);
+        V d = load_as<V>(vd + k * sizeof(W));
+        v_store_chunk<W>(i, vd, k, f(d, a, b));
       }
-    }; break;
-    case 0b0000011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.imm = ((i32)raw) >> 20;
+    });
+  }
 
-      if (funct3 == 0b000) {
-        i.op = Op::LB;
-      } else if (funct3 == 0b001) {
-        i.op = Op::LH;
-      } else if (funct3 == 0b010) {
-        i.op = Op::LW;
-      } else if (funct3 == 0b011) {
-        i.op = Op::LD;
-      } else if (funct3 == 0b100) {
-        i.op = Op::LBU;
-      } else if (funct3 == 0b101) {
-        i.op = Op::LHU;
-      } else if (funct3 == 0b110) {
-        i.op = Op::LWU;
-      } else {
-        std::println(stderr, "0000011: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vd = vs2 / factor wide elements, zero or sign extended as T is signed
+  template <typename T, u64 factor> void v_extend(const Ins &i) {
+    using N = IntOfSize<T, sizeof(T) / factor>;
+    using V = Simd<T>;
+    constexpr u64 lanes = VLENB / sizeof(T);
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(N));
+    for (u64 k = 0; k < m_vl; k += lanes) {
+      V r = __builtin_convertvector(
+          load_as<Simd<N, lanes>>(vs2 + k * sizeof(N)), V);
+      v_store_chunk<T>(i, vd, k, r);
+    }
+  }
+
+  // vd = vs2, twice as wide as SEW, shifted right and truncated
+  template <typename N, VSrc src> void v_narrow_shift(const Ins &i) {
+    using W = IntOfSize<N, 2 * sizeof(N)>;
+    u8 *vd = vreg(i.rd, sizeof(N));
+    u8 *vs2 = vreg(i.rs2, sizeof(W));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(N)) : nullptr;
+    N x = v_scalar<N, src>(i);
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        u64 shift = src == VSrc::V ? load_as<N>(vs1 + k * sizeof(N)) : x;
+        W a = load_as<W>(vs2 + k * sizeof(W));
+        store_as<N>(vd + k * sizeof(N), a >> (shift & (8 * sizeof(W) - 1)));
       }
-    }; break;
-    case 0b1100111: {
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.imm = ((i32)raw) >> 20;
-      i.op = Op::JALR;
-    }; break;
-    case 0b1110011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.imm = (raw >> 20) & 0b111111111111;
+    }
+  }
 
-      switch (funct3) {
-      case 0b000: {
-        if (i.imm == 0) {
-          i.op = Op::ECALL;
-        } else {
-          std::println(stderr, "1110011: funct3=000: unrecognized imm: {:b}",
-                       i.imm);
-          exit(1);
-        }
-      }; break;
-      case 0b010: {
-        i.op = Op::CSRRS;
-      }; break;
-      case 0b110: {
-        i.op = Op::CSRRSI;
-      }; break;
-      default:
-        std::println(stderr, "1110011: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vd = v0 ? vs1 or x : vs2, for all elements below vl
+  template <typename T, VSrc src> void v_merge(const Ins &i, T x) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(T)) : nullptr;
+    for (u64 k = 0; k < m_vl; k++) {
+      T b = src == VSrc::V ? load_as<T>(vs1 + k * sizeof(T)) : x;
+      T a = load_as<T>(vs2 + k * sizeof(T));
+      store_as<T>(vd + k * sizeof(T), mask_bit(m_vregs.data(), k) ? b : a);
+    }
+  }
+
+  // vd[k] = vs2[vs1[k] or x], 0 past VLMAX
+  template <typename T, VSrc src> void v_gather(const Ins &i) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    u8 *vs1 = src == VSrc::V ? vreg(i.rs1, sizeof(T)) : nullptr;
+    u64 x = src == VSrc::X ? m_regs[i.rs1] : (u64)i.imm;
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        u64 index = src == VSrc::V ? load_as<T>(vs1 + k * sizeof(T)) : x;
+        T v = index < m_vlmax ? load_as<T>(vs2 + index * sizeof(T)) : 0;
+        store_as<T>(vd + k * sizeof(T), v);
       }
-    }; break;
-    case 0b1101111: {
-      i.rd = (raw >> 7) & 0b11111;
-      i32 imm_20 = (raw >> 31) & 0b1;
-      i32 imm_10_1 = (raw >> 21) & 0b1111111111;
-      i32 imm_11 = (raw >> 20) & 0b1;
-      i32 imm_19_12 = (raw >> 12) & 0b11111111;
-      i.imm =
-          (imm_20 << 20) | (imm_19_12 << 12) | (imm_11 << 11) | (imm_10_1 << 1);
-      i.imm = (i.imm << 11) >> 11;
-      i.op = Op::JAL;
-    }; break;
-    case 0b0110011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct7 = (u8)((raw >> 25) & 0b1111111);
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
+    }
+  }
 
-      if (funct3 == 0b000) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::ADD;
-        } else if (funct7 == 0b0100000) {
-          i.op = Op::SUB;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::MUL;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b000: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b001) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SLL;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::MULH;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b001: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b010) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SLT;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b010: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b011) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SLTU;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::MULHU;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b011: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b100) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::XOR;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::DIV;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b100: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b101) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SRL;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::DIVU;
-        } else if (funct7 == 0b0100000) {
-          i.op = Op::SRA;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b101: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b110) {
-        if (funct7 == 0b0000001) {
-          i.op = Op::REM;
-        } else if (funct7 == 0b0000000) {
-          i.op = Op::OR;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b110: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b111) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::AND;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::REMU;
-        } else {
-          std::println(stderr,
-                       "R-type 1: funct3=0b111: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else {
-        std::println(stderr, "R-type 1: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vd[k] = vs2[k - offset], elements below offset keep their value
+  template <typename T> void v_slide_up(const Ins &i, u64 offset) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    for (u64 k = offset; k < m_vl; k++) {
+      if (active(i, k)) {
+        store_as<T>(vd + k * sizeof(T),
+                    load_as<T>(vs2 + (k - offset) * sizeof(T)));
       }
-    }; break;
-    case 0b0101111: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct7 = (raw >> 27) & 0b11111;
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
+    }
+  }
 
-      if (funct3 == 0b010) {
-        switch (funct7) {
-        case 0b00000: {
-          i.op = Op::AMOADD_W;
-        }; break;
-        case 0b00001: {
-          i.op = Op::AMOSWAP_W;
-        }; break;
-        case 0b00010: {
-          i.op = Op::LR_W;
-        }; break;
-        case 0b00011: {
-          i.op = Op::SC_W;
-        }; break;
-        case 0b01000: {
-          i.op = Op::AMOOR_W;
-        }; break;
-        case 0b11100: {
-          i.op = Op::AMOMAXU_W;
-        }; break;
-        default: {
-          std::println(stderr,
-                       "0101111: funct3=010: unrecognized funct7: {:05b}",
-                       funct7);
-          exit(1);
-        }; break;
-        }
-      } else if (funct3 == 0b011) {
-        switch (funct7) {
-        case 0b00000: {
-          i.op = Op::AMOADD_D;
-        }; break;
-        case 0b00001: {
-          i.op = Op::AMOSWAP_D;
-        }; break;
-        case 0b00010: {
-          i.op = Op::LR_D;
-        }; break;
-        case 0b00011: {
-          i.op = Op::SC_D;
-        }; break;
-        case 0b11100: {
-          i.op = Op::AMOMAXU_D;
-        }; break;
-        default: {
-          std::println(stderr,
-                       "0101111: funct3=011: unrecognized funct7: {:05b}",
-                       funct7);
-          exit(1);
-        }; break;
-        }
-      } else {
-        std::println(stderr, "0101111: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vd[k] = vs2[k + offset], 0 past VLMAX
+  template <typename T> void v_slide_down(const Ins &i, u64 offset) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        T v = offset < m_vlmax - k ? load_as<T>(vs2 + (k + offset) * sizeof(T))
+                                   : 0;
+        store_as<T>(vd + k * sizeof(T), v);
       }
-    }; break;
-    case 0b0111011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct7 = (u8)((raw >> 25) & 0b1111111);
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
+    }
+  }
 
-      if (funct3 == 0b000) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::ADDW;
-        } else if (funct7 == 0b0100000) {
-          i.op = Op::SUBW;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::MULW;
-        } else {
-          std::println(stderr,
-                       "R-type 3: funct3=000: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b001) {
-        i.op = Op::SLLW;
-      } else if (funct3 == 0b100) {
-        i.op = Op::DIVW;
-      } else if (funct3 == 0b101) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SRLW;
-        } else if (funct7 == 0b0100000) {
-          i.op = Op::SRAW;
-        } else if (funct7 == 0b0000001) {
-          i.op = Op::DIVUW;
-        } else {
-          std::println(stderr,
-                       "R-type 3: funct3=101: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else if (funct3 == 0b110) {
-        i.op = Op::REMW;
-      } else if (funct3 == 0b111) {
-        i.op = Op::REMUW;
-      } else {
-        std::println(stderr, "R-type 3: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // packs the elements of vs2 selected by the mask in vs1 into vd
+  template <typename T> void v_compress(const Ins &i) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u8 *vs2 = vreg(i.rs2, sizeof(T));
+    const u8 *vs1 = vreg_single(i.rs1);
+    u64 n = 0;
+    for (u64 k = 0; k < m_vl; k++) {
+      if (mask_bit(vs1, k)) {
+        store_as<T>(vd + n++ * sizeof(T), load_as<T>(vs2 + k * sizeof(T)));
       }
-    }; break;
-    case 0b0011011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct7 = (raw >> 25) & 0b1111111;
-      i.rd = (raw >> 7) & 0b11111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.imm = ((i32)raw) >> 20;
-      i.shamt = (raw >> 20) & 0b11111;
+    }
+  }
+
+  // vd = f(vs2, vs1) on the first vl mask bits, a byte at a time
+  template <typename F> void v_mask_logical(const Ins &i, F f) {
+    u8 *vd = vreg_single(i.rd);
+    const u8 *vs2 = vreg_single(i.rs2);
+    const u8 *vs1 = vreg_single(i.rs1);
+    u64 bytes = m_vl / 8;
+    for (u64 j = 0; j < bytes; j++) {
+      vd[j] = f(vs2[j], vs1[j]);
+    }
+    if (u64 rest = m_vl % 8) {
+      u8 keep = 0xff << rest;
+      vd[bytes] = (f(vs2[bytes], vs1[bytes]) & ~keep) | (vd[bytes] & keep);
+    }
+  }
+
+  // vmv<n>r.v, independent of vtype
+  void v_move_whole(const Ins &i, u64 regs) {
+    if (i.rd % regs != 0 || i.rs2 % regs != 0) {
+      illegal_instruction();
+    }
+    std::memmove(m_vregs.data() + i.rd * VLENB,
+                 m_vregs.data() + i.rs2 * VLENB, regs * VLENB);
+  }
+
+  // vd = f(vs2, vs1 or f) on host vectors, with NaN results made canonical
+  template <VSrc src, typename F> void v_fp(const Ins &i, F f) {
+    with_fp_sew([&](auto t) {
+      using T = decltype(t);
+      using V = Simd<T>;
+      v_binary<T, src>(i, v_scalar<T, src>(i), [&](V a, V b) {
+        V r = f(a, b);
+        return r == r ? r : V{} + std::numeric_limits<T>::quiet_NaN();
+      });
+    });
+  }
+
+  template <VSrc src, typename F> void v_fp_each(const Ins &i, F f) {
+    with_fp_sew([&](auto t) {
+      using T = decltype(t);
+      v_each<T, src>(i, v_scalar<T, src>(i),
+                     [&](T d, T a, T b) { return canonical(f(d, a, b)); });
+    });
+  }
+
+  template <VSrc src, typename F> void v_fp_compare(const Ins &i, F f) {
+    with_fp_sew([&](auto t) {
+      using T = decltype(t);
+      v_compare<T, src>(i, v_scalar<T, src>(i), f);
+    });
+  }
+
+  template <typename F> void v_fp_reduce(const Ins &i, F f) {
+    with_fp_sew([&](auto t) {
+      using T = decltype(t);
+      v_reduce<T>(i, [&](T acc, T v) { return canonical(f(acc, v)); });
+    });
+  }
+
+  // f(a, b, sign bit) on the raw bits
+  template <VSrc src, typename F> void v_fp_sign_inject(const Ins &i, F f) {
+    with_fp_sew([&](auto t) {
+      using T = decltype(t);
+      using U = FpBits<T>;
+      U sign = U(1) << (8 * sizeof(U) - 1);
+      U x = src == VSrc::F ? freg_bits<T>(i.rs1) : 0;
+      v_binary<U, src>(i, x, [&](auto a, auto b) { return f(a, b, sign); });
+    });
+  }
+
+  // unit-stride: vl elements at x[rs1], copied in one go when unmasked
+  template <typename T> void v_load(const Ins &i) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u64 addr = m_regs[i.rs1];
+    if (i.vm) {
+      std::memcpy(vd, guest_ptr(addr, m_vl * sizeof(T), PERM_R),
+                  m_vl * sizeof(T));
+      return;
+    }
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        store_as<T>(vd + k * sizeof(T), mem_read<T>(addr + k * sizeof(T)));
+      }
+    }
+  }
+  template <typename T> void v_store(const Ins &i) {
+    u8 *vs3 = vreg(i.rd, sizeof(T));
+    u64 addr = m_regs[i.rs1];
+    if (i.vm) {
+      std::memcpy(guest_ptr(addr, m_vl * sizeof(T), PERM_W), vs3,
+                  m_vl * sizeof(T));
+      return;
+    }
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        mem_write<T>(addr + k * sizeof(T), load_as<T>(vs3 + k * sizeof(T)));
+      }
+    }
+  }
 
-      if (funct3 == 0b000) {
-        i.op = Op::ADDIW;
-      } else if (funct3 == 0b001) {
-        i.op = Op::SLLIW;
-      } else if (funct3 == 0b101) {
-        if (funct7 == 0b0000000) {
-          i.op = Op::SRLIW;
-        } else if (funct7 == 0b0100000) {
-          i.op = Op::SRAIW;
-        } else {
-          std::println(stderr,
-                       "R-type 4: funct3=101: unrecognized funct7: {:b}",
-                       funct7);
-          exit(1);
-        }
-      } else {
-        std::println(stderr, "R-type 4: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // Only the first element may fault, a fault further on cuts vl short
+  // instead.
+  template <typename T> void v_load_first_fault(const Ins &i) {
+    u64 addr = m_regs[i.rs1];
+    u64 n = readable_bytes(addr, m_vl * sizeof(T)) / sizeof(T);
+    if (n < m_vl) {
+      if (n == 0) {
+        check_access(addr, sizeof(T), PERM_R);
       }
-    }; break;
-    case 0b0000111: {
-      u8 funct3 = (raw >> 12) & 0b111;
+      m_vl = n;
+    }
+    v_load<T>(i);
+  }
 
-      switch (funct3) {
-      case 0b010: {
-        i.rd = (raw >> 7) & 0b11111;
-        i.rs1 = (raw >> 15) & 0b11111;
-        i.imm = (i32)raw >> 20;
-        i.op = Op::FLW;
-      }; break;
-      case 0b011: {
-        i.rd = (raw >> 7) & 0b11111;
-        i.rs1 = (raw >> 15) & 0b11111;
-        i.imm = (i32)raw >> 20;
-        i.op = Op::FLD;
-      }; break;
-      default:
-        std::println(stderr, "0000111: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // how much of [addr, addr + len) can be read, up to the first page that
+  // can't
+  u64 readable_bytes(u64 addr, u64 len) const {
+    u64 end = addr;
+    while (end - addr < len) {
+      u64 page = end >> GUEST_PAGE_SHIFT;
+      if (page >= m_page_perms.size() || !(m_page_perms[page] & PERM_R)) {
+        break;
       }
-    }; break;
-    case 0b1010011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      u8 funct7 = (raw >> 25) & 0b1111111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
+      end = (page + 1) << GUEST_PAGE_SHIFT;
+    }
+    return std::min(end - addr, len);
+  }
 
-      switch (funct7) {
-      case 0b0000001: {
-        i.op = Op::FADD_D;
-      }; break;
-      case 0b0010000: {
-        switch (funct3) {
-        case 0b000:
-          i.op = Op::FSGNJ_S;
-          break;
-        case 0b001:
-          i.op = Op::FSGNJN_S;
-          break;
-        case 0b010:
-          i.op = Op::FSGNJX_S;
-          break;
-        default:
-          std::println(stderr,
-                       "1010011: funct7=0010000: unrecognized funct3: {:03b}",
-                       funct3);
-          exit(1);
-        }
-      }; break;
-      case 0b1111001: {
-        i.rs1 = (raw >> 15) & 0b11111;
-        i.op = Op::FMV_D_X;
-      }; break;
-      case 0b1101001: {
-        if (i.rs2 == 0b00000) {
-          i.op = Op::FCVT_D_W;
-        } else if (i.rs2 == 0b00001) {
-          i.op = Op::FCVT_D_WU;
-        } else {
-          std::println(
-              stderr, "1010011: funct7=1101001: unrecognized rs2: {:b}", i.rs2);
-          exit(1);
-        }
-      }; break;
-      case 0b0001001: {
-        i.op = Op::FMUL_D;
-      }; break;
-      case 0b0010001: {
-        switch (funct3) {
-        case 0b000:
-          i.op = Op::FSGNJ_D;
-          break;
-        case 0b001:
-          i.op = Op::FSGNJN_D;
-          break;
-        case 0b010:
-          i.op = Op::FSGNJX_D;
-          break;
-        default:
-          std::println(stderr,
-                       "1010011: funct7=0010001: unrecognized funct3: {:03b}",
-                       funct3);
-          exit(1);
+  template <typename T> void v_load_strided(const Ins &i) {
+    u8 *vd = vreg(i.rd, sizeof(T));
+    u64 addr = m_regs[i.rs1];
+    i64 stride = m_regs[i.rs2];
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        store_as<T>(vd + k * sizeof(T), mem_read<T>(addr + k * stride));
+      }
+    }
+  }
+  template <typename T> void v_store_strided(const Ins &i) {
+    u8 *vs3 = vreg(i.rd, sizeof(T));
+    u64 addr = m_regs[i.rs1];
+    i64 stride = m_regs[i.rs2];
+    for (u64 k = 0; k < m_vl; k++) {
+      if (active(i, k)) {
+        mem_write<T>(addr + k * stride, load_as<T>(vs3 + k * sizeof(T)));
+      }
+    }
+  }
+
+  // Indexed: byte offsets of type Index in vs2, elements of SEW. Ordered and
+  // unordered accesses are the same thing here.
+  template <typename Index> void v_load_indexed(const Ins &i) {
+    with_sew<false>([&](auto t) {
+      using T = decltype(t);
+      u8 *vd = vreg(i.rd, sizeof(T));
+      u8 *vs2 = vreg(i.rs2, sizeof(Index));
+      u64 addr = m_regs[i.rs1];
+      for (u64 k = 0; k < m_vl; k++) {
+        if (active(i, k)) {
+          u64 offset = load_as<Index>(vs2 + k * sizeof(Index));
+          store_as<T>(vd + k * sizeof(T), mem_read<T>(addr + offset));
         }
-      }; break;
-      case 0b1110001: {
-        switch (funct3) {
-        case 0b000: {
-          i.op = Op::FMV_X_D;
-        }; break;
-        case 0b001: {
-          i.op = Op::FCLASS_D;
-        }; break;
-        default: {
-          std::println(stderr,
-                       "1010011: funct7=1110001: unrecognized funct3: {:03b}",
-                       funct3);
-          exit(1);
-        }; break;
+      }
+    });
+  }
+  template <typename Index> void v_store_indexed(const Ins &i) {
+    with_sew<false>([&](auto t) {
+      using T = decltype(t);
+      u8 *vs3 = vreg(i.rd, sizeof(T));
+      u8 *vs2 = vreg(i.rs2, sizeof(Index));
+      u64 addr = m_regs[i.rs1];
+      for (u64 k = 0; k < m_vl; k++) {
+        if (active(i, k)) {
+          u64 offset = load_as<Index>(vs2 + k * sizeof(Index));
+          mem_write<T>(addr + offset, load_as<T>(vs3 + k * sizeof(T)));
         }
-      }; break;
-      case 0b1111000: {
-        i.op = Op::FMV_W_X;
-      }; break;
-      default: {
-        std::println(stderr, "1010011: unrecognized funct7: {:07b}", funct7);
-        exit(1);
-      }; break;
       }
-    }; break;
-    case 0b0100111: {
-      u8 funct3 = (raw >> 12) & 0b111;
+    });
+  }
 
-      switch (funct3) {
-      case 0b010: {
-        i.rs1 = (raw >> 15) & 0b11111;
-        i.rs2 = (raw >> 20) & 0b11111;
-        i32 imm_hi = (i32)raw >> 25;
-        i32 imm_lo = (raw >> 7) & 0b11111;
-        i.imm = (imm_hi << 5) | imm_lo;
-        i.op = Op::FSW;
-      }; break;
-      case 0b011: {
-        i.rs1 = (raw >> 15) & 0b11111;
-        i.rs2 = (raw >> 20) & 0b11111;
-        i32 imm_hi = (i32)raw >> 25;
-        i32 imm_lo = (raw >> 7) & 0b11111;
-        i.imm = (imm_hi << 5) | imm_lo;
-        i.op = Op::FSD;
-      }; break;
-      default: {
-        std::println(stderr, "0100111: unrecognized funct3: {:03b}", funct3);
-        exit(1);
-      }; break;
-      }
-    }; break;
-    case 0b0100011: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      i.rs1 = (raw >> 15) & 0b11111;
-      i.rs2 = (raw >> 20) & 0b11111;
-      i32 imm_11_5 = (raw >> 25) & 0b1111111;
-      i32 imm_4_0 = (raw >> 7) & 0b11111;
-      i.imm = (imm_11_5 << 5) | imm_4_0;
-      i.imm = (i.imm << 20) >> 20;
+  // vl<n>r.v and vs<n>r.v, independent of vtype
+  void v_load_whole(const Ins &i, u64 regs) {
+    if (i.rd % regs != 0) {
+      illegal_instruction();
+    }
+    std::memcpy(m_vregs.data() + i.rd * VLENB,
+                guest_ptr(m_regs[i.rs1], regs * VLENB, PERM_R), regs * VLENB);
+  }
+  void v_store_whole(const Ins &i, u64 regs) {
+    if (i.rd % regs != 0) {
+      illegal_instruction();
+    }
+    std::memcpy(guest_ptr(m_regs[i.rs1], regs * VLENB, PERM_W),
+                m_vregs.data() + i.rd * VLENB, regs * VLENB);
+  }
 
-      if (funct3 == 0b000) {
-        i.op = Op::SB;
-      } else if (funct3 == 0b001) {
-        i.op = Op::SH;
-      } else if (funct3 == 0b010) {
-        i.op = Op::SW;
-      } else if (funct3 == 0b011) {
-        i.op = Op::SD;
-      } else {
-        std::println(stderr, "0100011: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+  // vlm.v and vsm.v: a mask register's first vl bits, as whole bytes
+  void v_load_mask(const Ins &i) {
+    u8 *vd = vreg_single(i.rd);
+    u64 bytes = (m_vl + 7) / 8;
+    std::memcpy(vd, guest_ptr(m_regs[i.rs1], bytes, PERM_R), bytes);
+  }
+  void v_store_mask(const Ins &i) {
+    const u8 *vs3 = vreg_single(i.rd);
+    u64 bytes = (m_vl + 7) / 8;
+    std::memcpy(guest_ptr(m_regs[i.rs1], bytes, PERM_W), vs3, bytes);
+  }
+
+  // RISC-V division never traps: x / 0 is all ones, x % 0 is x, and the
+  // overflowing signed case gives the dividend back (quotient) or 0
+  template <typename T> static T divide(T a, T b) {
+    if (b == 0) {
+      return (T)-1;
+    }
+    if (std::is_signed_v<T> && a == std::numeric_limits<T>::min() &&
+        b == (T)-1) {
+      return a;
+    }
+    return a / b;
+  }
+  template <typename T> static T remainder_of(T a, T b) {
+    if (b == 0) {
+      return a;
+    }
+    if (std::is_signed_v<T> && a == std::numeric_limits<T>::min() &&
+        b == (T)-1) {
+      return 0;
+    }
+    return a % b;
+  }
+
+  // the upper half of a * b, signed or unsigned as A and B are
+  template <typename A, typename B> static A mul_high(A a, B b) {
+    constexpr bool is_signed = std::is_signed_v<A> || std::is_signed_v<B>;
+    if constexpr (sizeof(A) < 8) {
+      using W = IntOfSize<std::conditional_t<is_signed, i8, u8>, 2 * sizeof(A)>;
+      return (A)(((W)a * (W)b) >> (8 * sizeof(A)));
+    } else {
+      u64 a0 = (u64)a & 0xffffffff;
+      u64 a1 = (u64)a >> 32;
+      u64 b0 = (u64)b & 0xffffffff;
+      u64 b1 = (u64)b >> 32;
+      u64 t = a0 * b0;
+      t = a1 * b0 + (t >> 32);
+      u64 w1 = t & 0xffffffff;
+      u64 w2 = t >> 32;
+      t = a0 * b1 + w1;
+      u64 high = a1 * b1 + w2 + (t >> 32);
+      if (std::is_signed_v<A> && (i64)a < 0) {
+        high -= (u64)b;
       }
-    }; break;
-    case 0b0110111: {
-      i.rd = (raw >> 7) & 0b11111;
-      i.imm = raw >> 12;
-      i.op = Op::LUI;
-    }; break;
-    case 0b0010111: {
-      i.rd = (raw >> 7) & 0b11111;
-      i.imm = raw >> 12;
-      i.op = Op::AUIPC;
-    }; break;
-    case 0b0001111: {
-      u8 funct3 = (raw >> 12) & 0b111;
-      if (funct3 == 0b000) {
-        i.imm = (raw >> 20) & 0b111111111111;
+      if (std::is_signed_v<B> && (i64)b < 0) {
+        high -= (u64)a;
+      }
+      return (A)high;
+    }
+  }
+};
 
-        if (i.imm == 0b000000010000) {
-          i.op = Op::PAUSE;
-        } else if (i.imm == 0b100000110011) {
-          i.op = Op::FENCE_TSO;
-        } else {
-          i.op = Op::FENCE;
-        }
+// "<n>[K|M|G]" in bytes, 0 if malformed
+static u64 parse_size(std::string_view s) {
+  u64 n = 0;
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+  if (ec != std::errc() || end == s.data()) {
+    return 0;
+  }
+  std::string_view suffix(end, s.data() + s.size());
+  if (suffix == "K") {
+    n <<= 10;
+  } else if (suffix == "M") {
+    n <<= 20;
+  } else if (suffix == "G") {
+    n <<= 30;
+  } else if (!suffix.empty()) {
+    return 0;
+  }
+  return n;
+}
+
+// "<class>=<n>,..." on top of costs, false if malformed
+static bool parse_cycle_costs(std::string_view s, CycleCosts &costs) {
+  while (!s.empty()) {
+    std::string_view item = s.substr(0, s.find(','));
+    s.remove_prefix(std::min(item.size() + 1, s.size()));
+    u64 eq = item.find('=');
+    if (eq == std::string_view::npos) {
+      return false;
+    }
+    auto name = std::ranges::find(COST_CLASS_NAMES, item.substr(0, eq));
+    u32 n = 0;
+    auto [end, ec] = std::from_chars(item.data() + eq + 1,
+                                     item.data() + item.size(), n);
+    if (name == COST_CLASS_NAMES.end() || ec != std::errc() ||
+        end != item.data() + item.size()) {
+      return false;
+    }
+    costs[name - COST_CLASS_NAMES.begin()] = n;
+  }
+  return true;
+}
+
+// One line of a --batch job list: the executable and its arguments, which
+// become the guest's argv, plus "<path" for stdin and ">path" for stdout.
+// Both default to /dev/null.
+struct Job {
+  std::vector<std::string> args;
+  std::string stdin_path = "/dev/null";
+  std::string stdout_path = "/dev/null";
+};
+
+struct JobResult {
+  int exit_code;
+  u64 instructions;
+  double seconds;
+  // how much the job grew the emulator's host RSS, only taken by --bench
+  u64 rss_bytes;
+};
+
+static std::vector<Job> parse_jobs(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    std::println(stderr, "Failed to open: {}", path);
+    exit(1);
+  }
+  std::vector<Job> jobs;
+  char *line = nullptr;
+  size_t cap = 0;
+  while (getline(&line, &cap, file) >= 0) {
+    Job job;
+    std::string_view rest = line;
+    while (true) {
+      u64 start = rest.find_first_not_of(" \t\r\n");
+      if (start == std::string_view::npos || rest[start] == '#') {
+        break;
+      }
+      rest.remove_prefix(start);
+      std::string_view token = rest.substr(0, rest.find_first_of(" \t\r\n"));
+      rest.remove_prefix(token.size());
+      if (token.starts_with('<')) {
+        job.stdin_path = token.substr(1);
+      } else if (token.starts_with('>')) {
+        job.stdout_path = token.substr(1);
       } else {
-        std::println(stderr, "0001111: unrecognized funct3: {:03b}", funct3);
-        exit(1);
+        job.args.emplace_back(token);
       }
-    }; break;
-    default:
-      std::println(stderr, "Unrecognized opcode: {:07b}", opcode);
-      exit(1);
     }
+    if (!job.args.empty()) {
+      jobs.push_back(std::move(job));
+    }
+  }
+  free(line);
+  fclose(file);
+  return jobs;
+}
 
-    return i;
+// resident set size of this process, 0 if /proc can't tell
+static u64 host_rss_bytes() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == nullptr) {
+    return 0;
   }
+  unsigned long size;
+  unsigned long resident;
+  if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(file);
+  return resident * sysconf(_SC_PAGESIZE);
+}
 
-  template <typename T> T mem_read(u64 addr) {
-    T v;
-    std::memcpy(&v, m_memory + addr, sizeof(T));
-    return v;
+// s as a CSV field, quoted if it has to be
+static std::string csv_field(std::string_view s) {
+  if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+    return std::string(s);
   }
-  template <typename T> void mem_write(u64 addr, T v) {
-    std::memcpy(m_memory + addr, &v, sizeof(T));
+  std::string quoted = "\"";
+  for (char c : s) {
+    quoted += c;
+    if (c == '"') {
+      quoted += c;
+    }
   }
-};
+  return quoted + '"';
+}
+
+// Runs every job in the list on a pool of one thread per host core and
+// prints a CSV line per job, in job list order, as soon as the jobs up to it
+// are done. A job whose executable doesn't load or whose guest faults gets
+// exit code -1 and the others go on. Jobs running the same executable share
+// its decoded code, from decode_cache if that's set. With jit_cache set
+// every job starts from and adds to the saved translations. For bench the
+// jobs run one at a time, so they don't skew each other's timings, and the
+// CSV also has MIPS and how much host RSS each job added.
+static int run_batch(const char *jobs_path, Engine engine, u64 memory_size,
+                     const char *decode_cache, const char *jit_cache,
+                     const CycleCosts &cycle_costs, bool bench) {
+  std::vector<Job> jobs = parse_jobs(jobs_path);
 
-int main(int argc, char *argv[]) {
+  // nullptr for an executable that doesn't load
+  std::unordered_map<std::string, std::shared_ptr<const SharedCode>> code;
+  for (const Job &job : jobs) {
+    if (!code.contains(job.args[0])) {
+      try {
+        RISCV64 r(job.args[0].c_str(), memory_size);
+        code[job.args[0]] = decode_cache != nullptr
+                                ? r.cached_code(decode_cache)
+                                : r.decode_code();
+      } catch (const GuestFault &) {
+        code[job.args[0]] = nullptr;
+      }
+    }
+  }
+
+  auto run_job = [&](u64 n) {
+    const Job &job = jobs[n];
+    JobResult result = {
+        .exit_code = -1, .instructions = 0, .seconds = 0, .rss_bytes = 0};
+    const std::shared_ptr<const SharedCode> &shared = code.at(job.args[0]);
+    if (shared == nullptr) {
+      return result;
+    }
+
+    u64 rss_before = bench ? host_rss_bytes() : 0;
+    auto start = std::chrono::steady_clock::now();
+    std::optional<RISCV64> r;
+    try {
+      r.emplace(job.args[0].c_str(), memory_size);
+      int in = open(job.stdin_path.c_str(), O_RDONLY);
+      int out = open(job.stdout_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                     0644);
+      if (in < 0 || out < 0) {
+        std::println(stderr, "Job {}: failed to open its stdin or stdout", n);
+        close(in);
+        close(out);
+        return result;
+      }
+      r->set_fd(0, in);
+      r->set_fd(1, out);
+      r->set_cycle_costs(cycle_costs);
+      r->share_code(shared);
+      if (jit_cache != nullptr) {
+        r->set_jit_cache(jit_cache);
+      }
+      r->set_args(job.args);
+      result.exit_code = r->execute(engine);
+    } catch (const GuestFault &) {
+      std::println(stderr, "Job {}: {} failed", n, job.args[0]);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.instructions = r ? r->instructions() : 0;
+    result.seconds = elapsed.count();
+    if (bench) {
+      // whatever earlier jobs left behind isn't this one's
+      result.rss_bytes = std::max(host_rss_bytes(), rss_before) - rss_before;
+    }
+    return result;
+  };
+
+  std::println("job,elf,exit_code,instructions,wall_seconds{}",
+               bench ? ",mips,rss_kib" : "");
+  fflush(stdout);
+
+  std::vector<JobResult> results(jobs.size());
+  std::vector<bool> done(jobs.size());
+  u64 printed = 0;
+  int failed = 0;
+  std::mutex mutex;
+  // keeps job n's result and prints it along with any after it that were
+  // only waiting for it
+  auto finish = [&](u64 n, const JobResult &result) {
+    std::lock_guard lock(mutex);
+    results[n] = result;
+    done[n] = true;
+    for (; printed < jobs.size() && done[printed]; printed++) {
+      const JobResult &r = results[printed];
+      std::print("{},{},{},{},{:.6f}", printed,
+                 csv_field(jobs[printed].args[0]), r.exit_code, r.instructions,
+                 r.seconds);
+      if (bench) {
+        double mips = r.seconds > 0 ? r.instructions / r.seconds / 1e6 : 0;
+        std::print(",{:.2f},{}", mips, r.rss_bytes / 1024);
+      }
+      std::println();
+      failed |= r.exit_code != 0;
+    }
+    fflush(stdout);
+  };
+
+  std::atomic<u64> next_job = 0;
+  auto worker = [&] {
+    for (u64 n = next_job++; n < jobs.size(); n = next_job++) {
+      finish(n, run_job(n));
+    }
+  };
+
+  u64 threads = bench ? 1 : std::max(1U, std::thread::hardware_concurrency());
+  std::vector<std::thread> pool;
+  for (u64 n = 0; n < std::min<u64>(threads, jobs.size()); n++) {
+    pool.emplace_back(worker);
+  }
+  for (std::thread &thread : pool) {
+    thread.join();
+  }
+  return failed;
+}
+
+// Makes the engines sample the guest's call stack every interval_us of CPU
+// time the process uses. SA_RESTART keeps the timer from failing the
+// guest's host syscalls with EINTR.
+static void start_sampling(u64 interval_us) {
+  sampling = true;
+  struct sigaction action = {};
+  action.sa_handler = [](int) {
+    sample_due.store(true, std::memory_order_relaxed);
+  };
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  itimerval timer = {.it_interval = {.tv_sec = 0, .tv_usec = (i64)interval_us},
+                     .it_value = {.tv_sec = 0, .tv_usec = (i64)interval_us}};
+  if (sigaction(SIGPROF, &action, nullptr) < 0 ||
+      setitimer(ITIMER_PROF, &timer, nullptr) < 0) {
+    std::println(stderr, "Failed to start the sampling timer");
+    exit(1);
+  }
+}
+
+static void stop_sampling() {
+  itimerval timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+int main(int argc, char *argv[]) try {
   if (elf_version(EV_CURRENT) == EV_NONE) {
     std::println(stderr, "Failed to initialize libelf: {}", elf_errmsg(-1));
     return 1;
   }
 
   const char *path = nullptr;
+  const char *snapshot_at = nullptr;
+  const char *batch = nullptr;
+  bool bench = false;
+  const char *decode_cache = nullptr;
+  const char *jit_cache = nullptr;
+  std::vector<const char *> inputs;
+  bool disassemble = false;
+  bool memory_stats = false;
+  bool profile = false;
+  const char *sample_path = nullptr;
+  u64 memory_size = DEFAULT_MEMORY_SIZE;
+  u64 output_buffer_size = 0;
+  CycleCosts cycle_costs = DEFAULT_CYCLE_COSTS;
+#ifdef __x86_64__
+  Engine engine = Engine::JIT;
+#else
+  Engine engine = Engine::THREADED;
+#endif
   for (int i = 1; i < argc; i++) {
-    path = argv[i];
+    std::string_view arg = argv[i];
+    if (arg == "-d") {
+      disassemble = true;
+    } else if (arg == "--engine=switch") {
+      engine = Engine::SWITCH;
+    } else if (arg == "--engine=threaded") {
+      engine = Engine::THREADED;
+#ifdef __x86_64__
+    } else if (arg == "--engine=jit") {
+      engine = Engine::JIT;
+#endif
+    } else if (arg.starts_with("--memory=")) {
+      memory_size = parse_size(arg.substr(9));
+      if (memory_size == 0) {
+        std::println(stderr, "Invalid memory size: {}", arg.substr(9));
+        return 1;
+      }
+    } else if (arg == "--memory-stats") {
+      memory_stats = true;
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (arg.starts_with("--sample=")) {
+      sample_path = argv[i] + 9;
+    } else if (arg.starts_with("--output-buffer=")) {
+      output_buffer_size = parse_size(arg.substr(16));
+      if (output_buffer_size == 0) {
+        std::println(stderr, "Invalid output buffer size: {}", arg.substr(16));
+        return 1;
+      }
+    } else if (arg.starts_with("--cycle-costs=")) {
+      if (!parse_cycle_costs(arg.substr(14), cycle_costs)) {
+        std::println(stderr, "Invalid cycle costs: {}", arg.substr(14));
+        return 1;
+      }
+    } else if (arg.starts_with("--snapshot-at=")) {
+      snapshot_at = argv[i] + 14;
+    } else if (arg.starts_with("--batch=")) {
+      batch = argv[i] + 8;
+    } else if (arg.starts_with("--bench=")) {
+      batch = argv[i] + 8;
+      bench = true;
+    } else if (arg.starts_with("--decode-cache=")) {
+      decode_cache = argv[i] + 15;
+    } else if (arg.starts_with("--jit-cache=")) {
+      jit_cache = argv[i] + 12;
+    } else if (path == nullptr) {
+      path = argv[i];
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+
+  if (batch != nullptr) {
+    return run_batch(batch, engine, memory_size, decode_cache, jit_cache,
+                     cycle_costs, bench);
   }
 
   if (path == nullptr) {
-    std::println(stderr, "Usage: {} <path>", argv[0]);
+#ifdef __x86_64__
+    const char *engines = "switch|threaded|jit";
+#else
+    const char *engines = "switch|threaded";
+#endif
+    std::println(stderr,
+                 "Usage: {} [-d] [--engine={}] [--memory=<n>[K|M|G]] "
+                 "[--memory-stats] [--profile] [--sample=<path>] "
+                 "[--output-buffer=<n>[K|M|G]] [--decode-cache=<dir>] "
+                 "[--jit-cache=<dir>] [--cycle-costs=<class>=<n>,...] "
+                 "[--snapshot-at=<symbol>] <path> [<input>...]\n"
+                 "       {} [--engine={}] [--memory=<n>[K|M|G]] "
+                 "[--decode-cache=<dir>] [--jit-cache=<dir>] "
+                 "[--cycle-costs=<class>=<n>,...] "
+                 "(--batch=<jobs> | --bench=<jobs>)",
+                 argv[0], engines, argv[0], engines);
+    std::println(stderr, "  -d              print a disassembly instead of "
+                         "running");
+    std::println(stderr, "  --memory        guest address space size "
+                         "(default 2G)");
+    std::println(stderr, "  --memory-stats  print guest memory usage on exit");
+    std::println(stderr, "  --sample        sample the guest's call stack "
+                         "every 1ms of CPU time and write");
+    std::println(stderr, "                  the samples to a file as folded "
+                         "stacks for flame graphs");
+    std::println(stderr, "  --profile       print the instructions run per "
+                         "function on exit, and the hottest");
+    std::println(stderr, "                  functions' disassembly with "
+                         "per-instruction counts");
+    std::println(stderr, "  --output-buffer write guest stdout in blocks of "
+                         "this size");
+    std::println(stderr, "  --decode-cache  keep decoded code in this "
+                         "directory for later runs");
+    std::println(stderr, "  --jit-cache     keep JIT translations in this "
+                         "directory for later runs");
+    std::println(stderr, "  --cycle-costs   what the cycle CSR counts per "
+                         "alu, mul, div, mem, branch, fp,");
+    std::println(stderr, "                  fdiv and vector instruction "
+                         "(default 1 each)");
+    std::println(stderr, "  --snapshot-at   run up to <symbol> once, then from "
+                         "there for each input as stdin");
+    std::println(stderr, "  --batch         run the jobs listed in a file, one "
+                         "\"<path> [<arg>...] [<stdin] [>stdout]\" per line,");
+    std::println(stderr, "                  on all cores and print a CSV of "
+                         "the results");
+    std::println(stderr, "  --bench         like --batch, but one job at a "
+                         "time and with MIPS and host RSS");
     return 1;
   }
-
-  std::ifstream file(path, std::ios::binary | std::ios::ate);
-  if (!file) {
-    std::println(stderr, "Failed to open: {}", path);
+  if (!inputs.empty() && snapshot_at == nullptr) {
+    std::println(stderr, "Inputs are only taken with --snapshot-at");
     return 1;
   }
+  if (profile && engine == Engine::SWITCH) {
+    std::println(stderr, "--profile needs the threaded or jit engine");
+    return 1;
+  }
+  FILE *samples = nullptr;
+  if (sample_path != nullptr) {
+    samples = fopen(sample_path, "w");
+    if (samples == nullptr) {
+      std::println(stderr, "Failed to open: {}", sample_path);
+      return 1;
+    }
+    start_sampling(SAMPLE_INTERVAL_US);
+  }
 
-  i64 exe_size = file.tellg();
-  file.seekg(0, std::ios::beg);
-
-  std::vector<char> exe_bytes(exe_size);
-  file.read(exe_bytes.data(), exe_size);
-  file.close();
-
-  RISCV64 r(exe_bytes);
-
-  exe_bytes.clear();
-  exe_bytes.shrink_to_fit();
+  RISCV64 r(path, memory_size);
+  r.set_output_buffer(output_buffer_size);
+  r.set_cycle_costs(cycle_costs);
 
-  std::println("END DISASSEMBLY");
+  if (disassemble) {
+    r.disassemble_all();
+    return 0;
+  }
+  if (decode_cache != nullptr) {
+    r.share_code(r.cached_code(decode_cache));
+  }
+  if (jit_cache != nullptr) {
+    r.set_jit_cache(jit_cache);
+  }
 
-  r.execute();
+  int exit_code = 0;
+  if (snapshot_at != nullptr) {
+    u64 addr = r.symbol_addr(snapshot_at);
+    if (addr == 0) {
+      std::println(stderr, "No symbol {}", snapshot_at);
+      return 1;
+    }
+    if (!r.execute_until(engine, addr)) {
+      std::println(stderr, "Exited before getting to {}", snapshot_at);
+      return 1;
+    }
+    r.snapshot();
+    if (inputs.empty()) {
+      exit_code = r.resume(engine);
+    }
+    for (u64 n = 0; n < inputs.size(); n++) {
+      if (n > 0) {
+        r.reset();
+      }
+      int fd = open(inputs[n], O_RDONLY);
+      if (fd < 0) {
+        std::println(stderr, "Failed to open: {}", inputs[n]);
+        return 1;
+      }
+      r.set_fd(0, fd);
+      int code = r.resume(engine);
+      std::println(stderr, "{}: exit code {}", inputs[n], code);
+      if (exit_code == 0) {
+        exit_code = code;
+      }
+    }
+  } else {
+    exit_code = r.execute(engine);
+  }
+  if (samples != nullptr) {
+    stop_sampling();
+    r.write_samples(samples);
+    fclose(samples);
+  }
+  if (profile) {
+    r.print_profile();
+  }
+  if (memory_stats) {
+    auto usage = r.memory_usage();
+    std::println(stderr,
+                 "reserved: {} KiB, committed: {} KiB, resident: {} KiB",
+                 usage.reserved_bytes / 1024, usage.committed_bytes / 1024,
+                 usage.resident_bytes / 1024);
+  }
+  return exit_code;
+} catch (const GuestFault &) {
+  // the error has been printed already
+  return 1;
 }